@@ -0,0 +1,308 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+/*
+ * Resident copies of recently served firmware blobs.
+ *
+ * Each entry keeps the blob in a sealed memfd, so that a repeated request can
+ * be served with a plain sendfile() from memory. Entries are validated against
+ * the inode, size and mtime of the file they were read from, and the least
+ * recently used ones are evicted once the byte budget is exceeded. They also
+ * remember the filesystem that file is on, as that is what the transfer tuner
+ * tells apart, not the tmpfs behind the memfd.
+ *
+ * The cache is shared by the worker threads; blobs are copied without holding
+ * the lock, only the list and the counters are protected by it.
+ */
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry {
+        CacheEntry *prev;
+        CacheEntry *next;
+        char *name;
+        int dirfd;
+        int memfd;
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        long fs_type;
+};
+
+struct Cache {
+        CacheEntry *head;
+        CacheEntry *tail;
+        size_t budget;
+        CacheStats stats;
+        pthread_mutex_t lock;
+};
+
+int cache_new(Cache **cachep, size_t budget) {
+        Cache *c;
+
+        c = calloc(1, sizeof(*c));
+        if (!c)
+                return -ENOMEM;
+
+        c->budget = budget;
+        pthread_mutex_init(&c->lock, NULL);
+
+        *cachep = c;
+        return 0;
+}
+
+static void cache_unlink(Cache *c, CacheEntry *e) {
+        if (e->prev)
+                e->prev->next = e->next;
+        else
+                c->head = e->next;
+        if (e->next)
+                e->next->prev = e->prev;
+        else
+                c->tail = e->prev;
+
+        e->prev = e->next = NULL;
+}
+
+static void cache_link(Cache *c, CacheEntry *e) {
+        e->prev = NULL;
+        e->next = c->head;
+        if (c->head)
+                c->head->prev = e;
+        else
+                c->tail = e;
+        c->head = e;
+}
+
+static void cache_drop(Cache *c, CacheEntry *e) {
+        cache_unlink(c, e);
+
+        c->stats.entries--;
+        c->stats.size -= e->size;
+
+        close(e->memfd);
+        free(e->name);
+        free(e);
+}
+
+void cache_flush(Cache *c) {
+        pthread_mutex_lock(&c->lock);
+        while (c->head)
+                cache_drop(c, c->head);
+        pthread_mutex_unlock(&c->lock);
+}
+
+void cache_free(Cache *c) {
+        cache_flush(c);
+        pthread_mutex_destroy(&c->lock);
+        free(c);
+}
+
+static CacheEntry *cache_find(Cache *c, const char *name) {
+        for (CacheEntry *e = c->head; e; e = e->next)
+                if (!strcmp(e->name, name))
+                        return e;
+
+        return NULL;
+}
+
+void cache_invalidate(Cache *c, const char *name) {
+        CacheEntry *e;
+
+        pthread_mutex_lock(&c->lock);
+        e = cache_find(c, name);
+        if (e)
+                cache_drop(c, e);
+        pthread_mutex_unlock(&c->lock);
+}
+
+static bool cache_entry_matches(CacheEntry *e, const struct stat *st) {
+        return e->dev == st->st_dev &&
+               e->ino == st->st_ino &&
+               e->size == st->st_size &&
+               e->mtime.tv_sec == st->st_mtim.tv_sec &&
+               e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Returns a new descriptor for the cached copy of @name, or -ENOENT if there
+ * is no valid entry. The caller owns the returned descriptor. The magic of
+ * the filesystem the blob was read from is stored in @fs_typep.
+ */
+int cache_lookup(Cache *c, const char *name, long *fs_typep) {
+        CacheEntry *e;
+        struct stat st;
+        int fd;
+
+        pthread_mutex_lock(&c->lock);
+
+        e = cache_find(c, name);
+        if (!e) {
+                c->stats.misses++;
+                fd = -ENOENT;
+                goto finish;
+        }
+
+        if (fstatat(e->dirfd, name, &st, 0) < 0 || !cache_entry_matches(e, &st)) {
+                c->stats.stale++;
+                c->stats.misses++;
+                cache_drop(c, e);
+                fd = -ENOENT;
+                goto finish;
+        }
+
+        fd = fcntl(e->memfd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0) {
+                fd = -errno;
+                goto finish;
+        }
+
+        cache_unlink(c, e);
+        cache_link(c, e);
+        c->stats.hits++;
+        *fs_typep = e->fs_type;
+
+finish:
+        pthread_mutex_unlock(&c->lock);
+        return fd;
+}
+
+/*
+ * Stores the size of the cached copy of @name in @sizep, without checking
+ * that it is still valid, nor counting it as a use; or returns -ENOENT.
+ */
+int cache_peek_size(Cache *c, const char *name, uint64_t *sizep) {
+        CacheEntry *e;
+        int r = -ENOENT;
+
+        pthread_mutex_lock(&c->lock);
+
+        e = cache_find(c, name);
+        if (e) {
+                *sizep = e->size;
+                r = 0;
+        }
+
+        pthread_mutex_unlock(&c->lock);
+        return r;
+}
+
+static int cache_copy(int memfd, int firmwarefd, off_t size) {
+        off_t offset = 0;
+
+        while (offset < size) {
+                ssize_t n;
+
+                n = sendfile(memfd, firmwarefd, &offset, size - offset);
+                if (n < 0)
+                        return -errno;
+                else if (n == 0)
+                        return -EIO;
+        }
+
+        if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/*
+ * Copies the blob behind @firmwarefd, which was opened as @name relative to
+ * @dirfd, into the cache. On success a new descriptor for the cached copy is
+ * returned, which the caller should use instead of @firmwarefd, and the
+ * magic of the filesystem of @firmwarefd is stored in @fs_typep. @dirfd must
+ * stay valid for as long as the entry lives.
+ */
+int cache_insert(Cache *c, const char *name, int dirfd, int firmwarefd, long *fs_typep) {
+        CacheEntry *e, *old;
+        struct statfs sfs;
+        struct stat st;
+        int r, fd = -1;
+
+        if (fstat(firmwarefd, &st) < 0)
+                return -errno;
+
+        if (st.st_size == 0 || (size_t)st.st_size > c->budget)
+                return -E2BIG;
+
+        if (fstatfs(firmwarefd, &sfs) < 0)
+                return -errno;
+
+        e = calloc(1, sizeof(*e));
+        if (!e)
+                return -ENOMEM;
+
+        e->name = strdup(name);
+        if (!e->name) {
+                free(e);
+                return -ENOMEM;
+        }
+
+        e->memfd = memfd_create("firmware", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+        if (e->memfd < 0) {
+                r = -errno;
+                free(e->name);
+                free(e);
+                return r;
+        }
+
+        r = cache_copy(e->memfd, firmwarefd, st.st_size);
+        if (r >= 0) {
+                fd = fcntl(e->memfd, F_DUPFD_CLOEXEC, 3);
+                if (fd < 0)
+                        r = -errno;
+        }
+        if (r < 0) {
+                close(e->memfd);
+                free(e->name);
+                free(e);
+                return r;
+        }
+
+        e->dirfd = dirfd;
+        e->dev = st.st_dev;
+        e->ino = st.st_ino;
+        e->size = st.st_size;
+        e->mtime = st.st_mtim;
+        e->fs_type = sfs.f_type;
+
+        pthread_mutex_lock(&c->lock);
+
+        /* another thread may have inserted the same blob meanwhile */
+        old = cache_find(c, name);
+        if (old)
+                cache_drop(c, old);
+
+        while (c->tail && c->stats.size + e->size > c->budget) {
+                cache_drop(c, c->tail);
+                c->stats.evictions++;
+        }
+
+        cache_link(c, e);
+        c->stats.entries++;
+        c->stats.size += e->size;
+
+        pthread_mutex_unlock(&c->lock);
+
+        *fs_typep = sfs.f_type;
+        return fd;
+}
+
+void cache_get_stats(Cache *c, CacheStats *stats) {
+        pthread_mutex_lock(&c->lock);
+        *stats = c->stats;
+        pthread_mutex_unlock(&c->lock);
+        stats->budget = c->budget;
+}
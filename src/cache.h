@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Cache Cache;
+
+typedef struct CacheStats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t stale;
+        uint64_t evictions;
+        size_t entries;
+        size_t size;
+        size_t budget;
+} CacheStats;
+
+int cache_new(Cache **cachep, size_t budget);
+void cache_free(Cache *cache);
+
+int cache_lookup(Cache *cache, const char *name, long *fs_typep);
+int cache_insert(Cache *cache, const char *name, int dirfd, int firmwarefd, long *fs_typep);
+int cache_peek_size(Cache *cache, const char *name, uint64_t *sizep);
+void cache_invalidate(Cache *cache, const char *name);
+void cache_flush(Cache *cache);
+
+void cache_get_stats(Cache *cache, CacheStats *stats);
+
+static inline void cache_freep(Cache **cachep) {
+        if (*cachep)
+                cache_free(*cachep);
+}
@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "macro.h"
+
+/*
+ * Everything runs from the event loop, at low priority, and never blocks: a
+ * command is read as it trickles in, its reply is built in memory, and then
+ * written out as fast as the client reads it. Clients beyond the limit are
+ * turned away rather than queued.
+ */
+
+#define CONTROL_CLIENTS_MAX (16)
+
+/* without a descriptor for the next client, look again after this long at the latest */
+#define CONTROL_ACCEPT_RETRY_USEC (1 * USEC_PER_SEC)
+
+typedef struct ControlClient ControlClient;
+
+struct ControlClient {
+        ControlServer *server;
+        ControlClient *next;
+        int fd;
+        EventSource *source;
+        EventSource *timer;
+        char command[CONTROL_COMMAND_MAX];
+        size_t n_command;
+        char *reply;
+        size_t n_reply;
+        size_t written;
+};
+
+struct ControlServer {
+        EventLoop *loop;
+        char *path;
+        int fd;
+        EventSource *source;
+        /* accepting is paused while we are out of descriptors */
+        EventSource *retry;
+        bool paused;
+        uint64_t timeout_usec;
+        ControlClient *clients;
+        unsigned int n_clients;
+        control_command_func_t func;
+        void *userdata;
+};
+
+/* accepts clients again, once a descriptor may have come free */
+static void control_server_resume(ControlServer *s) {
+        if (!s->paused)
+                return;
+
+        s->paused = false;
+        event_source_set_time(s->retry, 0);
+        event_source_set_io_events(s->source, EPOLLIN);
+}
+
+/*
+ * Stops polling the listening socket, which stays readable while the next
+ * connection waits for a descriptor, until a client goes away or a while
+ * passed; for when the descriptors are taken up by something else.
+ */
+static void control_server_pause(ControlServer *s) {
+        if (s->paused)
+                return;
+
+        s->paused = true;
+        event_source_set_io_events(s->source, 0);
+        event_source_set_time(s->retry, event_now() + CONTROL_ACCEPT_RETRY_USEC);
+}
+
+static void control_client_free(ControlClient *c) {
+        ControlServer *s = c->server;
+
+        for (ControlClient **p = &s->clients; *p; p = &(*p)->next)
+                if (*p == c) {
+                        *p = c->next;
+                        break;
+                }
+        s->n_clients--;
+
+        if (c->source)
+                event_source_free(c->source);
+        if (c->timer)
+                event_source_free(c->timer);
+        close(c->fd);
+        free(c->reply);
+        free(c);
+
+        control_server_resume(s);
+}
+
+static int control_client_write(ControlClient *c) {
+        while (c->written < c->n_reply) {
+                ssize_t n;
+
+                n = send(c->fd, c->reply + c->written, c->n_reply - c->written, MSG_NOSIGNAL|MSG_DONTWAIT);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return 0;
+
+                        return -errno;
+                }
+
+                c->written += n;
+        }
+
+        return 1;
+}
+
+/* runs the command that was read, and starts sending its reply */
+static int control_client_reply(ControlClient *c) {
+        ControlServer *s = c->server;
+        FILE *out;
+        int r;
+
+        c->command[c->n_command] = '\0';
+        c->command[strcspn(c->command, "\r\n")] = '\0';
+
+        out = open_memstream(&c->reply, &c->n_reply);
+        if (!out)
+                return -errno;
+
+        r = s->func(c->command, out, s->userdata);
+        if (fclose(out) < 0)
+                return -errno;
+
+        if (r < 0) {
+                /* whatever was written before the error is thrown away */
+                free(c->reply);
+                if (asprintf(&c->reply, "error: %s\n", strerror(-r)) < 0) {
+                        c->reply = NULL;
+                        return -ENOMEM;
+                }
+                c->n_reply = strlen(c->reply);
+        }
+
+        r = control_client_write(c);
+        if (r != 0)
+                return r;
+
+        return event_source_set_io_events(c->source, EPOLLOUT);
+}
+
+static int control_on_client(EventSource *source, int fd, uint32_t events, void *userdata) {
+        ControlClient *c = userdata;
+        int r;
+
+        if (c->reply) {
+                r = control_client_write(c);
+                if (r != 0)
+                        control_client_free(c);
+                return 0;
+        }
+
+        for (;;) {
+                ssize_t n;
+
+                n = recv(fd, c->command + c->n_command, sizeof(c->command) - 1 - c->n_command, MSG_DONTWAIT);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return 0;
+
+                        control_client_free(c);
+                        return 0;
+                }
+
+                c->n_command += n;
+
+                /* a full line, the end of the input, or as much as we take */
+                if (n == 0 || memchr(c->command + c->n_command - n, '\n', n) ||
+                    c->n_command == sizeof(c->command) - 1)
+                        break;
+        }
+
+        r = control_client_reply(c);
+        if (r != 0)
+                control_client_free(c);
+
+        return 0;
+}
+
+/* a client that never finished its command, or does not read the reply */
+static int control_on_client_timeout(EventSource *source, uint64_t usec, void *userdata) {
+        control_client_free(userdata);
+
+        return 0;
+}
+
+static int control_on_retry(EventSource *source, uint64_t usec, void *userdata) {
+        control_server_resume(userdata);
+
+        return 0;
+}
+
+static int control_on_accept(EventSource *source, int fd, uint32_t events, void *userdata) {
+        ControlServer *s = userdata;
+
+        for (;;) {
+                ControlClient *c;
+                int cfd, r;
+
+                cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+                if (cfd < 0) {
+                        if (errno == EMFILE || errno == ENFILE)
+                                control_server_pause(s);
+                        return 0;
+                }
+
+                if (s->n_clients >= CONTROL_CLIENTS_MAX) {
+                        close(cfd);
+                        continue;
+                }
+
+                c = calloc(1, sizeof(*c));
+                if (!c) {
+                        close(cfd);
+                        continue;
+                }
+
+                c->server = s;
+                c->fd = cfd;
+                c->next = s->clients;
+                s->clients = c;
+                s->n_clients++;
+
+                r = event_add_io(s->loop, &c->source, cfd, EPOLLIN, EVENT_PRIORITY_LOW, control_on_client, c);
+                if (r >= 0)
+                        r = event_add_time(s->loop, &c->timer, event_now() + s->timeout_usec, EVENT_PRIORITY_LOW,
+                                           control_on_client_timeout, c);
+                if (r < 0)
+                        control_client_free(c);
+        }
+}
+
+/*
+ * Listens on @path, replacing a stale socket left behind there. Clients get
+ * @timeout_usec to send their command and read the reply.
+ */
+int control_server_new(ControlServer **serverp, EventLoop *loop, const char *path, uint64_t timeout_usec,
+                       control_command_func_t func, void *userdata) {
+        _cleanup_(control_server_freep) ControlServer *s = NULL;
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        mode_t mask;
+        int r;
+
+        if (strlen(path) >= sizeof(sa.sun_path))
+                return -ENAMETOOLONG;
+        strcpy(sa.sun_path, path);
+
+        s = calloc(1, sizeof(*s));
+        if (!s)
+                return -ENOMEM;
+
+        s->fd = -1;
+        s->loop = loop;
+        s->timeout_usec = timeout_usec;
+        s->func = func;
+        s->userdata = userdata;
+
+        s->fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (s->fd < 0)
+                return -errno;
+
+        unlink(path);
+
+        /* only root gets to look inside, or to flush */
+        mask = umask(0077);
+        r = bind(s->fd, (struct sockaddr *)&sa, sizeof(sa));
+        umask(mask);
+        if (r < 0)
+                return -errno;
+
+        s->path = strdup(path);
+        if (!s->path)
+                return -ENOMEM;
+
+        if (listen(s->fd, CONTROL_CLIENTS_MAX) < 0)
+                return -errno;
+
+        r = event_add_io(loop, &s->source, s->fd, EPOLLIN, EVENT_PRIORITY_LOW, control_on_accept, s);
+        if (r < 0)
+                return r;
+
+        r = event_add_time(loop, &s->retry, 0, EVENT_PRIORITY_LOW, control_on_retry, s);
+        if (r < 0)
+                return r;
+
+        *serverp = s;
+        s = NULL;
+
+        return 0;
+}
+
+void control_server_free(ControlServer *s) {
+        while (s->clients)
+                control_client_free(s->clients);
+
+        if (s->retry)
+                event_source_free(s->retry);
+        if (s->source)
+                event_source_free(s->source);
+        if (s->fd >= 0)
+                close(s->fd);
+        if (s->path) {
+                unlink(s->path);
+                free(s->path);
+        }
+        free(s);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "event.h"
+
+#define CONTROL_PATH_DEFAULT "/run/firmwared.sock"
+
+/* the longest command line a client may send */
+#define CONTROL_COMMAND_MAX (256)
+
+/*
+ * The daemon's control socket. A client connects, sends one command line,
+ * and reads the reply until the connection is closed. Replies that start
+ * with "error:" tell about a failed command. A client that takes longer
+ * than the timeout for all of that is disconnected.
+ */
+
+typedef struct ControlServer ControlServer;
+
+/* writes the reply to @command to @out; a negative errno is sent as an error instead */
+typedef int (*control_command_func_t)(const char *command, FILE *out, void *userdata);
+
+int control_server_new(ControlServer **serverp, EventLoop *loop, const char *path, uint64_t timeout_usec,
+                       control_command_func_t func, void *userdata);
+void control_server_free(ControlServer *server);
+
+static inline void control_server_freep(ControlServer **serverp) {
+        if (*serverp)
+                control_server_free(*serverp);
+}
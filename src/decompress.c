@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef HAVE_XZ
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+#include "macro.h"
+
+/* output handed on at a time */
+#define DECOMPRESS_BUFFER_SIZE (64 * 1024)
+
+/* the kernel's firmware is made with a dictionary of at most a few MiB */
+#define DECOMPRESS_XZ_MEMLIMIT (64 * 1024 * 1024)
+
+static const char * const compression_names[_COMPRESSION_MAX] = {
+        [COMPRESSION_NONE] = "none",
+        [COMPRESSION_ZSTD] = "zstd",
+        [COMPRESSION_XZ] = "xz",
+};
+
+static const char * const compression_suffixes[_COMPRESSION_MAX] = {
+        [COMPRESSION_NONE] = "",
+        [COMPRESSION_ZSTD] = ".zst",
+        [COMPRESSION_XZ] = ".xz",
+};
+
+const char *compression_to_string(Compression c) {
+        return compression_names[c];
+}
+
+const char *compression_suffix(Compression c) {
+        return compression_suffixes[c];
+}
+
+bool compression_supported(Compression c) {
+        switch (c) {
+        case COMPRESSION_NONE:
+                return true;
+#ifdef HAVE_ZSTD
+        case COMPRESSION_ZSTD:
+                return true;
+#endif
+#ifdef HAVE_XZ
+        case COMPRESSION_XZ:
+                return true;
+#endif
+        default:
+                return false;
+        }
+}
+
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#ifdef HAVE_XZ
+static int decompress_xz(const void *data, size_t size, char *buf, decompress_func_t func, void *userdata,
+                         DecompressStats *stats) {
+        lzma_stream s = LZMA_STREAM_INIT;
+        lzma_ret ret;
+        int r = 0;
+
+        if (lzma_stream_decoder(&s, DECOMPRESS_XZ_MEMLIMIT, 0) != LZMA_OK)
+                return -ENOMEM;
+
+        s.next_in = data;
+        s.avail_in = size;
+
+        do {
+                s.next_out = (uint8_t *)buf;
+                s.avail_out = DECOMPRESS_BUFFER_SIZE;
+
+                ret = lzma_code(&s, LZMA_FINISH);
+                if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+                        /* all input is there, so LZMA_BUF_ERROR means it was cut short */
+                        r = ret == LZMA_MEM_ERROR || ret == LZMA_MEMLIMIT_ERROR ? -ENOMEM : -EBADMSG;
+                        break;
+                }
+
+                if (s.avail_out < DECOMPRESS_BUFFER_SIZE) {
+                        r = func(buf, DECOMPRESS_BUFFER_SIZE - s.avail_out, userdata);
+                        if (r < 0)
+                                break;
+                }
+        } while (ret != LZMA_STREAM_END);
+
+        stats->in = s.total_in;
+        stats->out = s.total_out;
+        lzma_end(&s);
+
+        return r;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int decompress_zstd(const void *data, size_t size, char *buf, decompress_func_t func, void *userdata,
+                           DecompressStats *stats) {
+        ZSTD_inBuffer in = { .src = data, .size = size };
+        ZSTD_DStream *s;
+        size_t ret = 1;
+        int r = 0;
+
+        s = ZSTD_createDStream();
+        if (!s)
+                return -ENOMEM;
+
+        ZSTD_initDStream(s);
+
+        /* a frame is over when ret is 0; more may follow */
+        while (in.pos < in.size || ret != 0) {
+                ZSTD_outBuffer out = { .dst = buf, .size = DECOMPRESS_BUFFER_SIZE };
+
+                ret = ZSTD_decompressStream(s, &out, &in);
+                if (ZSTD_isError(ret)) {
+                        r = -EBADMSG;
+                        break;
+                }
+
+                if (out.pos == 0 && in.pos == in.size && ret != 0) {
+                        r = -EBADMSG;
+                        break;
+                }
+
+                if (out.pos > 0) {
+                        r = func(buf, out.pos, userdata);
+                        if (r < 0)
+                                break;
+                }
+
+                stats->out += out.pos;
+        }
+
+        stats->in = in.pos;
+        ZSTD_freeDStream(s);
+
+        return r;
+}
+#endif
+
+/*
+ * Decompresses the @size bytes at @data, and hands the output to @func one
+ * buffer at a time. Returns -EBADMSG if the data is corrupt or truncated.
+ */
+int decompress(Compression c, const void *data, size_t size, decompress_func_t func, void *userdata,
+               DecompressStats *stats) {
+        _cleanup_free_ char *buf = NULL;
+        uint64_t start = now_usec();
+        int r;
+
+        *stats = (DecompressStats) {};
+
+        if (c == COMPRESSION_NONE || !compression_supported(c))
+                return -EOPNOTSUPP;
+
+        buf = malloc(DECOMPRESS_BUFFER_SIZE);
+        if (!buf)
+                return -ENOMEM;
+
+        switch (c) {
+#ifdef HAVE_ZSTD
+        case COMPRESSION_ZSTD:
+                r = decompress_zstd(data, size, buf, func, userdata, stats);
+                break;
+#endif
+#ifdef HAVE_XZ
+        case COMPRESSION_XZ:
+                r = decompress_xz(data, size, buf, func, userdata, stats);
+                break;
+#endif
+        default:
+                r = -EOPNOTSUPP;
+                break;
+        }
+
+        stats->usec = now_usec() - start;
+        return r;
+}
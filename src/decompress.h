@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compressed firmware files, as the kernel's own loader knows them: the
+ * plain name with a suffix for the codec. Blobs are decompressed a bounded
+ * buffer at a time, the decompressed firmware is never in memory as a whole.
+ */
+
+typedef enum Compression {
+        COMPRESSION_NONE,
+        COMPRESSION_ZSTD,
+        COMPRESSION_XZ,
+        _COMPRESSION_MAX,
+} Compression;
+
+typedef struct DecompressStats {
+        uint64_t in;
+        uint64_t out;
+        uint64_t usec;
+} DecompressStats;
+
+/* takes the next @size bytes of the output */
+typedef int (*decompress_func_t)(const void *buf, size_t size, void *userdata);
+
+const char *compression_to_string(Compression compression);
+const char *compression_suffix(Compression compression);
+bool compression_supported(Compression compression);
+
+int decompress(Compression compression, const void *data, size_t size, decompress_func_t func,
+               void *userdata, DecompressStats *stats);
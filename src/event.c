@@ -0,0 +1,447 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "macro.h"
+
+/*
+ * Timers are kept in a min-heap ordered by expiry and priority, and share a
+ * single timerfd that is armed for the earliest of them; that timerfd is
+ * itself just another source in the loop.
+ *
+ * A source freed while a batch is dispatched is only taken out of epoll at
+ * once; the memory is released after the batch, so that later entries of the
+ * same batch never point to freed memory.
+ */
+
+/* readiness events fetched per epoll_wait() */
+#define EVENT_BATCH (64)
+
+typedef enum EventSourceType {
+        EVENT_SOURCE_IO,
+        EVENT_SOURCE_TIME,
+        EVENT_SOURCE_PREPARE,
+} EventSourceType;
+
+struct EventSource {
+        EventLoop *loop;
+        EventSourceType type;
+        int priority;
+        bool dead;
+        void *userdata;
+        /* the list of prepare sources, then the list of dead sources */
+        EventSource *next;
+        union {
+                struct {
+                        int fd;
+                        event_io_func_t func;
+                } io;
+                struct {
+                        uint64_t usec;
+                        size_t index;
+                        event_time_func_t func;
+                } time;
+                struct {
+                        event_prepare_func_t func;
+                } prepare;
+        };
+};
+
+struct EventLoop {
+        int epollfd;
+        int timerfd;
+        EventSource *timer_source;
+        uint64_t timer_armed;
+        EventSource **timers;
+        size_t n_timers;
+        size_t n_timers_allocated;
+        EventSource *prepares;
+        EventSource *dead;
+        bool exiting;
+        int exit_code;
+};
+
+uint64_t event_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static bool event_timer_before(EventSource *a, EventSource *b) {
+        if (a->time.usec != b->time.usec)
+                return a->time.usec < b->time.usec;
+
+        return a->priority < b->priority;
+}
+
+static void event_timer_swap(EventLoop *e, size_t i, size_t j) {
+        EventSource *s = e->timers[i];
+
+        e->timers[i] = e->timers[j];
+        e->timers[j] = s;
+        e->timers[i]->time.index = i;
+        e->timers[j]->time.index = j;
+}
+
+static void event_timer_sift(EventLoop *e, size_t i) {
+        while (i > 0 && event_timer_before(e->timers[i], e->timers[(i - 1) / 2])) {
+                event_timer_swap(e, i, (i - 1) / 2);
+                i = (i - 1) / 2;
+        }
+
+        for (;;) {
+                size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+
+                if (l < e->n_timers && event_timer_before(e->timers[l], e->timers[min]))
+                        min = l;
+                if (r < e->n_timers && event_timer_before(e->timers[r], e->timers[min]))
+                        min = r;
+                if (min == i)
+                        break;
+
+                event_timer_swap(e, i, min);
+                i = min;
+        }
+}
+
+static int event_timer_push(EventLoop *e, EventSource *s) {
+        if (e->n_timers == e->n_timers_allocated) {
+                size_t n = e->n_timers_allocated ? 2 * e->n_timers_allocated : 16;
+                EventSource **timers;
+
+                timers = realloc(e->timers, n * sizeof(*timers));
+                if (!timers)
+                        return -ENOMEM;
+
+                e->timers = timers;
+                e->n_timers_allocated = n;
+        }
+
+        s->time.index = e->n_timers;
+        e->timers[e->n_timers++] = s;
+        event_timer_sift(e, s->time.index);
+
+        return 0;
+}
+
+static void event_timer_remove(EventLoop *e, EventSource *s) {
+        size_t i = s->time.index;
+
+        if (s->time.usec == 0)
+                return;
+
+        e->n_timers--;
+        if (i != e->n_timers) {
+                e->timers[i] = e->timers[e->n_timers];
+                e->timers[i]->time.index = i;
+                event_timer_sift(e, i);
+        }
+}
+
+static int event_timer_arm(EventLoop *e) {
+        struct itimerspec its = {};
+        uint64_t usec = e->n_timers ? e->timers[0]->time.usec : 0;
+
+        if (usec == e->timer_armed)
+                return 0;
+
+        its.it_value.tv_sec = usec / USEC_PER_SEC;
+        its.it_value.tv_nsec = (usec % USEC_PER_SEC) * 1000;
+
+        if (timerfd_settime(e->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+                return -errno;
+
+        e->timer_armed = usec;
+        return 0;
+}
+
+/* runs every timer that expired, earliest first */
+static int event_timer_dispatch(EventSource *source, int fd, uint32_t events, void *userdata) {
+        EventLoop *e = userdata;
+        uint64_t expirations, now;
+
+        if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                return -errno;
+
+        /* the timerfd is no longer armed for anything */
+        e->timer_armed = 0;
+        now = event_now();
+
+        while (e->n_timers > 0 && e->timers[0]->time.usec <= now && !e->exiting) {
+                EventSource *s = e->timers[0];
+                uint64_t usec = s->time.usec;
+                int r;
+
+                /* disarmed before the callback, which may arm it again */
+                event_timer_remove(e, s);
+                s->time.usec = 0;
+
+                r = s->time.func(s, usec, s->userdata);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+int event_loop_new(EventLoop **loopp) {
+        _cleanup_(event_loop_freep) EventLoop *e = NULL;
+        int r;
+
+        e = calloc(1, sizeof(*e));
+        if (!e)
+                return -ENOMEM;
+
+        e->timerfd = -1;
+
+        e->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (e->epollfd < 0)
+                return -errno;
+
+        e->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (e->timerfd < 0)
+                return -errno;
+
+        r = event_add_io(e, &e->timer_source, e->timerfd, EPOLLIN, EVENT_PRIORITY_NORMAL,
+                         event_timer_dispatch, e);
+        if (r < 0)
+                return r;
+
+        *loopp = e;
+        e = NULL;
+
+        return 0;
+}
+
+static void event_free_dead(EventLoop *e) {
+        while (e->dead) {
+                EventSource *s = e->dead;
+
+                e->dead = s->next;
+                free(s);
+        }
+}
+
+void event_loop_free(EventLoop *e) {
+        if (e->timer_source)
+                event_source_free(e->timer_source);
+        event_free_dead(e);
+
+        free(e->timers);
+        if (e->timerfd >= 0)
+                close(e->timerfd);
+        if (e->epollfd >= 0)
+                close(e->epollfd);
+        free(e);
+}
+
+void event_loop_exit(EventLoop *e, int code) {
+        e->exiting = true;
+        e->exit_code = code;
+}
+
+static EventSource *event_source_new(EventLoop *e, EventSourceType type, int priority, void *userdata) {
+        EventSource *s;
+
+        s = calloc(1, sizeof(*s));
+        if (!s)
+                return NULL;
+
+        s->loop = e;
+        s->type = type;
+        s->priority = priority;
+        s->userdata = userdata;
+
+        return s;
+}
+
+int event_add_io(EventLoop *e, EventSource **sourcep, int fd, uint32_t events, int priority,
+                 event_io_func_t func, void *userdata) {
+        struct epoll_event ev = { .events = events };
+        EventSource *s;
+
+        s = event_source_new(e, EVENT_SOURCE_IO, priority, userdata);
+        if (!s)
+                return -ENOMEM;
+
+        s->io.fd = fd;
+        s->io.func = func;
+
+        ev.data.ptr = s;
+        if (epoll_ctl(e->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                free(s);
+                return -errno;
+        }
+
+        *sourcep = s;
+        return 0;
+}
+
+/* changes what the io source @s waits for, like EPOLLOUT once there is output */
+int event_source_set_io_events(EventSource *s, uint32_t events) {
+        struct epoll_event ev = { .events = events, .data.ptr = s };
+
+        if (epoll_ctl(s->loop->epollfd, EPOLL_CTL_MOD, s->io.fd, &ev) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/*
+ * Adds a timer that fires once at @usec on the monotonic clock, or not at all
+ * if that is zero. Use event_source_set_time() to arm it again.
+ */
+int event_add_time(EventLoop *e, EventSource **sourcep, uint64_t usec, int priority,
+                   event_time_func_t func, void *userdata) {
+        EventSource *s;
+        int r;
+
+        s = event_source_new(e, EVENT_SOURCE_TIME, priority, userdata);
+        if (!s)
+                return -ENOMEM;
+
+        s->time.func = func;
+
+        r = event_source_set_time(s, usec);
+        if (r < 0) {
+                free(s);
+                return r;
+        }
+
+        *sourcep = s;
+        return 0;
+}
+
+/* called before every wait, e.g. to flush what was queued meanwhile */
+int event_add_prepare(EventLoop *e, EventSource **sourcep, event_prepare_func_t func, void *userdata) {
+        EventSource *s;
+
+        s = event_source_new(e, EVENT_SOURCE_PREPARE, EVENT_PRIORITY_NORMAL, userdata);
+        if (!s)
+                return -ENOMEM;
+
+        s->prepare.func = func;
+        s->next = e->prepares;
+        e->prepares = s;
+
+        *sourcep = s;
+        return 0;
+}
+
+int event_source_set_time(EventSource *s, uint64_t usec) {
+        event_timer_remove(s->loop, s);
+        s->time.usec = usec;
+
+        if (usec == 0)
+                return 0;
+
+        return event_timer_push(s->loop, s);
+}
+
+uint64_t event_source_get_time(EventSource *s) {
+        return s->time.usec;
+}
+
+void event_source_free(EventSource *s) {
+        EventLoop *e = s->loop;
+
+        switch (s->type) {
+        case EVENT_SOURCE_IO:
+                epoll_ctl(e->epollfd, EPOLL_CTL_DEL, s->io.fd, NULL);
+                break;
+        case EVENT_SOURCE_TIME:
+                event_timer_remove(e, s);
+                s->time.usec = 0;
+                break;
+        case EVENT_SOURCE_PREPARE:
+                for (EventSource **p = &e->prepares; *p; p = &(*p)->next)
+                        if (*p == s) {
+                                *p = s->next;
+                                break;
+                        }
+                break;
+        }
+
+        s->dead = true;
+        s->next = e->dead;
+        e->dead = s;
+}
+
+typedef struct EventReady {
+        EventSource *source;
+        uint32_t events;
+} EventReady;
+
+static int event_dispatch(EventLoop *e, const struct epoll_event *events, int n) {
+        EventReady ready[EVENT_BATCH];
+
+        /* insertion sort by priority, keeping the kernel's order otherwise */
+        for (int i = 0; i < n; i++) {
+                EventSource *s = events[i].data.ptr;
+                int j = i;
+
+                while (j > 0 && ready[j - 1].source->priority > s->priority) {
+                        ready[j] = ready[j - 1];
+                        j--;
+                }
+
+                ready[j] = (EventReady) { s, events[i].events };
+        }
+
+        for (int i = 0; i < n && !e->exiting; i++) {
+                EventSource *s = ready[i].source;
+                int r;
+
+                if (s->dead)
+                        continue;
+
+                r = s->io.func(s, s->io.fd, ready[i].events, s->userdata);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+/*
+ * Dispatches events until event_loop_exit() is called, or a callback fails.
+ */
+int event_loop_run(EventLoop *e) {
+        while (!e->exiting) {
+                struct epoll_event events[EVENT_BATCH];
+                int n, r;
+
+                for (EventSource *s = e->prepares; s; s = s->next) {
+                        r = s->prepare.func(s, s->userdata);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = event_timer_arm(e);
+                if (r < 0)
+                        return r;
+
+                event_free_dead(e);
+
+                n = epoll_wait(e->epollfd, events, EVENT_BATCH, -1);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                r = event_dispatch(e, events, n);
+                event_free_dead(e);
+                if (r < 0)
+                        return r;
+        }
+
+        return e->exit_code;
+}
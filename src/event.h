@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The daemon's main loop: file descriptors and monotonic timers, each with a
+ * callback and a priority. Ready sources are collected in batches and
+ * dispatched in priority order, lowest value first.
+ */
+
+#define EVENT_PRIORITY_HIGH (-100)
+#define EVENT_PRIORITY_NORMAL (0)
+#define EVENT_PRIORITY_LOW (100)
+
+#define USEC_PER_SEC (UINT64_C(1000000))
+#define USEC_PER_MSEC (UINT64_C(1000))
+
+typedef struct EventLoop EventLoop;
+typedef struct EventSource EventSource;
+
+/* returning a negative error ends event_loop_run() with it */
+typedef int (*event_io_func_t)(EventSource *source, int fd, uint32_t events, void *userdata);
+typedef int (*event_time_func_t)(EventSource *source, uint64_t usec, void *userdata);
+typedef int (*event_prepare_func_t)(EventSource *source, void *userdata);
+
+int event_loop_new(EventLoop **loopp);
+void event_loop_free(EventLoop *loop);
+
+int event_loop_run(EventLoop *loop);
+void event_loop_exit(EventLoop *loop, int code);
+
+int event_add_io(EventLoop *loop, EventSource **sourcep, int fd, uint32_t events, int priority,
+                 event_io_func_t func, void *userdata);
+int event_add_time(EventLoop *loop, EventSource **sourcep, uint64_t usec, int priority,
+                   event_time_func_t func, void *userdata);
+int event_add_prepare(EventLoop *loop, EventSource **sourcep, event_prepare_func_t func, void *userdata);
+
+int event_source_set_io_events(EventSource *source, uint32_t events);
+int event_source_set_time(EventSource *source, uint64_t usec);
+uint64_t event_source_get_time(EventSource *source);
+void event_source_free(EventSource *source);
+
+uint64_t event_now(void);
+
+static inline void event_loop_freep(EventLoop **loopp) {
+        if (*loopp)
+                event_loop_free(*loopp);
+}
+
+static inline void event_source_freep(EventSource **sourcep) {
+        if (*sourcep)
+                event_source_free(*sourcep);
+}
@@ -0,0 +1,72 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log-util.h"
+#include "macro.h"
+#include "pack.h"
+
+static void usage(void) {
+	printf("firmware-pack - Build a firmware pack for firmwared\n"
+		"Usage:\n");
+	printf("\tfirmware-pack [options] PACK DIR [DIR...]\n");
+	printf("Options:\n"
+		"\t-h, --help             Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "help",          no_argument,       NULL, 'h' },
+	{ }
+};
+
+int main(int argc, char **argv) {
+        _cleanup_free_ int *dirfds = NULL;
+        size_t n_dirs;
+        int r;
+
+        for (;;) {
+                int opt;
+
+                opt = getopt_long(argc, argv, "h", main_options, NULL);
+                if (opt < 0)
+                        break;
+
+                switch (opt) {
+                case 'h':
+                        usage();
+                        return EXIT_SUCCESS;
+                default:
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (argc - optind < 2) {
+                usage();
+                return EXIT_FAILURE;
+        }
+
+        n_dirs = argc - optind - 1;
+        dirfds = calloc(n_dirs, sizeof(int));
+        if (!dirfds)
+                return EXIT_FAILURE;
+
+        for (size_t i = 0; i < n_dirs; i++) {
+                dirfds[i] = open(argv[optind + 1 + i], O_RDONLY|O_DIRECTORY|O_CLOEXEC|O_PATH);
+                if (dirfds[i] < 0) {
+                        log_error("firmware-pack %s: %m", argv[optind + 1 + i]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        r = pack_write(argv[optind], dirfds, n_dirs);
+        if (r < 0) {
+                log_error("firmware-pack %s: %s", argv[optind], strerror(-r));
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,525 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "firmware.h"
+#include "firmware-uring.h"
+#include "log-util.h"
+#include "macro.h"
+#include "trace.h"
+#include "uring.h"
+
+/*
+ * Every upload owns two slots of the registered file table, for "loading" and
+ * "data", and goes through three stages, each a chain of linked operations:
+ *
+ *   open:   openat(loading), openat(data), write(loading, "1")
+ *   data:   a batch of page sized writes to data, repeated until done
+ *   finish: write(loading, "0" or "-1"), close(data), close(loading)
+ *
+ * The next stage is queued once every operation of the previous one has
+ * completed. sysfs takes at most a page per write, which is why the blob is
+ * split up; a short write breaks the chain, and the next batch continues
+ * from where the device stopped. Uploads beyond the number of slots wait in
+ * a queue.
+ *
+ * Uploads may be handed over from any thread; they are only put on the
+ * incoming list then, which the thread owning the ring drains when it
+ * submits. Everything else runs on that thread.
+ */
+
+#define UPLOAD_DATA_BATCH (8)
+#define UPLOAD_OPS_MAX UPLOAD_DATA_BATCH
+
+#define UPLOAD_TAG_CONTROL (0)
+#define UPLOAD_TAG_DATA (1)
+
+enum {
+        UPLOAD_OPEN,
+        UPLOAD_DATA,
+        UPLOAD_FINISH,
+};
+
+static const char loading_start[] = "1\n";
+static const char loading_finish[] = "0\n";
+static const char loading_cancel[] = "-1\n";
+
+typedef struct Upload Upload;
+
+struct Upload {
+        Upload *next;
+        int devicefd;
+        void *map;
+        const char *data;
+        size_t size;
+        size_t offset;
+        size_t acked;
+        unsigned int slot;
+        unsigned int stage;
+        unsigned int pending;
+        bool tentative;
+        bool started;
+        int error;
+        void *cookie;
+        /* for the probes */
+        char devpath[];
+};
+
+struct FirmwareUring {
+        Uring *ring;
+        Upload **slots;
+        unsigned int n_slots;
+        unsigned int n_active;
+        Upload *queue_head;
+        Upload *queue_tail;
+        /* handed over, not started yet */
+        pthread_mutex_t lock;
+        Upload *incoming_head;
+        Upload *incoming_tail;
+        size_t chunk_size;
+        firmware_uring_func_t func;
+        void *userdata;
+};
+
+static unsigned int upload_loading_file(Upload *u) {
+        return 2 * u->slot;
+}
+
+static unsigned int upload_data_file(Upload *u) {
+        return 2 * u->slot + 1;
+}
+
+static void upload_free(Upload *u) {
+        if (u->map)
+                munmap(u->map, u->size);
+        if (u->devicefd >= 0)
+                close(u->devicefd);
+        free(u);
+}
+
+/* frees an upload that was accepted by firmware_uring_load() */
+static void upload_release(FirmwareUring *f, Upload *u, int error) {
+        void *cookie = u->cookie;
+
+        TRACE3(upload_end, u->devpath, (uint64_t)u->size, error);
+        upload_free(u);
+        if (f->func)
+                f->func(cookie, error, f->userdata);
+}
+
+static struct io_uring_sqe *upload_get_sqe(FirmwareUring *f, Upload *u, unsigned int tag) {
+        struct io_uring_sqe *sqe;
+
+        /* every stage makes sure there is room before queueing anything */
+        sqe = uring_get_sqe(f->ring);
+        sqe->user_data = (uintptr_t)u | tag;
+        u->pending++;
+
+        return sqe;
+}
+
+static void upload_prep_openat(FirmwareUring *f, Upload *u, const char *path, unsigned int file) {
+        struct io_uring_sqe *sqe;
+
+        sqe = upload_get_sqe(f, u, UPLOAD_TAG_CONTROL);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = u->devicefd;
+        sqe->addr = (uintptr_t)path;
+        /* direct descriptors never reach the fd table, O_CLOEXEC is refused */
+        sqe->open_flags = O_WRONLY;
+        sqe->file_index = file + 1;
+        sqe->flags = IOSQE_IO_LINK;
+}
+
+static void upload_prep_write(FirmwareUring *f, Upload *u, unsigned int tag, unsigned int file,
+                              const void *buf, size_t len, uint64_t offset, uint8_t flags) {
+        struct io_uring_sqe *sqe;
+
+        sqe = upload_get_sqe(f, u, tag);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = file;
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->flags = IOSQE_FIXED_FILE|flags;
+}
+
+static void upload_prep_close(FirmwareUring *f, Upload *u, unsigned int file, uint8_t flags) {
+        struct io_uring_sqe *sqe;
+
+        sqe = upload_get_sqe(f, u, UPLOAD_TAG_CONTROL);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = file + 1;
+        sqe->flags = flags;
+}
+
+static int upload_reserve(FirmwareUring *f) {
+        int r;
+
+        if (uring_get_sq_space(f->ring) >= UPLOAD_OPS_MAX)
+                return 0;
+
+        r = uring_submit(f->ring, 0);
+        if (r < 0)
+                return r;
+
+        return uring_get_sq_space(f->ring) >= UPLOAD_OPS_MAX ? 0 : -EBUSY;
+}
+
+static int upload_queue_open(FirmwareUring *f, Upload *u) {
+        int r;
+
+        r = upload_reserve(f);
+        if (r < 0)
+                return r;
+
+        u->stage = UPLOAD_OPEN;
+
+        upload_prep_openat(f, u, "loading", upload_loading_file(u));
+        upload_prep_openat(f, u, "data", upload_data_file(u));
+        /* the file position is used, as with write() */
+        upload_prep_write(f, u, UPLOAD_TAG_CONTROL, upload_loading_file(u),
+                          loading_start, strlen(loading_start), (uint64_t)-1, 0);
+
+        return 0;
+}
+
+static int upload_queue_data(FirmwareUring *f, Upload *u) {
+        size_t offset = u->offset;
+        int r;
+
+        r = upload_reserve(f);
+        if (r < 0)
+                return r;
+
+        u->stage = UPLOAD_DATA;
+        u->acked = 0;
+
+        for (unsigned int i = 0; i < UPLOAD_DATA_BATCH && offset < u->size; i++) {
+                size_t len = u->size - offset;
+
+                if (len > f->chunk_size)
+                        len = f->chunk_size;
+
+                upload_prep_write(f, u, UPLOAD_TAG_DATA, upload_data_file(u), u->data + offset, len, offset,
+                                  i + 1 < UPLOAD_DATA_BATCH && offset + len < u->size ? IOSQE_IO_LINK : 0);
+                offset += len;
+        }
+
+        return 0;
+}
+
+static int upload_queue_finish(FirmwareUring *f, Upload *u) {
+        int r;
+
+        r = upload_reserve(f);
+        if (r < 0)
+                return r;
+
+        u->stage = UPLOAD_FINISH;
+
+        /* the descriptors are closed even if the write fails */
+        if (!u->error)
+                upload_prep_write(f, u, UPLOAD_TAG_CONTROL, upload_loading_file(u),
+                                  loading_finish, strlen(loading_finish), (uint64_t)-1, IOSQE_IO_HARDLINK);
+        else if (u->error != -ENOENT && (!u->tentative || u->started))
+                upload_prep_write(f, u, UPLOAD_TAG_CONTROL, upload_loading_file(u),
+                                  loading_cancel, strlen(loading_cancel), (uint64_t)-1, IOSQE_IO_HARDLINK);
+
+        upload_prep_close(f, u, upload_data_file(u), IOSQE_IO_HARDLINK);
+        upload_prep_close(f, u, upload_loading_file(u), 0);
+
+        return 0;
+}
+
+static int firmware_uring_start(FirmwareUring *f, Upload *u) {
+        for (unsigned int i = 0; i < f->n_slots; i++) {
+                int r;
+
+                if (f->slots[i])
+                        continue;
+
+                u->slot = i;
+                r = upload_queue_open(f, u);
+                if (r < 0)
+                        return r;
+
+                f->slots[i] = u;
+                f->n_active++;
+
+                return 0;
+        }
+
+        /* all slots busy, wait for one to finish */
+        if (f->queue_tail)
+                f->queue_tail->next = u;
+        else
+                f->queue_head = u;
+        f->queue_tail = u;
+
+        return 0;
+}
+
+static int upload_done(FirmwareUring *f, Upload *u) {
+        Upload *next;
+        int r;
+
+        if (u->error && u->error != -ENOENT)
+                log_error("firmware upload failed: %s", strerror(-u->error));
+
+        f->slots[u->slot] = NULL;
+        f->n_active--;
+        upload_release(f, u, u->error);
+
+        next = f->queue_head;
+        if (!next)
+                return 0;
+
+        f->queue_head = next->next;
+        if (!f->queue_head)
+                f->queue_tail = NULL;
+        next->next = NULL;
+
+        r = firmware_uring_start(f, next);
+        if (r < 0)
+                upload_release(f, next, r);
+
+        return r;
+}
+
+/* called once every operation of the current stage has completed */
+static int upload_advance(FirmwareUring *f, Upload *u) {
+        switch (u->stage) {
+        case UPLOAD_OPEN:
+                if (u->error)
+                        return upload_queue_finish(f, u);
+
+                u->started = true;
+                return upload_queue_data(f, u);
+
+        case UPLOAD_DATA:
+                if (!u->error && u->acked == 0)
+                        u->error = -EIO;
+                if (u->error)
+                        return upload_queue_finish(f, u);
+
+                u->offset += u->acked;
+                if (u->offset < u->size)
+                        return upload_queue_data(f, u);
+
+                return upload_queue_finish(f, u);
+
+        default:
+                return upload_done(f, u);
+        }
+}
+
+int firmware_uring_process(FirmwareUring *f) {
+        struct io_uring_cqe cqe;
+        int r;
+
+        while (uring_get_cqe(f->ring, &cqe)) {
+                Upload *u = (Upload *)(uintptr_t)(cqe.user_data & ~(uint64_t)1);
+
+                if (cqe.res < 0) {
+                        /* the rest of a broken chain is cancelled, keep the cause */
+                        if (cqe.res != -ECANCELED && !u->error && u->stage != UPLOAD_FINISH)
+                                u->error = cqe.res;
+                } else if (cqe.user_data & UPLOAD_TAG_DATA)
+                        u->acked += cqe.res;
+
+                if (--u->pending > 0)
+                        continue;
+
+                r = upload_advance(f, u);
+                if (r < 0)
+                        return r;
+        }
+
+        return uring_submit(f->ring, 0);
+}
+
+/* starts the uploads handed over since the last time */
+static void firmware_uring_start_incoming(FirmwareUring *f) {
+        Upload *u;
+
+        pthread_mutex_lock(&f->lock);
+        u = f->incoming_head;
+        f->incoming_head = f->incoming_tail = NULL;
+        pthread_mutex_unlock(&f->lock);
+
+        while (u) {
+                Upload *next = u->next;
+                int r;
+
+                u->next = NULL;
+                r = firmware_uring_start(f, u);
+                if (r < 0)
+                        upload_release(f, u, r);
+                u = next;
+        }
+}
+
+int firmware_uring_submit(FirmwareUring *f) {
+        firmware_uring_start_incoming(f);
+
+        return uring_submit(f->ring, 0);
+}
+
+int firmware_uring_get_fd(FirmwareUring *f) {
+        return uring_get_fd(f->ring);
+}
+
+int firmware_uring_new(FirmwareUring **fp, unsigned int max_uploads, firmware_uring_func_t func,
+                       void *userdata) {
+        _cleanup_(firmware_uring_freep) FirmwareUring *f = NULL;
+        int r;
+
+        if (max_uploads == 0)
+                return -EINVAL;
+
+        f = calloc(1, sizeof(*f));
+        if (!f)
+                return -ENOMEM;
+
+        f->chunk_size = sysconf(_SC_PAGESIZE);
+        f->func = func;
+        f->userdata = userdata;
+        pthread_mutex_init(&f->lock, NULL);
+
+        f->slots = calloc(max_uploads, sizeof(Upload *));
+        if (!f->slots)
+                return -ENOMEM;
+        f->n_slots = max_uploads;
+
+        r = uring_new(&f->ring, max_uploads * UPLOAD_OPS_MAX);
+        if (r < 0)
+                return r;
+
+        /* sparse tables and openat() into them need a recent kernel */
+        r = uring_register_files(f->ring, 2 * max_uploads);
+        if (r < 0)
+                return r;
+
+        *fp = f;
+        f = NULL;
+
+        return 0;
+}
+
+/*
+ * Completes every upload that was handed over, then releases the ring.
+ */
+void firmware_uring_free(FirmwareUring *f) {
+        if (f->ring)
+                firmware_uring_start_incoming(f);
+        if (f->ring)
+                while (f->n_active > 0) {
+                        if (uring_submit(f->ring, 1) < 0 ||
+                            firmware_uring_process(f) < 0)
+                                break;
+                }
+
+        for (unsigned int i = 0; i < f->n_slots; i++)
+                if (f->slots[i])
+                        upload_release(f, f->slots[i], -ECANCELED);
+
+        while (f->queue_head) {
+                Upload *u = f->queue_head;
+
+                f->queue_head = u->next;
+                upload_release(f, u, -ECANCELED);
+        }
+
+        while (f->incoming_head) {
+                Upload *u = f->incoming_head;
+
+                f->incoming_head = u->next;
+                upload_release(f, u, -ECANCELED);
+        }
+
+        pthread_mutex_destroy(&f->lock);
+        if (f->ring)
+                uring_free(f->ring);
+        free(f->slots);
+        free(f);
+}
+
+/*
+ * Queues the upload of the file @firmwarefd or, if that is negative, of the
+ * @size bytes at @data, to the device @devicefd at @devpath, which must stay valid until the upload completed. The
+ * descriptors are not needed anymore when this returns. Returns 1 if the
+ * upload was queued; the completion callback is called with @cookie once it
+ * is over then. May be called from any thread; the upload is started by the
+ * next firmware_uring_submit().
+ */
+int firmware_uring_load(FirmwareUring *f, int devicefd, const char *devpath, int firmwarefd, const void *data,
+                        size_t size, bool tentative, void *cookie) {
+        Upload *u;
+        int r;
+
+        if (firmwarefd >= 0) {
+                struct stat st;
+
+                if (fstat(firmwarefd, &st) < 0)
+                        return -errno;
+
+                size = st.st_size;
+        }
+
+        if (size == 0) {
+                log_warn("firmware is empty; ignoring request");
+                if (tentative)
+                        return 0;
+
+                firmware_cancel_load(devicefd, devpath);
+                return -EIO;
+        }
+
+        u = calloc(1, sizeof(*u) + strlen(devpath) + 1);
+        if (!u)
+                return -ENOMEM;
+
+        strcpy(u->devpath, devpath);
+        u->size = size;
+        u->tentative = tentative;
+        u->data = data;
+        u->cookie = cookie;
+
+        u->devicefd = fcntl(devicefd, F_DUPFD_CLOEXEC, 3);
+        if (u->devicefd < 0) {
+                r = -errno;
+                free(u);
+                return r;
+        }
+
+        if (firmwarefd >= 0) {
+                u->map = mmap(NULL, size, PROT_READ, MAP_SHARED, firmwarefd, 0);
+                if (u->map == MAP_FAILED) {
+                        r = -errno;
+                        u->map = NULL;
+                        upload_free(u);
+                        return r;
+                }
+
+                u->data = u->map;
+        }
+
+        TRACE2(upload_start, u->devpath, (uint64_t)size);
+
+        pthread_mutex_lock(&f->lock);
+        if (f->incoming_tail)
+                f->incoming_tail->next = u;
+        else
+                f->incoming_head = u;
+        f->incoming_tail = u;
+        pthread_mutex_unlock(&f->lock);
+
+        return 1;
+}
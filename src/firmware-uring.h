@@ -0,0 +1,62 @@
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Uploads firmware through io_uring: the whole sysfs exchange of a request is
+ * queued as a few chains of linked operations, and the chains of many devices
+ * are submitted together. Uploads are handed over from any thread, and
+ * started by firmware_uring_submit(); completions are reaped by
+ * firmware_uring_process() once the descriptor becomes readable. Both of
+ * these run on one thread.
+ */
+
+typedef struct FirmwareUring FirmwareUring;
+
+/* called once an upload is over, successful or not, with the cookie it was queued with */
+typedef void (*firmware_uring_func_t)(void *cookie, int error, void *userdata);
+
+#ifdef HAVE_IO_URING
+int firmware_uring_new(FirmwareUring **fp, unsigned int max_uploads, firmware_uring_func_t func,
+                       void *userdata);
+void firmware_uring_free(FirmwareUring *f);
+
+int firmware_uring_get_fd(FirmwareUring *f);
+int firmware_uring_submit(FirmwareUring *f);
+int firmware_uring_process(FirmwareUring *f);
+
+int firmware_uring_load(FirmwareUring *f, int devicefd, const char *devpath, int firmwarefd, const void *data,
+                        size_t size, bool tentative, void *cookie);
+#else
+static inline int firmware_uring_new(FirmwareUring **fp, unsigned int max_uploads,
+                                     firmware_uring_func_t func, void *userdata) {
+        return -EOPNOTSUPP;
+}
+
+static inline void firmware_uring_free(FirmwareUring *f) {
+}
+
+static inline int firmware_uring_get_fd(FirmwareUring *f) {
+        return -1;
+}
+
+static inline int firmware_uring_submit(FirmwareUring *f) {
+        return -EOPNOTSUPP;
+}
+
+static inline int firmware_uring_process(FirmwareUring *f) {
+        return -EOPNOTSUPP;
+}
+
+static inline int firmware_uring_load(FirmwareUring *f, int devicefd, const char *devpath, int firmwarefd,
+                                      const void *data, size_t size, bool tentative, void *cookie) {
+        return -EOPNOTSUPP;
+}
+#endif
+
+static inline void firmware_uring_freep(FirmwareUring **fp) {
+        if (*fp)
+                firmware_uring_free(*fp);
+}
@@ -1,17 +1,28 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <sys/sendfile.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "decompress.h"
 #include "firmware.h"
 #include "log-util.h"
+#include "trace.h"
+#include "transfer.h"
 
 #define LOADING_START   (1)
 #define LOADING_CANCEL  (-1)
 #define LOADING_FINISH  (0)
 
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int firmware_set_loading(int loadingfd, int state) {
         int r;
 
@@ -22,7 +33,64 @@ static int firmware_set_loading(int loadingfd, int state) {
         return 0;
 }
 
-int firmware_load(int devicefd, int firmwarefd, bool tentative) {
+static int firmware_write_data(int datafd, const void *data, size_t size) {
+        const char *p = data;
+
+        while (size) {
+                ssize_t n;
+
+                n = write(datafd, p, size);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                } else if (n == 0)
+                        return -EIO;
+
+                p += n;
+                size -= n;
+        }
+
+        return 0;
+}
+
+static int firmware_write_chunk(const void *buf, size_t size, void *userdata) {
+        return firmware_write_data(*(int *)userdata, buf, size);
+}
+
+/* streams the decompressed blob into the data file, one buffer at a time */
+static int firmware_write_compressed(int datafd, int firmwarefd, const void *data, size_t size,
+                                     Compression compression, DecompressStats *stats) {
+        void *map = NULL;
+        int r;
+
+        if (firmwarefd >= 0) {
+                map = mmap(NULL, size, PROT_READ, MAP_SHARED, firmwarefd, 0);
+                if (map == MAP_FAILED)
+                        return -errno;
+
+                data = map;
+        }
+
+        r = decompress(compression, data, size, firmware_write_chunk, &datafd, stats);
+
+        if (map)
+                munmap(map, size);
+        return r;
+}
+
+/*
+ * Uploads either the file @firmwarefd or, if that is negative, the @datasize
+ * bytes at @data, decompressing it on the way if @compression says so. Files
+ * are copied as @transfer finds best for the filesystem @fs_type, or with
+ * sendfile() without one. When each step was done is stored in @times, if
+ * given. The @devpath of @devicefd is only passed on to the probes.
+ */
+static int firmware_upload(int devicefd, const char *devpath, int firmwarefd, const void *data,
+                           size_t datasize, Compression compression, Transfer *transfer, long fs_type,
+                           bool tentative, DecompressStats *stats, FirmwareTimes *times) {
+        FirmwareTimes t = {};
         int loadingfd = -1, datafd = -1;
         struct stat statbuf;
         bool started = false;
@@ -40,7 +108,9 @@ int firmware_load(int devicefd, int firmwarefd, bool tentative) {
                 goto finish;
         }
 
-        if (fstat(firmwarefd, &statbuf) < 0) {
+        if (firmwarefd < 0)
+                statbuf.st_size = datasize;
+        else if (fstat(firmwarefd, &statbuf) < 0) {
                 r = -errno;
                 goto finish;
         }
@@ -56,35 +126,77 @@ int firmware_load(int devicefd, int firmwarefd, bool tentative) {
                 goto finish;
 
         started = true;
-
-        while (statbuf.st_size) {
-                ssize_t size;
-                off_t offset = 0;
-
-                size = sendfile(datafd, firmwarefd, &offset, statbuf.st_size);
-                if (size < 0) {
-                        r = -errno;
-                        goto finish;
-                }
-
-                statbuf.st_size -= size;
+        t.loading = now_usec();
+        TRACE2(upload_start, devpath, (uint64_t)statbuf.st_size);
+
+        if (compression != COMPRESSION_NONE)
+                r = firmware_write_compressed(datafd, firmwarefd, data, statbuf.st_size, compression, stats);
+        else if (firmwarefd < 0)
+                r = firmware_write_data(datafd, data, datasize);
+        else if (transfer)
+                r = transfer_run(transfer, datafd, firmwarefd, statbuf.st_size, fs_type);
+        else {
+                size_t done;
+
+                r = transfer_copy(TRANSFER_SENDFILE, datafd, firmwarefd, statbuf.st_size, 0, &done);
         }
+        if (r < 0)
+                goto finish;
 
+        t.written = now_usec();
         firmware_set_loading(loadingfd, LOADING_FINISH);
+        t.done = now_usec();
 
 finish:
+        if (started)
+                TRACE3(upload_end, devpath, (uint64_t)statbuf.st_size, r);
+        if (times)
+                *times = t;
+
+        /* the device is told before the descriptor goes away */
+        if (r < 0 && r != -ENOENT && (!tentative || started) && loadingfd >= 0)
+                firmware_set_loading(loadingfd, LOADING_CANCEL);
         if (loadingfd >= 0)
                 close(loadingfd);
         if (datafd >= 0)
                 close(datafd);
-        if (r < 0 && r != -ENOENT && (!tentative || started)) {
-                firmware_set_loading(loadingfd, LOADING_CANCEL);
+        if (r < 0 && r != -ENOENT && (!tentative || started))
                 return r;
-        } else
+        else
                 return 0;
 }
 
-int firmware_cancel_load(int devicefd) {
+/*
+ * @fs_type is the filesystem the contents of @firmwarefd came from, e.g. when
+ * it is a cached copy; 0 for the one it is on.
+ */
+int firmware_load(int devicefd, const char *devpath, int firmwarefd, long fs_type, Transfer *transfer,
+                  bool tentative, FirmwareTimes *times) {
+        return firmware_upload(devicefd, devpath, firmwarefd, NULL, 0, COMPRESSION_NONE, transfer, fs_type,
+                               tentative, NULL, times);
+}
+
+/* uploads a blob that is already in memory, e.g. mapped from a pack */
+int firmware_load_data(int devicefd, const char *devpath, const void *data, size_t size, bool tentative,
+                       FirmwareTimes *times) {
+        return firmware_upload(devicefd, devpath, -1, data, size, COMPRESSION_NONE, NULL, 0, tentative, NULL,
+                               times);
+}
+
+/*
+ * Like firmware_load() or, with a negative @firmwarefd, firmware_load_data(),
+ * for a compressed blob. How long that took is stored in @stats.
+ */
+int firmware_load_compressed(int devicefd, const char *devpath, int firmwarefd, const void *data, size_t size,
+                             Compression compression, bool tentative, DecompressStats *stats,
+                             FirmwareTimes *times) {
+        *stats = (DecompressStats) {};
+
+        return firmware_upload(devicefd, devpath, firmwarefd, data, size, compression, NULL, 0, tentative, stats,
+                               times);
+}
+
+int firmware_cancel_load(int devicefd, const char *devpath) {
         int loadingfd;
         int r;
 
@@ -97,6 +209,7 @@ int firmware_cancel_load(int devicefd) {
         r = firmware_set_loading(loadingfd, LOADING_CANCEL);
 
 finish:
+        TRACE2(upload_cancel, devpath, r);
         if (loadingfd >= 0)
                 close(loadingfd);
         if (r < 0 && r != -ENOENT)
@@ -1,6 +1,27 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-int firmware_load(int devicefd, int firmwarefd, bool tentative);
-int firmware_cancel_load(int devicefd);
+#include "decompress.h"
+#include "transfer.h"
+
+/* when an upload got this far, on the monotonic clock in usec; 0 if it did not */
+typedef struct FirmwareTimes {
+        /* "loading" set to 1 */
+        uint64_t loading;
+        /* all of the data written */
+        uint64_t written;
+        /* "loading" set to 0 */
+        uint64_t done;
+} FirmwareTimes;
+
+int firmware_load(int devicefd, const char *devpath, int firmwarefd, long fs_type, Transfer *transfer,
+                  bool tentative, FirmwareTimes *times);
+int firmware_load_data(int devicefd, const char *devpath, const void *data, size_t size, bool tentative,
+                       FirmwareTimes *times);
+int firmware_load_compressed(int devicefd, const char *devpath, int firmwarefd, const void *data, size_t size,
+                             Compression compression, bool tentative, DecompressStats *stats,
+                             FirmwareTimes *times);
+int firmware_cancel_load(int devicefd, const char *devpath);
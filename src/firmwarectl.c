@@ -0,0 +1,116 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "log-util.h"
+#include "macro.h"
+
+static void usage(void) {
+	printf("firmwarectl - Control the Linux Firmware Loader Daemon\n"
+		"Usage:\n");
+	printf("\tfirmwarectl [options] COMMAND [ARG]\n");
+	printf("Options:\n"
+		"\t-s, --socket PATH      The daemon's control socket\n"
+		"\t-h, --help             Show help options\n");
+	printf("Commands are listed by 'firmwarectl help'\n");
+}
+
+static const struct option main_options[] = {
+	{ "socket",        required_argument, NULL, 's' },
+	{ "help",          no_argument,       NULL, 'h' },
+	{ }
+};
+
+int main(int argc, char **argv) {
+        _cleanup_close_ int fd = -1;
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        const char *path = CONTROL_PATH_DEFAULT;
+        char command[CONTROL_COMMAND_MAX], buf[4096];
+        bool failed = false, start = true;
+        size_t len = 0;
+
+        for (;;) {
+                int opt;
+
+                opt = getopt_long(argc, argv, "+s:h", main_options, NULL);
+                if (opt < 0)
+                        break;
+
+                switch (opt) {
+                case 's':
+                        path = optarg;
+                        break;
+                case 'h':
+                        usage();
+                        return EXIT_SUCCESS;
+                default:
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (optind >= argc) {
+                usage();
+                return EXIT_FAILURE;
+        }
+
+        for (int i = optind; i < argc; i++) {
+                int n;
+
+                n = snprintf(command + len, sizeof(command) - len, "%s%s", i > optind ? " " : "", argv[i]);
+                if (n < 0 || (size_t)n >= sizeof(command) - len - 1) {
+                        log_error("firmwarectl: command too long");
+                        return EXIT_FAILURE;
+                }
+                len += n;
+        }
+        command[len++] = '\n';
+
+        if (strlen(path) >= sizeof(sa.sun_path)) {
+                log_error("firmwarectl %s: %s", path, strerror(ENAMETOOLONG));
+                return EXIT_FAILURE;
+        }
+        strcpy(sa.sun_path, path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+                log_error("firmwarectl %s: %m", path);
+                return EXIT_FAILURE;
+        }
+
+        if (send(fd, command, len, MSG_NOSIGNAL) != (ssize_t)len) {
+                log_error("firmwarectl %s: %m", path);
+                return EXIT_FAILURE;
+        }
+        shutdown(fd, SHUT_WR);
+
+        for (;;) {
+                ssize_t n;
+
+                n = read(fd, buf, sizeof(buf));
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        log_error("firmwarectl %s: %m", path);
+                        return EXIT_FAILURE;
+                }
+                if (n == 0)
+                        break;
+
+                /* the daemon tells about failed commands in the first line */
+                if (start && !strncmp(buf, "error:", MIN((size_t)n, strlen("error:"))))
+                        failed = true;
+                start = false;
+
+                fwrite(buf, 1, n, failed ? stderr : stdout);
+        }
+
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -2,11 +2,17 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 
+#include "control.h"
 #include "manager.h"
 #include "log-util.h"
+#include "macro.h"
 
-#define ELEMENTSOF(x) (sizeof(x)/sizeof(x[0]))
+#define CACHE_SIZE_DEFAULT (16 * 1024 * 1024)
+#define THREADS_DEFAULT (4)
+#define THREADS_MAX (256)
+#define LOG_RING_SIZE (256 * 1024)
 
 static const char* const firmware_builtin_dirs[] = {
 	FIRMWARE_PATH
@@ -61,6 +67,52 @@ static void cleanup_firmware_dirs(void) {
                 free(firmware_dirs);
 }
 
+static int parse_size(const char *s, size_t *sizep) {
+        unsigned long long size;
+        char *end;
+
+        errno = 0;
+        size = strtoull(s, &end, 0);
+        if (errno)
+                return -errno;
+        if (end == s)
+                return -EINVAL;
+
+        switch (*end) {
+        case 'G':
+                size *= 1024;
+                /* fall through */
+        case 'M':
+                size *= 1024;
+                /* fall through */
+        case 'K':
+                size *= 1024;
+                end++;
+                break;
+        }
+
+        if (*end)
+                return -EINVAL;
+
+        *sizep = size;
+        return 0;
+}
+
+static int parse_unsigned(const char *s, unsigned int *up) {
+        unsigned long u;
+        char *end;
+
+        errno = 0;
+        u = strtoul(s, &end, 10);
+        if (errno)
+                return -errno;
+        if (end == s || *end || u > UINT_MAX)
+                return -EINVAL;
+
+        *up = u;
+        return 0;
+}
+
 static void usage(void) {
 	printf("firmwared - Linux Firmware Loader Daemon\n"
 		"Usage:\n");
@@ -68,38 +120,150 @@ static void usage(void) {
 	printf("Options:\n"
 		"\t-t, --tentative        Defer loading of non existing firmwares\n"
 		"\t-d, --dirs [paths]     Firmware loading paths\n"
+		"\t-c, --cache-size SIZE  Bytes of firmware kept in memory (K, M, G)\n"
+		"\t-i, --index FILE       Use a prebuilt index of the firmware paths\n"
+		"\t-j, --threads N        Upload firmware from N threads (0: none);\n"
+		"\t                       with io-uring, look it up there (at least 1)\n"
+		"\t-e, --engine ENGINE    Upload engine: threads (default), io-uring\n"
+		"\t-T, --transfer METHOD  Copy files with: auto (default), sendfile,\n"
+		"\t                       splice, mmap, read-write\n"
+		"\t    --chunk-size SIZE  Buffer size for splice and read-write (K, M)\n"
+		"\t-p, --profile FILE     Record requests, and prefetch what the last\n"
+		"\t                       run recorded\n"
+		"\t-m, --modalias-map FILE\n"
+		"\t                       Prefetch the firmware that new devices and\n"
+		"\t                       modules declare, see tools/modalias-map.sh\n"
+		"\t-P, --priorities FILE  Rules for the order requests are handled in\n"
+		"\t-C, --control PATH     Control socket, see firmwarectl (default:\n"
+		"\t                       " CONTROL_PATH_DEFAULT ", \"\" for none)\n"
+		"\t    --build-index FILE Write an index of the firmware paths and exit\n"
+		"\t    --sysfs PATH       Where sysfs is mounted (default: /sys)\n"
+		"\t    --uevent-socket PATH\n"
+		"\t                       Take uevents from a datagram socket bound\n"
+		"\t                       here, see tools/firmware-bench.c\n"
 		"\t-h, --help             Show help options\n");
 }
 
+enum {
+        ARG_BUILD_INDEX = 0x100,
+        ARG_CHUNK_SIZE,
+        ARG_SYSFS,
+        ARG_UEVENT_SOCKET,
+};
+
 static const struct option main_options[] = {
 	{ "tentative",     no_argument,       NULL, 't' },
 	{ "dirs",          required_argument, NULL, 'd' },
+	{ "cache-size",    required_argument, NULL, 'c' },
+	{ "index",         required_argument, NULL, 'i' },
+	{ "threads",       required_argument, NULL, 'j' },
+	{ "engine",        required_argument, NULL, 'e' },
+	{ "transfer",      required_argument, NULL, 'T' },
+	{ "chunk-size",    required_argument, NULL, ARG_CHUNK_SIZE },
+	{ "profile",       required_argument, NULL, 'p' },
+	{ "modalias-map",  required_argument, NULL, 'm' },
+	{ "priorities",    required_argument, NULL, 'P' },
+	{ "control",       required_argument, NULL, 'C' },
+	{ "build-index",   required_argument, NULL, ARG_BUILD_INDEX },
+	{ "sysfs",         required_argument, NULL, ARG_SYSFS },
+	{ "uevent-socket", required_argument, NULL, ARG_UEVENT_SOCKET },
 	{ "help",          no_argument,       NULL, 'h' },
 	{ }
 };
 
 int main(int argc, char **argv) {
         _cleanup_(manager_freep) Manager *manager = NULL;
-        bool tentative = false;
+        ManagerConfig config = {
+                .cache_size = CACHE_SIZE_DEFAULT,
+                .engine = MANAGER_ENGINE_THREADS,
+                .n_threads = THREADS_DEFAULT,
+                .transfer = TRANSFER_AUTO,
+                .chunk_size = TRANSFER_CHUNK_SIZE_DEFAULT,
+                .control_path = CONTROL_PATH_DEFAULT,
+        };
+        const char *build_index = NULL;
         char *dirs = NULL;
         int r;
 
+        /* until the log ring takes over, or if it cannot */
         setbuf(stdout, NULL);
 
         for (;;) {
                 int opt;
 
-                opt = getopt_long(argc, argv, "td:h", main_options, NULL);
+                opt = getopt_long(argc, argv, "td:c:i:j:e:T:p:m:P:C:h", main_options, NULL);
                 if (opt < 0)
                         break;
 
                 switch (opt) {
                 case 't':
-                        tentative = true;
+                        config.tentative = true;
                         break;
                 case 'd':
                         dirs = optarg;
                         break;
+                case 'c':
+                        r = parse_size(optarg, &config.cache_size);
+                        if (r < 0) {
+                                log_error("invalid cache size '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'i':
+                        config.index_path = optarg;
+                        break;
+                case 'j':
+                        r = parse_unsigned(optarg, &config.n_threads);
+                        if (r < 0 || config.n_threads > THREADS_MAX) {
+                                log_error("invalid number of threads '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'e':
+                        if (!strcmp(optarg, "threads"))
+                                config.engine = MANAGER_ENGINE_THREADS;
+                        else if (!strcmp(optarg, "io-uring"))
+                                config.engine = MANAGER_ENGINE_IO_URING;
+                        else {
+                                log_error("invalid upload engine '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'T':
+                        config.transfer = transfer_strategy_from_string(optarg);
+                        if (config.transfer == _TRANSFER_MAX) {
+                                log_error("invalid transfer method '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case ARG_CHUNK_SIZE:
+                        r = parse_size(optarg, &config.chunk_size);
+                        if (r < 0 || config.chunk_size == 0 || config.chunk_size > INT_MAX) {
+                                log_error("invalid chunk size '%s'", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'p':
+                        config.profile_path = optarg;
+                        break;
+                case 'm':
+                        config.modalias_map_path = optarg;
+                        break;
+                case 'P':
+                        config.priority_rules_path = optarg;
+                        break;
+                case 'C':
+                        config.control_path = optarg;
+                        break;
+                case ARG_BUILD_INDEX:
+                        build_index = optarg;
+                        break;
+                case ARG_SYSFS:
+                        config.sysfs_path = optarg;
+                        break;
+                case ARG_UEVENT_SOCKET:
+                        config.uevent_socket = optarg;
+                        break;
                 case 'h':
                         usage();
                         return EXIT_SUCCESS;
@@ -108,11 +272,23 @@ int main(int argc, char **argv) {
                 }
         }
 
+        /* from here on, logging does not wait for the console */
+        r = log_ring_start(LOG_RING_SIZE);
+        if (r < 0)
+                log_warn("cannot log asynchronously: %s", strerror(-r));
+
         r = setup_firmware_dirs(dirs);
         if (r < 0)
                 goto out;
 
-        r = manager_new(&manager, tentative);
+        if (build_index) {
+                r = manager_write_index(build_index);
+                if (r < 0)
+                        log_error("firmwared %s: %s", build_index, strerror(-r));
+                goto out;
+        }
+
+        r = manager_new(&manager, &config);
         if (r < 0) {
                 log_error("firmwared %s", strerror(-r));
                 goto out;
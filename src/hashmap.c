@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * A small chained hash table. Keys and values are not owned by the map. The
+ * entry last returned by hashmap_iterate() may be removed while iterating,
+ * but no other modification is allowed.
+ */
+
+#define HASHMAP_BUCKETS_MIN (64)
+
+typedef struct HashmapEntry HashmapEntry;
+
+struct HashmapEntry {
+        HashmapEntry *next;
+        const void *key;
+        void *value;
+        unsigned long hash;
+};
+
+struct Hashmap {
+        HashmapEntry **buckets;
+        size_t n_buckets;
+        size_t size;
+        hash_func_t hash;
+        compare_func_t compare;
+};
+
+unsigned long string_hash_func(const void *key) {
+        const unsigned char *p = key;
+        uint64_t hash = 14695981039346656037ULL;
+
+        /* FNV-1a */
+        while (*p) {
+                hash ^= *p++;
+                hash *= 1099511628211ULL;
+        }
+
+        return (unsigned long)hash;
+}
+
+int string_compare_func(const void *a, const void *b) {
+        return strcmp(a, b);
+}
+
+unsigned long trivial_hash_func(const void *key) {
+        uint64_t hash = (uintptr_t)key;
+
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+
+        return (unsigned long)hash;
+}
+
+int trivial_compare_func(const void *a, const void *b) {
+        return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+int hashmap_new(Hashmap **hashmapp, hash_func_t hash, compare_func_t compare) {
+        Hashmap *h;
+
+        h = calloc(1, sizeof(*h));
+        if (!h)
+                return -ENOMEM;
+
+        h->buckets = calloc(HASHMAP_BUCKETS_MIN, sizeof(*h->buckets));
+        if (!h->buckets) {
+                free(h);
+                return -ENOMEM;
+        }
+
+        h->n_buckets = HASHMAP_BUCKETS_MIN;
+        h->hash = hash;
+        h->compare = compare;
+
+        *hashmapp = h;
+        return 0;
+}
+
+void hashmap_free(Hashmap *h) {
+        for (size_t i = 0; i < h->n_buckets; i++) {
+                HashmapEntry *e, *next;
+
+                for (e = h->buckets[i]; e; e = next) {
+                        next = e->next;
+                        free(e);
+                }
+        }
+
+        free(h->buckets);
+        free(h);
+}
+
+static HashmapEntry **hashmap_find(Hashmap *h, const void *key, unsigned long hash) {
+        HashmapEntry **e;
+
+        for (e = &h->buckets[hash % h->n_buckets]; *e; e = &(*e)->next)
+                if ((*e)->hash == hash && !h->compare((*e)->key, key))
+                        return e;
+
+        return NULL;
+}
+
+static void hashmap_resize(Hashmap *h) {
+        HashmapEntry **buckets;
+        size_t n_buckets;
+
+        if (h->size < h->n_buckets)
+                return;
+
+        n_buckets = h->n_buckets * 4;
+        buckets = calloc(n_buckets, sizeof(*buckets));
+        if (!buckets)
+                /* keep going with longer chains */
+                return;
+
+        for (size_t i = 0; i < h->n_buckets; i++) {
+                HashmapEntry *e, *next;
+
+                for (e = h->buckets[i]; e; e = next) {
+                        next = e->next;
+                        e->next = buckets[e->hash % n_buckets];
+                        buckets[e->hash % n_buckets] = e;
+                }
+        }
+
+        free(h->buckets);
+        h->buckets = buckets;
+        h->n_buckets = n_buckets;
+}
+
+int hashmap_put(Hashmap *h, const void *key, void *value) {
+        HashmapEntry *e;
+        unsigned long hash;
+
+        hash = h->hash(key);
+        if (hashmap_find(h, key, hash))
+                return -EEXIST;
+
+        e = malloc(sizeof(*e));
+        if (!e)
+                return -ENOMEM;
+
+        e->key = key;
+        e->value = value;
+        e->hash = hash;
+        e->next = h->buckets[hash % h->n_buckets];
+        h->buckets[hash % h->n_buckets] = e;
+        h->size++;
+
+        hashmap_resize(h);
+
+        return 0;
+}
+
+void *hashmap_get(Hashmap *h, const void *key) {
+        HashmapEntry **e;
+
+        e = hashmap_find(h, key, h->hash(key));
+        if (!e)
+                return NULL;
+
+        return (*e)->value;
+}
+
+void *hashmap_remove(Hashmap *h, const void *key) {
+        HashmapEntry **e, *entry;
+        void *value;
+
+        e = hashmap_find(h, key, h->hash(key));
+        if (!e)
+                return NULL;
+
+        entry = *e;
+        *e = entry->next;
+        value = entry->value;
+        free(entry);
+        h->size--;
+
+        return value;
+}
+
+size_t hashmap_size(Hashmap *h) {
+        return h->size;
+}
+
+bool hashmap_iterate(Hashmap *h, HashmapIterator *i, const void **keyp, void **valuep) {
+        HashmapEntry *e = i->entry;
+
+        while (!e) {
+                if (i->bucket >= h->n_buckets)
+                        return false;
+
+                e = h->buckets[i->bucket++];
+        }
+
+        i->entry = e->next;
+
+        if (keyp)
+                *keyp = e->key;
+        if (valuep)
+                *valuep = e->value;
+
+        return true;
+}
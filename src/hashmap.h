@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct Hashmap Hashmap;
+
+typedef unsigned long (*hash_func_t)(const void *key);
+typedef int (*compare_func_t)(const void *a, const void *b);
+
+typedef struct HashmapIterator {
+        size_t bucket;
+        void *entry;
+} HashmapIterator;
+
+#define HASHMAP_ITERATOR_FIRST ((HashmapIterator) { 0, NULL })
+
+unsigned long string_hash_func(const void *key);
+int string_compare_func(const void *a, const void *b);
+unsigned long trivial_hash_func(const void *key);
+int trivial_compare_func(const void *a, const void *b);
+
+int hashmap_new(Hashmap **hashmapp, hash_func_t hash, compare_func_t compare);
+void hashmap_free(Hashmap *hashmap);
+
+int hashmap_put(Hashmap *hashmap, const void *key, void *value);
+void *hashmap_get(Hashmap *hashmap, const void *key);
+void *hashmap_remove(Hashmap *hashmap, const void *key);
+size_t hashmap_size(Hashmap *hashmap);
+
+bool hashmap_iterate(Hashmap *hashmap, HashmapIterator *i, const void **keyp, void **valuep);
+
+#define HASHMAP_FOREACH(v, h, i) \
+        for ((i) = HASHMAP_ITERATOR_FIRST; hashmap_iterate((h), &(i), NULL, (void **)&(v)); )
+
+static inline void hashmap_freep(Hashmap **hashmapp) {
+        if (*hashmapp)
+                hashmap_free(*hashmapp);
+}
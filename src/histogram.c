@@ -0,0 +1,80 @@
+#include <stdbool.h>
+
+#include "histogram.h"
+
+static unsigned int histogram_bucket(uint64_t value) {
+        unsigned int msb;
+
+        if (value < 8)
+                return value;
+
+        msb = 63 - __builtin_clzll(value);
+
+        return 4 * (msb - 1) + ((value >> (msb - 2)) & 3);
+}
+
+/* the largest value that goes into @bucket */
+static uint64_t histogram_bucket_max(unsigned int bucket) {
+        unsigned int msb, shift;
+
+        if (bucket < 8)
+                return bucket;
+
+        msb = bucket / 4 + 1;
+        shift = msb - 2;
+
+        return ((uint64_t)(4 + bucket % 4) << shift) + (((uint64_t)1 << shift) - 1);
+}
+
+void histogram_add(Histogram *histogram, uint64_t value) {
+        uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+        __atomic_add_fetch(&histogram->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+
+        while (value > max &&
+               !__atomic_compare_exchange_n(&histogram->max, &max, value, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+}
+
+uint64_t histogram_count(Histogram *histogram) {
+        uint64_t count = 0;
+
+        for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+                count += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+
+        return count;
+}
+
+/*
+ * The value @percent of all are at or below, rounded up to the end of its
+ * bucket but never beyond the largest value seen; 0 if there are none.
+ */
+uint64_t histogram_percentile(Histogram *histogram, unsigned int percent) {
+        uint64_t counts[HISTOGRAM_BUCKETS], count = 0, rank, seen = 0;
+        uint64_t max = histogram_max(histogram);
+
+        for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                counts[i] = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+                count += counts[i];
+        }
+
+        if (count == 0)
+                return 0;
+
+        rank = (count * percent + 99) / 100;
+        if (rank == 0)
+                rank = 1;
+
+        for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                seen += counts[i];
+                if (seen >= rank)
+                        return histogram_bucket_max(i) < max ? histogram_bucket_max(i) : max;
+        }
+
+        return max;
+}
+
+uint64_t histogram_max(Histogram *histogram) {
+        return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
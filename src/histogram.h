@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Latencies, or any other values, counted in buckets that grow with the
+ * value: values below 8 have their own, above that there are four per power
+ * of two, so a bucket is at most a quarter as wide as the values in it.
+ * Values can be added from any thread without a lock; one that is read
+ * while values are added may be off by those.
+ */
+
+#define HISTOGRAM_BUCKETS (256)
+
+typedef struct Histogram {
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+        uint64_t max;
+} Histogram;
+
+void histogram_add(Histogram *histogram, uint64_t value);
+uint64_t histogram_count(Histogram *histogram);
+uint64_t histogram_percentile(Histogram *histogram, unsigned int percent);
+uint64_t histogram_max(Histogram *histogram);
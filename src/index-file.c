@@ -0,0 +1,413 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index-file.h"
+#include "macro.h"
+
+struct IndexFile {
+        void *map;
+        size_t size;
+        const IndexFileHeader *header;
+        const IndexFileSlot *slots;
+        const IndexFileDir *dirs;
+        const IndexFileEntry *entries;
+        const char *strings;
+};
+
+static bool index_file_range_valid(const IndexFileHeader *h, uint64_t offset, uint64_t n, size_t size) {
+        if (offset > h->file_size || offset % 8)
+                return false;
+
+        return n <= (h->file_size - offset) / size;
+}
+
+int index_file_open(IndexFile **filep, const char *path) {
+        _cleanup_close_ int fd = -1;
+        const IndexFileHeader *h;
+        IndexFile *f;
+        struct stat st;
+        void *map;
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if ((size_t)st.st_size < sizeof(IndexFileHeader))
+                return -EBADMSG;
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        h = map;
+        if (memcmp(h->magic, INDEX_FILE_MAGIC, sizeof(h->magic)) ||
+            h->version != INDEX_FILE_VERSION ||
+            h->header_size != sizeof(IndexFileHeader) ||
+            h->file_size != (uint64_t)st.st_size ||
+            !index_file_range_valid(h, h->slots_offset, h->n_slots, sizeof(IndexFileSlot)) ||
+            !index_file_range_valid(h, h->dirs_offset, h->n_dirs, sizeof(IndexFileDir)) ||
+            !index_file_range_valid(h, h->entries_offset, h->n_entries, sizeof(IndexFileEntry)) ||
+            !index_file_range_valid(h, h->strings_offset, h->strings_size, 1) ||
+            h->strings_size == 0 ||
+            ((const char *)map)[h->strings_offset + h->strings_size - 1] != '\0') {
+                munmap(map, st.st_size);
+                return -EBADMSG;
+        }
+
+        f = calloc(1, sizeof(*f));
+        if (!f) {
+                munmap(map, st.st_size);
+                return -ENOMEM;
+        }
+
+        f->map = map;
+        f->size = st.st_size;
+        f->header = h;
+        f->slots = (const IndexFileSlot *)((const char *)map + h->slots_offset);
+        f->dirs = (const IndexFileDir *)((const char *)map + h->dirs_offset);
+        f->entries = (const IndexFileEntry *)((const char *)map + h->entries_offset);
+        f->strings = (const char *)map + h->strings_offset;
+
+        *filep = f;
+        return 0;
+}
+
+void index_file_free(IndexFile *f) {
+        munmap(f->map, f->size);
+        free(f);
+}
+
+const char *index_file_get_string(IndexFile *f, uint32_t offset) {
+        if (offset >= f->header->strings_size)
+                return "";
+
+        return f->strings + offset;
+}
+
+size_t index_file_get_n_slots(IndexFile *f) {
+        return f->header->n_slots;
+}
+
+const char *index_file_get_slot_path(IndexFile *f, size_t slot) {
+        return index_file_get_string(f, f->slots[slot].path);
+}
+
+const IndexFileDir *index_file_get_dirs(IndexFile *f, size_t *n_dirsp) {
+        *n_dirsp = f->header->n_dirs;
+        return f->dirs;
+}
+
+/*
+ * Returns the entries for @name, one per search directory that has it, in
+ * search order.
+ */
+const IndexFileEntry *index_file_lookup(IndexFile *f, const char *name, size_t *n_entriesp) {
+        size_t lo = 0, hi = f->header->n_entries, end;
+
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+
+                if (strcmp(index_file_get_string(f, f->entries[mid].name), name) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        for (end = lo; end < f->header->n_entries; end++)
+                if (strcmp(index_file_get_string(f, f->entries[end].name), name))
+                        break;
+
+        *n_entriesp = end - lo;
+        return end > lo ? &f->entries[lo] : NULL;
+}
+
+typedef struct IndexBuilderEntry {
+        char *name;
+        IndexFileEntry entry;
+} IndexBuilderEntry;
+
+typedef struct IndexBuilder {
+        IndexFileSlot *slots;
+        size_t n_slots;
+        IndexFileDir *dirs;
+        size_t n_dirs;
+        IndexBuilderEntry *entries;
+        size_t n_entries;
+        char *strings;
+        size_t strings_size;
+} IndexBuilder;
+
+static int index_builder_add_string(IndexBuilder *b, const char *s, uint32_t *offsetp) {
+        size_t len = strlen(s) + 1;
+        char *strings;
+
+        if (b->strings_size + len > UINT32_MAX)
+                return -E2BIG;
+
+        strings = realloc(b->strings, b->strings_size + len);
+        if (!strings)
+                return -ENOMEM;
+
+        b->strings = strings;
+        memcpy(b->strings + b->strings_size, s, len);
+        *offsetp = b->strings_size;
+        b->strings_size += len;
+
+        return 0;
+}
+
+static int index_builder_add_dir(IndexBuilder *b, unsigned int slot, const char *prefix,
+                                 const struct stat *st, uint16_t flags) {
+        IndexFileDir *dirs;
+
+        dirs = realloc(b->dirs, (b->n_dirs + 1) * sizeof(*dirs));
+        if (!dirs)
+                return -ENOMEM;
+        b->dirs = dirs;
+
+        dirs[b->n_dirs] = (IndexFileDir) {
+                .slot = slot,
+                .flags = flags,
+                .ino = st->st_ino,
+                .mtime_sec = st->st_mtim.tv_sec,
+                .mtime_nsec = st->st_mtim.tv_nsec,
+        };
+
+        b->n_dirs++;
+        return index_builder_add_string(b, prefix, &dirs[b->n_dirs - 1].prefix);
+}
+
+static int index_builder_add_entry(IndexBuilder *b, unsigned int slot, const char *name,
+                                   const struct stat *st) {
+        IndexBuilderEntry *entries;
+
+        if (b->n_entries % 1024 == 0) {
+                entries = realloc(b->entries, (b->n_entries + 1024) * sizeof(*entries));
+                if (!entries)
+                        return -ENOMEM;
+                b->entries = entries;
+        }
+
+        b->entries[b->n_entries] = (IndexBuilderEntry) {
+                .name = strdup(name),
+                .entry = {
+                        .slot = slot,
+                        .ino = st->st_ino,
+                        .size = st->st_size,
+                        .mtime_sec = st->st_mtim.tv_sec,
+                        .mtime_nsec = st->st_mtim.tv_nsec,
+                },
+        };
+        if (!b->entries[b->n_entries].name)
+                return -ENOMEM;
+
+        b->n_entries++;
+        return 0;
+}
+
+static int index_builder_scan_dir(IndexBuilder *b, unsigned int slot, int dirfd, const char *prefix) {
+        struct dirent *de;
+        struct stat st;
+        DIR *dir;
+        int r;
+
+        if (fstat(dirfd, &st) < 0) {
+                r = -errno;
+                close(dirfd);
+                return r;
+        }
+
+        r = index_builder_add_dir(b, slot, prefix, &st, 0);
+        if (r < 0) {
+                close(dirfd);
+                return r;
+        }
+
+        dir = fdopendir(dirfd);
+        if (!dir) {
+                r = -errno;
+                close(dirfd);
+                return r;
+        }
+
+        while ((de = readdir(dir))) {
+                _cleanup_free_ char *name = NULL;
+                int fd;
+
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+
+                if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                        continue;
+
+                if (asprintf(&name, "%s%s", prefix, de->d_name) < 0) {
+                        r = -ENOMEM;
+                        break;
+                }
+
+                if (S_ISDIR(st.st_mode)) {
+                        _cleanup_free_ char *subprefix = NULL;
+
+                        fd = openat(dirfd, de->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+                        if (fd < 0)
+                                continue;
+
+                        if (asprintf(&subprefix, "%s/", name) < 0) {
+                                close(fd);
+                                r = -ENOMEM;
+                                break;
+                        }
+
+                        r = index_builder_scan_dir(b, slot, fd, subprefix);
+                } else if (S_ISLNK(st.st_mode)) {
+                        if (fstatat(dirfd, de->d_name, &st, 0) >= 0 && S_ISDIR(st.st_mode))
+                                r = index_builder_add_dir(b, slot, name, &st, INDEX_FILE_DIR_LINK);
+                        else
+                                r = index_builder_add_entry(b, slot, name, &st);
+                } else if (S_ISREG(st.st_mode))
+                        r = index_builder_add_entry(b, slot, name, &st);
+
+                if (r < 0)
+                        break;
+        }
+
+        closedir(dir);
+        return r;
+}
+
+static int index_builder_compare(const void *a, const void *b) {
+        const IndexBuilderEntry *x = a, *y = b;
+        int r;
+
+        r = strcmp(x->name, y->name);
+        if (r)
+                return r;
+
+        return x->entry.slot < y->entry.slot ? -1 : (x->entry.slot > y->entry.slot ? 1 : 0);
+}
+
+static void index_builder_free(IndexBuilder *b) {
+        for (size_t i = 0; i < b->n_entries; i++)
+                free(b->entries[i].name);
+        free(b->entries);
+        free(b->dirs);
+        free(b->slots);
+        free(b->strings);
+}
+
+static int index_builder_write(IndexBuilder *b, int fd) {
+        IndexFileHeader h = {
+                .magic = INDEX_FILE_MAGIC,
+                .version = INDEX_FILE_VERSION,
+                .header_size = sizeof(IndexFileHeader),
+                .n_slots = b->n_slots,
+                .n_dirs = b->n_dirs,
+                .n_entries = b->n_entries,
+        };
+        static const char padding[8];
+        FILE *f;
+        int r;
+
+        h.slots_offset = sizeof(h);
+        h.dirs_offset = h.slots_offset + b->n_slots * sizeof(IndexFileSlot);
+        h.entries_offset = h.dirs_offset + b->n_dirs * sizeof(IndexFileDir);
+        h.strings_offset = h.entries_offset + b->n_entries * sizeof(IndexFileEntry);
+        h.strings_size = b->strings_size;
+        h.file_size = h.strings_offset + ((h.strings_size + 7) & ~7ULL);
+
+        f = fdopen(fd, "w");
+        if (!f) {
+                r = -errno;
+                close(fd);
+                return r;
+        }
+
+        fwrite(&h, sizeof(h), 1, f);
+        fwrite(b->slots, sizeof(IndexFileSlot), b->n_slots, f);
+        fwrite(b->dirs, sizeof(IndexFileDir), b->n_dirs, f);
+        for (size_t i = 0; i < b->n_entries; i++)
+                fwrite(&b->entries[i].entry, sizeof(IndexFileEntry), 1, f);
+        fwrite(b->strings, 1, b->strings_size, f);
+        fwrite(padding, 1, h.file_size - h.strings_offset - h.strings_size, f);
+
+        r = fflush(f) == 0 && fsync(fd) == 0 ? 0 : -errno;
+        fclose(f);
+
+        return r;
+}
+
+/*
+ * Scans the search directories @dirpaths, opened as @dirfds, and atomically
+ * replaces the index at @path.
+ */
+int index_file_write(const char *path, const int *dirfds, char * const *dirpaths, size_t n_dirs) {
+        _cleanup_free_ char *tmp = NULL;
+        IndexBuilder b = {};
+        int fd, r = 0;
+
+        b.slots = calloc(n_dirs, sizeof(*b.slots));
+        if (!b.slots)
+                return -ENOMEM;
+        b.n_slots = n_dirs;
+
+        for (unsigned int i = 0; i < n_dirs && r >= 0; i++) {
+                r = index_builder_add_string(&b, dirpaths[i], &b.slots[i].path);
+                if (r < 0 || dirfds[i] < 0)
+                        continue;
+
+                fd = openat(dirfds[i], ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                if (fd < 0)
+                        continue;
+
+                r = index_builder_scan_dir(&b, i, fd, "");
+        }
+        if (r < 0)
+                goto finish;
+
+        qsort(b.entries, b.n_entries, sizeof(*b.entries), index_builder_compare);
+
+        for (size_t i = 0; i < b.n_entries && r >= 0; i++) {
+                if (i > 0 && !strcmp(b.entries[i].name, b.entries[i - 1].name))
+                        b.entries[i].entry.name = b.entries[i - 1].entry.name;
+                else
+                        r = index_builder_add_string(&b, b.entries[i].name, &b.entries[i].entry.name);
+        }
+        if (r < 0)
+                goto finish;
+
+        if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        fd = mkostemp(tmp, O_CLOEXEC);
+        if (fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        if (fchmod(fd, 0644) < 0) {
+                r = -errno;
+                close(fd);
+        } else
+                r = index_builder_write(&b, fd);
+        if (r >= 0 && rename(tmp, path) < 0)
+                r = -errno;
+        if (r < 0)
+                unlink(tmp);
+
+finish:
+        index_builder_free(&b);
+        return r;
+}
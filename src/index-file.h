@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On-disk firmware index, as written by `firmwared --build-index`.
+ *
+ * The file is mapped as is: a header, followed by the search directories it
+ * describes, every directory below them with the inode and mtime it had when
+ * the index was built, and the firmware files sorted by name, then search
+ * directory. All strings live in a NUL-terminated table at the end and are
+ * referenced by offset. Integers are in host byte order.
+ */
+
+#define INDEX_FILE_MAGIC "FWIDX\0\0\0"
+#define INDEX_FILE_VERSION (1)
+
+#define INDEX_FILE_DIR_LINK (1 << 0)
+
+typedef struct IndexFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t n_slots;
+        uint32_t n_dirs;
+        uint32_t n_entries;
+        uint32_t reserved;
+        uint64_t slots_offset;
+        uint64_t dirs_offset;
+        uint64_t entries_offset;
+        uint64_t strings_offset;
+        uint64_t strings_size;
+        uint64_t file_size;
+} IndexFileHeader;
+
+typedef struct IndexFileSlot {
+        uint32_t path;
+        uint32_t reserved;
+} IndexFileSlot;
+
+typedef struct IndexFileDir {
+        uint32_t prefix;
+        uint16_t slot;
+        uint16_t flags;
+        uint64_t ino;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+} IndexFileDir;
+
+typedef struct IndexFileEntry {
+        uint32_t name;
+        uint16_t slot;
+        uint16_t reserved;
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+} IndexFileEntry;
+
+typedef struct IndexFile IndexFile;
+
+int index_file_open(IndexFile **filep, const char *path);
+void index_file_free(IndexFile *file);
+
+size_t index_file_get_n_slots(IndexFile *file);
+const char *index_file_get_slot_path(IndexFile *file, size_t slot);
+const IndexFileDir *index_file_get_dirs(IndexFile *file, size_t *n_dirsp);
+const char *index_file_get_string(IndexFile *file, uint32_t offset);
+
+const IndexFileEntry *index_file_lookup(IndexFile *file, const char *name, size_t *n_entriesp);
+
+int index_file_write(const char *path, const int *dirfds, char * const *dirpaths, size_t n_dirs);
+
+static inline void index_file_freep(IndexFile **filep) {
+        if (*filep)
+                index_file_free(*filep);
+}
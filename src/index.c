@@ -0,0 +1,934 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hashmap.h"
+#include "index-file.h"
+#include "index.h"
+#include "log-util.h"
+#include "macro.h"
+
+/*
+ * In-memory index of the firmware search path.
+ *
+ * Every search directory (a "slot", in lookup order) is scanned recursively
+ * at startup and kept up to date with inotify. A lookup then only opens a file
+ * in the slots that are known to contain it, so a miss costs no syscalls at
+ * all. Slots that cannot be watched, and directories reached through a
+ * symlink, are probed with openat() as before. A search directory that does
+ * not exist yet is waited for: its closest existing parent is watched for the
+ * next missing component, and the slot is opened and scanned once it is there.
+ * A directory that is moved away, or mounted over, is re-opened from its path;
+ * the old descriptor is kept open, as lookups and the cache may still use it.
+ * New files are only indexed once they were written and closed, or moved in,
+ * so that a file being copied into place is not served half-way through.
+ *
+ * When an index file is given, slots whose directories did not change since it
+ * was built are answered from the mapped file instead of being scanned; the
+ * hash then only records what inotify reported since startup.
+ *
+ * Lookups may run concurrently from the worker threads; processing inotify
+ * events takes the lock exclusively, and calls the changed callback with it
+ * held.
+ */
+
+#define INDEX_SLOTS_MAX (64)
+
+#define INDEX_WATCH_MASK (IN_CREATE|IN_CLOSE_WRITE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|\
+                          IN_MOVE_SELF|IN_ONLYDIR)
+
+typedef struct IndexEntry {
+        uint64_t slots;
+        uint64_t removed;
+        char name[];
+} IndexEntry;
+
+typedef struct IndexWatch IndexWatch;
+
+struct IndexWatch {
+        IndexWatch *next;
+        unsigned int slot;
+        /* on a parent of a missing search dir, waiting for @prefix to appear */
+        bool missing;
+        char prefix[];
+};
+
+/* all watches sharing an inotify watch descriptor, as search dirs may overlap */
+typedef struct IndexWatchList {
+        int wd;
+        IndexWatch *watches;
+} IndexWatchList;
+
+typedef struct IndexSlot {
+        bool watched;
+        bool mapped;
+        bool dirty;
+        char **links;
+        size_t n_links;
+} IndexSlot;
+
+struct Index {
+        int inotifyfd;
+        int *dirfds;
+        char * const *dirpaths;
+        size_t n_dirs;
+        IndexSlot *slots;
+        Hashmap *names;
+        Hashmap *watches;
+        IndexFile *file;
+        int *file_slots;
+        /* descriptors of directories replaced since, closed along with the index */
+        int *retired;
+        size_t n_retired;
+        index_changed_func_t changed;
+        void *userdata;
+        pthread_rwlock_t lock;
+};
+
+static void index_notify(Index *x, const char *name) {
+        if (x->changed)
+                x->changed(name, x->userdata);
+}
+
+static uint64_t index_get_slots(Index *x, const char *name, IndexEntry *e) {
+        const IndexFileEntry *f = NULL;
+        uint64_t slots = 0;
+        size_t n = 0;
+
+        if (x->file)
+                f = index_file_lookup(x->file, name, &n);
+
+        for (size_t i = 0; i < n; i++) {
+                int slot;
+
+                if (f[i].slot >= index_file_get_n_slots(x->file))
+                        continue;
+
+                slot = x->file_slots[f[i].slot];
+                if (slot >= 0 && x->slots[slot].mapped)
+                        slots |= UINT64_C(1) << slot;
+        }
+
+        if (e)
+                slots = (slots & ~e->removed) | e->slots;
+
+        return slots;
+}
+
+static int index_add_name(Index *x, unsigned int slot, const char *name) {
+        IndexEntry *e;
+        uint64_t slots;
+        int r;
+
+        e = hashmap_get(x->names, name);
+        slots = index_get_slots(x, name, e);
+        if (!e) {
+                e = calloc(1, sizeof(*e) + strlen(name) + 1);
+                if (!e)
+                        return -ENOMEM;
+
+                strcpy(e->name, name);
+
+                r = hashmap_put(x->names, e->name, e);
+                if (r < 0) {
+                        free(e);
+                        return r;
+                }
+        }
+
+        e->slots |= UINT64_C(1) << slot;
+        e->removed &= ~(UINT64_C(1) << slot);
+
+        if (!(slots & (UINT64_C(1) << slot)))
+                index_notify(x, name);
+
+        return 0;
+}
+
+static void index_remove_name(Index *x, unsigned int slot, const char *name) {
+        IndexEntry *e;
+
+        e = hashmap_get(x->names, name);
+        if (!(index_get_slots(x, name, e) & (UINT64_C(1) << slot)))
+                return;
+
+        if (!e) {
+                e = calloc(1, sizeof(*e) + strlen(name) + 1);
+                if (!e || hashmap_put(x->names, strcpy(e->name, name), e) < 0) {
+                        /* forget about the whole mapping rather than serve a stale entry */
+                        free(e);
+                        x->slots[slot].dirty = true;
+                        return;
+                }
+        }
+
+        e->slots &= ~(UINT64_C(1) << slot);
+        if (x->slots[slot].mapped)
+                e->removed |= UINT64_C(1) << slot;
+        index_notify(x, name);
+
+        if (!e->slots && !e->removed) {
+                hashmap_remove(x->names, e->name);
+                free(e);
+        }
+}
+
+static int index_add_link(Index *x, unsigned int slot, const char *prefix) {
+        IndexSlot *s = &x->slots[slot];
+        char **links;
+
+        links = realloc(s->links, (s->n_links + 1) * sizeof(char *));
+        if (!links)
+                return -ENOMEM;
+        s->links = links;
+
+        if (asprintf(&s->links[s->n_links], "%s/", prefix) < 0)
+                return -ENOMEM;
+
+        s->n_links++;
+        return 0;
+}
+
+static void index_remove_link(Index *x, unsigned int slot, const char *prefix) {
+        IndexSlot *s = &x->slots[slot];
+        size_t len = strlen(prefix);
+
+        for (size_t i = 0; i < s->n_links; i++) {
+                if (strncmp(s->links[i], prefix, len) || strcmp(s->links[i] + len, "/"))
+                        continue;
+
+                free(s->links[i]);
+                s->links[i] = s->links[--s->n_links];
+                return;
+        }
+}
+
+static bool index_slot_has_link(Index *x, unsigned int slot, const char *name) {
+        IndexSlot *s = &x->slots[slot];
+
+        for (size_t i = 0; i < s->n_links; i++)
+                if (!strncmp(name, s->links[i], strlen(s->links[i])))
+                        return true;
+
+        return false;
+}
+
+static int index_watch_path(Index *x, unsigned int slot, const char *path, const char *prefix, bool missing) {
+        IndexWatchList *l;
+        IndexWatch *w;
+        int wd, r;
+
+        wd = inotify_add_watch(x->inotifyfd, path, INDEX_WATCH_MASK);
+        if (wd < 0)
+                return -errno;
+
+        w = calloc(1, sizeof(*w) + strlen(prefix) + 1);
+        if (!w)
+                return -ENOMEM;
+
+        w->slot = slot;
+        w->missing = missing;
+        strcpy(w->prefix, prefix);
+
+        l = hashmap_get(x->watches, INT_TO_PTR(wd));
+        if (!l) {
+                l = calloc(1, sizeof(*l));
+                if (!l) {
+                        free(w);
+                        return -ENOMEM;
+                }
+
+                l->wd = wd;
+
+                r = hashmap_put(x->watches, INT_TO_PTR(wd), l);
+                if (r < 0) {
+                        free(l);
+                        free(w);
+                        return r;
+                }
+        }
+
+        w->next = l->watches;
+        l->watches = w;
+
+        return 0;
+}
+
+static int index_add_watch(Index *x, unsigned int slot, const char *prefix) {
+        _cleanup_free_ char *path = NULL;
+
+        if (asprintf(&path, "%s/%s", x->dirpaths[slot], prefix) < 0)
+                return -ENOMEM;
+
+        return index_watch_path(x, slot, path, prefix, false);
+}
+
+/*
+ * Watches the closest existing parent of the missing directory of @slot, for
+ * the next component of its path to be created or moved in.
+ */
+static int index_watch_missing(Index *x, unsigned int slot) {
+        _cleanup_free_ char *path = NULL;
+
+        path = strdup(x->dirpaths[slot]);
+        if (!path)
+                return -ENOMEM;
+
+        for (;;) {
+                const char *parent;
+                char *name;
+                int r;
+
+                name = strrchr(path, '/');
+                while (name && name != path && name[1] == '\0') {
+                        *name = '\0';
+                        name = strrchr(path, '/');
+                }
+
+                if (!name) {
+                        parent = ".";
+                        name = path;
+                } else if (name == path) {
+                        parent = "/";
+                        name++;
+                } else {
+                        *name++ = '\0';
+                        parent = path;
+                }
+
+                if (!*name)
+                        return -EINVAL;
+
+                r = index_watch_path(x, slot, parent, name, true);
+                if (r != -ENOENT || parent != path)
+                        return r;
+        }
+}
+
+static void index_watch_list_free(IndexWatchList *l) {
+        IndexWatch *w, *next;
+
+        for (w = l->watches; w; w = next) {
+                next = w->next;
+                free(w);
+        }
+
+        free(l);
+}
+
+static int index_scan_dir(Index *x, unsigned int slot, int dirfd, const char *prefix) {
+        DIR *dir;
+        struct dirent *de;
+        int r;
+
+        r = index_add_watch(x, slot, prefix);
+        if (r < 0) {
+                close(dirfd);
+                return r;
+        }
+
+        dir = fdopendir(dirfd);
+        if (!dir) {
+                r = -errno;
+                close(dirfd);
+                return r;
+        }
+
+        while ((de = readdir(dir))) {
+                _cleanup_free_ char *name = NULL;
+                struct stat st;
+                int fd;
+
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+
+                if (asprintf(&name, "%s%s", prefix, de->d_name) < 0) {
+                        r = -ENOMEM;
+                        break;
+                }
+
+                if (de->d_type == DT_UNKNOWN &&
+                    fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) >= 0) {
+                        if (S_ISREG(st.st_mode))
+                                de->d_type = DT_REG;
+                        else if (S_ISDIR(st.st_mode))
+                                de->d_type = DT_DIR;
+                        else if (S_ISLNK(st.st_mode))
+                                de->d_type = DT_LNK;
+                }
+
+                if (de->d_type == DT_REG) {
+                        r = index_add_name(x, slot, name);
+                } else if (de->d_type == DT_DIR) {
+                        _cleanup_free_ char *subprefix = NULL;
+
+                        fd = openat(dirfd, de->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+                        if (fd < 0)
+                                continue;
+
+                        if (asprintf(&subprefix, "%s/", name) < 0) {
+                                close(fd);
+                                r = -ENOMEM;
+                                break;
+                        }
+
+                        r = index_scan_dir(x, slot, fd, subprefix);
+                } else if (de->d_type == DT_LNK) {
+                        if (fstatat(dirfd, de->d_name, &st, 0) < 0)
+                                /* dangling symlinks are indexed, opening them fails later on */
+                                r = index_add_name(x, slot, name);
+                        else if (S_ISDIR(st.st_mode))
+                                r = index_add_link(x, slot, name);
+                        else
+                                r = index_add_name(x, slot, name);
+                }
+
+                if (r < 0)
+                        break;
+        }
+
+        closedir(dir);
+        return r;
+}
+
+static void index_clear_slot(Index *x, unsigned int slot) {
+        IndexSlot *s = &x->slots[slot];
+        HashmapIterator i;
+        IndexEntry *e;
+        IndexWatchList *l;
+
+        HASHMAP_FOREACH(e, x->names, i) {
+                e->slots &= ~(UINT64_C(1) << slot);
+                e->removed &= ~(UINT64_C(1) << slot);
+                if (!e->slots && !e->removed) {
+                        hashmap_remove(x->names, e->name);
+                        free(e);
+                }
+        }
+
+        HASHMAP_FOREACH(l, x->watches, i) {
+                IndexWatch **w;
+
+                for (w = &l->watches; *w; ) {
+                        IndexWatch *tmp = *w;
+
+                        if (tmp->slot != slot) {
+                                w = &tmp->next;
+                                continue;
+                        }
+
+                        *w = tmp->next;
+                        free(tmp);
+                }
+
+                if (!l->watches) {
+                        inotify_rm_watch(x->inotifyfd, l->wd);
+                        hashmap_remove(x->watches, INT_TO_PTR(l->wd));
+                        free(l);
+                }
+        }
+
+        for (size_t j = 0; j < s->n_links; j++)
+                free(s->links[j]);
+        free(s->links);
+        s->links = NULL;
+        s->n_links = 0;
+        s->watched = false;
+        s->mapped = false;
+        s->dirty = false;
+}
+
+/*
+ * Answers @slot from the index file, if that has a matching slot and none of
+ * its directories changed. Watches are added before comparing the mtimes, so
+ * that no later change can be missed.
+ */
+static bool index_map_slot(Index *x, unsigned int slot) {
+        const IndexFileDir *dirs;
+        size_t n_dirs;
+        int j = -1;
+
+        for (size_t i = 0; i < index_file_get_n_slots(x->file); i++)
+                if (x->file_slots[i] < 0 &&
+                    !strcmp(index_file_get_slot_path(x->file, i), x->dirpaths[slot])) {
+                        j = i;
+                        break;
+                }
+
+        if (j < 0)
+                return false;
+
+        dirs = index_file_get_dirs(x->file, &n_dirs);
+        for (size_t i = 0; i < n_dirs; i++) {
+                const char *prefix = index_file_get_string(x->file, dirs[i].prefix);
+                struct stat st;
+
+                if (dirs[i].slot != j)
+                        continue;
+
+                if (dirs[i].flags & INDEX_FILE_DIR_LINK) {
+                        if (index_add_link(x, slot, prefix) < 0)
+                                return false;
+
+                        continue;
+                }
+
+                if (index_add_watch(x, slot, prefix) < 0)
+                        return false;
+
+                if (fstatat(x->dirfds[slot], prefix[0] ? prefix : ".", &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+                    st.st_ino != dirs[i].ino ||
+                    st.st_mtim.tv_sec != dirs[i].mtime_sec ||
+                    st.st_mtim.tv_nsec != dirs[i].mtime_nsec)
+                        return false;
+        }
+
+        x->file_slots[j] = slot;
+        x->slots[slot].mapped = true;
+        x->slots[slot].watched = true;
+
+        return true;
+}
+
+static void index_unmap_slot(Index *x, unsigned int slot) {
+        if (!x->file)
+                return;
+
+        for (size_t i = 0; i < index_file_get_n_slots(x->file); i++)
+                if (x->file_slots[i] == (int)slot)
+                        x->file_slots[i] = -1;
+}
+
+static void index_scan_slot(Index *x, unsigned int slot, bool map) {
+        int fd, r;
+
+        index_clear_slot(x, slot);
+        index_unmap_slot(x, slot);
+
+        if (x->inotifyfd < 0 || slot >= INDEX_SLOTS_MAX)
+                return;
+
+        if (x->dirfds[slot] < 0) {
+                x->dirfds[slot] = openat(AT_FDCWD, x->dirpaths[slot],
+                                         O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+                if (x->dirfds[slot] < 0) {
+                        /* a firmware pack, or its kernel release subdirectory */
+                        if (errno != ENOENT)
+                                return;
+
+                        r = index_watch_missing(x, slot);
+                        if (r < 0 && r != -ENOENT)
+                                log_warn("cannot wait for %s to appear: %s", x->dirpaths[slot], strerror(-r));
+                        return;
+                }
+        }
+
+        if (map && x->file) {
+                if (index_map_slot(x, slot))
+                        return;
+
+                log_info("index of %s is out of date", x->dirpaths[slot]);
+                index_clear_slot(x, slot);
+        }
+
+        fd = openat(x->dirfds[slot], ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0)
+                return;
+
+        r = index_scan_dir(x, slot, fd, "");
+        if (r < 0) {
+                log_warn("cannot index %s, falling back to lookups: %s", x->dirpaths[slot], strerror(-r));
+                index_clear_slot(x, slot);
+                return;
+        }
+
+        x->slots[slot].watched = true;
+}
+
+/*
+ * Points @slot at the directory its path resolves to now, if that is not the
+ * one it has open. Returns whether it changed.
+ */
+static bool index_reopen_slot(Index *x, unsigned int slot) {
+        struct stat a, b;
+        int fd;
+
+        fd = openat(AT_FDCWD, x->dirpaths[slot], O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (fd < 0 && x->dirfds[slot] < 0)
+                return false;
+
+        if (fd >= 0 && x->dirfds[slot] >= 0 &&
+            fstat(fd, &a) >= 0 && fstat(x->dirfds[slot], &b) >= 0 &&
+            a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+                close(fd);
+                return false;
+        }
+
+        if (x->dirfds[slot] >= 0) {
+                int *retired;
+
+                retired = realloc(x->retired, (x->n_retired + 1) * sizeof(int));
+                if (!retired) {
+                        if (fd >= 0)
+                                close(fd);
+                        return false;
+                }
+
+                x->retired = retired;
+                x->retired[x->n_retired++] = x->dirfds[slot];
+        }
+
+        log_info("firmware directory %s %s", x->dirpaths[slot],
+                 fd < 0 ? "went away" : x->dirfds[slot] < 0 ? "appeared" : "was replaced");
+
+        x->dirfds[slot] = fd;
+        return true;
+}
+
+int index_new(Index **indexp, int *dirfds, char * const *dirpaths, size_t n_dirs,
+              const char *index_path, index_changed_func_t changed, void *userdata) {
+        _cleanup_(index_freep) Index *x = NULL;
+        int r;
+
+        x = calloc(1, sizeof(*x));
+        if (!x)
+                return -ENOMEM;
+
+        x->inotifyfd = -1;
+        pthread_rwlock_init(&x->lock, NULL);
+        x->dirfds = dirfds;
+        x->dirpaths = dirpaths;
+        x->n_dirs = n_dirs;
+
+        x->slots = calloc(n_dirs, sizeof(*x->slots));
+        if (!x->slots)
+                return -ENOMEM;
+
+        r = hashmap_new(&x->names, string_hash_func, string_compare_func);
+        if (r < 0)
+                return r;
+
+        r = hashmap_new(&x->watches, trivial_hash_func, trivial_compare_func);
+        if (r < 0)
+                return r;
+
+        x->inotifyfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+        if (x->inotifyfd < 0)
+                log_warn("cannot watch firmware directories: %m");
+
+        if (index_path) {
+                r = index_file_open(&x->file, index_path);
+                if (r < 0)
+                        log_warn("cannot use index %s: %s", index_path, strerror(-r));
+                else {
+                        x->file_slots = malloc(index_file_get_n_slots(x->file) * sizeof(int));
+                        if (!x->file_slots)
+                                return -ENOMEM;
+
+                        for (size_t i = 0; i < index_file_get_n_slots(x->file); i++)
+                                x->file_slots[i] = -1;
+                }
+        }
+
+        for (unsigned int i = 0; i < n_dirs; i++)
+                index_scan_slot(x, i, true);
+
+        /* nothing to invalidate during the initial scan */
+        x->changed = changed;
+        x->userdata = userdata;
+
+        *indexp = x;
+        x = NULL;
+
+        return 0;
+}
+
+void index_free(Index *x) {
+        HashmapIterator i;
+        IndexEntry *e;
+        IndexWatchList *l;
+
+        if (x->slots)
+                for (unsigned int j = 0; j < x->n_dirs; j++) {
+                        for (size_t k = 0; k < x->slots[j].n_links; k++)
+                                free(x->slots[j].links[k]);
+                        free(x->slots[j].links);
+                }
+        free(x->slots);
+
+        if (x->names) {
+                HASHMAP_FOREACH(e, x->names, i)
+                        free(e);
+                hashmap_free(x->names);
+        }
+
+        if (x->watches) {
+                HASHMAP_FOREACH(l, x->watches, i)
+                        index_watch_list_free(l);
+                hashmap_free(x->watches);
+        }
+
+        if (x->inotifyfd >= 0)
+                close(x->inotifyfd);
+
+        if (x->file)
+                index_file_free(x->file);
+        free(x->file_slots);
+
+        for (size_t j = 0; j < x->n_retired; j++)
+                close(x->retired[j]);
+        free(x->retired);
+
+        pthread_rwlock_destroy(&x->lock);
+        free(x);
+}
+
+int index_get_fd(Index *x) {
+        return x->inotifyfd;
+}
+
+static void index_handle_event(Index *x, IndexWatch *w, const struct inotify_event *ev) {
+        _cleanup_free_ char *name = NULL;
+        struct stat st;
+        int fd, r = 0;
+
+        if (w->missing) {
+                /* one step closer to the search dir, or back to square one */
+                if ((ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) ||
+                    ((ev->mask & (IN_CREATE|IN_MOVED_TO)) && ev->len && !strcmp(ev->name, w->prefix)))
+                        x->slots[w->slot].dirty = true;
+                return;
+        }
+
+        if (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) {
+                /* subdirectories are dealt with through their parent */
+                if (!w->prefix[0])
+                        x->slots[w->slot].dirty = true;
+                return;
+        }
+
+        if (!ev->len)
+                return;
+
+        if (asprintf(&name, "%s%s", w->prefix, ev->name) < 0) {
+                x->slots[w->slot].dirty = true;
+                return;
+        }
+
+        if (ev->mask & (IN_DELETE|IN_MOVED_FROM)) {
+                if (!(ev->mask & IN_ISDIR)) {
+                        index_remove_name(x, w->slot, name);
+                        index_remove_link(x, w->slot, name);
+                } else if (ev->mask & IN_MOVED_FROM)
+                        /* a whole subtree went away, along with its watches */
+                        x->slots[w->slot].dirty = true;
+
+                return;
+        }
+
+        if (ev->mask & IN_ISDIR) {
+                _cleanup_free_ char *prefix = NULL;
+
+                fd = openat(x->dirfds[w->slot], name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+                if (fd < 0)
+                        return;
+
+                if (asprintf(&prefix, "%s/", name) < 0) {
+                        close(fd);
+                        r = -ENOMEM;
+                } else
+                        r = index_scan_dir(x, w->slot, fd, prefix);
+        } else if ((ev->mask & IN_CREATE) &&
+                   (fstatat(x->dirfds[w->slot], name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+                    (S_ISREG(st.st_mode) && st.st_nlink == 1))) {
+                /* a new file is still being written; it is indexed on IN_CLOSE_WRITE */
+                return;
+        } else if (fstatat(x->dirfds[w->slot], name, &st, 0) >= 0 && S_ISDIR(st.st_mode))
+                r = index_add_link(x, w->slot, name);
+        else if ((ev->mask & IN_CLOSE_WRITE) && (index_get_slots(x, name, hashmap_get(x->names, name)) &
+                                                 (UINT64_C(1) << w->slot)))
+                /* rewritten in place, which requests waiting for it want to know too */
+                index_notify(x, name);
+        else
+                r = index_add_name(x, w->slot, name);
+
+        if (r < 0)
+                x->slots[w->slot].dirty = true;
+}
+
+int index_process(Index *x) {
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        bool rescan = false;
+        int r = 0;
+
+        pthread_rwlock_wrlock(&x->lock);
+
+        for (;;) {
+                const struct inotify_event *ev;
+                ssize_t len;
+
+                len = read(x->inotifyfd, buf, sizeof(buf));
+                if (len < 0) {
+                        if (errno == EAGAIN)
+                                break;
+                        if (errno == EINTR)
+                                continue;
+
+                        r = -errno;
+                        goto finish;
+                }
+
+                for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+                        IndexWatchList *l;
+
+                        ev = (const struct inotify_event *)p;
+
+                        if (ev->mask & IN_Q_OVERFLOW) {
+                                rescan = true;
+                                continue;
+                        }
+
+                        if (ev->mask & IN_IGNORED) {
+                                l = hashmap_remove(x->watches, INT_TO_PTR(ev->wd));
+                                if (l)
+                                        index_watch_list_free(l);
+                                continue;
+                        }
+
+                        l = hashmap_get(x->watches, INT_TO_PTR(ev->wd));
+                        if (!l)
+                                continue;
+
+                        for (IndexWatch *w = l->watches; w; w = w->next)
+                                index_handle_event(x, w, ev);
+                }
+        }
+
+        for (unsigned int i = 0; i < x->n_dirs; i++) {
+                if (!rescan && !x->slots[i].dirty)
+                        continue;
+
+                /* the directory itself may have been moved, or replaced */
+                index_reopen_slot(x, i);
+                index_scan_slot(x, i, false);
+                index_notify(x, NULL);
+        }
+
+finish:
+        pthread_rwlock_unlock(&x->lock);
+        return r;
+}
+
+/*
+ * Re-opens the search directories whose paths lead elsewhere now, as after a
+ * mount on top of one, and rescans them. Returns the number of directories
+ * that changed.
+ */
+int index_refresh(Index *x) {
+        int n = 0;
+
+        pthread_rwlock_wrlock(&x->lock);
+
+        for (unsigned int i = 0; i < x->n_dirs; i++) {
+                if (!index_reopen_slot(x, i))
+                        continue;
+
+                index_scan_slot(x, i, false);
+                n++;
+        }
+
+        if (n > 0)
+                index_notify(x, NULL);
+
+        pthread_rwlock_unlock(&x->lock);
+        return n;
+}
+
+/* how lookups in @slot are answered: from the index file, the index, or by probing */
+const char *index_get_slot_state(Index *x, unsigned int slot) {
+        const char *state;
+
+        pthread_rwlock_rdlock(&x->lock);
+
+        if (x->dirfds[slot] < 0)
+                state = "missing";
+        else if (x->slots[slot].mapped)
+                state = "mapped";
+        else if (x->slots[slot].watched)
+                state = "indexed";
+        else
+                state = "probed";
+
+        pthread_rwlock_unlock(&x->lock);
+        return state;
+}
+
+/* whether @name may be in @slot, given the @slots the index knows it in */
+static bool index_slot_may_have(Index *x, unsigned int slot, const char *name, uint64_t slots) {
+        if (x->dirfds[slot] < 0)
+                return false;
+
+        return !x->slots[slot].watched || index_slot_has_link(x, slot, name) ||
+               (slots & (UINT64_C(1) << slot));
+}
+
+/*
+ * Opens @name from the first search directory that has it, and returns the
+ * directory it was found in through @slotp.
+ */
+int index_open(Index *x, const char *name, unsigned int *slotp) {
+        uint64_t slots;
+        int fd = -ENOENT;
+
+        pthread_rwlock_rdlock(&x->lock);
+
+        slots = index_get_slots(x, name, hashmap_get(x->names, name));
+
+        for (unsigned int i = 0; i < x->n_dirs; i++) {
+                if (!index_slot_may_have(x, i, name, slots))
+                        continue;
+
+                fd = openat(x->dirfds[i], name, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+                if (fd >= 0) {
+                        *slotp = i;
+                        break;
+                }
+                fd = -ENOENT;
+        }
+
+        pthread_rwlock_unlock(&x->lock);
+        return fd;
+}
+
+/* like index_open(), but only stats the file, for when its size is all that matters */
+int index_stat(Index *x, const char *name, unsigned int *slotp, struct stat *st) {
+        uint64_t slots;
+        int r = -ENOENT;
+
+        pthread_rwlock_rdlock(&x->lock);
+
+        slots = index_get_slots(x, name, hashmap_get(x->names, name));
+
+        for (unsigned int i = 0; i < x->n_dirs; i++) {
+                if (!index_slot_may_have(x, i, name, slots))
+                        continue;
+
+                if (fstatat(x->dirfds[i], name, st, 0) >= 0) {
+                        *slotp = i;
+                        r = 0;
+                        break;
+                }
+        }
+
+        pthread_rwlock_unlock(&x->lock);
+        return r;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+typedef struct Index Index;
+
+/* called with the name of a changed file, or NULL if everything may have changed */
+typedef void (*index_changed_func_t)(const char *name, void *userdata);
+
+/* search dirs that do not exist yet, at -1 in @dirfds, are opened into it once they appear */
+int index_new(Index **indexp, int *dirfds, char * const *dirpaths, size_t n_dirs,
+              const char *index_path, index_changed_func_t changed, void *userdata);
+void index_free(Index *index);
+
+int index_get_fd(Index *index);
+int index_process(Index *index);
+int index_refresh(Index *index);
+
+int index_open(Index *index, const char *name, unsigned int *slotp);
+int index_stat(Index *index, const char *name, unsigned int *slotp, struct stat *st);
+const char *index_get_slot_state(Index *index, unsigned int slot);
+
+static inline void index_freep(Index **indexp) {
+        if (*indexp)
+                index_free(*indexp);
+}
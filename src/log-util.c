@@ -0,0 +1,353 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log-util.h"
+#include "macro.h"
+
+/* longer messages are cut short */
+#define LOG_LINE_MAX (1024)
+
+/* messages queued per second at most, the rest are only counted */
+#define LOG_RATELIMIT_BURST (1000)
+
+/* records written with one writev() at most */
+#define LOG_IOV_MAX (64)
+
+int log_max_level = LOG_INFO;
+
+static const char * const log_level_names[] = {
+        [LOG_ERR] = "error",
+        [LOG_WARNING] = "warning",
+        [LOG_INFO] = "info",
+        [LOG_DEBUG] = "debug",
+};
+
+int log_level_from_string(const char *s) {
+        for (unsigned int i = 0; i < ELEMENTSOF(log_level_names); i++)
+                if (log_level_names[i] && !strcmp(s, log_level_names[i]))
+                        return i;
+
+        return -EINVAL;
+}
+
+const char *log_level_to_string(int level) {
+        if (level < 0 || level >= (int)ELEMENTSOF(log_level_names))
+                return NULL;
+
+        return log_level_names[level];
+}
+
+/* a message in the ring, or the unused space at its end */
+typedef struct LogRecord {
+        uint32_t size;
+        /* where it goes, or -1 for the padding */
+        int fd;
+        char text[];
+} LogRecord;
+
+#define LOG_RECORD_SIZE(n) ((sizeof(LogRecord) + (n) + 7) & ~(size_t)7)
+
+typedef struct LogRing {
+        char *buf;
+        size_t size;
+        /* where the next record goes, and the first one not written yet; both only grow */
+        size_t head;
+        size_t tail;
+        pthread_mutex_t lock;
+        pthread_cond_t wakeup;
+        pthread_t thread;
+        bool sleeping;
+        bool stopping;
+        /* the second the rate limit counts messages for */
+        uint64_t interval;
+        unsigned int burst;
+        /* dropped since the last summary */
+        uint64_t suppressed;
+        LogStats stats;
+} LogRing;
+
+static LogRing *log_ring;
+
+static uint64_t log_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec;
+}
+
+/* called under the lock; false if the record does not fit */
+static bool log_ring_push(LogRing *ring, int fd, const char *text, size_t len) {
+        size_t size = LOG_RECORD_SIZE(len), pos = ring->head % ring->size, pad = 0;
+        LogRecord *record;
+
+        /* records are never split, the rest of the buffer is skipped instead */
+        if (size > ring->size - pos)
+                pad = ring->size - pos;
+        if (ring->head - ring->tail + pad + size > ring->size)
+                return false;
+
+        if (pad > 0) {
+                record = (LogRecord *)(ring->buf + pos);
+                record->size = pad - sizeof(LogRecord);
+                record->fd = -1;
+                ring->head += pad;
+        }
+
+        record = (LogRecord *)(ring->buf + ring->head % ring->size);
+        record->size = len;
+        record->fd = fd;
+        memcpy(record->text, text, len);
+        ring->head += size;
+
+        return true;
+}
+
+/* called under the lock; tells what was suppressed, once a new second started or with @force */
+static void log_ring_summarize(LogRing *ring, uint64_t now, bool force) {
+        char line[64];
+        int n;
+
+        if (now != ring->interval) {
+                ring->interval = now;
+                ring->burst = 0;
+        } else if (!force)
+                return;
+
+        if (ring->suppressed == 0)
+                return;
+
+        n = snprintf(line, sizeof(line), "%llu messages suppressed\n", (unsigned long long)ring->suppressed);
+        if (log_ring_push(ring, STDERR_FILENO, line, n))
+                ring->suppressed = 0;
+}
+
+static void log_writev(int fd, struct iovec *iov, unsigned int n) {
+        while (n > 0) {
+                ssize_t k;
+
+                k = writev(fd, iov, n);
+                if (k < 0 && errno == EINTR)
+                        continue;
+                /* there is nowhere to tell about it */
+                if (k <= 0)
+                        return;
+
+                while (n > 0 && (size_t)k >= iov->iov_len) {
+                        k -= iov->iov_len;
+                        iov++;
+                        n--;
+                }
+
+                if (n > 0) {
+                        iov->iov_base = (char *)iov->iov_base + k;
+                        iov->iov_len -= k;
+                }
+        }
+}
+
+/* writes the records from @tail on that go to the same place, and returns where it stopped */
+static size_t log_ring_write(LogRing *ring, size_t tail, size_t head) {
+        struct iovec iov[LOG_IOV_MAX];
+        unsigned int n = 0;
+        int fd = -1;
+
+        while (tail != head && n < LOG_IOV_MAX) {
+                LogRecord *record = (LogRecord *)(ring->buf + tail % ring->size);
+
+                if (record->fd >= 0) {
+                        if (n > 0 && record->fd != fd)
+                                break;
+
+                        fd = record->fd;
+                        iov[n++] = (struct iovec) { .iov_base = record->text, .iov_len = record->size };
+                }
+
+                tail += LOG_RECORD_SIZE(record->size);
+        }
+
+        if (n > 0)
+                log_writev(fd, iov, n);
+
+        return tail;
+}
+
+/* the records are written without the lock; writers only ever touch the space after them */
+static void *log_ring_thread(void *userdata) {
+        LogRing *ring = userdata;
+
+        pthread_mutex_lock(&ring->lock);
+
+        for (;;) {
+                size_t tail, head;
+
+                log_ring_summarize(ring, log_now(), ring->stopping);
+
+                if (ring->head == ring->tail) {
+                        if (ring->stopping)
+                                break;
+
+                        ring->sleeping = true;
+                        if (ring->suppressed > 0) {
+                                struct timespec ts;
+
+                                /* to tell about the end of a burst, even if nothing follows it */
+                                clock_gettime(CLOCK_REALTIME, &ts);
+                                ts.tv_sec++;
+                                pthread_cond_timedwait(&ring->wakeup, &ring->lock, &ts);
+                        } else
+                                pthread_cond_wait(&ring->wakeup, &ring->lock);
+                        ring->sleeping = false;
+                        continue;
+                }
+
+                tail = ring->tail;
+                head = ring->head;
+                pthread_mutex_unlock(&ring->lock);
+
+                tail = log_ring_write(ring, tail, head);
+
+                pthread_mutex_lock(&ring->lock);
+                ring->tail = tail;
+        }
+
+        pthread_mutex_unlock(&ring->lock);
+        return NULL;
+}
+
+static void log_ring_queue(LogRing *ring, int fd, const char *text, size_t len) {
+        pthread_mutex_lock(&ring->lock);
+
+        log_ring_summarize(ring, log_now(), false);
+
+        if (ring->burst < LOG_RATELIMIT_BURST && log_ring_push(ring, fd, text, len)) {
+                ring->burst++;
+                ring->stats.written++;
+        } else {
+                ring->suppressed++;
+                ring->stats.suppressed++;
+        }
+
+        if (ring->sleeping && ring->head != ring->tail) {
+                ring->sleeping = false;
+                pthread_cond_signal(&ring->wakeup);
+        }
+
+        pthread_mutex_unlock(&ring->lock);
+}
+
+void log_submit(int level, const char *format, ...) {
+        LogRing *ring = __atomic_load_n(&log_ring, __ATOMIC_ACQUIRE);
+        int fd = level <= LOG_WARNING ? STDERR_FILENO : STDOUT_FILENO;
+        char line[LOG_LINE_MAX];
+        va_list ap;
+        int n;
+
+        /* first thing, for %m to see the caller's errno */
+        va_start(ap, format);
+        n = vsnprintf(line, sizeof(line) - 1, format, ap);
+        va_end(ap);
+        if (n < 0)
+                return;
+
+        if ((size_t)n > sizeof(line) - 2)
+                n = sizeof(line) - 2;
+        line[n++] = '\n';
+
+        if (ring)
+                log_ring_queue(ring, fd, line, n);
+        else
+                fwrite(line, 1, n, fd == STDERR_FILENO ? stderr : stdout);
+}
+
+/*
+ * Queues messages to a buffer of @size bytes from now on. It is flushed on
+ * exit, or by log_ring_stop(), once no other thread logs anymore.
+ */
+int log_ring_start(size_t size) {
+        static bool registered;
+        LogRing *ring;
+        sigset_t mask, saved;
+        int r;
+
+        if (log_ring)
+                return -EBUSY;
+
+        size = (size + 7) & ~(size_t)7;
+        if (size < 4 * LOG_RECORD_SIZE(LOG_LINE_MAX))
+                return -EINVAL;
+
+        ring = calloc(1, sizeof(*ring));
+        if (!ring)
+                return -ENOMEM;
+
+        ring->size = size;
+        ring->buf = malloc(size);
+        if (!ring->buf) {
+                free(ring);
+                return -ENOMEM;
+        }
+
+        /* touched now, rather than when the first burst comes in */
+        memset(ring->buf, 0, size);
+        pthread_mutex_init(&ring->lock, NULL);
+        pthread_cond_init(&ring->wakeup, NULL);
+        ring->interval = log_now();
+
+        /* signals are left to the threads that handle them */
+        sigfillset(&mask);
+        pthread_sigmask(SIG_BLOCK, &mask, &saved);
+        r = -pthread_create(&ring->thread, NULL, log_ring_thread, ring);
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        if (r < 0) {
+                free(ring->buf);
+                free(ring);
+                return r;
+        }
+
+        if (!registered && atexit(log_ring_stop) == 0)
+                registered = true;
+
+        __atomic_store_n(&log_ring, ring, __ATOMIC_RELEASE);
+        return 0;
+}
+
+/* writes out what is queued, and goes back to writing messages right away */
+void log_ring_stop(void) {
+        LogRing *ring = __atomic_exchange_n(&log_ring, NULL, __ATOMIC_ACQ_REL);
+
+        if (!ring)
+                return;
+
+        pthread_mutex_lock(&ring->lock);
+        ring->stopping = true;
+        pthread_cond_signal(&ring->wakeup);
+        pthread_mutex_unlock(&ring->lock);
+
+        pthread_join(ring->thread, NULL);
+
+        pthread_cond_destroy(&ring->wakeup);
+        pthread_mutex_destroy(&ring->lock);
+        free(ring->buf);
+        free(ring);
+}
+
+void log_get_stats(LogStats *stats) {
+        LogRing *ring = __atomic_load_n(&log_ring, __ATOMIC_ACQUIRE);
+
+        if (!ring) {
+                *stats = (LogStats) {};
+                return;
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        *stats = ring->stats;
+        pthread_mutex_unlock(&ring->lock);
+}
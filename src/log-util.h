@@ -1,15 +1,53 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <syslog.h>
+
+/* messages less important than this are dropped; may be changed at runtime */
+extern int log_max_level;
+
+int log_level_from_string(const char *s);
+const char *log_level_to_string(int level);
+
+/*
+ * Messages are written to stdout, or to stderr from warnings on, right
+ * away; or, once log_ring_start() was called, queued to a buffer that a
+ * thread of its own writes out, so that a slow console never holds up the
+ * caller. Then a burst of more messages than the buffer or the rate limit
+ * takes is dropped, and replaced by a count of what was suppressed.
+ */
+
+typedef struct LogStats {
+        uint64_t written;
+        uint64_t suppressed;
+} LogStats;
+
+int log_ring_start(size_t size);
+void log_ring_stop(void);
+void log_get_stats(LogStats *stats);
+
+void log_submit(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_enabled(level) ((level) <= __atomic_load_n(&log_max_level, __ATOMIC_RELAXED))
+
+#define log_debug(fmt, arg...) do {				\
+		if (log_enabled(LOG_DEBUG))			\
+			log_submit(LOG_DEBUG, fmt, ##arg);	\
+	} while (0)
 
 #define log_info(fmt, arg...) do {				\
-		fprintf(stdout, fmt "\n", ##arg);		\
+		if (log_enabled(LOG_INFO))			\
+			log_submit(LOG_INFO, fmt, ##arg);	\
 	} while (0)
 
 #define log_warn(fmt, arg...) do {				\
-                fprintf(stderr, fmt "\n", ##arg);               \
+                if (log_enabled(LOG_WARNING))                   \
+                        log_submit(LOG_WARNING, fmt, ##arg);    \
         } while (0)
 
 #define log_error(fmt, arg...) do {				\
-                fprintf(stderr, fmt "\n", ##arg);               \
+                if (log_enabled(LOG_ERR))                       \
+                        log_submit(LOG_ERR, fmt, ##arg);        \
         } while (0)
@@ -1,34 +1,444 @@
 #include <errno.h>
 #include <fcntl.h>
-#include <libudev.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "control.h"
+#include "decompress.h"
+#include "event.h"
 #include "firmwared.h"
 #include "firmware.h"
+#include "firmware-uring.h"
+#include "hashmap.h"
+#include "histogram.h"
+#include "index-file.h"
+#include "index.h"
 #include "manager.h"
 #include "log-util.h"
+#include "modalias.h"
+#include "pack.h"
+#include "priority.h"
+#include "profile.h"
+#include "queue.h"
+#include "request.h"
+#include "trace.h"
+#include "uevent.h"
+#include "worker.h"
+
+/* uploads in flight at once, more are queued */
+#define MANAGER_URING_UPLOADS (32)
+
+/* lost events come in bursts, rescan once things calmed down a bit */
+#define MANAGER_RESYNC_DELAY_USEC (50 * USEC_PER_MSEC)
+
+/* the boot profile is saved once no new firmware was asked for this long */
+#define MANAGER_PROFILE_SAVE_DELAY_USEC (10 * USEC_PER_SEC)
+
+/* requests after the start whose latency tells how well the prefetch works */
+#define MANAGER_FIRST_REQUESTS (16)
+
+/* a queued request goes next once it waited this long, whatever its priority */
+#define MANAGER_STARVATION_USEC (1 * USEC_PER_SEC)
+
+/* a control client has this long to send its command and read the reply */
+#define MANAGER_CONTROL_TIMEOUT_USEC (10 * USEC_PER_SEC)
+
+/* the kernel's default, if /sys/class/firmware/timeout cannot be read */
+#define MANAGER_TIMEOUT_DEFAULT_USEC (60 * USEC_PER_SEC)
+
+/* distinct priorities with their own latency stats */
+#define MANAGER_PRIORITY_LEVELS (8)
+
+/* firmware prefetched ahead of its request, at most, and for how long it is expected */
+#define MANAGER_SPECULATED_MAX (1024)
+#define MANAGER_SPECULATED_USEC (60 * USEC_PER_SEC)
+
+/* firmware up to these sizes has latencies of its own */
+#define MANAGER_SIZE_CLASSES (4)
+
+static const uint64_t manager_size_class_max[MANAGER_SIZE_CLASSES] = {
+        64 * 1024, 1024 * 1024, 16 * 1024 * 1024, UINT64_MAX,
+};
+
+static const char *const manager_size_class_names[MANAGER_SIZE_CLASSES] = {
+        "<64K", "<1M", "<16M", ">=16M",
+};
+
+/* what a request waits for, one after the other, from its event to the end of the upload */
+typedef enum ManagerStage {
+        MANAGER_STAGE_QUEUE,
+        MANAGER_STAGE_LOOKUP,
+        MANAGER_STAGE_OPEN,
+        MANAGER_STAGE_WRITE,
+        MANAGER_STAGE_FINISH,
+        MANAGER_STAGE_TOTAL,
+        _MANAGER_STAGE_MAX,
+} ManagerStage;
+
+static const char *const manager_stage_names[_MANAGER_STAGE_MAX] = {
+        [MANAGER_STAGE_QUEUE] = "queue",
+        [MANAGER_STAGE_LOOKUP] = "lookup",
+        [MANAGER_STAGE_OPEN] = "open",
+        [MANAGER_STAGE_WRITE] = "write",
+        [MANAGER_STAGE_FINISH] = "finish",
+        [MANAGER_STAGE_TOTAL] = "total",
+};
+
+typedef struct InflightRequest {
+        uint64_t start;
+        uint64_t deadline;
+        int priority;
+        /* found waiting at startup */
+        bool coldplug;
+        /* handed over to be handled */
+        bool dispatched;
+        /* let ahead by the starvation guard */
+        bool starved;
+        /* given up on by the kernel before we got to it */
+        bool dropped;
+        /* parked until its firmware shows up */
+        bool waiting;
+        /* of the upload handed to io_uring, for its latency */
+        uint64_t received;
+        uint64_t size;
+        /* stored after the devpath */
+        const char *name;
+        char devpath[];
+} InflightRequest;
+
+/* a name prefetched ahead of its request, oldest first */
+typedef struct SpeculatedFirmware SpeculatedFirmware;
+
+struct SpeculatedFirmware {
+        SpeculatedFirmware *prev;
+        SpeculatedFirmware *next;
+        uint64_t usec;
+        const char *name;
+};
+
+/* what was uploaded of one firmware, for the control socket */
+typedef struct ServedFirmware {
+        uint64_t requests;
+        uint64_t bytes;
+        char name[];
+} ServedFirmware;
+
+/* the tentative requests for a firmware that is not there yet */
+typedef struct UnresolvedFirmware UnresolvedFirmware;
+
+struct UnresolvedFirmware {
+        UnresolvedFirmware *next;
+        Request **requests;
+        size_t n_requests;
+        /* a matching file changed, to be looked up again */
+        bool ready;
+        char name[];
+};
+
+typedef struct PriorityStats {
+        int priority;
+        uint64_t requests;
+        uint64_t usec;
+        uint64_t max_usec;
+        uint64_t starved;
+} PriorityStats;
 
 struct Manager {
-        struct udev *udev;
-        struct udev_monitor *udev_monitor;
+        UeventMonitor *monitor;
+        Cache *cache;
+        Index *index;
         int *firmwaredirfds;
-        int devicesfd;
+        char **firmwaredirpaths;
+        Pack **firmwarepacks;
+        WorkerPool *workers;
+        FirmwareUring *uring;
+        Transfer *transfer;
+        EventLoop *event;
+        EventSource *signal_source;
+        EventSource *monitor_source;
+        EventSource *index_source;
+        EventSource *mount_source;
+        EventSource *uring_source;
+        EventSource *prepare;
+        EventSource *dispatch_source;
+        EventSource *resync_timer;
+        EventSource *profile_timer;
+        /* the requests being handled by devpath, to not take one twice */
+        Hashmap *inflight;
+        pthread_mutex_t inflight_lock;
+        /* requests waiting for a worker or an io_uring slot */
+        RequestQueue *queue;
+        PriorityRules *rules;
+        /* requests handed over at most, and right now */
+        unsigned int capacity;
+        unsigned int dispatched;
+        size_t queued;
+        /* kicked by the workers, when there is room for queued requests, or uploads for io_uring */
+        int dispatchfd;
+        /* when the events being handled came in, for the deadlines */
+        uint64_t arrival_usec;
+        uint64_t timeout_usec;
+        /* under inflight_lock */
+        PriorityStats priority_stats[MANAGER_PRIORITY_LEVELS];
+        unsigned int n_priority_stats;
+        uint64_t deadlines_met;
+        uint64_t deadlines_missed;
+        uint64_t deadlines_dropped;
+        /* latency of the first requests, under inflight_lock */
+        unsigned int n_first;
+        uint64_t first_usec;
+        uint64_t first_max_usec;
+        /* the backlog found at startup, under inflight_lock */
+        bool coldplugging;
+        unsigned int coldplug_pending;
+        unsigned int coldplug_requests;
+        uint64_t coldplug_start;
+        uint64_t coldplug_scan_usec;
+        uint64_t coldplug_drain_usec;
+        Profile *profile;
+        Profile *replay;
+        const char *profile_path;
+        pthread_t prefetch_thread;
+        bool prefetching;
+        bool prefetch_stop;
+        uint64_t start_usec;
+        /* device and module additions, to prefetch what they will ask for */
+        UeventMonitor *speculative_monitor;
+        EventSource *speculative_source;
+        ModaliasMap *modalias_map;
+        /* names prefetched and not asked for yet, and the same in the order they were */
+        Hashmap *speculated;
+        SpeculatedFirmware *speculated_oldest;
+        SpeculatedFirmware *speculated_newest;
+        uint64_t speculative_events;
+        uint64_t speculative_prefetches;
+        uint64_t speculative_hits;
+        uint64_t speculative_misses;
+        uint64_t speculative_wasted;
+        /* tentative requests waiting for their firmware by name, under inflight_lock */
+        Hashmap *unresolved;
+        bool unresolved_ready;
+        /* bumped on every index change, so that a lookup racing with one is retried */
+        unsigned int index_generation;
+        uint64_t unresolved_deferred;
+        uint64_t unresolved_retried;
+        uint64_t resyncs;
+        uint64_t duplicates;
+        /* per codec, updated from the workers */
+        uint64_t decompressed[_COMPRESSION_MAX];
+        DecompressStats decompress_stats[_COMPRESSION_MAX];
+        /* in usec, per stage and size class, updated from the workers */
+        Histogram latency[_MANAGER_STAGE_MAX][MANAGER_SIZE_CLASSES];
+        int sysfd;
         int signalfd;
-        int epollfd;
+        /* polled for mount changes, which may put a firmware dir elsewhere */
+        int mountinfofd;
+        /* cleared at runtime, under inflight_lock, once no more firmware shows up */
         bool tentative;
+        uint64_t finalized_found;
+        uint64_t finalized_cancelled;
+        /* per firmware name, under inflight_lock */
+        Hashmap *served;
+        ControlServer *control;
 };
 
-int manager_new(Manager **managerp, bool tentative) {
-        _cleanup_(manager_freep) Manager *m = NULL;
+static bool manager_is_tentative(Manager *m) {
+        return __atomic_load_n(&m->tentative, __ATOMIC_SEQ_CST);
+}
+
+/* called under inflight_lock, marks the requests a change to @name may resolve */
+static void manager_unresolved_mark(Manager *m, const char *name) {
+        UnresolvedFirmware *f;
+        HashmapIterator i;
+
+        if (!name) {
+                HASHMAP_FOREACH(f, m->unresolved, i)
+                        f->ready = true;
+
+                m->unresolved_ready = hashmap_size(m->unresolved) > 0;
+                return;
+        }
+
+        for (Compression c = 0; c < _COMPRESSION_MAX; c++) {
+                _cleanup_free_ char *base = NULL;
+                size_t len = strlen(name), suffix = strlen(compression_suffix(c));
+
+                if (!compression_supported(c) || len <= suffix ||
+                    strcmp(name + len - suffix, compression_suffix(c)))
+                        continue;
+
+                base = strndup(name, len - suffix);
+                if (!base)
+                        return;
+
+                f = hashmap_get(m->unresolved, base);
+                if (f) {
+                        f->ready = true;
+                        m->unresolved_ready = true;
+                }
+        }
+}
+
+static void manager_index_changed(const char *name, void *userdata) {
+        Manager *m = userdata;
+
+        /* a file may now be shadowed by, or fall back to, another search dir */
+        if (name)
+                cache_invalidate(m->cache, name);
+        else
+                cache_flush(m->cache);
+
+        pthread_mutex_lock(&m->inflight_lock);
+        m->index_generation++;
+        if (hashmap_size(m->unresolved) > 0)
+                manager_unresolved_mark(m, name);
+        pthread_mutex_unlock(&m->inflight_lock);
+}
+
+typedef struct FirmwareBlob {
+        int fd;
+        int dirfd;
+        /* where @fd was read from, if it is a cached copy; 0 otherwise */
+        long fs_type;
+        const void *data;
+        size_t size;
+        Compression compression;
+} FirmwareBlob;
+
+static void firmware_blob_done(FirmwareBlob *blob) {
+        if (blob->fd >= 0)
+                close(blob->fd);
+}
+
+static uint64_t firmware_blob_size(const FirmwareBlob *blob) {
+        struct stat st;
+
+        if (blob->fd < 0)
+                return blob->size;
+
+        if (fstat(blob->fd, &st) < 0)
+                return 0;
+
+        return st.st_size;
+}
+
+/*
+ * Opens the search path: every firmware dir, each followed by its kernel
+ * release subdirectory. Directories that do not exist are left at -1. An
+ * entry that is a file is mapped as a firmware pack instead, if @packs is
+ * given; packs have no kernel release subdirectory.
+ */
+static int manager_open_dirs(int *dirfds, char **dirpaths, Pack **packs) {
         struct utsname kernel;
-        struct epoll_event ep_udev = { .events = EPOLLIN };
-        struct epoll_event ep_signal = { .events = EPOLLIN };
+
+        for (unsigned int i = 0; i < 2 * firmware_dirs_size; i ++)
+                dirfds[i] = -1;
+
+        if (uname(&kernel) < 0)
+                return -errno;
+
+        for (unsigned int i = 0; i < firmware_dirs_size; i ++) {
+                dirfds[2 * i] = openat(AT_FDCWD, firmware_dirs[i], O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+                if (dirfds[2 * i] < 0 && errno == ENOTDIR && packs) {
+                        int r;
+
+                        r = pack_open(&packs[2 * i], AT_FDCWD, firmware_dirs[i]);
+                        if (r < 0)
+                                log_warn("cannot use firmware pack %s: %s", firmware_dirs[i], strerror(-r));
+                }
+
+                dirfds[2 * i + 1] = openat(dirfds[2 * i], kernel.release, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+
+                dirpaths[2 * i] = strdup(firmware_dirs[i]);
+                if (!dirpaths[2 * i] ||
+                    asprintf(&dirpaths[2 * i + 1], "%s/%s", firmware_dirs[i], kernel.release) < 0)
+                        return -ENOMEM;
+        }
+
+        return 0;
+}
+
+static void manager_close_dirs(int *dirfds, char **dirpaths, Pack **packs) {
+        for (unsigned int i = 0; i < 2 * firmware_dirs_size; i ++) {
+                if (dirfds[i] >= 0)
+                        close(dirfds[i]);
+                if (dirpaths)
+                        free(dirpaths[i]);
+                if (packs && packs[i])
+                        pack_free(packs[i]);
+        }
+        free(dirpaths);
+        free(packs);
+}
+
+int manager_write_index(const char *path) {
+        _cleanup_free_ int *dirfds = NULL;
+        char **dirpaths;
+        int r;
+
+        dirfds = calloc(2 * firmware_dirs_size, sizeof(int));
+        if (!dirfds)
+                return -ENOMEM;
+
+        dirpaths = calloc(2 * firmware_dirs_size, sizeof(char *));
+        if (!dirpaths)
+                return -ENOMEM;
+
+        r = manager_open_dirs(dirfds, dirpaths, NULL);
+        if (r >= 0)
+                r = index_file_write(path, dirfds, dirpaths, 2 * firmware_dirs_size);
+
+        manager_close_dirs(dirfds, dirpaths, NULL);
+        return r;
+}
+
+static void manager_handle_request(Request *request, void *userdata);
+static void manager_upload_done(void *cookie, int error, void *userdata);
+static int manager_add_sources(Manager *m);
+static int manager_on_control(const char *command, FILE *out, void *userdata);
+
+/* without a usable map, firmware is simply not prefetched */
+static int manager_speculate_init(Manager *m, const char *path) {
+        int r;
+
+        r = modalias_map_new(&m->modalias_map, path);
+        if (r == -ENOMEM)
+                return r;
+        if (r < 0) {
+                log_warn("cannot read modalias map %s: %s", path, strerror(-r));
+                return 0;
+        }
+
+        r = hashmap_new(&m->speculated, string_hash_func, string_compare_func);
+        if (r < 0)
+                return r;
+
+        r = uevent_monitor_new(&m->speculative_monitor);
+        if (r < 0)
+                return r;
+
+        r = uevent_monitor_filter_action(m->speculative_monitor, "add");
+        if (r < 0)
+                log_warn("cannot filter uevents in the kernel: %s", strerror(-r));
+
+        return 0;
+}
+
+int manager_new(Manager **managerp, const ManagerConfig *config) {
+        _cleanup_(manager_freep) Manager *m = NULL;
+        unsigned int n_threads;
         sigset_t mask;
         int r;
 
@@ -36,56 +446,178 @@ int manager_new(Manager **managerp, bool tentative) {
         if (!m)
                 return -ENOMEM;
 
-        m->tentative = tentative;
-        m->devicesfd = -1;
+        m->tentative = config->tentative;
+        m->sysfd = -1;
         m->signalfd = -1;
-        m->epollfd = -1;
+        m->mountinfofd = -1;
+        m->dispatchfd = -1;
+        pthread_mutex_init(&m->inflight_lock, NULL);
+        m->start_usec = event_now();
+        m->timeout_usec = MANAGER_TIMEOUT_DEFAULT_USEC;
         m->firmwaredirfds = (int*)(m + 1);
+        for (unsigned int i = 0; i < 2 * firmware_dirs_size; i ++)
+                m->firmwaredirfds[i] = -1;
+
+        m->firmwaredirpaths = calloc(2 * firmware_dirs_size, sizeof(char *));
+        if (!m->firmwaredirpaths)
+                return -ENOMEM;
 
-        r = uname(&kernel);
+        m->firmwarepacks = calloc(2 * firmware_dirs_size, sizeof(Pack *));
+        if (!m->firmwarepacks)
+                return -ENOMEM;
+
+        r = manager_open_dirs(m->firmwaredirfds, m->firmwaredirpaths, m->firmwarepacks);
         if (r < 0)
-                return -errno;
+                return r;
 
-        for (unsigned int i = 0; i < firmware_dirs_size; i ++) {
-                m->firmwaredirfds[2 * i] = openat(AT_FDCWD, firmware_dirs[i], O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
-                m->firmwaredirfds[2 * i + 1] = openat(m->firmwaredirfds[2 * i], kernel.release, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (config->profile_path) {
+                m->profile_path = config->profile_path;
+
+                r = profile_new(&m->profile);
+                if (r < 0)
+                        return r;
+
+                r = profile_new(&m->replay);
+                if (r < 0)
+                        return r;
+
+                r = profile_load(m->replay, m->profile_path);
+                if (r < 0 && r != -ENOENT)
+                        log_warn("cannot read boot profile %s: %s", m->profile_path, strerror(-r));
         }
 
-        m->devicesfd = openat(AT_FDCWD, "/sys/devices", O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
-        if (m->devicesfd < 0)
-                return -errno;
+        r = transfer_new(&m->transfer, config->transfer, config->chunk_size);
+        if (r < 0)
+                return r;
 
-        m->udev = udev_new();
-        if (!m->udev)
-                return -errno;
+        r = hashmap_new(&m->inflight, string_hash_func, string_compare_func);
+        if (r < 0)
+                return r;
 
-        m->udev_monitor = udev_monitor_new_from_netlink(m->udev, "kernel");
-        if (!m->udev_monitor)
-                return -errno;
+        r = hashmap_new(&m->unresolved, string_hash_func, string_compare_func);
+        if (r < 0)
+                return r;
+
+        r = hashmap_new(&m->served, string_hash_func, string_compare_func);
+        if (r < 0)
+                return r;
 
-        r = udev_monitor_filter_add_match_subsystem_devtype(m->udev_monitor, "firmware", NULL);
+        r = cache_new(&m->cache, config->cache_size);
         if (r < 0)
                 return r;
 
+        r = index_new(&m->index, m->firmwaredirfds, m->firmwaredirpaths, 2 * firmware_dirs_size,
+                      config->index_path, manager_index_changed, m);
+        if (r < 0)
+                return r;
+
+        /* before any thread is started, so that all of them inherit the mask */
         sigemptyset(&mask);
         sigaddset(&mask, SIGTERM);
         sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGUSR1);
+        sigaddset(&mask, SIGUSR2);
         sigprocmask(SIG_BLOCK, &mask, NULL);
 
+        if (config->engine == MANAGER_ENGINE_IO_URING) {
+                r = firmware_uring_new(&m->uring, MANAGER_URING_UPLOADS, manager_upload_done, m);
+                if (r < 0)
+                        log_warn("cannot use io_uring, falling back to threads: %s", strerror(-r));
+        }
+
+        /*
+         * Without threads, requests are handled inline by the event loop. With
+         * io_uring, the workers still look up the firmware, fill the cache and
+         * decompress, only the sysfs exchange is left to io_uring; none of that
+         * is to hold up the loop that reaps the uploads.
+         */
+        n_threads = config->n_threads;
+        if (m->uring && n_threads == 0) {
+                log_warn("io_uring leaves lookups and decompression to threads, using one");
+                n_threads = 1;
+        }
+
+        if (n_threads > 0) {
+                r = worker_pool_new(&m->workers, n_threads, manager_handle_request, m);
+                if (r < 0)
+                        return r;
+
+                m->dispatchfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+                if (m->dispatchfd < 0)
+                        return -errno;
+        }
+
+        /*
+         * Only hand over what can be started, the rest waits in the queue. The
+         * workers share one queue, so below n_threads there is an idle worker;
+         * with io_uring, a lookup is quick next to an upload, which is what
+         * there are slots for.
+         */
+        if (m->uring)
+                m->capacity = MANAGER_URING_UPLOADS;
+        else if (m->workers)
+                m->capacity = n_threads;
+        else
+                m->capacity = 1;
+
+        r = request_queue_new(&m->queue, MANAGER_STARVATION_USEC);
+        if (r < 0)
+                return r;
+
+        if (config->priority_rules_path) {
+                r = priority_rules_new(&m->rules, config->priority_rules_path);
+                if (r < 0) {
+                        log_error("cannot read priority rules %s: %s", config->priority_rules_path, strerror(-r));
+                        return r;
+                }
+        }
+
+        m->sysfd = openat(AT_FDCWD, config->sysfs_path ? config->sysfs_path : "/sys",
+                          O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (m->sysfd < 0)
+                return -errno;
+
+        /* listen before enumerating, so no request falls in between */
+        if (config->uevent_socket)
+                r = uevent_monitor_new_socket(&m->monitor, config->uevent_socket);
+        else
+                r = uevent_monitor_new(&m->monitor);
+        if (r < 0)
+                return r;
+
+        r = uevent_monitor_filter_subsystem(m->monitor, "firmware");
+        if (r < 0)
+                log_warn("cannot filter uevents in the kernel: %s", strerror(-r));
+
+        if (config->modalias_map_path) {
+                r = manager_speculate_init(m, config->modalias_map_path);
+                if (r < 0)
+                        return r;
+        }
+
         m->signalfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
         if (m->signalfd < 0)
                 return -errno;
 
-        m->epollfd = epoll_create1(EPOLL_CLOEXEC);
-        if (m->epollfd < 0)
-                return -errno;
+        m->mountinfofd = open("/proc/self/mountinfo", O_RDONLY|O_CLOEXEC);
+        if (m->mountinfofd < 0)
+                log_warn("cannot watch for mounts: %m");
+
+        r = event_loop_new(&m->event);
+        if (r < 0)
+                return r;
 
-        ep_udev.data.fd = udev_monitor_get_fd(m->udev_monitor);
-        ep_signal.data.fd = m->signalfd;
+        r = manager_add_sources(m);
+        if (r < 0)
+                return r;
 
-        if (epoll_ctl(m->epollfd, EPOLL_CTL_ADD, udev_monitor_get_fd(m->udev_monitor), &ep_udev) < 0 ||
-            epoll_ctl(m->epollfd, EPOLL_CTL_ADD, m->signalfd, &ep_signal))
-                return -errno;
+        /* the daemon is of use without it, too */
+        if (config->control_path && config->control_path[0]) {
+                r = control_server_new(&m->control, m->event, config->control_path, MANAGER_CONTROL_TIMEOUT_USEC,
+                                       manager_on_control, m);
+                if (r < 0)
+                        log_warn("cannot listen on %s: %s", config->control_path, strerror(-r));
+        }
 
         *managerp = m;
         m = NULL;
@@ -93,159 +625,1764 @@ int manager_new(Manager **managerp, bool tentative) {
         return 0;
 }
 
+static int manager_save_profile(Manager *m);
+static int manager_dispatch(Manager *manager);
+
 void manager_free(Manager *m) {
-        if (m->epollfd >= 0)
-                close(m->epollfd);
+        if (m->prefetching) {
+                __atomic_store_n(&m->prefetch_stop, true, __ATOMIC_RELAXED);
+                pthread_join(m->prefetch_thread, NULL);
+        }
+
+        /* hand over what is still queued, as we did before there was a queue */
+        if (m->queue) {
+                m->capacity = UINT_MAX;
+                manager_dispatch(m);
+        }
+
+        /* finish the uploads in flight while everything they use is still there */
+        if (m->workers)
+                worker_pool_free(m->workers);
+        if (m->uring)
+                firmware_uring_free(m->uring);
+        if (m->control)
+                control_server_free(m->control);
+        if (m->profile_timer) {
+                /* still waiting to be saved */
+                if (event_source_get_time(m->profile_timer) > 0)
+                        manager_save_profile(m);
+                event_source_free(m->profile_timer);
+        }
+        if (m->resync_timer)
+                event_source_free(m->resync_timer);
+        if (m->prepare)
+                event_source_free(m->prepare);
+        if (m->dispatch_source)
+                event_source_free(m->dispatch_source);
+        if (m->uring_source)
+                event_source_free(m->uring_source);
+        if (m->index_source)
+                event_source_free(m->index_source);
+        if (m->mount_source)
+                event_source_free(m->mount_source);
+        if (m->monitor_source)
+                event_source_free(m->monitor_source);
+        if (m->speculative_source)
+                event_source_free(m->speculative_source);
+        if (m->signal_source)
+                event_source_free(m->signal_source);
+        if (m->event)
+                event_loop_free(m->event);
         if (m->signalfd >= 0)
                 close(m->signalfd);
-        udev_monitor_unref(m->udev_monitor);
-        udev_unref(m->udev);
-        if (m->devicesfd >= 0)
-                close(m->devicesfd);
-        for (unsigned int i = 0; i < 2 * firmware_dirs_size; i ++)
-                if (m->firmwaredirfds[i] >= 0)
-                        close(m->firmwaredirfds[i]);
+        if (m->mountinfofd >= 0)
+                close(m->mountinfofd);
+        if (m->dispatchfd >= 0)
+                close(m->dispatchfd);
+        if (m->queue)
+                request_queue_free(m->queue);
+        if (m->rules)
+                priority_rules_free(m->rules);
+        if (m->monitor)
+                uevent_monitor_free(m->monitor);
+        if (m->speculative_monitor)
+                uevent_monitor_free(m->speculative_monitor);
+        if (m->speculated) {
+                SpeculatedFirmware *f;
+                HashmapIterator i;
+
+                HASHMAP_FOREACH(f, m->speculated, i)
+                        free(f);
+                hashmap_free(m->speculated);
+        }
+        if (m->modalias_map)
+                modalias_map_free(m->modalias_map);
+        if (m->sysfd >= 0)
+                close(m->sysfd);
+        if (m->index)
+                index_free(m->index);
+        if (m->cache)
+                cache_free(m->cache);
+        if (m->transfer)
+                transfer_free(m->transfer);
+        if (m->served) {
+                ServedFirmware *f;
+                HashmapIterator i;
+
+                HASHMAP_FOREACH(f, m->served, i)
+                        free(f);
+                hashmap_free(m->served);
+        }
+        if (m->unresolved) {
+                UnresolvedFirmware *f;
+                HashmapIterator i;
+
+                HASHMAP_FOREACH(f, m->unresolved, i) {
+                        for (size_t j = 0; j < f->n_requests; j++)
+                                request_free(f->requests[j]);
+                        free(f->requests);
+                        free(f);
+                }
+                hashmap_free(m->unresolved);
+        }
+        if (m->inflight) {
+                InflightRequest *request;
+                HashmapIterator i;
+
+                HASHMAP_FOREACH(request, m->inflight, i)
+                        free(request);
+                hashmap_free(m->inflight);
+        }
+        if (m->replay)
+                profile_free(m->replay);
+        if (m->profile)
+                profile_free(m->profile);
+        pthread_mutex_destroy(&m->inflight_lock);
+        manager_close_dirs(m->firmwaredirfds, m->firmwaredirpaths, m->firmwarepacks);
         free(m);
 }
 
-static int manager_find_firmware(Manager *manager, const char *name) {
+static int manager_find_firmware(Manager *manager, const char *name, FirmwareBlob *blob) {
+        unsigned int slot = 2 * firmware_dirs_size;
         int firmwarefd;
 
-        for (unsigned int i = 0; i < 2 * firmware_dirs_size; i ++) {
-                firmwarefd = openat(manager->firmwaredirfds[i], name, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
-                if (firmwarefd >= 0)
-                        return firmwarefd;
+        TRACE1(lookup_start, name);
+
+        firmwarefd = index_open(manager->index, name, &slot);
+
+        /* packs are not indexed, check those ahead of the hit */
+        for (unsigned int i = 0; i < slot; i ++)
+                if (manager->firmwarepacks[i] &&
+                    pack_find(manager->firmwarepacks[i], name, &blob->data, &blob->size) >= 0) {
+                        if (firmwarefd >= 0)
+                                close(firmwarefd);
+                        TRACE2(lookup_hit, name, i);
+                        return 0;
+                }
+
+        if (firmwarefd >= 0) {
+                blob->fd = firmwarefd;
+                blob->dirfd = manager->firmwaredirfds[slot];
+                TRACE2(lookup_hit, name, slot);
+                return 0;
         }
 
-        log_info("firmware '%s' not found", name);
+        TRACE1(lookup_miss, name);
         return -ENOENT;
 }
 
-static void closep(int *fdp) {
-        if (*fdp >= 0)
-                close(*fdp);
-}
+static int manager_open_file(Manager *manager, const char *name, FirmwareBlob *blob) {
+        int cachefd, r;
 
-static int manager_handle_device(Manager *manager, struct udev_device *device) {
-        _cleanup_(closep) int devicefd = -1, firmwarefd = -1;
-        const char *name;
-        int r;
+        blob->fd = cache_lookup(manager->cache, name, &blob->fs_type);
+        if (blob->fd >= 0)
+                return 0;
 
-        devicefd = openat(manager->devicesfd, udev_device_get_syspath(device), O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
-        if (devicefd < 0)
-                return errno == ENOENT ? 0 : -errno;
+        r = manager_find_firmware(manager, name, blob);
+        if (r < 0)
+                return r;
 
-        name = udev_device_get_property_value(device, "FIRMWARE");
-        firmwarefd = manager_find_firmware(manager, name);
-        if (firmwarefd >= 0) {
-                log_info("load firmware %s", name);
-                r = firmware_load(devicefd, firmwarefd, manager->tentative);
-                if (r < 0)
-                        return r;
-        } else if (!manager->tentative) {
-                log_info("cancel firmware load %s", name);
-                r = firmware_cancel_load(devicefd);
-                if (r < 0)
-                        return r;
+        /* packs are in memory already */
+        if (blob->fd < 0)
+                return 0;
+
+        /* serve from the resident copy, so the file is read only once */
+        cachefd = cache_insert(manager->cache, name, blob->dirfd, blob->fd, &blob->fs_type);
+        if (cachefd >= 0) {
+                close(blob->fd);
+                blob->fd = cachefd;
         }
 
         return 0;
 }
 
-static void udev_enumerate_unrefp(struct udev_enumerate **enumeratep) {
-        if (*enumeratep)
-                udev_enumerate_unref(*enumeratep);
-}
+/*
+ * Like the kernel, looks for the plain file anywhere in the search path
+ * before it falls back to a compressed one. Compressed files are cached as
+ * they are, and only decompressed on the way to the device.
+ */
+static int manager_open_firmware(Manager *manager, const char *name, FirmwareBlob *blob) {
+        for (Compression c = 0; c < _COMPRESSION_MAX; c++) {
+                _cleanup_free_ char *path = NULL;
+                int r;
 
-static void udev_device_unrefp(struct udev_device **devicep) {
-        if (*devicep)
-                udev_device_unref(*devicep);
+                if (!compression_supported(c))
+                        continue;
+
+                if (asprintf(&path, "%s%s", name, compression_suffix(c)) < 0)
+                        return -ENOMEM;
+
+                r = manager_open_file(manager, path, blob);
+                if (r >= 0) {
+                        blob->compression = c;
+                        return 0;
+                } else if (r != -ENOENT)
+                        return r;
+        }
+
+        log_info("firmware '%s' not found", name);
+        return -ENOENT;
 }
 
-int manager_run(Manager *manager) {
-        _cleanup_(udev_enumerate_unrefp) struct udev_enumerate *enumerate = NULL;
-        struct udev_list_entry *device_list, *device_entry;
+static int manager_load_compressed(Manager *manager, int devicefd, const char *devpath, FirmwareBlob *blob,
+                                   const char *name, FirmwareTimes *times) {
+        DecompressStats stats;
         int r;
 
-        enumerate = udev_enumerate_new(manager->udev);
-        if (!enumerate)
-                return -errno;
-
-        r = udev_enumerate_add_match_subsystem(enumerate, "firmware");
+        r = firmware_load_compressed(devicefd, devpath, blob->fd, blob->data, blob->size, blob->compression,
+                                     manager_is_tentative(manager), &stats, times);
         if (r < 0)
                 return r;
 
-        r = udev_monitor_enable_receiving(manager->udev_monitor);
-        if (r < 0)
-                return r;
+        if (stats.out == 0)
+                return 0;
 
-        r = udev_enumerate_scan_devices(enumerate);
-        if (r < 0)
-                return r;
+        log_info("decompressed firmware %s (%s): %llu -> %llu bytes in %llu us, %.1f MiB/s",
+                 name, compression_to_string(blob->compression),
+                 (unsigned long long)stats.in, (unsigned long long)stats.out,
+                 (unsigned long long)stats.usec,
+                 stats.usec ? (double)stats.out / stats.usec * 1000000 / (1024 * 1024) : 0.0);
 
-        device_list = udev_enumerate_get_list_entry(enumerate);
-        udev_list_entry_foreach(device_entry, device_list) {
-                _cleanup_(udev_device_unrefp) struct udev_device *device = NULL;
+        __atomic_add_fetch(&manager->decompressed[blob->compression], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&manager->decompress_stats[blob->compression].in, stats.in, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&manager->decompress_stats[blob->compression].out, stats.out, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&manager->decompress_stats[blob->compression].usec, stats.usec, __ATOMIC_RELAXED);
 
-                device = udev_device_new_from_syspath(manager->udev, udev_list_entry_get_name(device_entry));
-                if (!device)
+        return 0;
+}
+
+/* finds @name in the first form there is, bypassing the cache */
+static int manager_find_any_firmware(Manager *manager, const char *name, FirmwareBlob *blob) {
+        for (Compression c = 0; c < _COMPRESSION_MAX; c++) {
+                _cleanup_free_ char *path = NULL;
+
+                if (!compression_supported(c))
                         continue;
 
-                r = manager_handle_device(manager, device);
-                if (r < 0)
-                        return r;
-        }
+                if (asprintf(&path, "%s%s", name, compression_suffix(c)) < 0)
+                        return -ENOMEM;
 
-        udev_enumerate_unref(enumerate);
-        enumerate = NULL;
+                if (manager_find_firmware(manager, path, blob) >= 0) {
+                        blob->compression = c;
+                        return 0;
+                }
+        }
 
-        for (;;) {
-                struct epoll_event ev;
-                int n;
+        return -ENOENT;
+}
 
-                n = epoll_wait(manager->epollfd, &ev, 1, -1);
-                if (n < 0) {
-                        if (errno == EINTR)
-                                continue;
+/*
+ * Starts reading @name into the page cache, in whatever form it is found.
+ * With @wait, returns once the reads are queued, which keeps them in order.
+ */
+static int manager_prefetch_firmware(Manager *manager, const char *name, bool wait) {
+        _cleanup_(firmware_blob_done) FirmwareBlob blob = { .fd = -1 };
+        struct stat st;
+        int r;
 
-                        return -errno;
-                } else if (n == 0)
-                        continue;
+        r = manager_find_any_firmware(manager, name, &blob);
+        if (r < 0)
+                return r;
 
-                if (ev.data.fd == manager->signalfd &&
-                    ev.events & EPOLLIN) {
-                        struct signalfd_siginfo fdsi;
-                        ssize_t size;
+        if (blob.fd < 0) {
+                uintptr_t page = (uintptr_t)blob.data & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
 
-                        size = read(manager->signalfd, &fdsi, sizeof(fdsi));
-                        if (size != sizeof(fdsi))
-                                continue;
+                madvise((void *)page, (uintptr_t)blob.data + blob.size - page, MADV_WILLNEED);
+                return 0;
+        }
 
-                        if (fdsi.ssi_signo != SIGTERM && fdsi.ssi_signo != SIGINT)
-                                continue;
+        if (fstat(blob.fd, &st) < 0)
+                return -errno;
 
-                        return 0;
-                }
+        if (!wait || readahead(blob.fd, 0, st.st_size) < 0)
+                posix_fadvise(blob.fd, 0, st.st_size, POSIX_FADV_WILLNEED);
 
-                if (ev.data.fd == udev_monitor_get_fd(manager->udev_monitor) &&
-                    ev.events & EPOLLIN) {
-                        for (;;) {
-                                _cleanup_(udev_device_unrefp) struct udev_device *device = NULL;
+        return 0;
+}
 
-                                device = udev_monitor_receive_device(manager->udev_monitor);
-                                if (!device)
-                                        break;
+/* reads ahead what the last boot asked for, in the same order */
+static void *manager_prefetch_thread(void *userdata) {
+        Manager *manager = userdata;
+        uint64_t start = event_now();
+        size_t n = 0, i;
 
-                                if (strcmp(udev_device_get_action(device), "add") &&
-                                    strcmp(udev_device_get_action(device), "move"))
-                                        continue;
+        for (i = 0; i < profile_get_size(manager->replay); i++) {
+                if (__atomic_load_n(&manager->prefetch_stop, __ATOMIC_RELAXED))
+                        break;
 
-                                r = manager_handle_device(manager, device);
-                                if (r < 0)
-                                        return r;
-                        }
-                }
+                if (manager_prefetch_firmware(manager, profile_get_name(manager->replay, i), true) >= 0)
+                        n++;
         }
 
-        return 0;
+        log_info("prefetched %zu of %zu firmware files of the boot profile in %llu us",
+                 n, i, (unsigned long long)(event_now() - start));
+
+        return NULL;
+}
+
+static void manager_speculated_remove(Manager *manager, SpeculatedFirmware *f) {
+        hashmap_remove(manager->speculated, f->name);
+
+        if (f->prev)
+                f->prev->next = f->next;
+        else
+                manager->speculated_oldest = f->next;
+        if (f->next)
+                f->next->prev = f->prev;
+        else
+                manager->speculated_newest = f->prev;
+
+        free(f);
+}
+
+/*
+ * Forgets what was prefetched long ago, or the oldest to make room, as
+ * nobody asked for it; otherwise a full table would end the prefetching.
+ */
+static void manager_speculated_expire(Manager *manager, uint64_t now) {
+        SpeculatedFirmware *f;
+
+        while ((f = manager->speculated_oldest) &&
+               (now - f->usec > MANAGER_SPECULATED_USEC ||
+                hashmap_size(manager->speculated) >= MANAGER_SPECULATED_MAX)) {
+                manager_speculated_remove(manager, f);
+                manager->speculative_wasted++;
+        }
+}
+
+/* warms up the firmware a new device or module is likely to ask for */
+static void manager_speculate_firmware(const char *name, void *userdata) {
+        Manager *manager = userdata;
+        SpeculatedFirmware *f;
+        uint64_t now = event_now();
+
+        if (hashmap_get(manager->speculated, name))
+                return;
+
+        manager_speculated_expire(manager, now);
+
+        f = calloc(1, sizeof(*f));
+        if (!f)
+                return;
+
+        /* the name is owned by the map */
+        f->name = name;
+        f->usec = now;
+
+        if (hashmap_put(manager->speculated, name, f) < 0) {
+                free(f);
+                return;
+        }
+
+        f->prev = manager->speculated_newest;
+        if (f->prev)
+                f->prev->next = f;
+        else
+                manager->speculated_oldest = f;
+        manager->speculated_newest = f;
+
+        if (manager_prefetch_firmware(manager, name, false) < 0) {
+                manager_speculated_remove(manager, f);
+                return;
+        }
+
+        manager->speculative_prefetches++;
+}
+
+/* the firmware request for @name came in; was it seen coming? */
+static void manager_speculate_check(Manager *manager, const char *name) {
+        SpeculatedFirmware *f;
+
+        if (!manager->speculated)
+                return;
+
+        f = hashmap_get(manager->speculated, name);
+        if (f) {
+                manager_speculated_remove(manager, f);
+                manager->speculative_hits++;
+        } else
+                manager->speculative_misses++;
+}
+
+static void manager_handle_speculative_uevent(const Uevent *event, void *userdata) {
+        Manager *manager = userdata;
+        int n = 0;
+
+        /* "/module/<name>", added before the module initializes */
+        if (event->subsystem && !strcmp(event->subsystem, "module"))
+                n = modalias_map_lookup_module(manager->modalias_map, strrchr(event->devpath, '/') + 1,
+                                               manager_speculate_firmware, manager);
+        else if (event->modalias)
+                n = modalias_map_lookup(manager->modalias_map, event->modalias,
+                                        manager_speculate_firmware, manager);
+
+        if (n > 0)
+                manager->speculative_events++;
+}
+
+/* describes the latency of @stage for firmware in size class @c, false if there was none */
+static bool manager_latency_line(Manager *manager, ManagerStage stage, unsigned int c, char *buf, size_t size) {
+        Histogram *h = &manager->latency[stage][c];
+        uint64_t count = histogram_count(h);
+
+        if (count == 0)
+                return false;
+
+        snprintf(buf, size, "%-6s %5s: %llu requests, p50 %llu us, p99 %llu us, max %llu us",
+                 manager_stage_names[stage], manager_size_class_names[c], (unsigned long long)count,
+                 (unsigned long long)histogram_percentile(h, 50),
+                 (unsigned long long)histogram_percentile(h, 99),
+                 (unsigned long long)histogram_max(h));
+        return true;
+}
+
+static void manager_log_stats(Manager *manager) {
+        UeventStats uevent_stats;
+        LogStats log_stats;
+        CacheStats stats;
+        unsigned int n_first;
+
+        uevent_monitor_get_stats(manager->monitor, &uevent_stats);
+        log_info("uevents: %llu emitted, %llu received, %llu relevant, kernel filter %s",
+                 (unsigned long long)uevent_stats.emitted, (unsigned long long)uevent_stats.received,
+                 (unsigned long long)uevent_stats.relevant, uevent_stats.filtered ? "on" : "off");
+        log_info("uevents: %llu overflows, %llu sequence gaps, %llu resyncs, %llu duplicate requests",
+                 (unsigned long long)uevent_stats.overflows, (unsigned long long)uevent_stats.gaps,
+                 (unsigned long long)manager->resyncs,
+                 (unsigned long long)__atomic_load_n(&manager->duplicates, __ATOMIC_RELAXED));
+
+        for (Compression c = 0; c < _COMPRESSION_MAX; c++) {
+                uint64_t n = __atomic_load_n(&manager->decompressed[c], __ATOMIC_RELAXED);
+                uint64_t in = __atomic_load_n(&manager->decompress_stats[c].in, __ATOMIC_RELAXED);
+                uint64_t out = __atomic_load_n(&manager->decompress_stats[c].out, __ATOMIC_RELAXED);
+                uint64_t usec = __atomic_load_n(&manager->decompress_stats[c].usec, __ATOMIC_RELAXED);
+
+                if (n == 0)
+                        continue;
+
+                log_info("%s: %llu requests, %llu -> %llu bytes, %llu us per request, %.1f MiB/s",
+                         compression_to_string(c), (unsigned long long)n,
+                         (unsigned long long)in, (unsigned long long)out, (unsigned long long)(usec / n),
+                         usec ? (double)out / usec * 1000000 / (1024 * 1024) : 0.0);
+        }
+
+        for (TransferStrategy s = 0; s < _TRANSFER_MAX; s++) {
+                TransferStats transfer_stats;
+
+                transfer_get_stats(manager->transfer, s, &transfer_stats);
+                if (transfer_stats.transfers == 0)
+                        continue;
+
+                log_info("%s: %llu transfers, %llu bytes in %llu us, %.1f MiB/s",
+                         transfer_strategy_to_string(s), (unsigned long long)transfer_stats.transfers,
+                         (unsigned long long)transfer_stats.bytes, (unsigned long long)transfer_stats.usec,
+                         transfer_stats.usec ?
+                         (double)transfer_stats.bytes / transfer_stats.usec * 1000000 / (1024 * 1024) : 0.0);
+        }
+
+        if (manager->speculated)
+                log_info("speculative prefetch: %llu events, %llu files, %llu hits, %llu misses, "
+                         "%llu wasted, %zu unused",
+                         (unsigned long long)manager->speculative_events,
+                         (unsigned long long)manager->speculative_prefetches,
+                         (unsigned long long)manager->speculative_hits,
+                         (unsigned long long)manager->speculative_misses,
+                         (unsigned long long)manager->speculative_wasted,
+                         hashmap_size(manager->speculated));
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        if (manager->unresolved_deferred > 0)
+                log_info("tentative: %llu requests deferred, %llu retried, %zu firmware files waited for",
+                         (unsigned long long)manager->unresolved_deferred,
+                         (unsigned long long)manager->unresolved_retried,
+                         hashmap_size(manager->unresolved));
+        for (unsigned int i = 0; i < manager->n_priority_stats; i++) {
+                PriorityStats *p = &manager->priority_stats[i];
+
+                log_info("priority %d: %llu requests, %llu us on average, %llu us at most, %llu starved",
+                         p->priority, (unsigned long long)p->requests,
+                         (unsigned long long)(p->usec / p->requests), (unsigned long long)p->max_usec,
+                         (unsigned long long)p->starved);
+        }
+        if (manager->finalized_found + manager->finalized_cancelled > 0)
+                log_info("final mode: %llu waiting requests found, %llu cancelled",
+                         (unsigned long long)manager->finalized_found,
+                         (unsigned long long)manager->finalized_cancelled);
+        log_info("deadlines: %llu met, %llu missed, %llu dropped, timeout %llu s",
+                 (unsigned long long)manager->deadlines_met, (unsigned long long)manager->deadlines_missed,
+                 (unsigned long long)manager->deadlines_dropped,
+                 (unsigned long long)(manager->timeout_usec / USEC_PER_SEC));
+        if (manager->coldplug_requests > 0 && manager->coldplug_pending == 0)
+                log_info("coldplug: %u requests, scanned in %llu us, drained in %llu us",
+                         manager->coldplug_requests, (unsigned long long)manager->coldplug_scan_usec,
+                         (unsigned long long)manager->coldplug_drain_usec);
+        n_first = manager->n_first;
+        if (n_first > 0)
+                log_info("first %u requests: %llu us on average, %llu us at most",
+                         n_first, (unsigned long long)(manager->first_usec / n_first),
+                         (unsigned long long)manager->first_max_usec);
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        cache_get_stats(manager->cache, &stats);
+        log_info("cache: %zu entries, %zu/%zu bytes, %llu hits, %llu misses, %llu stale, %llu evictions",
+                 stats.entries, stats.size, stats.budget,
+                 (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                 (unsigned long long)stats.stale, (unsigned long long)stats.evictions);
+
+        for (ManagerStage s = 0; s < _MANAGER_STAGE_MAX; s++)
+                for (unsigned int c = 0; c < MANAGER_SIZE_CLASSES; c++) {
+                        char line[LINE_MAX];
+
+                        if (manager_latency_line(manager, s, c, line, sizeof(line)))
+                                log_info("latency %s", line);
+                }
+
+        log_get_stats(&log_stats);
+        log_info("log: %llu messages, %llu suppressed",
+                 (unsigned long long)log_stats.written, (unsigned long long)log_stats.suppressed);
+}
+
+static int manager_save_profile(Manager *manager) {
+        int r;
+
+        r = profile_save(manager->profile, manager->profile_path);
+        if (r < 0)
+                log_error("cannot save boot profile %s: %s", manager->profile_path, strerror(-r));
+
+        return r;
+}
+
+static int manager_on_profile_timer(EventSource *source, uint64_t usec, void *userdata) {
+        manager_save_profile(userdata);
+        return 0;
+}
+
+/* notes @name in this boot's profile, which is saved when things are quiet */
+static int manager_record_profile(Manager *manager, const char *name) {
+        int r;
+
+        if (!manager->profile)
+                return 0;
+
+        r = profile_record(manager->profile, name, event_now() - manager->start_usec);
+        if (r <= 0)
+                return r;
+
+        return event_source_set_time(manager->profile_timer, event_now() + MANAGER_PROFILE_SAVE_DELAY_USEC);
+}
+
+/*
+ * Claims the request for @devpath; returns 0 if it is being handled already.
+ * A device asks only once at a time, but may show up both in an event and a
+ * rescan.
+ */
+static int manager_request_claim(Manager *manager, const char *devpath, const char *name) {
+        InflightRequest *request;
+        int r;
+
+        request = calloc(1, sizeof(*request) + strlen(devpath) + 1 + strlen(name) + 1);
+        if (!request)
+                return -ENOMEM;
+
+        request->start = event_now();
+        strcpy(request->devpath, devpath);
+        request->name = strcpy(request->devpath + strlen(devpath) + 1, name);
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        request->coldplug = manager->coldplugging;
+        r = hashmap_put(manager->inflight, request->devpath, request);
+        if (r >= 0 && request->coldplug) {
+                manager->coldplug_pending++;
+                manager->coldplug_requests++;
+        }
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        if (r < 0) {
+                free(request);
+                if (r != -EEXIST)
+                        return r;
+
+                __atomic_add_fetch(&manager->duplicates, 1, __ATOMIC_RELAXED);
+                return 0;
+        }
+
+        return 1;
+}
+
+/* called under inflight_lock, once the last request of the backlog is done */
+static void manager_coldplug_drained(Manager *manager) {
+        manager->coldplug_drain_usec = event_now() - manager->coldplug_start;
+
+        TRACE2(coldplug_end, manager->coldplug_requests, manager->coldplug_drain_usec);
+
+        log_info("coldplug: %u requests, scanned in %llu us, drained in %llu us",
+                 manager->coldplug_requests, (unsigned long long)manager->coldplug_scan_usec,
+                 (unsigned long long)manager->coldplug_drain_usec);
+}
+
+/* called under inflight_lock */
+static void manager_account_priority(Manager *manager, InflightRequest *request, uint64_t usec) {
+        PriorityStats *stats = NULL;
+
+        for (unsigned int i = 0; i < manager->n_priority_stats; i++)
+                if (manager->priority_stats[i].priority == request->priority) {
+                        stats = &manager->priority_stats[i];
+                        break;
+                }
+
+        if (!stats) {
+                /* the rest are not told apart */
+                if (manager->n_priority_stats == MANAGER_PRIORITY_LEVELS)
+                        return;
+
+                stats = &manager->priority_stats[manager->n_priority_stats++];
+                stats->priority = request->priority;
+        }
+
+        stats->requests++;
+        stats->usec += usec;
+        if (usec > stats->max_usec)
+                stats->max_usec = usec;
+        if (request->starved)
+                stats->starved++;
+}
+
+/* called under inflight_lock; returns whether the dispatcher needs a kick */
+static bool manager_request_undispatch(Manager *manager, InflightRequest *request) {
+        request->dispatched = false;
+        __atomic_sub_fetch(&manager->dispatched, 1, __ATOMIC_SEQ_CST);
+
+        return manager->dispatchfd >= 0 && __atomic_load_n(&manager->queued, __ATOMIC_SEQ_CST) > 0;
+}
+
+static void manager_request_done(Manager *manager, const char *devpath) {
+        InflightRequest *request;
+        uint64_t usec = 0;
+        bool first_done = false, kick = false;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+
+        request = hashmap_remove(manager->inflight, devpath);
+        if (request) {
+                uint64_t now = event_now();
+
+                usec = now - request->start;
+                manager_account_priority(manager, request, usec);
+
+                if (request->dropped)
+                        manager->deadlines_dropped++;
+                else if (request->deadline != UINT64_MAX && now > request->deadline)
+                        manager->deadlines_missed++;
+                else if (request->deadline != UINT64_MAX)
+                        manager->deadlines_met++;
+        }
+        if (request && request->dispatched)
+                kick = manager_request_undispatch(manager, request);
+        if (request && request->coldplug && --manager->coldplug_pending == 0 && !manager->coldplugging)
+                manager_coldplug_drained(manager);
+        if (request && manager->n_first < MANAGER_FIRST_REQUESTS) {
+                manager->first_usec += usec;
+                if (usec > manager->first_max_usec)
+                        manager->first_max_usec = usec;
+                first_done = ++manager->n_first == MANAGER_FIRST_REQUESTS;
+        }
+
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        if (kick)
+                eventfd_write(manager->dispatchfd, 1);
+
+        if (first_done)
+                log_info("first %u requests: %llu us on average, %llu us at most, boot profile %s",
+                         MANAGER_FIRST_REQUESTS,
+                         (unsigned long long)(manager->first_usec / MANAGER_FIRST_REQUESTS),
+                         (unsigned long long)manager->first_max_usec,
+                         manager->replay && profile_get_size(manager->replay) > 0 ? "replayed" : "not replayed");
+
+        free(request);
+}
+
+/*
+ * Notes that @request is about to be handed to io_uring, and returns the
+ * devpath owned by the table, which outlives the request.
+ */
+static const char *manager_request_upload(Manager *manager, Request *request, uint64_t size) {
+        InflightRequest *inflight;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        inflight = hashmap_get(manager->inflight, request->devpath);
+        if (inflight) {
+                inflight->received = request->received;
+                inflight->size = size;
+        }
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        return inflight ? inflight->devpath : NULL;
+}
+
+static unsigned int manager_size_class(uint64_t size) {
+        unsigned int c = 0;
+
+        while (size >= manager_size_class_max[c])
+                c++;
+
+        return c;
+}
+
+/*
+ * Counts how long a request of @size bytes took from when it was @received
+ * through each stage, as given by when it got to the end of it in @ends, up
+ * to the first it did not get through.
+ */
+static void manager_account_latency(Manager *manager, uint64_t size, uint64_t received,
+                                    const uint64_t ends[MANAGER_STAGE_TOTAL]) {
+        unsigned int c = manager_size_class(size);
+        uint64_t last = received;
+
+        for (ManagerStage s = 0; s < MANAGER_STAGE_TOTAL; s++) {
+                if (ends[s] == 0)
+                        return;
+
+                histogram_add(&manager->latency[s][c], ends[s] > last ? ends[s] - last : 0);
+                last = ends[s];
+        }
+
+        histogram_add(&manager->latency[MANAGER_STAGE_TOTAL][c], last - received);
+}
+
+/* counts an upload of @name, handed to io_uring or done */
+static void manager_account_served(Manager *manager, const char *name, uint64_t bytes) {
+        ServedFirmware *f;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+
+        f = hashmap_get(manager->served, name);
+        if (!f) {
+                f = calloc(1, sizeof(*f) + strlen(name) + 1);
+                if (!f || hashmap_put(manager->served, strcpy(f->name, name), f) < 0) {
+                        free(f);
+                        f = NULL;
+                }
+        }
+
+        if (f) {
+                f->requests++;
+                f->bytes += bytes;
+        }
+
+        pthread_mutex_unlock(&manager->inflight_lock);
+}
+
+/* the upload of a request handed to io_uring is over; only its total latency is known */
+static void manager_upload_done(void *cookie, int error, void *userdata) {
+        Manager *manager = userdata;
+        InflightRequest *request;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        request = hashmap_get(manager->inflight, cookie);
+        if (request && error >= 0)
+                histogram_add(&manager->latency[MANAGER_STAGE_TOTAL][manager_size_class(request->size)],
+                              event_now() - request->received);
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        manager_request_done(manager, cookie);
+}
+
+/*
+ * Returns 1 if the upload was queued to io_uring, and the request is only
+ * done once that completes; -ENOENT if, in tentative mode, there is no such
+ * firmware yet.
+ */
+static int manager_load_firmware(Manager *manager, Request *request) {
+        _cleanup_(closep) int devicefd = -1;
+        _cleanup_(firmware_blob_done) FirmwareBlob blob = { .fd = -1 };
+        bool tentative = manager_is_tentative(manager);
+        uint64_t handled = event_now(), found;
+        FirmwareTimes times = {};
+        int r;
+
+        devicefd = openat(manager->sysfd, request->devpath + strspn(request->devpath, "/"), O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (devicefd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        r = manager_open_firmware(manager, request->name, &blob);
+        found = event_now();
+        if (r >= 0) {
+                uint64_t size = firmware_blob_size(&blob);
+
+                log_info("load firmware %s", request->name);
+                /* io_uring only copies, so compressed blobs are streamed in here, on the worker */
+                if (blob.compression != COMPRESSION_NONE)
+                        r = manager_load_compressed(manager, devicefd, request->devpath, &blob, request->name,
+                                                    &times);
+                else if (manager->uring) {
+                        r = firmware_uring_load(manager->uring, devicefd, request->devpath, blob.fd, blob.data,
+                                                blob.size, tentative,
+                                                (void *)manager_request_upload(manager, request, size));
+                        if (r > 0) {
+                                /* started by the event loop, along with the others */
+                                if (manager->dispatchfd >= 0)
+                                        eventfd_write(manager->dispatchfd, 1);
+                                manager_account_served(manager, request->name, size);
+                                manager_account_latency(manager, size, request->received,
+                                                        (uint64_t[MANAGER_STAGE_TOTAL]) { handled, found });
+                                return 1;
+                        }
+                } else if (blob.fd >= 0)
+                        r = firmware_load(devicefd, request->devpath, blob.fd, blob.fs_type, manager->transfer,
+                                          tentative, &times);
+                else
+                        r = firmware_load_data(devicefd, request->devpath, blob.data, blob.size, tentative,
+                                               &times);
+                if (r < 0)
+                        return r;
+
+                manager_account_served(manager, request->name, size);
+                manager_account_latency(manager, size, request->received,
+                                        (uint64_t[MANAGER_STAGE_TOTAL]) {
+                                                handled, found, times.loading, times.written, times.done,
+                                        });
+        } else if (tentative) {
+                if (r == -ENOENT)
+                        return r;
+        } else {
+                log_info("cancel firmware load %s", request->name);
+                r = firmware_cancel_load(devicefd, request->devpath);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+/*
+ * Parks a tentative @request until its firmware shows up, and returns 1. If
+ * the index changed since @generation, the lookup may have missed the file,
+ * and if tentative mode was left meanwhile, nobody would retry it; then
+ * returns 0, and the request is to be looked up again.
+ */
+static int manager_request_defer(Manager *manager, Request *request, unsigned int generation) {
+        _cleanup_(request_freep) Request *copy = NULL;
+        UnresolvedFirmware *f;
+        InflightRequest *inflight;
+        Request **requests;
+        bool kick = false;
+        int r;
+
+        /* the worker frees the one it was handed */
+        r = request_new(&copy, request->devpath, request->name);
+        if (r < 0)
+                return r;
+
+        copy->priority = request->priority;
+        copy->deadline = request->deadline;
+        copy->received = request->received;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+
+        if (manager->index_generation != generation || !manager->tentative) {
+                r = 0;
+                goto finish;
+        }
+
+        f = hashmap_get(manager->unresolved, request->name);
+        if (!f) {
+                f = calloc(1, sizeof(*f) + strlen(request->name) + 1);
+                if (!f) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+
+                strcpy(f->name, request->name);
+
+                r = hashmap_put(manager->unresolved, f->name, f);
+                if (r < 0) {
+                        free(f);
+                        goto finish;
+                }
+        }
+
+        requests = realloc(f->requests, (f->n_requests + 1) * sizeof(Request *));
+        if (!requests) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        f->requests = requests;
+        f->requests[f->n_requests++] = copy;
+        copy = NULL;
+        manager->unresolved_deferred++;
+
+        /* it no longer takes up a slot, nor holds up the backlog */
+        inflight = hashmap_get(manager->inflight, request->devpath);
+        if (inflight)
+                inflight->waiting = true;
+        if (inflight && inflight->dispatched)
+                kick = manager_request_undispatch(manager, inflight);
+        if (inflight && inflight->coldplug) {
+                inflight->coldplug = false;
+                if (--manager->coldplug_pending == 0 && !manager->coldplugging)
+                        manager_coldplug_drained(manager);
+        }
+
+        r = 1;
+
+finish:
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        if (kick)
+                eventfd_write(manager->dispatchfd, 1);
+
+        if (r > 0)
+                log_info("firmware %s for %s not found yet, waiting for it", request->name, request->devpath);
+
+        return r;
+}
+
+/* runs on a worker thread, or inline without workers */
+static void manager_handle_request(Request *request, void *userdata) {
+        Manager *manager = userdata;
+        int r;
+
+        TRACE2(request_start, request->devpath, request->name);
+
+        for (;;) {
+                unsigned int generation = __atomic_load_n(&manager->index_generation, __ATOMIC_SEQ_CST);
+
+                r = manager_load_firmware(manager, request);
+                if (r != -ENOENT)
+                        break;
+
+                r = manager_request_defer(manager, request, generation);
+                if (r != 0)
+                        break;
+        }
+
+        TRACE3(request_end, request->devpath, request->name, r);
+
+        if (r < 0)
+                log_error("firmware %s for %s: %s", request->name, request->devpath, strerror(-r));
+        if (r != 1)
+                manager_request_done(manager, request->devpath);
+}
+
+/* the subsystem of the device asking, from the "device" link of the request */
+static const char *manager_request_subsystem(Manager *manager, const char *devpath, char *buf, size_t size) {
+        _cleanup_free_ char *path = NULL;
+        const char *subsystem;
+        ssize_t n;
+
+        if (asprintf(&path, "%s/device/subsystem", devpath + strspn(devpath, "/")) < 0)
+                return NULL;
+
+        n = readlinkat(manager->sysfd, path, buf, size - 1);
+        if (n < 0)
+                return NULL;
+        buf[n] = '\0';
+
+        subsystem = strrchr(buf, '/');
+        return subsystem ? subsystem + 1 : buf;
+}
+
+/*
+ * The size of @name as stored, or 0 if it is missing, which is quick to
+ * handle. This runs on the event loop for every request, so it goes by the
+ * cache and the index, and stats the file at most, in the order
+ * manager_open_firmware() looks; without opening anything.
+ */
+static uint64_t manager_firmware_size(Manager *manager, const char *name) {
+        for (Compression c = 0; c < _COMPRESSION_MAX; c++) {
+                _cleanup_free_ char *path = NULL;
+                unsigned int slot = 2 * firmware_dirs_size;
+                const void *data;
+                struct stat st;
+                uint64_t size;
+                size_t packed;
+                bool found;
+
+                if (!compression_supported(c))
+                        continue;
+
+                if (asprintf(&path, "%s%s", name, compression_suffix(c)) < 0)
+                        return 0;
+
+                if (cache_peek_size(manager->cache, path, &size) >= 0)
+                        return size;
+
+                found = index_stat(manager->index, path, &slot, &st) >= 0;
+
+                for (unsigned int i = 0; i < slot; i++)
+                        if (manager->firmwarepacks[i] &&
+                            pack_find(manager->firmwarepacks[i], path, &data, &packed) >= 0)
+                                return packed;
+
+                if (found)
+                        return st.st_size;
+        }
+
+        return 0;
+}
+
+/*
+ * The kernel times the request out after the TIMEOUT it announced, or the
+ * one in /sys/class/firmware/timeout; 0 means never. Requests found by a
+ * scan were made earlier than we can tell, so their deadline is a guess on
+ * the late side.
+ */
+static uint64_t manager_request_deadline(Manager *manager, const char *timeout) {
+        uint64_t usec = manager->timeout_usec;
+
+        if (timeout) {
+                unsigned long sec;
+                char *end;
+
+                errno = 0;
+                sec = strtoul(timeout, &end, 10);
+                if (errno == 0 && end != timeout && *end == '\0')
+                        usec = sec * USEC_PER_SEC;
+        }
+
+        if (usec == 0)
+                return UINT64_MAX;
+
+        return manager->arrival_usec + usec;
+}
+
+/* picks up changes to the fallback timeout */
+static void manager_read_timeout(Manager *manager) {
+        _cleanup_close_ int fd = -1;
+        char buf[32];
+        ssize_t n;
+        long sec;
+
+        fd = openat(manager->sysfd, "class/firmware/timeout", O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return;
+
+        n = read(fd, buf, sizeof(buf) - 1);
+        if (n <= 0)
+                return;
+        buf[n] = '\0';
+
+        sec = strtol(buf, NULL, 10);
+        manager->timeout_usec = sec > 0 ? (uint64_t)sec * USEC_PER_SEC : 0;
+}
+
+/* sets where @request goes in the queue */
+static void manager_rank_request(Manager *manager, Request *request, const char *timeout) {
+        InflightRequest *inflight;
+
+        if (manager->rules) {
+                const char *subsystem = NULL;
+                char buf[PATH_MAX];
+
+                if (priority_rules_need_subsystem(manager->rules))
+                        subsystem = manager_request_subsystem(manager, request->devpath, buf, sizeof(buf));
+
+                request->priority = priority_rules_lookup(manager->rules, request->name, subsystem);
+        }
+
+        request->size = manager_firmware_size(manager, request->name);
+        request->deadline = manager_request_deadline(manager, timeout);
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        inflight = hashmap_get(manager->inflight, request->devpath);
+        if (inflight) {
+                inflight->priority = request->priority;
+                inflight->deadline = request->deadline;
+        }
+        pthread_mutex_unlock(&manager->inflight_lock);
+}
+
+/*
+ * Whether the kernel gave up on @request already: once it timed out, the
+ * device is gone, and "loading" with it.
+ */
+static bool manager_request_gone(Manager *manager, Request *request) {
+        _cleanup_free_ char *path = NULL;
+
+        if (asprintf(&path, "%s/loading", request->devpath + strspn(request->devpath, "/")) < 0)
+                return false;
+
+        return faccessat(manager->sysfd, path, W_OK, 0) < 0 && errno != ENOMEM;
+}
+
+static void manager_request_drop(Manager *manager, Request *request) {
+        InflightRequest *inflight;
+
+        log_info("dropping firmware request %s for %s, the device is gone", request->name, request->devpath);
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        inflight = hashmap_get(manager->inflight, request->devpath);
+        if (inflight)
+                inflight->dropped = true;
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        manager_request_done(manager, request->devpath);
+}
+
+/* marks the request for @devpath as handed over */
+static void manager_request_dispatched(Manager *manager, const char *devpath, bool starved) {
+        InflightRequest *request;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        request = hashmap_get(manager->inflight, devpath);
+        if (request) {
+                request->dispatched = true;
+                request->starved = starved;
+        }
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        __atomic_add_fetch(&manager->dispatched, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Hands queued requests to the workers, or to io_uring, for as long as they
+ * can start them right away; handling them inline, without either. Whatever
+ * is left stays in the queue, so a late request can still overtake it.
+ */
+static int manager_dispatch(Manager *manager) {
+        while (__atomic_load_n(&manager->dispatched, __ATOMIC_SEQ_CST) < manager->capacity) {
+                _cleanup_(request_freep) Request *request = NULL;
+                bool starved;
+                int r;
+
+                request = request_queue_pop(manager->queue, event_now(), &starved);
+                if (!request)
+                        break;
+
+                __atomic_store_n(&manager->queued, request_queue_size(manager->queue), __ATOMIC_SEQ_CST);
+
+                /* no need to look it up, or to wait for a slot */
+                if (manager_request_gone(manager, request)) {
+                        manager_request_drop(manager, request);
+                        continue;
+                }
+
+                manager_request_dispatched(manager, request->devpath, starved);
+
+                if (!manager->workers) {
+                        manager_handle_request(request, manager);
+                        continue;
+                }
+
+                r = worker_pool_submit(manager->workers, request);
+                if (r < 0) {
+                        manager_request_done(manager, request->devpath);
+                        return r;
+                }
+
+                request = NULL;
+        }
+
+        return 0;
+}
+
+static int manager_handle_device(Manager *manager, const char *devpath, const char *name, const char *timeout) {
+        _cleanup_(request_freep) Request *request = NULL;
+        int r;
+
+        r = request_new(&request, devpath, name);
+        if (r == -EINVAL) {
+                log_warn("ignoring firmware request without firmware name");
+                return 0;
+        } else if (r < 0)
+                return r;
+
+        request->received = manager->arrival_usec;
+
+        r = manager_request_claim(manager, devpath, name);
+        if (r <= 0)
+                return r;
+
+        r = manager_record_profile(manager, name);
+        if (r < 0)
+                log_warn("cannot record %s in the boot profile: %s", name, strerror(-r));
+
+        manager_speculate_check(manager, name);
+
+        manager_rank_request(manager, request, timeout);
+
+        r = request_queue_push(manager->queue, request, event_now());
+        if (r < 0) {
+                manager_request_done(manager, devpath);
+                return r;
+        }
+
+        __atomic_store_n(&manager->queued, request_queue_size(manager->queue), __ATOMIC_SEQ_CST);
+
+        request = NULL;
+        return 0;
+}
+
+/* hands a parked request back to the queue */
+static void manager_requeue(Manager *manager, Request *request) {
+        InflightRequest *inflight;
+        int r;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        inflight = hashmap_get(manager->inflight, request->devpath);
+        if (inflight)
+                inflight->waiting = false;
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        request->size = manager_firmware_size(manager, request->name);
+
+        r = request_queue_push(manager->queue, request, event_now());
+        if (r < 0) {
+                log_error("firmware request for %s: %s", request->devpath, strerror(-r));
+                manager_request_done(manager, request->devpath);
+                request_free(request);
+                return;
+        }
+
+        __atomic_store_n(&manager->queued, request_queue_size(manager->queue), __ATOMIC_SEQ_CST);
+}
+
+/* queues the tentative requests whose firmware may have shown up */
+static void manager_retry_unresolved(Manager *manager) {
+        UnresolvedFirmware *f, *ready = NULL, *next;
+        HashmapIterator i;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        if (manager->unresolved_ready) {
+                HASHMAP_FOREACH(f, manager->unresolved, i) {
+                        if (!f->ready)
+                                continue;
+
+                        hashmap_remove(manager->unresolved, f->name);
+                        manager->unresolved_retried += f->n_requests;
+                        f->next = ready;
+                        ready = f;
+                }
+                manager->unresolved_ready = false;
+        }
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        for (f = ready; f; f = next) {
+                next = f->next;
+
+                log_info("firmware %s changed, retrying %zu waiting requests", f->name, f->n_requests);
+                for (size_t j = 0; j < f->n_requests; j++)
+                        manager_requeue(manager, f->requests[j]);
+
+                free(f->requests);
+                free(f);
+        }
+}
+
+/* tells the device there is no firmware for the parked @request, and retires it */
+static void manager_cancel_request(Manager *manager, Request *request) {
+        _cleanup_(closep) int devicefd = -1;
+        int r = 0;
+
+        devicefd = openat(manager->sysfd, request->devpath + strspn(request->devpath, "/"), O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (devicefd >= 0) {
+                log_info("cancel firmware load %s", request->name);
+                r = firmware_cancel_load(devicefd, request->devpath);
+        } else if (errno != ENOENT)
+                r = -errno;
+
+        if (r < 0)
+                log_error("firmware %s for %s: %s", request->name, request->devpath, strerror(-r));
+
+        manager_request_done(manager, request->devpath);
+}
+
+/*
+ * Leaves tentative mode, as no more firmware is going to show up. Requests
+ * still waiting get one last lookup: those whose firmware is there now are
+ * queued, and the rest are cancelled in one go, so their devices fail right
+ * away instead of at the timeout. Requests handled later on are cancelled as
+ * in final mode.
+ */
+int manager_finalize(Manager *manager) {
+        UnresolvedFirmware *f, *parked = NULL, *next;
+        unsigned int found_requests = 0, cancelled = 0;
+        HashmapIterator i;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        if (!manager->tentative) {
+                pthread_mutex_unlock(&manager->inflight_lock);
+                return 0;
+        }
+
+        __atomic_store_n(&manager->tentative, false, __ATOMIC_SEQ_CST);
+
+        HASHMAP_FOREACH(f, manager->unresolved, i) {
+                hashmap_remove(manager->unresolved, f->name);
+                f->next = parked;
+                parked = f;
+        }
+        manager->unresolved_ready = false;
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        for (f = parked; f; f = next) {
+                _cleanup_(firmware_blob_done) FirmwareBlob blob = { .fd = -1 };
+                bool found;
+
+                next = f->next;
+                found = manager_find_any_firmware(manager, f->name, &blob) >= 0;
+
+                for (size_t j = 0; j < f->n_requests; j++) {
+                        if (found) {
+                                manager_requeue(manager, f->requests[j]);
+                                found_requests++;
+                                continue;
+                        }
+
+                        manager_cancel_request(manager, f->requests[j]);
+                        request_free(f->requests[j]);
+                        cancelled++;
+                }
+
+                free(f->requests);
+                free(f);
+        }
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        manager->finalized_found += found_requests;
+        manager->finalized_cancelled += cancelled;
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        log_info("left tentative mode: %u waiting requests found, %u cancelled", found_requests, cancelled);
+
+        return 0;
+}
+
+/* the kernel gave up on the request for @devpath, which may be parked */
+static void manager_forget_unresolved(Manager *manager, const char *devpath) {
+        _cleanup_(request_freep) Request *request = NULL;
+        UnresolvedFirmware *f;
+        HashmapIterator i;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        HASHMAP_FOREACH(f, manager->unresolved, i) {
+                for (size_t j = 0; j < f->n_requests; j++) {
+                        if (strcmp(f->requests[j]->devpath, devpath))
+                                continue;
+
+                        request = f->requests[j];
+                        f->requests[j] = f->requests[--f->n_requests];
+                        break;
+                }
+
+                if (!request)
+                        continue;
+
+                if (f->n_requests == 0) {
+                        hashmap_remove(manager->unresolved, f->name);
+                        free(f->requests);
+                        free(f);
+                }
+                break;
+        }
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        if (request)
+                manager_request_drop(manager, request);
+}
+
+static void manager_handle_uevent(const Uevent *event, void *userdata) {
+        Manager *manager = userdata;
+        int r;
+
+        TRACE3(uevent, event->action, event->devpath, event->firmware);
+
+        if (!strcmp(event->action, "remove")) {
+                manager_forget_unresolved(manager, event->devpath);
+                return;
+        }
+
+        if (strcmp(event->action, "add") && strcmp(event->action, "move"))
+                return;
+
+        r = manager_handle_device(manager, event->devpath, event->firmware, event->timeout);
+        if (r < 0)
+                log_error("firmware request for %s: %s", event->devpath, strerror(-r));
+}
+
+static int manager_on_signal(EventSource *source, int fd, uint32_t events, void *userdata) {
+        Manager *manager = userdata;
+        struct signalfd_siginfo fdsi;
+
+        if (read(fd, &fdsi, sizeof(fdsi)) != sizeof(fdsi))
+                return 0;
+
+        switch (fdsi.ssi_signo) {
+        case SIGUSR1:
+                manager_log_stats(manager);
+                break;
+        case SIGUSR2:
+                manager_finalize(manager);
+                break;
+        case SIGTERM:
+        case SIGINT:
+                event_loop_exit(manager->event, 0);
+                break;
+        }
+
+        return 0;
+}
+
+/* picks up the requests whose events were lost */
+static int manager_on_resync(EventSource *source, uint64_t usec, void *userdata) {
+        Manager *manager = userdata;
+
+        log_info("rescanning firmware requests after lost uevents");
+        manager->resyncs++;
+
+        manager_read_timeout(manager);
+        manager->arrival_usec = event_now();
+
+        return uevent_enumerate(manager->sysfd, "firmware", manager_handle_uevent, manager);
+}
+
+static int manager_on_uevent(EventSource *source, int fd, uint32_t events, void *userdata) {
+        Manager *manager = userdata;
+        int r;
+
+        /* a batch counts as arrived at once, so its requests are ranked by size */
+        manager->arrival_usec = event_now();
+
+        r = uevent_monitor_receive(manager->monitor, manager_handle_uevent, manager);
+        if (r <= 0)
+                return r;
+
+        if (event_source_get_time(manager->resync_timer) > 0)
+                return 0;
+
+        return event_source_set_time(manager->resync_timer, event_now() + MANAGER_RESYNC_DELAY_USEC);
+}
+
+static int manager_on_speculative_uevent(EventSource *source, int fd, uint32_t events, void *userdata) {
+        Manager *manager = userdata;
+        int r;
+
+        /* losing some only costs a prefetch */
+        r = uevent_monitor_receive(manager->speculative_monitor, manager_handle_speculative_uevent, manager);
+
+        return r < 0 ? r : 0;
+}
+
+static int manager_on_index(EventSource *source, int fd, uint32_t events, void *userdata) {
+        Manager *manager = userdata;
+        int r;
+
+        r = index_process(manager->index);
+
+        /* dispatched along with the rest of the batch */
+        manager_retry_unresolved(manager);
+
+        return r;
+}
+
+/* a firmware dir may have been mounted, or mounted over */
+static int manager_on_mount(EventSource *source, int fd, uint32_t events, void *userdata) {
+        Manager *manager = userdata;
+
+        if (index_refresh(manager->index) > 0)
+                manager_retry_unresolved(manager);
+
+        return 0;
+}
+
+static int manager_on_uring(EventSource *source, int fd, uint32_t events, void *userdata) {
+        Manager *manager = userdata;
+
+        return firmware_uring_process(manager->uring);
+}
+
+/*
+ * Once a batch of events is in, starts the queued requests there is room
+ * for, in order, and hands the uploads this queued to io_uring in one go.
+ */
+static int manager_prepare(EventSource *source, void *userdata) {
+        Manager *manager = userdata;
+        int r;
+
+        r = manager_dispatch(manager);
+        if (r < 0)
+                return r;
+
+        if (!manager->uring)
+                return 0;
+
+        return firmware_uring_submit(manager->uring);
+}
+
+/* a worker is done, and requests are waiting, or it queued an upload to io_uring */
+static int manager_on_dispatch(EventSource *source, int fd, uint32_t events, void *userdata) {
+        eventfd_t v;
+
+        eventfd_read(fd, &v);
+        return 0;
+}
+
+/* the search path in lookup order, and how each entry is looked up */
+static void manager_control_paths(Manager *manager, FILE *out) {
+        for (unsigned int i = 0; i < 2 * firmware_dirs_size; i++)
+                fprintf(out, "%-8s %s\n",
+                        manager->firmwarepacks[i] ? "pack" : index_get_slot_state(manager->index, i),
+                        manager->firmwaredirpaths[i]);
+}
+
+static void manager_control_requests(Manager *manager, FILE *out) {
+        InflightRequest *request;
+        HashmapIterator i;
+        uint64_t now = event_now();
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        HASHMAP_FOREACH(request, manager->inflight, i)
+                fprintf(out, "%8llu ms %-8s %4d %s %s\n",
+                        (unsigned long long)((now - request->start) / USEC_PER_MSEC),
+                        request->waiting ? "waiting" : request->dispatched ? "loading" : "queued",
+                        request->priority, request->name, request->devpath);
+        pthread_mutex_unlock(&manager->inflight_lock);
+}
+
+static void manager_control_firmware(Manager *manager, FILE *out) {
+        ServedFirmware *f;
+        HashmapIterator i;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        HASHMAP_FOREACH(f, manager->served, i)
+                fprintf(out, "%8llu %12llu %s\n",
+                        (unsigned long long)f->requests, (unsigned long long)f->bytes, f->name);
+        pthread_mutex_unlock(&manager->inflight_lock);
+}
+
+static void manager_control_latency(Manager *manager, FILE *out) {
+        for (ManagerStage s = 0; s < _MANAGER_STAGE_MAX; s++)
+                for (unsigned int c = 0; c < MANAGER_SIZE_CLASSES; c++) {
+                        char line[LINE_MAX];
+
+                        if (manager_latency_line(manager, s, c, line, sizeof(line)))
+                                fprintf(out, "%s\n", line);
+                }
+}
+
+static void manager_control_status(Manager *manager, FILE *out) {
+        InflightRequest *request;
+        HashmapIterator i;
+        CacheStats stats;
+        size_t n = 0, waiting = 0;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        HASHMAP_FOREACH(request, manager->inflight, i) {
+                n++;
+                if (request->waiting)
+                        waiting++;
+        }
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        cache_get_stats(manager->cache, &stats);
+
+        fprintf(out, "mode: %s\n", manager_is_tentative(manager) ? "tentative" : "final");
+        fprintf(out, "uptime: %llu s\n", (unsigned long long)((event_now() - manager->start_usec) / USEC_PER_SEC));
+        fprintf(out, "requests: %zu in flight, %zu queued, %zu waiting for firmware\n",
+                n, request_queue_size(manager->queue), waiting);
+        fprintf(out, "cache: %zu entries, %zu/%zu bytes, %llu hits, %llu misses\n",
+                stats.entries, stats.size, stats.budget,
+                (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+        fprintf(out, "log level: %s\n", log_level_to_string(__atomic_load_n(&log_max_level, __ATOMIC_RELAXED)));
+}
+
+/* looks up the waiting requests again, and rescans for requests whose events were lost */
+static void manager_control_retry(Manager *manager, FILE *out) {
+        UnresolvedFirmware *f;
+        HashmapIterator i;
+        size_t n = 0;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        HASHMAP_FOREACH(f, manager->unresolved, i)
+                n += f->n_requests;
+        manager_unresolved_mark(manager, NULL);
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        manager_retry_unresolved(manager);
+
+        manager_read_timeout(manager);
+        manager->arrival_usec = event_now();
+        uevent_enumerate(manager->sysfd, "firmware", manager_handle_uevent, manager);
+
+        fprintf(out, "retrying %zu waiting requests\n", n);
+}
+
+static bool control_command_is(const char *command, size_t n, const char *name) {
+        return strlen(name) == n && !strncmp(command, name, n);
+}
+
+/* runs on the event loop, like everything else touching the queue */
+static int manager_on_control(const char *command, FILE *out, void *userdata) {
+        Manager *manager = userdata;
+        const char *arg;
+        size_t n;
+
+        n = strcspn(command, " \t");
+        arg = command + n + strspn(command + n, " \t");
+
+        if (control_command_is(command, n, "status"))
+                manager_control_status(manager, out);
+        else if (control_command_is(command, n, "requests"))
+                manager_control_requests(manager, out);
+        else if (control_command_is(command, n, "firmware"))
+                manager_control_firmware(manager, out);
+        else if (control_command_is(command, n, "paths"))
+                manager_control_paths(manager, out);
+        else if (control_command_is(command, n, "latency"))
+                manager_control_latency(manager, out);
+        else if (control_command_is(command, n, "flush")) {
+                CacheStats stats;
+
+                cache_get_stats(manager->cache, &stats);
+                cache_flush(manager->cache);
+                fprintf(out, "flushed %zu entries, %zu bytes\n", stats.entries, stats.size);
+        } else if (control_command_is(command, n, "retry"))
+                manager_control_retry(manager, out);
+        else if (control_command_is(command, n, "log-level")) {
+                int level;
+
+                if (*arg) {
+                        level = log_level_from_string(arg);
+                        if (level < 0)
+                                return level;
+
+                        __atomic_store_n(&log_max_level, level, __ATOMIC_RELAXED);
+                }
+
+                fprintf(out, "%s\n", log_level_to_string(__atomic_load_n(&log_max_level, __ATOMIC_RELAXED)));
+        } else if (control_command_is(command, n, "final")) {
+                manager_finalize(manager);
+                fprintf(out, "final mode\n");
+        } else if (control_command_is(command, n, "help"))
+                fprintf(out,
+                        "status              mode, request and cache counts\n"
+                        "requests            requests being handled, with their age\n"
+                        "firmware            uploads and bytes served per firmware\n"
+                        "paths               the search path, and how it is looked up\n"
+                        "latency             p50, p99 and max per request stage and firmware size\n"
+                        "flush               empty the firmware cache\n"
+                        "retry               look up waiting requests again\n"
+                        "log-level [LEVEL]   show or set: error, warning, info, debug\n"
+                        "final               leave tentative mode\n");
+        else
+                fprintf(out, "error: unknown command '%.*s', try 'help'\n", (int)n, command);
+
+        return 0;
+}
+
+/*
+ * Signals go first; within a batch, finished uploads and directory changes
+ * are taken in before new requests are looked up.
+ */
+static int manager_add_sources(Manager *m) {
+        int r;
+
+        r = event_add_io(m->event, &m->signal_source, m->signalfd, EPOLLIN, EVENT_PRIORITY_HIGH,
+                         manager_on_signal, m);
+        if (r < 0)
+                return r;
+
+        /* without inotify, the index falls back to probing every directory */
+        if (index_get_fd(m->index) >= 0) {
+                r = event_add_io(m->event, &m->index_source, index_get_fd(m->index), EPOLLIN,
+                                 EVENT_PRIORITY_NORMAL, manager_on_index, m);
+                if (r < 0)
+                        return r;
+        }
+
+        /* signalled with POLLPRI, while it always polls readable */
+        if (m->mountinfofd >= 0) {
+                r = event_add_io(m->event, &m->mount_source, m->mountinfofd, EPOLLPRI,
+                                 EVENT_PRIORITY_NORMAL, manager_on_mount, m);
+                if (r < 0)
+                        return r;
+        }
+
+        if (m->uring) {
+                r = event_add_io(m->event, &m->uring_source, firmware_uring_get_fd(m->uring), EPOLLIN,
+                                 EVENT_PRIORITY_NORMAL, manager_on_uring, m);
+                if (r < 0)
+                        return r;
+        }
+
+        if (m->dispatchfd >= 0) {
+                r = event_add_io(m->event, &m->dispatch_source, m->dispatchfd, EPOLLIN, EVENT_PRIORITY_NORMAL,
+                                 manager_on_dispatch, m);
+                if (r < 0)
+                        return r;
+        }
+
+        r = event_add_prepare(m->event, &m->prepare, manager_prepare, m);
+        if (r < 0)
+                return r;
+
+        r = event_add_time(m->event, &m->resync_timer, 0, EVENT_PRIORITY_LOW, manager_on_resync, m);
+        if (r < 0)
+                return r;
+
+        r = event_add_time(m->event, &m->profile_timer, 0, EVENT_PRIORITY_LOW, manager_on_profile_timer, m);
+        if (r < 0)
+                return r;
+
+        if (m->speculative_monitor) {
+                r = event_add_io(m->event, &m->speculative_source, uevent_monitor_get_fd(m->speculative_monitor),
+                                 EPOLLIN, EVENT_PRIORITY_LOW, manager_on_speculative_uevent, m);
+                if (r < 0)
+                        return r;
+        }
+
+        return event_add_io(m->event, &m->monitor_source, uevent_monitor_get_fd(m->monitor), EPOLLIN,
+                            EVENT_PRIORITY_LOW, manager_on_uevent, m);
+}
+
+/*
+ * Picks up the requests that were waiting before we started. All of them
+ * are handed to the workers, or queued to io_uring, as the class directory
+ * is read; the backlog is drained when the last of them is done.
+ */
+static int manager_coldplug(Manager *manager) {
+        int r;
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        manager->coldplugging = true;
+        manager->coldplug_start = event_now();
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        manager_read_timeout(manager);
+        manager->arrival_usec = manager->coldplug_start;
+
+        TRACE(coldplug_begin);
+        r = uevent_enumerate(manager->sysfd, "firmware", manager_handle_uevent, manager);
+
+        pthread_mutex_lock(&manager->inflight_lock);
+        manager->coldplugging = false;
+        manager->coldplug_scan_usec = event_now() - manager->coldplug_start;
+        TRACE2(coldplug_scanned, manager->coldplug_requests, manager->coldplug_scan_usec);
+        if (manager->coldplug_requests > 0 && manager->coldplug_pending == 0)
+                manager_coldplug_drained(manager);
+        else if (manager->coldplug_requests == 0)
+                TRACE2(coldplug_end, 0, manager->coldplug_scan_usec);
+        pthread_mutex_unlock(&manager->inflight_lock);
+
+        return r;
+}
+
+int manager_run(Manager *manager) {
+        int r;
+
+        if (manager->replay && profile_get_size(manager->replay) > 0) {
+                r = pthread_create(&manager->prefetch_thread, NULL, manager_prefetch_thread, manager);
+                if (r > 0)
+                        log_warn("cannot prefetch the boot profile: %s", strerror(r));
+                else
+                        manager->prefetching = true;
+        }
+
+        r = manager_coldplug(manager);
+        if (r < 0)
+                return r;
+
+        return event_loop_run(manager->event);
 }
@@ -1,15 +1,43 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
-#define _cleanup_(_x) __attribute__((__cleanup__(_x)))
+#include "macro.h"
+#include "transfer.h"
 
 typedef struct Manager Manager;
 
-int manager_new(Manager **managerp, bool tentative);
+typedef enum ManagerEngine {
+        MANAGER_ENGINE_THREADS,
+        MANAGER_ENGINE_IO_URING,
+} ManagerEngine;
+
+typedef struct ManagerConfig {
+        bool tentative;
+        size_t cache_size;
+        const char *index_path;
+        ManagerEngine engine;
+        unsigned int n_threads;
+        TransferStrategy transfer;
+        size_t chunk_size;
+        const char *profile_path;
+        const char *modalias_map_path;
+        const char *priority_rules_path;
+        /* the control socket, none if NULL or empty */
+        const char *control_path;
+        /* where sysfs is, "/sys" if NULL; and a socket to take uevents from instead of the kernel */
+        const char *sysfs_path;
+        const char *uevent_socket;
+} ManagerConfig;
+
+int manager_new(Manager **managerp, const ManagerConfig *config);
 void manager_free(Manager *manager);
 
 int manager_run(Manager *manager);
+int manager_finalize(Manager *manager);
+
+int manager_write_index(const char *path);
 
 static inline void manager_freep(Manager **managerp) {
         if (*managerp)
@@ -0,0 +1,419 @@
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "macro.h"
+#include "modalias.h"
+
+/*
+ * The file has a header line, then "firmware <module> <name>" lines for
+ * what a module declares, and "alias <pattern> <module>" lines as in
+ * modules.alias, in any order. Lines that do not parse are skipped.
+ */
+
+#define MODALIAS_MAP_HEADER "# firmwared modalias map 1\n"
+
+/* as the kernel's MODULE_NAME_LEN */
+#define MODALIAS_MODULE_NAME_MAX (64)
+
+/* "pci:", "usb:"; longer ones are not taken for a bus */
+#define MODALIAS_BUS_MAX (32)
+
+typedef struct ModaliasModule {
+        char *name;
+        char **firmware;
+        size_t n_firmware;
+} ModaliasModule;
+
+typedef struct ModaliasAlias {
+        char *pattern;
+        char *module;
+} ModaliasAlias;
+
+/* the aliases that may match modaliases of one bus, by index, in file order */
+typedef struct ModaliasBus {
+        char *prefix;
+        size_t *aliases;
+        size_t n_aliases;
+        size_t allocated;
+} ModaliasBus;
+
+struct ModaliasMap {
+        /* modules by name, only those that declare firmware */
+        Hashmap *modules;
+        ModaliasAlias *aliases;
+        size_t n_aliases;
+        size_t allocated;
+        /*
+         * The aliases of modules with firmware, by the bus their pattern starts
+         * with, as in "pci:"; and those that do not start with a plain one.
+         */
+        Hashmap *buses;
+        ModaliasBus any;
+};
+
+static void modalias_module_free(ModaliasModule *module) {
+        for (size_t i = 0; i < module->n_firmware; i++)
+                free(module->firmware[i]);
+        free(module->firmware);
+        free(module->name);
+        free(module);
+}
+
+/* module names may be written with either '-' or '_' */
+static int modalias_module_name(char *buf, const char *name) {
+        size_t len = strlen(name);
+
+        if (len == 0 || len >= MODALIAS_MODULE_NAME_MAX)
+                return -EINVAL;
+
+        for (size_t i = 0; i <= len; i++)
+                buf[i] = name[i] == '-' ? '_' : name[i];
+
+        return 0;
+}
+
+static int modalias_map_add_firmware(ModaliasMap *map, const char *name, const char *firmware) {
+        char buf[MODALIAS_MODULE_NAME_MAX];
+        ModaliasModule *module;
+        char **p;
+        int r;
+
+        r = modalias_module_name(buf, name);
+        if (r < 0)
+                return r;
+
+        module = hashmap_get(map->modules, buf);
+        if (!module) {
+                module = calloc(1, sizeof(*module));
+                if (!module)
+                        return -ENOMEM;
+
+                module->name = strdup(buf);
+                if (!module->name) {
+                        free(module);
+                        return -ENOMEM;
+                }
+
+                r = hashmap_put(map->modules, module->name, module);
+                if (r < 0) {
+                        modalias_module_free(module);
+                        return r;
+                }
+        }
+
+        p = realloc(module->firmware, (module->n_firmware + 1) * sizeof(char *));
+        if (!p)
+                return -ENOMEM;
+        module->firmware = p;
+
+        module->firmware[module->n_firmware] = strdup(firmware);
+        if (!module->firmware[module->n_firmware])
+                return -ENOMEM;
+        module->n_firmware++;
+
+        return 0;
+}
+
+static int modalias_map_add_alias(ModaliasMap *map, const char *pattern, const char *module) {
+        char buf[MODALIAS_MODULE_NAME_MAX];
+        ModaliasAlias *alias;
+        int r;
+
+        r = modalias_module_name(buf, module);
+        if (r < 0)
+                return r;
+
+        if (map->n_aliases == map->allocated) {
+                size_t allocated = map->allocated ? 2 * map->allocated : 64;
+                ModaliasAlias *p;
+
+                p = realloc(map->aliases, allocated * sizeof(ModaliasAlias));
+                if (!p)
+                        return -ENOMEM;
+
+                map->aliases = p;
+                map->allocated = allocated;
+        }
+
+        alias = &map->aliases[map->n_aliases];
+        alias->pattern = strdup(pattern);
+        alias->module = strdup(buf);
+        if (!alias->pattern || !alias->module) {
+                free(alias->pattern);
+                free(alias->module);
+                return -ENOMEM;
+        }
+        map->n_aliases++;
+
+        return 0;
+}
+
+/* splits off the first word of *@linep */
+static char *modalias_word(char **linep) {
+        char *word = *linep;
+        char *end;
+
+        end = strchr(word, ' ');
+        if (!end)
+                return NULL;
+
+        *end = '\0';
+        *linep = end + 1;
+
+        return *word ? word : NULL;
+}
+
+/* the "bus:" @modalias starts with into @buf, or false if there is none */
+static bool modalias_bus(char *buf, const char *modalias) {
+        size_t len = strcspn(modalias, ":");
+
+        if (modalias[len] != ':' || len + 1 >= MODALIAS_BUS_MAX)
+                return false;
+
+        memcpy(buf, modalias, len + 1);
+        buf[len + 1] = '\0';
+
+        return true;
+}
+
+static int modalias_bus_add(ModaliasBus *bus, size_t alias) {
+        if (bus->n_aliases == bus->allocated) {
+                size_t allocated = bus->allocated ? 2 * bus->allocated : 16;
+                size_t *p;
+
+                p = realloc(bus->aliases, allocated * sizeof(size_t));
+                if (!p)
+                        return -ENOMEM;
+
+                bus->aliases = p;
+                bus->allocated = allocated;
+        }
+
+        bus->aliases[bus->n_aliases++] = alias;
+
+        return 0;
+}
+
+static void modalias_bus_free(ModaliasBus *bus) {
+        free(bus->aliases);
+        free(bus->prefix);
+        free(bus);
+}
+
+/*
+ * Sorts the aliases by bus, once the whole file is read, so that a lookup
+ * only matches the patterns that can match; most of modules.alias is for
+ * modules without firmware, which are left out.
+ */
+static int modalias_map_index(ModaliasMap *map) {
+        int r;
+
+        r = hashmap_new(&map->buses, string_hash_func, string_compare_func);
+        if (r < 0)
+                return r;
+
+        for (size_t i = 0; i < map->n_aliases; i++) {
+                char prefix[MODALIAS_BUS_MAX];
+                ModaliasBus *bus;
+
+                if (!hashmap_get(map->modules, map->aliases[i].module))
+                        continue;
+
+                /* a wildcard in the prefix may stand for any bus */
+                if (!modalias_bus(prefix, map->aliases[i].pattern) || strpbrk(prefix, "*?[\\")) {
+                        r = modalias_bus_add(&map->any, i);
+                        if (r < 0)
+                                return r;
+                        continue;
+                }
+
+                bus = hashmap_get(map->buses, prefix);
+                if (!bus) {
+                        bus = calloc(1, sizeof(*bus));
+                        if (!bus)
+                                return -ENOMEM;
+
+                        bus->prefix = strdup(prefix);
+                        if (!bus->prefix) {
+                                free(bus);
+                                return -ENOMEM;
+                        }
+
+                        r = hashmap_put(map->buses, bus->prefix, bus);
+                        if (r < 0) {
+                                modalias_bus_free(bus);
+                                return r;
+                        }
+                }
+
+                r = modalias_bus_add(bus, i);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int modalias_map_parse_line(ModaliasMap *map, char *line) {
+        char *kind, *key;
+
+        kind = modalias_word(&line);
+        if (!kind)
+                return -EINVAL;
+
+        key = modalias_word(&line);
+        if (!key || !*line)
+                return -EINVAL;
+
+        if (!strcmp(kind, "firmware"))
+                return modalias_map_add_firmware(map, key, line);
+        if (!strcmp(kind, "alias"))
+                return modalias_map_add_alias(map, key, line);
+
+        return -EINVAL;
+}
+
+int modalias_map_new(ModaliasMap **mapp, const char *path) {
+        _cleanup_(modalias_map_freep) ModaliasMap *map = NULL;
+        _cleanup_free_ char *line = NULL;
+        size_t allocated = 0;
+        ssize_t n;
+        FILE *f;
+        int r = 0;
+
+        map = calloc(1, sizeof(*map));
+        if (!map)
+                return -ENOMEM;
+
+        r = hashmap_new(&map->modules, string_hash_func, string_compare_func);
+        if (r < 0)
+                return r;
+
+        f = fopen(path, "re");
+        if (!f)
+                return -errno;
+
+        n = getline(&line, &allocated, f);
+        if (n < 0 || strcmp(line, MODALIAS_MAP_HEADER)) {
+                fclose(f);
+                return -EBADMSG;
+        }
+
+        while ((n = getline(&line, &allocated, f)) > 0) {
+                if (line[n - 1] == '\n')
+                        line[n - 1] = '\0';
+
+                if (line[0] == '#' || line[0] == '\0')
+                        continue;
+
+                r = modalias_map_parse_line(map, line);
+                if (r < 0 && r != -EINVAL)
+                        break;
+                r = 0;
+        }
+
+        fclose(f);
+        if (r < 0)
+                return r;
+
+        r = modalias_map_index(map);
+        if (r < 0)
+                return r;
+
+        *mapp = map;
+        map = NULL;
+
+        return 0;
+}
+
+void modalias_map_free(ModaliasMap *map) {
+        if (map->modules) {
+                ModaliasModule *module;
+                HashmapIterator i;
+
+                HASHMAP_FOREACH(module, map->modules, i)
+                        modalias_module_free(module);
+                hashmap_free(map->modules);
+        }
+
+        if (map->buses) {
+                ModaliasBus *bus;
+                HashmapIterator i;
+
+                HASHMAP_FOREACH(bus, map->buses, i)
+                        modalias_bus_free(bus);
+                hashmap_free(map->buses);
+        }
+        free(map->any.aliases);
+
+        for (size_t i = 0; i < map->n_aliases; i++) {
+                free(map->aliases[i].pattern);
+                free(map->aliases[i].module);
+        }
+        free(map->aliases);
+        free(map);
+}
+
+size_t modalias_map_get_n_modules(ModaliasMap *map) {
+        return hashmap_size(map->modules);
+}
+
+/*
+ * Calls @func for every firmware @module declares. Returns the number of
+ * names, which are valid as long as the map.
+ */
+int modalias_map_lookup_module(ModaliasMap *map, const char *module, modalias_func_t func, void *userdata) {
+        char buf[MODALIAS_MODULE_NAME_MAX];
+        ModaliasModule *m;
+
+        if (modalias_module_name(buf, module) < 0)
+                return 0;
+
+        m = hashmap_get(map->modules, buf);
+        if (!m)
+                return 0;
+
+        for (size_t i = 0; i < m->n_firmware; i++)
+                func(m->firmware[i], userdata);
+
+        return m->n_firmware;
+}
+
+/*
+ * Calls @func for every firmware declared by the modules that @modalias
+ * would load. A name may come up more than once. Returns the number of
+ * matching modules.
+ */
+int modalias_map_lookup(ModaliasMap *map, const char *modalias, modalias_func_t func, void *userdata) {
+        char prefix[MODALIAS_BUS_MAX];
+        ModaliasBus *bus = NULL;
+        size_t b = 0, a = 0;
+        int n = 0;
+
+        if (modalias_bus(prefix, modalias))
+                bus = hashmap_get(map->buses, prefix);
+
+        /* both in file order, merged, as if every alias was tried */
+        while ((bus && b < bus->n_aliases) || a < map->any.n_aliases) {
+                size_t i;
+
+                if (bus && b < bus->n_aliases &&
+                    (a == map->any.n_aliases || bus->aliases[b] < map->any.aliases[a]))
+                        i = bus->aliases[b++];
+                else
+                        i = map->any.aliases[a++];
+
+                if (fnmatch(map->aliases[i].pattern, modalias, 0) != 0)
+                        continue;
+
+                if (modalias_map_lookup_module(map, map->aliases[i].module, func, userdata) > 0)
+                        n++;
+        }
+
+        return n;
+}
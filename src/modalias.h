@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Which firmware a device or module is going to ask for, as written by
+ * tools/modalias-map.sh: the modalias patterns of the kernel modules, and
+ * the firmware the modules declare. Module names are compared with '-' and
+ * '_' taken as the same, like the kernel does.
+ */
+
+typedef struct ModaliasMap ModaliasMap;
+
+typedef void (*modalias_func_t)(const char *firmware, void *userdata);
+
+int modalias_map_new(ModaliasMap **mapp, const char *path);
+void modalias_map_free(ModaliasMap *map);
+
+size_t modalias_map_get_n_modules(ModaliasMap *map);
+
+int modalias_map_lookup(ModaliasMap *map, const char *modalias, modalias_func_t func, void *userdata);
+int modalias_map_lookup_module(ModaliasMap *map, const char *module, modalias_func_t func, void *userdata);
+
+static inline void modalias_map_freep(ModaliasMap **mapp) {
+        if (*mapp)
+                modalias_map_free(*mapp);
+}
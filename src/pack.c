@@ -0,0 +1,379 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "pack.h"
+
+/* symlinked directories are followed, but not forever */
+#define PACK_DEPTH_MAX (16)
+
+#define ALIGN_TO(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+struct Pack {
+        void *map;
+        size_t size;
+        const PackHeader *header;
+        const PackEntry *entries;
+        const char *strings;
+};
+
+int pack_open(Pack **packp, int dirfd, const char *path) {
+        _cleanup_close_ int fd = -1;
+        const PackHeader *h;
+        struct stat st;
+        Pack *p;
+        void *map;
+
+        fd = openat(dirfd, path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if (!S_ISREG(st.st_mode))
+                return -EISDIR;
+
+        if ((size_t)st.st_size < sizeof(PackHeader))
+                return -EBADMSG;
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        h = map;
+        if (memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) ||
+            h->version != PACK_VERSION ||
+            h->header_size != sizeof(PackHeader) ||
+            h->file_size != (uint64_t)st.st_size ||
+            h->entries_offset % 8 ||
+            h->entries_offset > h->file_size ||
+            h->n_entries > (h->file_size - h->entries_offset) / sizeof(PackEntry) ||
+            h->strings_offset > h->file_size ||
+            h->strings_size == 0 ||
+            h->strings_size > h->file_size - h->strings_offset ||
+            ((const char *)map)[h->strings_offset + h->strings_size - 1] != '\0') {
+                munmap(map, st.st_size);
+                return -EBADMSG;
+        }
+
+        p = calloc(1, sizeof(*p));
+        if (!p) {
+                munmap(map, st.st_size);
+                return -ENOMEM;
+        }
+
+        p->map = map;
+        p->size = st.st_size;
+        p->header = h;
+        p->entries = (const PackEntry *)((const char *)map + h->entries_offset);
+        p->strings = (const char *)map + h->strings_offset;
+
+        *packp = p;
+        return 0;
+}
+
+void pack_free(Pack *p) {
+        munmap(p->map, p->size);
+        free(p);
+}
+
+static const char *pack_get_string(Pack *p, uint32_t offset) {
+        if (offset >= p->header->strings_size)
+                return "";
+
+        return p->strings + offset;
+}
+
+/*
+ * Looks up @name and returns its blob as a pointer into the mapped pack.
+ */
+int pack_find(Pack *p, const char *name, const void **datap, size_t *sizep) {
+        size_t lo = 0, hi = p->header->n_entries;
+
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                const PackEntry *e = &p->entries[mid];
+                int r;
+
+                r = strcmp(pack_get_string(p, e->name), name);
+                if (r < 0)
+                        lo = mid + 1;
+                else if (r > 0)
+                        hi = mid;
+                else {
+                        if (e->offset > p->size || e->size > p->size - e->offset)
+                                return -EBADMSG;
+
+                        *datap = (const char *)p->map + e->offset;
+                        *sizep = e->size;
+                        return 0;
+                }
+        }
+
+        return -ENOENT;
+}
+
+typedef struct PackBuilderEntry {
+        char *name;
+        unsigned int dir;
+        PackEntry entry;
+} PackBuilderEntry;
+
+typedef struct PackBuilder {
+        PackBuilderEntry *entries;
+        size_t n_entries;
+} PackBuilder;
+
+static int pack_builder_add(PackBuilder *b, unsigned int dir, const char *name, const struct stat *st) {
+        PackBuilderEntry *entries;
+
+        if (b->n_entries % 1024 == 0) {
+                entries = realloc(b->entries, (b->n_entries + 1024) * sizeof(*entries));
+                if (!entries)
+                        return -ENOMEM;
+                b->entries = entries;
+        }
+
+        b->entries[b->n_entries] = (PackBuilderEntry) {
+                .name = strdup(name),
+                .dir = dir,
+                .entry.size = st->st_size,
+        };
+        if (!b->entries[b->n_entries].name)
+                return -ENOMEM;
+
+        b->n_entries++;
+        return 0;
+}
+
+static int pack_builder_scan_dir(PackBuilder *b, unsigned int dir, int dirfd, const char *prefix,
+                                 unsigned int depth) {
+        struct dirent *de;
+        DIR *d;
+        int r = 0;
+
+        d = fdopendir(dirfd);
+        if (!d) {
+                r = -errno;
+                close(dirfd);
+                return r;
+        }
+
+        while ((de = readdir(d))) {
+                _cleanup_free_ char *name = NULL;
+                struct stat st;
+                int fd;
+
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+
+                if (fstatat(dirfd, de->d_name, &st, 0) < 0)
+                        continue;
+
+                if (asprintf(&name, "%s%s", prefix, de->d_name) < 0) {
+                        r = -ENOMEM;
+                        break;
+                }
+
+                if (S_ISDIR(st.st_mode)) {
+                        _cleanup_free_ char *subprefix = NULL;
+
+                        if (depth >= PACK_DEPTH_MAX)
+                                continue;
+
+                        fd = openat(dirfd, de->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                        if (fd < 0)
+                                continue;
+
+                        if (asprintf(&subprefix, "%s/", name) < 0) {
+                                close(fd);
+                                r = -ENOMEM;
+                                break;
+                        }
+
+                        r = pack_builder_scan_dir(b, dir, fd, subprefix, depth + 1);
+                } else if (S_ISREG(st.st_mode) && st.st_size > 0)
+                        r = pack_builder_add(b, dir, name, &st);
+
+                if (r < 0)
+                        break;
+        }
+
+        closedir(d);
+        return r;
+}
+
+static int pack_builder_compare(const void *a, const void *b) {
+        const PackBuilderEntry *x = a, *y = b;
+        int r;
+
+        r = strcmp(x->name, y->name);
+        if (r)
+                return r;
+
+        return x->dir < y->dir ? -1 : (x->dir > y->dir ? 1 : 0);
+}
+
+static int pack_copy(int fd, int firmwarefd, uint64_t offset, uint64_t size) {
+        if (lseek(fd, offset, SEEK_SET) < 0)
+                return -errno;
+
+        while (size) {
+                ssize_t n;
+
+                n = sendfile(fd, firmwarefd, NULL, size);
+                if (n < 0)
+                        return -errno;
+                else if (n == 0)
+                        return -EIO;
+
+                size -= n;
+        }
+
+        return 0;
+}
+
+static int pack_builder_write(PackBuilder *b, const int *dirfds, int fd) {
+        PackHeader h = {
+                .magic = PACK_MAGIC,
+                .version = PACK_VERSION,
+                .header_size = sizeof(PackHeader),
+                .alignment = PACK_ALIGNMENT,
+        };
+        _cleanup_free_ PackEntry *entries = NULL;
+        _cleanup_free_ char *strings = NULL;
+        uint64_t offset;
+        size_t n = 0;
+
+        h.n_entries = b->n_entries;
+        entries = calloc(b->n_entries, sizeof(PackEntry));
+        if (!entries)
+                return -ENOMEM;
+
+        for (size_t i = 0; i < b->n_entries; i++)
+                h.strings_size += strlen(b->entries[i].name) + 1;
+        h.strings_size++;
+
+        strings = calloc(1, h.strings_size);
+        if (!strings)
+                return -ENOMEM;
+
+        h.entries_offset = sizeof(h);
+        h.strings_offset = h.entries_offset + b->n_entries * sizeof(PackEntry);
+        offset = ALIGN_TO(h.strings_offset + h.strings_size, PACK_ALIGNMENT);
+
+        /* the empty string first, then every name */
+        n = 1;
+        for (size_t i = 0; i < b->n_entries; i++) {
+                entries[i] = b->entries[i].entry;
+                entries[i].name = n;
+                entries[i].offset = offset;
+                strcpy(strings + n, b->entries[i].name);
+                n += strlen(b->entries[i].name) + 1;
+                offset = ALIGN_TO(offset + entries[i].size, PACK_ALIGNMENT);
+        }
+
+        h.file_size = b->n_entries ? entries[b->n_entries - 1].offset + entries[b->n_entries - 1].size :
+                                     h.strings_offset + h.strings_size;
+
+        if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+            pwrite(fd, entries, b->n_entries * sizeof(PackEntry), h.entries_offset) != (ssize_t)(b->n_entries * sizeof(PackEntry)) ||
+            pwrite(fd, strings, h.strings_size, h.strings_offset) != (ssize_t)h.strings_size)
+                return errno ? -errno : -EIO;
+
+        for (size_t i = 0; i < b->n_entries; i++) {
+                _cleanup_close_ int firmwarefd = -1;
+                struct stat st;
+                int r;
+
+                firmwarefd = openat(dirfds[b->entries[i].dir], b->entries[i].name, O_RDONLY|O_CLOEXEC);
+                if (firmwarefd < 0)
+                        return -errno;
+
+                /* the size is in the header already, so the file must not change */
+                if (fstat(firmwarefd, &st) < 0)
+                        return -errno;
+                if ((uint64_t)st.st_size != entries[i].size)
+                        return -ESTALE;
+
+                r = pack_copy(fd, firmwarefd, entries[i].offset, entries[i].size);
+                if (r < 0)
+                        return r;
+        }
+
+        if (ftruncate(fd, h.file_size) < 0 || fsync(fd) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/*
+ * Packs every file below @dirfds into a new pack at @path. A name found in
+ * more than one directory is taken from the first one.
+ */
+int pack_write(const char *path, const int *dirfds, size_t n_dirs) {
+        _cleanup_free_ char *tmp = NULL;
+        _cleanup_close_ int fd = -1;
+        PackBuilder b = {};
+        size_t n = 0;
+        int r = 0;
+
+        for (unsigned int i = 0; i < n_dirs && r >= 0; i++) {
+                int dirfd;
+
+                dirfd = openat(dirfds[i], ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                if (dirfd < 0) {
+                        r = -errno;
+                        break;
+                }
+
+                r = pack_builder_scan_dir(&b, i, dirfd, "", 0);
+        }
+        if (r < 0)
+                goto finish;
+
+        qsort(b.entries, b.n_entries, sizeof(*b.entries), pack_builder_compare);
+
+        for (size_t i = 0; i < b.n_entries; i++) {
+                if (n > 0 && !strcmp(b.entries[n - 1].name, b.entries[i].name)) {
+                        free(b.entries[i].name);
+                        continue;
+                }
+
+                b.entries[n++] = b.entries[i];
+        }
+        b.n_entries = n;
+
+        if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        fd = mkostemp(tmp, O_CLOEXEC);
+        if (fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        r = pack_builder_write(&b, dirfds, fd);
+        if (r >= 0 && (fchmod(fd, 0644) < 0 || rename(tmp, path) < 0))
+                r = -errno;
+        if (r < 0)
+                unlink(tmp);
+
+finish:
+        for (size_t i = 0; i < b.n_entries; i++)
+                free(b.entries[i].name);
+        free(b.entries);
+        return r;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Firmware pack, as written by firmware-pack(1).
+ *
+ * A single file holding many firmware blobs, meant to be mapped as a whole:
+ * a header, the entries sorted by name, a NUL-terminated string table, and
+ * then the blobs, each starting on a page boundary. Integers are in host byte
+ * order.
+ */
+
+#define PACK_MAGIC "FWPACK\0\0"
+#define PACK_VERSION (1)
+#define PACK_ALIGNMENT (4096)
+
+typedef struct PackHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t n_entries;
+        uint32_t alignment;
+        uint64_t entries_offset;
+        uint64_t strings_offset;
+        uint64_t strings_size;
+        uint64_t file_size;
+} PackHeader;
+
+typedef struct PackEntry {
+        uint32_t name;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t size;
+} PackEntry;
+
+typedef struct Pack Pack;
+
+int pack_open(Pack **packp, int dirfd, const char *path);
+void pack_free(Pack *pack);
+
+int pack_find(Pack *pack, const char *name, const void **datap, size_t *sizep);
+
+int pack_write(const char *path, const int *dirfds, size_t n_dirs);
+
+static inline void pack_freep(Pack **packp) {
+        if (*packp)
+                pack_free(*packp);
+}
@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log-util.h"
+#include "macro.h"
+#include "priority.h"
+
+typedef enum PriorityRuleKind {
+        PRIORITY_RULE_NAME,
+        PRIORITY_RULE_SUBSYSTEM,
+} PriorityRuleKind;
+
+typedef struct PriorityRule {
+        PriorityRuleKind kind;
+        char *pattern;
+        int priority;
+} PriorityRule;
+
+struct PriorityRules {
+        PriorityRule *rules;
+        size_t n_rules;
+        bool need_subsystem;
+};
+
+static int priority_rules_parse_line(PriorityRules *rules, const char *line) {
+        char kind[16], pattern[256];
+        PriorityRule *rule, *p;
+        int priority, n;
+
+        if (sscanf(line, "%15s %255s %d %n", kind, pattern, &priority, &n) != 3 || line[n])
+                return -EINVAL;
+
+        p = realloc(rules->rules, (rules->n_rules + 1) * sizeof(PriorityRule));
+        if (!p)
+                return -ENOMEM;
+        rules->rules = p;
+
+        rule = &rules->rules[rules->n_rules];
+        if (!strcmp(kind, "name"))
+                rule->kind = PRIORITY_RULE_NAME;
+        else if (!strcmp(kind, "subsystem"))
+                rule->kind = PRIORITY_RULE_SUBSYSTEM;
+        else
+                return -EINVAL;
+
+        rule->pattern = strdup(pattern);
+        if (!rule->pattern)
+                return -ENOMEM;
+
+        rule->priority = priority;
+        rules->n_rules++;
+
+        if (rule->kind == PRIORITY_RULE_SUBSYSTEM)
+                rules->need_subsystem = true;
+
+        return 0;
+}
+
+int priority_rules_new(PriorityRules **rulesp, const char *path) {
+        _cleanup_(priority_rules_freep) PriorityRules *rules = NULL;
+        _cleanup_free_ char *line = NULL;
+        size_t allocated = 0;
+        unsigned int lineno = 0;
+        ssize_t n;
+        FILE *f;
+        int r = 0;
+
+        rules = calloc(1, sizeof(*rules));
+        if (!rules)
+                return -ENOMEM;
+
+        f = fopen(path, "re");
+        if (!f)
+                return -errno;
+
+        while ((n = getline(&line, &allocated, f)) > 0) {
+                lineno++;
+
+                if (line[n - 1] == '\n')
+                        line[n - 1] = '\0';
+
+                if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t")] == '\0')
+                        continue;
+
+                r = priority_rules_parse_line(rules, line);
+                if (r == -EINVAL)
+                        log_warn("%s:%u: ignoring invalid priority rule", path, lineno);
+                else if (r < 0)
+                        break;
+                r = 0;
+        }
+
+        fclose(f);
+        if (r < 0)
+                return r;
+
+        *rulesp = rules;
+        rules = NULL;
+
+        return 0;
+}
+
+void priority_rules_free(PriorityRules *rules) {
+        for (size_t i = 0; i < rules->n_rules; i++)
+                free(rules->rules[i].pattern);
+        free(rules->rules);
+        free(rules);
+}
+
+/* whether the rules care about the subsystem, which costs a lookup */
+bool priority_rules_need_subsystem(PriorityRules *rules) {
+        return rules->need_subsystem;
+}
+
+/* @subsystem may be NULL if it is not known */
+int priority_rules_lookup(PriorityRules *rules, const char *name, const char *subsystem) {
+        for (size_t i = 0; i < rules->n_rules; i++) {
+                PriorityRule *rule = &rules->rules[i];
+
+                switch (rule->kind) {
+                case PRIORITY_RULE_NAME:
+                        if (fnmatch(rule->pattern, name, 0) == 0)
+                                return rule->priority;
+                        break;
+                case PRIORITY_RULE_SUBSYSTEM:
+                        if (subsystem && !strcmp(rule->pattern, subsystem))
+                                return rule->priority;
+                        break;
+                }
+        }
+
+        return 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Rules that rank firmware requests, read from a file with one rule per line:
+ *
+ *   name <pattern> <priority>
+ *   subsystem <subsystem> <priority>
+ *
+ * The pattern is matched against the firmware name as with fnmatch(3), the
+ * subsystem is the one of the device asking. The first matching rule wins;
+ * lower priorities go first, and requests no rule matches get 0. Empty
+ * lines and those starting with '#' are ignored.
+ */
+
+typedef struct PriorityRules PriorityRules;
+
+int priority_rules_new(PriorityRules **rulesp, const char *path);
+void priority_rules_free(PriorityRules *rules);
+
+bool priority_rules_need_subsystem(PriorityRules *rules);
+int priority_rules_lookup(PriorityRules *rules, const char *name, const char *subsystem);
+
+static inline void priority_rules_freep(PriorityRules **rulesp) {
+        if (*rulesp)
+                priority_rules_free(*rulesp);
+}
@@ -0,0 +1,187 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hashmap.h"
+#include "macro.h"
+#include "profile.h"
+
+/*
+ * The file has a header line, then one "<usec> <name>" line per entry.
+ * Lines that do not parse are skipped, so a damaged profile only costs the
+ * prefetch of what it lost.
+ */
+
+#define PROFILE_HEADER "# firmwared boot profile 1\n"
+
+typedef struct ProfileEntry {
+        uint64_t usec;
+        char *name;
+} ProfileEntry;
+
+struct Profile {
+        ProfileEntry *entries;
+        size_t n_entries;
+        /* names recorded so far */
+        Hashmap *names;
+};
+
+int profile_new(Profile **profilep) {
+        _cleanup_(profile_freep) Profile *p = NULL;
+        int r;
+
+        p = calloc(1, sizeof(*p));
+        if (!p)
+                return -ENOMEM;
+
+        p->entries = calloc(PROFILE_ENTRIES_MAX, sizeof(ProfileEntry));
+        if (!p->entries)
+                return -ENOMEM;
+
+        r = hashmap_new(&p->names, string_hash_func, string_compare_func);
+        if (r < 0)
+                return r;
+
+        *profilep = p;
+        p = NULL;
+
+        return 0;
+}
+
+void profile_free(Profile *p) {
+        if (p->entries)
+                for (size_t i = 0; i < p->n_entries; i++)
+                        free(p->entries[i].name);
+        if (p->names)
+                hashmap_free(p->names);
+        free(p->entries);
+        free(p);
+}
+
+/*
+ * Appends @name, unless it is in the profile already or the profile is
+ * full. Returns 1 if it was added.
+ */
+int profile_record(Profile *p, const char *name, uint64_t usec) {
+        ProfileEntry *e;
+        int r;
+
+        if (p->n_entries >= PROFILE_ENTRIES_MAX || hashmap_get(p->names, name))
+                return 0;
+
+        /* the file is line based */
+        if (!*name || strpbrk(name, "\n\r"))
+                return -EINVAL;
+
+        e = &p->entries[p->n_entries];
+        e->name = strdup(name);
+        if (!e->name)
+                return -ENOMEM;
+
+        r = hashmap_put(p->names, e->name, e);
+        if (r < 0) {
+                free(e->name);
+                return r;
+        }
+
+        e->usec = usec;
+        p->n_entries++;
+
+        return 1;
+}
+
+int profile_load(Profile *p, const char *path) {
+        _cleanup_free_ char *line = NULL;
+        size_t allocated = 0;
+        ssize_t n;
+        FILE *f;
+        int r = 0;
+
+        f = fopen(path, "re");
+        if (!f)
+                return -errno;
+
+        n = getline(&line, &allocated, f);
+        if (n < 0 || strcmp(line, PROFILE_HEADER)) {
+                fclose(f);
+                return -EBADMSG;
+        }
+
+        while ((n = getline(&line, &allocated, f)) > 0) {
+                uint64_t usec;
+                int offset;
+
+                if (line[n - 1] == '\n')
+                        line[n - 1] = '\0';
+
+                if (sscanf(line, "%" SCNu64 " %n", &usec, &offset) != 1 || !line[offset])
+                        continue;
+
+                r = profile_record(p, line + offset, usec);
+                if (r < 0 && r != -EINVAL)
+                        break;
+                r = 0;
+        }
+
+        fclose(f);
+        return r;
+}
+
+/* replaces the file at @path, so a reader sees either the old or the new one */
+int profile_save(Profile *p, const char *path) {
+        _cleanup_free_ char *tmp = NULL;
+        FILE *f;
+        int fd, r = 0;
+
+        if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+                return -ENOMEM;
+
+        fd = mkostemp(tmp, O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        f = fdopen(fd, "w");
+        if (!f) {
+                r = -errno;
+                close(fd);
+                unlink(tmp);
+                return r;
+        }
+
+        fputs(PROFILE_HEADER, f);
+        for (size_t i = 0; i < p->n_entries; i++)
+                fprintf(f, "%" PRIu64 " %s\n", p->entries[i].usec, p->entries[i].name);
+
+        if (fchmod(fd, 0644) < 0)
+                r = -errno;
+        else if (fflush(f) != 0 || ferror(f))
+                r = -EIO;
+        /* or a crash right after the rename may leave an empty profile behind */
+        else if (fsync(fd) < 0)
+                r = -errno;
+        if (fclose(f) != 0 && r >= 0)
+                r = -errno;
+        if (r >= 0 && rename(tmp, path) < 0)
+                r = -errno;
+        if (r < 0)
+                unlink(tmp);
+
+        return r;
+}
+
+size_t profile_get_size(Profile *p) {
+        return p->n_entries;
+}
+
+const char *profile_get_name(Profile *p, size_t i) {
+        return p->entries[i].name;
+}
+
+uint64_t profile_get_usec(Profile *p, size_t i) {
+        return p->entries[i].usec;
+}
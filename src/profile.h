@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A boot profile: the firmware requested during one run of the daemon, in
+ * the order it was first asked for, with the time since the start. It is
+ * saved as a small text file, and replayed on the next start to read the
+ * files ahead.
+ */
+
+#define PROFILE_ENTRIES_MAX (512)
+
+typedef struct Profile Profile;
+
+int profile_new(Profile **profilep);
+void profile_free(Profile *profile);
+
+int profile_load(Profile *profile, const char *path);
+int profile_save(Profile *profile, const char *path);
+
+int profile_record(Profile *profile, const char *name, uint64_t usec);
+
+size_t profile_get_size(Profile *profile);
+const char *profile_get_name(Profile *profile, size_t i);
+uint64_t profile_get_usec(Profile *profile, size_t i);
+
+static inline void profile_freep(Profile **profilep) {
+        if (*profilep)
+                profile_free(*profilep);
+}
@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "macro.h"
+#include "queue.h"
+
+/*
+ * A binary min-heap for the order, and a list in arrival order threaded
+ * through the same entries for the starvation guard. Each entry knows its
+ * place in the heap, so the guard can take one out of the middle.
+ */
+
+typedef struct QueueEntry QueueEntry;
+
+struct QueueEntry {
+        Request *request;
+        uint64_t seqnum;
+        uint64_t queued;
+        size_t index;
+        QueueEntry *prev;
+        QueueEntry *next;
+};
+
+struct RequestQueue {
+        QueueEntry **heap;
+        size_t n_entries;
+        size_t allocated;
+        QueueEntry *oldest;
+        QueueEntry *newest;
+        uint64_t seqnum;
+        uint64_t starvation_usec;
+};
+
+int request_queue_new(RequestQueue **queuep, uint64_t starvation_usec) {
+        RequestQueue *q;
+
+        q = calloc(1, sizeof(*q));
+        if (!q)
+                return -ENOMEM;
+
+        q->starvation_usec = starvation_usec;
+
+        *queuep = q;
+        return 0;
+}
+
+void request_queue_free(RequestQueue *q) {
+        for (size_t i = 0; i < q->n_entries; i++) {
+                request_free(q->heap[i]->request);
+                free(q->heap[i]);
+        }
+        free(q->heap);
+        free(q);
+}
+
+static bool queue_entry_before(const QueueEntry *a, const QueueEntry *b) {
+        if (a->request->priority != b->request->priority)
+                return a->request->priority < b->request->priority;
+        if (a->request->deadline != b->request->deadline)
+                return a->request->deadline < b->request->deadline;
+        if (a->request->size != b->request->size)
+                return a->request->size < b->request->size;
+        return a->seqnum < b->seqnum;
+}
+
+static void queue_place(RequestQueue *q, QueueEntry *e, size_t i) {
+        q->heap[i] = e;
+        e->index = i;
+}
+
+static void queue_sift_up(RequestQueue *q, size_t i) {
+        QueueEntry *e = q->heap[i];
+
+        while (i > 0 && queue_entry_before(e, q->heap[(i - 1) / 2])) {
+                queue_place(q, q->heap[(i - 1) / 2], i);
+                i = (i - 1) / 2;
+        }
+        queue_place(q, e, i);
+}
+
+static void queue_sift_down(RequestQueue *q, size_t i) {
+        QueueEntry *e = q->heap[i];
+
+        for (;;) {
+                size_t child = 2 * i + 1;
+
+                if (child >= q->n_entries)
+                        break;
+                if (child + 1 < q->n_entries && queue_entry_before(q->heap[child + 1], q->heap[child]))
+                        child++;
+                if (!queue_entry_before(q->heap[child], e))
+                        break;
+
+                queue_place(q, q->heap[child], i);
+                i = child;
+        }
+        queue_place(q, e, i);
+}
+
+/* Queues @request, taking ownership of it, unless this fails. */
+int request_queue_push(RequestQueue *q, Request *request, uint64_t now) {
+        QueueEntry *e;
+
+        if (q->n_entries == q->allocated) {
+                size_t allocated = q->allocated ? 2 * q->allocated : 16;
+                QueueEntry **heap;
+
+                heap = realloc(q->heap, allocated * sizeof(QueueEntry *));
+                if (!heap)
+                        return -ENOMEM;
+
+                q->heap = heap;
+                q->allocated = allocated;
+        }
+
+        e = calloc(1, sizeof(*e));
+        if (!e)
+                return -ENOMEM;
+
+        e->request = request;
+        e->seqnum = q->seqnum++;
+        e->queued = now;
+
+        e->prev = q->newest;
+        if (q->newest)
+                q->newest->next = e;
+        else
+                q->oldest = e;
+        q->newest = e;
+
+        queue_place(q, e, q->n_entries++);
+        queue_sift_up(q, e->index);
+
+        return 0;
+}
+
+static Request *queue_remove(RequestQueue *q, QueueEntry *e) {
+        QueueEntry *last = q->heap[--q->n_entries];
+        Request *request = e->request;
+
+        if (last != e) {
+                queue_place(q, last, e->index);
+                queue_sift_up(q, last->index);
+                queue_sift_down(q, last->index);
+        }
+
+        if (e->prev)
+                e->prev->next = e->next;
+        else
+                q->oldest = e->next;
+        if (e->next)
+                e->next->prev = e->prev;
+        else
+                q->newest = e->prev;
+
+        free(e);
+        return request;
+}
+
+/*
+ * Returns the request to handle next, or NULL if there is none. @starvedp
+ * tells if it was picked only because it waited too long.
+ */
+Request *request_queue_pop(RequestQueue *q, uint64_t now, bool *starvedp) {
+        QueueEntry *e;
+        bool starved;
+
+        if (q->n_entries == 0)
+                return NULL;
+
+        e = q->heap[0];
+        starved = e != q->oldest && now - q->oldest->queued >= q->starvation_usec;
+        if (starved)
+                e = q->oldest;
+
+        if (starvedp)
+                *starvedp = starved;
+
+        return queue_remove(q, e);
+}
+
+size_t request_queue_size(RequestQueue *q) {
+        return q->n_entries;
+}
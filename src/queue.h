@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+
+/*
+ * Requests waiting to be handled, ordered by their priority, then earliest
+ * deadline first, then by the size of their firmware, smallest first, then
+ * by arrival. The deadline takes precedence over the size, so the shortest
+ * go first only among requests with the same deadline. A request that
+ * waited for longer than the starvation limit goes next regardless, oldest
+ * first.
+ */
+
+typedef struct RequestQueue RequestQueue;
+
+int request_queue_new(RequestQueue **queuep, uint64_t starvation_usec);
+void request_queue_free(RequestQueue *queue);
+
+int request_queue_push(RequestQueue *queue, Request *request, uint64_t now);
+Request *request_queue_pop(RequestQueue *queue, uint64_t now, bool *starvedp);
+size_t request_queue_size(RequestQueue *queue);
+
+static inline void request_queue_freep(RequestQueue **queuep) {
+        if (*queuep)
+                request_queue_free(*queuep);
+}
@@ -0,0 +1,32 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "request.h"
+
+int request_new(Request **requestp, const char *devpath, const char *name) {
+        Request *req;
+
+        if (!devpath || !name)
+                return -EINVAL;
+
+        req = calloc(1, sizeof(*req));
+        if (!req)
+                return -ENOMEM;
+
+        req->devpath = strdup(devpath);
+        req->name = strdup(name);
+        if (!req->devpath || !req->name) {
+                request_free(req);
+                return -ENOMEM;
+        }
+
+        *requestp = req;
+        return 0;
+}
+
+void request_free(Request *req) {
+        free(req->devpath);
+        free(req->name);
+        free(req);
+}
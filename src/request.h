@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+/* a firmware request, detached from the uevent it was parsed from */
+typedef struct Request {
+        char *devpath;
+        char *name;
+        /* where it goes in the queue */
+        int priority;
+        uint64_t size;
+        /* when the kernel gives up on it, UINT64_MAX for never */
+        uint64_t deadline;
+        /* when the event asking for it came in */
+        uint64_t received;
+} Request;
+
+int request_new(Request **requestp, const char *devpath, const char *name);
+void request_free(Request *request);
+
+static inline void request_freep(Request **requestp) {
+        if (*requestp)
+                request_free(*requestp);
+}
@@ -3,10 +3,219 @@
  */
 
 #include <assert.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_XZ
+#include <lzma.h>
+#endif
+
+#include "firmware.h"
+#include "firmware-uring.h"
+#include "macro.h"
+
+/* a fake sysfs firmware device, with plain files for "loading" and "data" */
+static int device_new(char *dir) {
+        int dirfd, fd;
+
+        assert(mkdtemp(dir));
+        dirfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfd >= 0);
+
+        fd = openat(dirfd, "loading", O_CREAT|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        close(fd);
+        fd = openat(dirfd, "data", O_CREAT|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        close(fd);
+
+        return dirfd;
+}
+
+static void device_free(char *dir, int dirfd) {
+        unlinkat(dirfd, "loading", 0);
+        unlinkat(dirfd, "data", 0);
+        close(dirfd);
+        rmdir(dir);
+}
+
+static void device_check_loading(int dirfd, const char *loading) {
+        char buf[64] = {};
+        int fd;
+
+        fd = openat(dirfd, "loading", O_RDONLY|O_CLOEXEC);
+        assert(fd >= 0);
+        assert(read(fd, buf, sizeof(buf) - 1) == (ssize_t)strlen(loading));
+        assert(!strcmp(buf, loading));
+        close(fd);
+}
+
+static void device_check(int dirfd, const char *loading, const char *data) {
+        char buf[64] = {};
+        int fd;
+
+        device_check_loading(dirfd, loading);
+
+        fd = openat(dirfd, "data", O_RDONLY|O_CLOEXEC);
+        assert(fd >= 0);
+        assert(read(fd, buf, sizeof(buf) - 1) == (ssize_t)strlen(data));
+        assert(!strcmp(buf, data));
+        close(fd);
+}
+
+static void test_load(void) {
+        char dir[] = "/tmp/test-basic-XXXXXX";
+        char firmware[] = "/tmp/test-basic-XXXXXX";
+        int devicefd, firmwarefd;
+
+        devicefd = device_new(dir);
+        firmwarefd = mkostemp(firmware, O_CLOEXEC);
+        assert(firmwarefd >= 0);
+        assert(write(firmwarefd, "firmware", 8) == 8);
+
+        assert(firmware_load(devicefd, dir, firmwarefd, 0, NULL, false, NULL) >= 0);
+        device_check(devicefd, "1\n0\n", "firmware");
+
+        close(firmwarefd);
+        unlink(firmware);
+        device_free(dir, devicefd);
+}
+
+static void test_load_data(void) {
+        char dir[] = "/tmp/test-basic-XXXXXX";
+        FirmwareTimes times;
+        int devicefd;
+
+        devicefd = device_new(dir);
+
+        assert(firmware_load_data(devicefd, dir, "firmware", 8, false, &times) >= 0);
+        device_check(devicefd, "1\n0\n", "firmware");
+
+        /* each step is stamped, in order */
+        assert(times.loading > 0);
+        assert(times.written >= times.loading);
+        assert(times.done >= times.written);
+
+        device_free(dir, devicefd);
+}
+
+static void test_cancel_load(void) {
+        char dir[] = "/tmp/test-basic-XXXXXX";
+        int devicefd;
+
+        devicefd = device_new(dir);
+
+        assert(firmware_cancel_load(devicefd, dir) >= 0);
+        device_check(devicefd, "-1\n", "");
+
+        device_free(dir, devicefd);
+}
+
+static void test_load_compressed(void) {
+#ifdef HAVE_XZ
+        char dir[] = "/tmp/test-basic-XXXXXX";
+        char firmware[] = "/tmp/test-basic-XXXXXX";
+        uint8_t compressed[256];
+        DecompressStats stats;
+        size_t size = 0;
+        int devicefd, firmwarefd;
+
+        assert(lzma_easy_buffer_encode(6, LZMA_CHECK_CRC32, NULL, (const uint8_t *)"firmware", 8,
+                                       compressed, &size, sizeof(compressed)) == LZMA_OK);
+
+        devicefd = device_new(dir);
+        firmwarefd = mkostemp(firmware, O_CLOEXEC);
+        assert(firmwarefd >= 0);
+        assert(write(firmwarefd, compressed, size) == (ssize_t)size);
+
+        assert(firmware_load_compressed(devicefd, dir, firmwarefd, NULL, 0, COMPRESSION_XZ, false, &stats,
+                                        NULL) >= 0);
+        device_check(devicefd, "1\n0\n", "firmware");
+        assert(stats.in == size);
+        assert(stats.out == 8);
+
+        close(firmwarefd);
+        unlink(firmware);
+        device_free(dir, devicefd);
+
+        /* corrupt data is not loaded */
+        strcpy(dir, "/tmp/test-basic-XXXXXX");
+        devicefd = device_new(dir);
+        compressed[size / 2] ^= 0xff;
+        assert(firmware_load_compressed(devicefd, dir, -1, compressed, size, COMPRESSION_XZ, false, &stats,
+                                        NULL) < 0);
+        device_check_loading(devicefd, "1\n-1\n");
+        device_free(dir, devicefd);
+#else
+        printf("xz not available, skipping\n");
+#endif
+}
+
+static void uring_done(void *cookie, int error, void *userdata) {
+        unsigned int *done = userdata;
+
+        assert(error == 0);
+        *done |= 1u << PTR_TO_INT(cookie);
+}
+
+/* a blob spanning several sysfs writes, for several devices at once */
+static void test_uring_load(void) {
+        char dirs[3][32];
+        int devicefds[3];
+        FirmwareUring *f;
+        char *blob, *buf;
+        size_t size = 5 * 4096 + 123;
+        unsigned int done = 0;
+        int fd, r;
+
+        r = firmware_uring_new(&f, 2, uring_done, &done);
+        if (r < 0) {
+                printf("io_uring not available, skipping: %s\n", strerror(-r));
+                return;
+        }
+
+        blob = malloc(size);
+        buf = malloc(size + 1);
+        assert(blob && buf);
+        for (size_t i = 0; i < size; i++)
+                blob[i] = 'a' + i % 26;
+
+        for (unsigned int i = 0; i < 3; i++) {
+                strcpy(dirs[i], "/tmp/test-basic-XXXXXX");
+                devicefds[i] = device_new(dirs[i]);
+                assert(firmware_uring_load(f, devicefds[i], dirs[i], -1, blob, size, false, INT_TO_PTR(i)) >= 0);
+        }
+
+        assert(firmware_uring_submit(f) >= 0);
+        /* waits for every upload */
+        firmware_uring_free(f);
+        assert(done == 7);
+
+        for (unsigned int i = 0; i < 3; i++) {
+                device_check_loading(devicefds[i], "1\n0\n");
+
+                fd = openat(devicefds[i], "data", O_RDONLY|O_CLOEXEC);
+                assert(fd >= 0);
+                assert(read(fd, buf, size + 1) == (ssize_t)size);
+                assert(!memcmp(buf, blob, size));
+                close(fd);
+
+                device_free(dirs[i], devicefds[i]);
+        }
+
+        free(buf);
+        free(blob);
+}
 
 int main(int argc, char **argv) {
+        test_load();
+        test_load_data();
+        test_cancel_load();
+        test_load_compressed();
+        test_uring_load();
+
         return 0;
 }
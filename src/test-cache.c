@@ -0,0 +1,107 @@
+/*
+ * Tests for the firmware blob cache
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+static void write_file(int dirfd, const char *name, const char *content) {
+        int fd;
+
+        fd = openat(dirfd, name, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        assert(write(fd, content, strlen(content)) == (ssize_t)strlen(content));
+        close(fd);
+}
+
+static int insert_file(Cache *cache, int dirfd, const char *name, long *fs_typep) {
+        int fd, r;
+
+        fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC);
+        assert(fd >= 0);
+        r = cache_insert(cache, name, dirfd, fd, fs_typep);
+        close(fd);
+
+        return r;
+}
+
+static void test_cache(int dirfd) {
+        Cache *cache;
+        CacheStats stats;
+        struct statfs sfs;
+        long fs_type;
+        uint64_t size;
+        char buf[16];
+        int fd;
+
+        assert(fstatfs(dirfd, &sfs) >= 0);
+        assert(cache_new(&cache, 8) >= 0);
+        write_file(dirfd, "a.bin", "hello");
+        write_file(dirfd, "b.bin", "world!");
+
+        assert(cache_lookup(cache, "a.bin", &fs_type) == -ENOENT);
+
+        fd = insert_file(cache, dirfd, "a.bin", &fs_type);
+        assert(fd >= 0);
+        assert(fs_type == sfs.f_type);
+        assert(pread(fd, buf, sizeof(buf), 0) == 5);
+        assert(!memcmp(buf, "hello", 5));
+        close(fd);
+
+        assert(cache_peek_size(cache, "a.bin", &size) >= 0);
+        assert(size == 5);
+        assert(cache_peek_size(cache, "b.bin", &size) == -ENOENT);
+
+        /* served from a memfd, but accounted to where the file is */
+        fs_type = 0;
+        fd = cache_lookup(cache, "a.bin", &fs_type);
+        assert(fd >= 0);
+        assert(fs_type == sfs.f_type);
+        close(fd);
+
+        /* over budget, so "a.bin" gets evicted */
+        fd = insert_file(cache, dirfd, "b.bin", &fs_type);
+        assert(fd >= 0);
+        close(fd);
+        assert(cache_lookup(cache, "a.bin", &fs_type) == -ENOENT);
+
+        /* a changed file invalidates its entry */
+        write_file(dirfd, "b.bin", "WORLD!!");
+        assert(cache_lookup(cache, "b.bin", &fs_type) == -ENOENT);
+
+        cache_get_stats(cache, &stats);
+        assert(stats.hits == 1);
+        assert(stats.misses == 3);
+        assert(stats.stale == 1);
+        assert(stats.evictions == 1);
+        assert(stats.entries == 0);
+        assert(stats.size == 0);
+
+        unlinkat(dirfd, "a.bin", 0);
+        unlinkat(dirfd, "b.bin", 0);
+        cache_free(cache);
+}
+
+int main(int argc, char **argv) {
+        char dir[] = "/tmp/test-cache-XXXXXX";
+        int dirfd;
+
+        assert(mkdtemp(dir));
+        dirfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfd >= 0);
+
+        test_cache(dirfd);
+
+        close(dirfd);
+        rmdir(dir);
+
+        return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Tests for the control socket
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "macro.h"
+
+#define TIMEOUT_USEC (500 * USEC_PER_MSEC)
+
+static char dir[] = "/tmp/test-control-XXXXXX";
+static char path[256];
+
+static int on_command(const char *command, FILE *out, void *userdata) {
+        EventLoop *loop = userdata;
+
+        if (!strncmp(command, "echo ", 5))
+                fprintf(out, "%s\n", command + 5);
+        else if (!strcmp(command, "big"))
+                for (unsigned int i = 0; i < 100000; i++)
+                        fprintf(out, "line %u\n", i);
+        else if (!strcmp(command, "quit"))
+                event_loop_exit(loop, 0);
+        else {
+                fprintf(out, "thrown away\n");
+                return -EINVAL;
+        }
+
+        return 0;
+}
+
+static void connect_fd(int fd) {
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+
+        strcpy(sa.sun_path, path);
+        assert(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) >= 0);
+}
+
+static int connect_new(void) {
+        int fd;
+
+        fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        assert(fd >= 0);
+        connect_fd(fd);
+
+        return fd;
+}
+
+static uint64_t cpu_usec(void) {
+        struct rusage ru;
+
+        assert(getrusage(RUSAGE_SELF, &ru) >= 0);
+        return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * USEC_PER_SEC +
+               ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* sends @command in pieces of @chunk bytes, and returns the reply */
+static char *run(const char *command, size_t chunk, size_t *sizep) {
+        char *reply = NULL;
+        size_t size = 0;
+        FILE *f;
+        int fd;
+
+        fd = connect_new();
+
+        for (size_t i = 0; i < strlen(command); i += chunk) {
+                size_t n = MIN(chunk, strlen(command) - i);
+
+                assert(write(fd, command + i, n) == (ssize_t)n);
+                usleep(1000);
+        }
+        shutdown(fd, SHUT_WR);
+
+        f = open_memstream(&reply, &size);
+        assert(f);
+        for (;;) {
+                char buf[4096];
+                ssize_t n;
+
+                n = read(fd, buf, sizeof(buf));
+                assert(n >= 0);
+                if (n == 0)
+                        break;
+                fwrite(buf, 1, n, f);
+        }
+        fclose(f);
+        close(fd);
+
+        if (sizep)
+                *sizep = size;
+        return reply;
+}
+
+/* a client that never ends its command is cut off */
+static void test_timeout(void) {
+        char buf[64];
+        int fd;
+
+        fd = connect_new();
+        assert(write(fd, "echo never", 10) == 10);
+
+        assert(read(fd, buf, sizeof(buf)) == 0);
+        close(fd);
+}
+
+/* without a descriptor for a client, it waits for one, without spinning on it */
+static void test_out_of_fds(void) {
+        struct rlimit limit, none = {};
+        char buf[64];
+        uint64_t cpu;
+        int idle, fd;
+
+        idle = connect_new();
+        fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        assert(fd >= 0);
+
+        assert(getrlimit(RLIMIT_NOFILE, &limit) >= 0);
+        none.rlim_max = limit.rlim_max;
+        assert(setrlimit(RLIMIT_NOFILE, &none) >= 0);
+
+        connect_fd(fd);
+        cpu = cpu_usec();
+        usleep(200 * 1000);
+        assert(cpu_usec() - cpu < 100 * 1000);
+
+        assert(setrlimit(RLIMIT_NOFILE, &limit) >= 0);
+
+        /* taken once another client is gone */
+        close(idle);
+        assert(write(fd, "echo back\n", 10) == 10);
+        assert(read(fd, buf, sizeof(buf)) == 5);
+        assert(!memcmp(buf, "back\n", 5));
+        close(fd);
+}
+
+static void *client(void *userdata) {
+        char *reply;
+        size_t size;
+
+        reply = run("echo hello\n", 64, NULL);
+        assert(!strcmp(reply, "hello\n"));
+        free(reply);
+
+        /* a command trickling in byte by byte */
+        reply = run("echo slow\n", 1, NULL);
+        assert(!strcmp(reply, "slow\n"));
+        free(reply);
+
+        /* the end of the input ends the command, too */
+        reply = run("echo eof", 64, NULL);
+        assert(!strcmp(reply, "eof\n"));
+        free(reply);
+
+        reply = run("fail\n", 64, NULL);
+        assert(!strcmp(reply, "error: Invalid argument\n"));
+        free(reply);
+
+        /* more than the socket buffer holds at once */
+        reply = run("big\n", 64, &size);
+        assert(size > 1000000);
+        assert(!strncmp(reply, "line 0\n", 7));
+        assert(!strcmp(reply + size - strlen("line 99999\n"), "line 99999\n"));
+        free(reply);
+
+        test_timeout();
+        test_out_of_fds();
+
+        reply = run("quit\n", 64, NULL);
+        free(reply);
+
+        return NULL;
+}
+
+int main(int argc, char **argv) {
+        ControlServer *server;
+        EventLoop *loop;
+        pthread_t thread;
+
+        assert(mkdtemp(dir));
+        snprintf(path, sizeof(path), "%s/control", dir);
+
+        assert(event_loop_new(&loop) >= 0);
+        assert(control_server_new(&server, loop, path, TIMEOUT_USEC, on_command, loop) >= 0);
+
+        assert(pthread_create(&thread, NULL, client, NULL) == 0);
+        assert(event_loop_run(loop) == 0);
+        assert(pthread_join(thread, NULL) == 0);
+
+        control_server_free(server);
+        event_loop_free(loop);
+
+        /* the socket goes away with the server */
+        assert(access(path, F_OK) < 0 && errno == ENOENT);
+        rmdir(dir);
+
+        return 0;
+}
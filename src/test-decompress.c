@@ -0,0 +1,124 @@
+/*
+ * Tests for streaming decompression
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_XZ
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+
+/* several output buffers worth */
+#define BLOB_SIZE (300 * 1024 + 17)
+
+typedef struct Sink {
+        const char *expected;
+        size_t offset;
+        size_t calls;
+        size_t max_chunk;
+        int fail_after;
+} Sink;
+
+static int sink_func(const void *buf, size_t size, void *userdata) {
+        Sink *sink = userdata;
+
+        assert(sink->offset + size <= BLOB_SIZE);
+        assert(!memcmp(sink->expected + sink->offset, buf, size));
+
+        sink->offset += size;
+        sink->calls++;
+        if (size > sink->max_chunk)
+                sink->max_chunk = size;
+
+        if (sink->fail_after && sink->calls == (size_t)sink->fail_after)
+                return -EIO;
+
+        return 0;
+}
+
+#if defined(HAVE_XZ) || defined(HAVE_ZSTD)
+static void check_codec(Compression c, const char *blob, const char *compressed, size_t size) {
+        DecompressStats stats;
+        Sink sink = { .expected = blob };
+
+        assert(decompress(c, compressed, size, sink_func, &sink, &stats) >= 0);
+        assert(sink.offset == BLOB_SIZE);
+        assert(sink.calls > 1);
+        /* never all of it at once */
+        assert(sink.max_chunk < BLOB_SIZE);
+        assert(stats.in == size);
+        assert(stats.out == BLOB_SIZE);
+
+        /* cut short */
+        sink = (Sink) { .expected = blob };
+        assert(decompress(c, compressed, size / 2, sink_func, &sink, &stats) == -EBADMSG);
+        assert(sink.offset < BLOB_SIZE);
+
+        /* the consumer's errors are passed on */
+        sink = (Sink) { .expected = blob, .fail_after = 2 };
+        assert(decompress(c, compressed, size, sink_func, &sink, &stats) == -EIO);
+        assert(sink.calls == 2);
+}
+#endif
+
+static void test_codecs(void) {
+        char *blob, *compressed;
+        size_t size;
+
+        blob = malloc(BLOB_SIZE);
+        compressed = malloc(2 * BLOB_SIZE);
+        assert(blob && compressed);
+
+        srand(4711);
+        for (size_t i = 0; i < BLOB_SIZE; i++)
+                blob[i] = i % 97 < 50 ? (char)('a' + i % 7) : (char)rand();
+
+#ifdef HAVE_XZ
+        size = 0;
+        assert(lzma_easy_buffer_encode(6, LZMA_CHECK_CRC32, NULL, (const uint8_t *)blob, BLOB_SIZE,
+                                       (uint8_t *)compressed, &size, 2 * BLOB_SIZE) == LZMA_OK);
+        check_codec(COMPRESSION_XZ, blob, compressed, size);
+#else
+        printf("xz not available, skipping\n");
+#endif
+
+#ifdef HAVE_ZSTD
+        size = ZSTD_compress(compressed, 2 * BLOB_SIZE, blob, BLOB_SIZE, 3);
+        assert(!ZSTD_isError(size));
+        check_codec(COMPRESSION_ZSTD, blob, compressed, size);
+#else
+        printf("zstd not available, skipping\n");
+#endif
+
+        (void)size;
+        free(compressed);
+        free(blob);
+}
+
+static void test_names(void) {
+        DecompressStats stats;
+
+        assert(compression_supported(COMPRESSION_NONE));
+        assert(!strcmp(compression_suffix(COMPRESSION_NONE), ""));
+        assert(!strcmp(compression_suffix(COMPRESSION_XZ), ".xz"));
+        assert(!strcmp(compression_suffix(COMPRESSION_ZSTD), ".zst"));
+        assert(!strcmp(compression_to_string(COMPRESSION_ZSTD), "zstd"));
+
+        assert(decompress(COMPRESSION_NONE, "x", 1, sink_func, NULL, &stats) == -EOPNOTSUPP);
+}
+
+int main(int argc, char **argv) {
+        test_names();
+        test_codecs();
+
+        return 0;
+}
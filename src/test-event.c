@@ -0,0 +1,159 @@
+/*
+ * Tests for the event loop
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "event.h"
+
+typedef struct Log {
+        char order[16];
+        unsigned int n;
+        EventSource *victim;
+        EventLoop *loop;
+} Log;
+
+static int on_io(EventSource *source, int fd, uint32_t events, void *userdata) {
+        Log *log = userdata;
+        char c;
+
+        assert(events & EPOLLIN);
+        assert(read(fd, &c, 1) == 1);
+        log->order[log->n++] = c;
+
+        /* a source freed in the same batch is not dispatched anymore */
+        if (log->victim) {
+                event_source_free(log->victim);
+                log->victim = NULL;
+        }
+
+        return 0;
+}
+
+static int on_time(EventSource *source, uint64_t usec, void *userdata) {
+        Log *log = userdata;
+
+        assert(usec <= event_now());
+        log->order[log->n++] = 't';
+        event_loop_exit(log->loop, 7);
+
+        return 0;
+}
+
+static int on_rearm(EventSource *source, uint64_t usec, void *userdata) {
+        Log *log = userdata;
+
+        log->order[log->n++] = 'r';
+        if (log->n < 3)
+                assert(event_source_set_time(source, usec + USEC_PER_MSEC) >= 0);
+
+        return 0;
+}
+
+static int on_fail(EventSource *source, uint64_t usec, void *userdata) {
+        return -EIO;
+}
+
+static int on_prepare(EventSource *source, void *userdata) {
+        unsigned int *n = userdata;
+
+        (*n)++;
+        return 0;
+}
+
+static void test_priority(void) {
+        EventLoop *loop;
+        EventSource *low, *high, *normal, *exit_timer;
+        int low_fds[2], high_fds[2], normal_fds[2];
+        Log log = {};
+
+        assert(event_loop_new(&loop) >= 0);
+        log.loop = loop;
+
+        assert(pipe(low_fds) >= 0);
+        assert(pipe(high_fds) >= 0);
+        assert(pipe(normal_fds) >= 0);
+
+        assert(event_add_io(loop, &low, low_fds[0], EPOLLIN, EVENT_PRIORITY_LOW, on_io, &log) >= 0);
+        assert(event_add_io(loop, &normal, normal_fds[0], EPOLLIN, EVENT_PRIORITY_NORMAL, on_io, &log) >= 0);
+        assert(event_add_io(loop, &high, high_fds[0], EPOLLIN, EVENT_PRIORITY_HIGH, on_io, &log) >= 0);
+
+        /* all ready at once, so they come in one batch */
+        assert(write(low_fds[1], "l", 1) == 1);
+        assert(write(normal_fds[1], "n", 1) == 1);
+        assert(write(high_fds[1], "h", 1) == 1);
+        log.victim = low;
+
+        assert(event_add_time(loop, &exit_timer, event_now() + 10 * USEC_PER_MSEC, EVENT_PRIORITY_NORMAL,
+                              on_time, &log) >= 0);
+
+        assert(event_loop_run(loop) == 7);
+        assert(!strcmp(log.order, "hnt"));
+
+        event_source_free(exit_timer);
+        event_source_free(normal);
+        event_source_free(high);
+        event_loop_free(loop);
+
+        for (unsigned int i = 0; i < 2; i++) {
+                close(low_fds[i]);
+                close(high_fds[i]);
+                close(normal_fds[i]);
+        }
+}
+
+static void test_timers(void) {
+        EventLoop *loop;
+        EventSource *rearm, *late, *never, *prepare;
+        unsigned int prepared = 0;
+        uint64_t now = event_now();
+        Log log = {};
+
+        assert(event_loop_new(&loop) >= 0);
+        log.loop = loop;
+
+        assert(event_add_prepare(loop, &prepare, on_prepare, &prepared) >= 0);
+
+        /* fires three times, then the later timer ends the loop */
+        assert(event_add_time(loop, &rearm, now + USEC_PER_MSEC, EVENT_PRIORITY_NORMAL, on_rearm, &log) >= 0);
+        assert(event_add_time(loop, &late, now + 50 * USEC_PER_MSEC, EVENT_PRIORITY_NORMAL, on_time, &log) >= 0);
+        assert(event_add_time(loop, &never, 0, EVENT_PRIORITY_NORMAL, on_fail, NULL) >= 0);
+        assert(event_source_get_time(never) == 0);
+
+        assert(event_loop_run(loop) == 7);
+        assert(!strcmp(log.order, "rrrt"));
+        assert(event_now() >= now + 50 * USEC_PER_MSEC);
+        assert(prepared >= 2);
+
+        event_source_free(late);
+        event_source_free(rearm);
+        event_source_free(never);
+        event_source_free(prepare);
+        event_loop_free(loop);
+}
+
+static void test_error(void) {
+        EventLoop *loop;
+        EventSource *fail;
+
+        assert(event_loop_new(&loop) >= 0);
+        /* a failing callback ends the loop with its error */
+        assert(event_add_time(loop, &fail, event_now(), EVENT_PRIORITY_NORMAL, on_fail, NULL) >= 0);
+        assert(event_loop_run(loop) == -EIO);
+
+        event_source_free(fail);
+        event_loop_free(loop);
+}
+
+int main(int argc, char **argv) {
+        test_priority();
+        test_timers();
+        test_error();
+
+        return 0;
+}
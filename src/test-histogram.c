@@ -0,0 +1,97 @@
+/*
+ * Tests for the latency histograms
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "histogram.h"
+
+#define N_THREADS (4)
+#define N_VALUES (100000)
+
+static void test_small(void) {
+        Histogram h = {};
+
+        assert(histogram_count(&h) == 0);
+        assert(histogram_percentile(&h, 50) == 0);
+        assert(histogram_max(&h) == 0);
+
+        /* small values are counted exactly */
+        for (uint64_t i = 0; i < 8; i++)
+                histogram_add(&h, i);
+
+        assert(histogram_count(&h) == 8);
+        assert(histogram_percentile(&h, 0) == 0);
+        assert(histogram_percentile(&h, 50) == 3);
+        assert(histogram_percentile(&h, 100) == 7);
+        assert(histogram_max(&h) == 7);
+}
+
+static void test_bounds(void) {
+        /* a value is reported as at most a quarter larger than it is */
+        for (uint64_t v = 1; v < UINT64_MAX / 3; v = v * 3 + 1) {
+                Histogram h = {};
+                uint64_t p;
+
+                histogram_add(&h, v);
+                histogram_add(&h, UINT64_MAX);
+
+                p = histogram_percentile(&h, 50);
+                assert(p >= v);
+                assert(p - v <= v / 4);
+        }
+}
+
+static void test_percentiles(void) {
+        Histogram h = {};
+        uint64_t p;
+
+        for (uint64_t i = 1; i <= 1000; i++)
+                histogram_add(&h, i);
+
+        assert(histogram_count(&h) == 1000);
+        assert(histogram_max(&h) == 1000);
+
+        p = histogram_percentile(&h, 50);
+        assert(p >= 500 && p <= 500 + 500 / 4);
+
+        p = histogram_percentile(&h, 99);
+        assert(p >= 990 && p <= 1000);
+
+        /* never beyond what was seen */
+        assert(histogram_percentile(&h, 100) == 1000);
+}
+
+static void *add_values(void *userdata) {
+        Histogram *h = userdata;
+
+        for (uint64_t i = 1; i <= N_VALUES; i++)
+                histogram_add(h, i);
+
+        return NULL;
+}
+
+static void test_threads(void) {
+        pthread_t threads[N_THREADS];
+        Histogram h = {};
+
+        for (unsigned int i = 0; i < N_THREADS; i++)
+                assert(pthread_create(&threads[i], NULL, add_values, &h) == 0);
+        for (unsigned int i = 0; i < N_THREADS; i++)
+                assert(pthread_join(threads[i], NULL) == 0);
+
+        assert(histogram_count(&h) == N_THREADS * N_VALUES);
+        assert(histogram_max(&h) == N_VALUES);
+}
+
+int main(int argc, char **argv) {
+        test_small();
+        test_bounds();
+        test_percentiles();
+        test_threads();
+
+        return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * Tests for the firmware name index
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index-file.h"
+#include "index.h"
+
+static unsigned int changes;
+
+static void changed(const char *name, void *userdata) {
+        changes++;
+}
+
+static void write_file(const char *dir, const char *name) {
+        char path[256];
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        fd = open(path, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        close(fd);
+}
+
+static void remove_file(const char *dir, const char *name) {
+        char path[256];
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        assert(unlink(path) >= 0);
+}
+
+static int lookup(Index *index, const char *name, const int *dirfds) {
+        unsigned int slot;
+        int fd;
+
+        fd = index_open(index, name, &slot);
+        if (fd < 0)
+                return fd;
+
+        close(fd);
+        return slot;
+}
+
+/* same answer, without opening anything */
+static int lookup_stat(Index *index, const char *name) {
+        unsigned int slot;
+        struct stat st;
+        int r;
+
+        r = index_stat(index, name, &slot, &st);
+        if (r < 0)
+                return r;
+
+        return slot;
+}
+
+static void test_index(char *a, char *b) {
+        char *paths[] = { a, b };
+        char path[256];
+        int dirfds[2], fd;
+        Index *index;
+
+        write_file(a, "a.bin");
+        write_file(b, "a.bin");
+        write_file(b, "b.bin");
+        snprintf(path, sizeof(path), "%s/sub", b);
+        assert(mkdir(path, 0755) >= 0);
+        write_file(b, "sub/c.bin");
+        snprintf(path, sizeof(path), "%s/link", a);
+        assert(symlink(b, path) >= 0);
+
+        dirfds[0] = open(a, O_PATH|O_DIRECTORY|O_CLOEXEC);
+        dirfds[1] = open(b, O_PATH|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfds[0] >= 0 && dirfds[1] >= 0);
+
+        assert(index_new(&index, dirfds, paths, 2, NULL, changed, NULL) >= 0);
+        assert(index_get_fd(index) >= 0);
+
+        /* search order is preserved */
+        assert(lookup(index, "a.bin", dirfds) == 0);
+        assert(lookup(index, "b.bin", dirfds) == 1);
+        assert(lookup(index, "sub/c.bin", dirfds) == 1);
+        assert(lookup(index, "d.bin", dirfds) == -ENOENT);
+        assert(lookup_stat(index, "a.bin") == 0);
+        assert(lookup_stat(index, "sub/c.bin") == 1);
+        assert(lookup_stat(index, "d.bin") == -ENOENT);
+
+        /* symlinked directories are probed */
+        assert(lookup(index, "link/b.bin", dirfds) == 0);
+
+        /* files and directories appearing later on */
+        write_file(a, "d.bin");
+        snprintf(path, sizeof(path), "%s/new", a);
+        assert(mkdir(path, 0755) >= 0);
+        assert(index_process(index) >= 0);
+        write_file(a, "new/e.bin");
+        remove_file(a, "a.bin");
+        assert(index_process(index) >= 0);
+        assert(changes >= 3);
+
+        assert(lookup(index, "d.bin", dirfds) == 0);
+        assert(lookup(index, "new/e.bin", dirfds) == 0);
+        assert(lookup(index, "a.bin", dirfds) == 1);
+        assert(lookup_stat(index, "a.bin") == 1);
+
+        /* only once it was written */
+        snprintf(path, sizeof(path), "%s/f.bin", a);
+        fd = open(path, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        assert(index_process(index) >= 0);
+        assert(lookup(index, "f.bin", dirfds) == -ENOENT);
+        assert(write(fd, "x", 1) == 1);
+        close(fd);
+        assert(index_process(index) >= 0);
+        assert(lookup(index, "f.bin", dirfds) == 0);
+
+        index_free(index);
+
+        remove_file(a, "d.bin");
+        remove_file(a, "f.bin");
+        remove_file(a, "new/e.bin");
+        remove_file(a, "link");
+        snprintf(path, sizeof(path), "%s/new", a);
+        rmdir(path);
+        remove_file(b, "a.bin");
+        remove_file(b, "b.bin");
+        remove_file(b, "sub/c.bin");
+        snprintf(path, sizeof(path), "%s/sub", b);
+        rmdir(path);
+        close(dirfds[0]);
+        close(dirfds[1]);
+}
+
+static void test_index_file(char *a, char *b) {
+        char *paths[] = { a, b };
+        char file[256];
+        const IndexFileEntry *entries;
+        IndexFile *indexfile;
+        int dirfds[2];
+        Index *index;
+        size_t n;
+
+        write_file(a, "a.bin");
+        write_file(b, "a.bin");
+        write_file(b, "b.bin");
+
+        dirfds[0] = open(a, O_PATH|O_DIRECTORY|O_CLOEXEC);
+        dirfds[1] = open(b, O_PATH|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfds[0] >= 0 && dirfds[1] >= 0);
+
+        snprintf(file, sizeof(file), "%s/index", b);
+        assert(index_file_write(file, dirfds, paths, 2) >= 0);
+
+        assert(index_file_open(&indexfile, file) >= 0);
+        assert(index_file_get_n_slots(indexfile) == 2);
+        assert(!strcmp(index_file_get_slot_path(indexfile, 1), b));
+        entries = index_file_lookup(indexfile, "a.bin", &n);
+        assert(entries && n == 2);
+        assert(entries[0].slot == 0 && entries[1].slot == 1);
+        entries = index_file_lookup(indexfile, "b.bin", &n);
+        assert(entries && n == 1);
+        assert(!index_file_lookup(indexfile, "c.bin", &n) && n == 0);
+        index_file_free(indexfile);
+
+        /* "b" changed after the index was written, so only "a" is mapped */
+        write_file(b, "c.bin");
+
+        assert(index_new(&index, dirfds, paths, 2, file, changed, NULL) >= 0);
+        assert(lookup(index, "a.bin", dirfds) == 0);
+        assert(lookup(index, "b.bin", dirfds) == 1);
+        assert(lookup(index, "c.bin", dirfds) == 1);
+
+        /* changes to a mapped directory are tracked */
+        remove_file(a, "a.bin");
+        write_file(a, "d.bin");
+        assert(index_process(index) >= 0);
+        assert(lookup(index, "a.bin", dirfds) == 1);
+        assert(lookup(index, "d.bin", dirfds) == 0);
+        index_free(index);
+
+        remove_file(a, "d.bin");
+        remove_file(b, "a.bin");
+        remove_file(b, "b.bin");
+        remove_file(b, "c.bin");
+        remove_file(b, "index");
+        close(dirfds[0]);
+        close(dirfds[1]);
+}
+
+static void test_index_missing(char *a) {
+        char path[256], dir[256];
+        char *paths[] = { path };
+        int dirfds[1] = { -1 };
+        Index *index;
+
+        snprintf(path, sizeof(path), "%s/missing/sub", a);
+
+        assert(index_new(&index, dirfds, paths, 1, NULL, changed, NULL) >= 0);
+        assert(lookup(index, "a.bin", dirfds) == -ENOENT);
+        assert(dirfds[0] < 0);
+
+        /* the search dir shows up one component at a time */
+        snprintf(dir, sizeof(dir), "%s/missing", a);
+        assert(mkdir(dir, 0755) >= 0);
+        assert(index_process(index) >= 0);
+        assert(dirfds[0] < 0);
+        assert(mkdir(path, 0755) >= 0);
+        assert(index_process(index) >= 0);
+        assert(dirfds[0] >= 0);
+
+        write_file(path, "a.bin");
+        assert(index_process(index) >= 0);
+        assert(lookup(index, "a.bin", dirfds) == 0);
+
+        index_free(index);
+
+        remove_file(path, "a.bin");
+        rmdir(path);
+        rmdir(dir);
+        close(dirfds[0]);
+}
+
+static void test_index_replaced(char *a) {
+        char path[256], old[256];
+        char *paths[] = { path };
+        int dirfds[1];
+        Index *index;
+
+        snprintf(path, sizeof(path), "%s/dir", a);
+        snprintf(old, sizeof(old), "%s/old", a);
+        assert(mkdir(path, 0755) >= 0);
+        write_file(path, "a.bin");
+
+        dirfds[0] = open(path, O_PATH|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfds[0] >= 0);
+
+        assert(index_new(&index, dirfds, paths, 1, NULL, changed, NULL) >= 0);
+        assert(lookup(index, "a.bin", dirfds) == 0);
+        assert(index_refresh(index) == 0);
+
+        /* a new directory takes the place of the one that is open */
+        assert(rename(path, old) >= 0);
+        assert(mkdir(path, 0755) >= 0);
+        write_file(path, "b.bin");
+        assert(index_process(index) >= 0);
+        assert(index_refresh(index) == 0);
+
+        assert(lookup(index, "a.bin", dirfds) == -ENOENT);
+        assert(lookup(index, "b.bin", dirfds) == 0);
+
+        /* as after a mount, which inotify does not report */
+        remove_file(old, "a.bin");
+        rmdir(old);
+        assert(rename(path, old) >= 0);
+        assert(mkdir(path, 0755) >= 0);
+        write_file(path, "c.bin");
+        assert(index_refresh(index) == 1);
+        assert(lookup(index, "b.bin", dirfds) == -ENOENT);
+        assert(lookup(index, "c.bin", dirfds) == 0);
+        assert(index_process(index) >= 0);
+        assert(lookup(index, "c.bin", dirfds) == 0);
+
+        index_free(index);
+
+        remove_file(old, "b.bin");
+        remove_file(path, "c.bin");
+        rmdir(old);
+        rmdir(path);
+        close(dirfds[0]);
+}
+
+int main(int argc, char **argv) {
+        char a[] = "/tmp/test-index-XXXXXX";
+        char b[] = "/tmp/test-index-XXXXXX";
+
+        assert(mkdtemp(a));
+        assert(mkdtemp(b));
+
+        test_index(a, b);
+        test_index_file(a, b);
+        test_index_missing(a);
+        test_index_replaced(a);
+
+        rmdir(a);
+        rmdir(b);
+
+        return 0;
+}
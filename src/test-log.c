@@ -0,0 +1,165 @@
+/*
+ * Tests for the logging, right away and through the ring
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log-util.h"
+#include "macro.h"
+
+#define N_BURST (3000)
+
+/* points stdout and stderr to fresh files, which are returned */
+static void redirect(int *outfd, int *errfd) {
+        char out[] = "/tmp/test-log-out-XXXXXX";
+        char err[] = "/tmp/test-log-err-XXXXXX";
+
+        fflush(stdout);
+        fflush(stderr);
+
+        *outfd = mkstemp(out);
+        *errfd = mkstemp(err);
+        assert(*outfd >= 0 && *errfd >= 0);
+        unlink(out);
+        unlink(err);
+
+        assert(dup2(*outfd, STDOUT_FILENO) == STDOUT_FILENO);
+        assert(dup2(*errfd, STDERR_FILENO) == STDERR_FILENO);
+}
+
+static char *slurp(int fd) {
+        struct stat st;
+        char *buf;
+
+        fflush(stdout);
+        fflush(stderr);
+
+        assert(fstat(fd, &st) >= 0);
+        buf = calloc(1, st.st_size + 1);
+        assert(buf);
+        assert(pread(fd, buf, st.st_size, 0) == st.st_size);
+        close(fd);
+
+        return buf;
+}
+
+static void test_direct(void) {
+        _cleanup_free_ char *out = NULL, *err = NULL;
+        int outfd, errfd;
+
+        redirect(&outfd, &errfd);
+
+        log_info("info %d", 1);
+        log_error("error %s", "two");
+        log_debug("not shown");
+
+        __atomic_store_n(&log_max_level, LOG_ERR, __ATOMIC_RELAXED);
+        log_warn("not shown either");
+        __atomic_store_n(&log_max_level, LOG_INFO, __ATOMIC_RELAXED);
+
+        errno = ENOENT;
+        log_warn("warning: %m");
+
+        out = slurp(outfd);
+        err = slurp(errfd);
+        assert(!strcmp(out, "info 1\n"));
+        assert(!strcmp(err, "error two\nwarning: No such file or directory\n"));
+}
+
+static void test_ring(void) {
+        _cleanup_free_ char *out = NULL, *err = NULL;
+        char padding[200];
+        LogStats stats;
+        const char *p;
+        int outfd, errfd, last = -1;
+        unsigned int lines = 0;
+
+        redirect(&outfd, &errfd);
+
+        assert(log_ring_start(1024) == -EINVAL);
+        assert(log_ring_start(64 * 1024) >= 0);
+        assert(log_ring_start(64 * 1024) == -EBUSY);
+
+        /* more than the ring holds at once, so that it wraps around */
+        memset(padding, 'x', sizeof(padding) - 1);
+        padding[sizeof(padding) - 1] = '\0';
+        for (int i = 0; i < 900; i++)
+                log_info("line %d %s", i, padding);
+
+        log_get_stats(&stats);
+        assert(stats.written + stats.suppressed == 900);
+
+        log_ring_stop();
+        log_ring_stop();
+
+        /* right away again */
+        log_error("done");
+
+        out = slurp(outfd);
+        err = slurp(errfd);
+
+        /* whatever made it is complete, and in order */
+        for (p = out; *p; p = strchr(p, '\n') + 1) {
+                int i;
+
+                assert(sscanf(p, "line %d ", &i) == 1);
+                assert(i > last);
+                assert(!strncmp(strchr(p + 5, ' ') + 1, padding, strlen(padding)));
+                last = i;
+                lines++;
+        }
+
+        /* and all that was queued is written on the way out, the count of the rest too */
+        assert(lines == stats.written);
+        assert(!!strstr(err, " messages suppressed\n") == (stats.suppressed > 0));
+        assert(strstr(err, "done\n"));
+}
+
+static void test_ratelimit(void) {
+        _cleanup_free_ char *out = NULL, *err = NULL;
+        LogStats stats;
+        int outfd, errfd;
+
+        redirect(&outfd, &errfd);
+
+        assert(log_ring_start(1024 * 1024) >= 0);
+
+        for (int i = 0; i < N_BURST; i++)
+                log_info("burst %d", i);
+
+        log_get_stats(&stats);
+        assert(stats.written + stats.suppressed == N_BURST);
+        /* the burst may straddle a second, but not two */
+        assert(stats.suppressed >= N_BURST - 2000);
+
+        /* the summary is not lost on the way out */
+        log_ring_stop();
+
+        out = slurp(outfd);
+        err = slurp(errfd);
+        assert(strstr(out, "burst 0\n"));
+        assert(strstr(err, " messages suppressed\n"));
+}
+
+int main(int argc, char **argv) {
+        int out, err;
+
+        out = dup(STDOUT_FILENO);
+        err = dup(STDERR_FILENO);
+
+        test_direct();
+        test_ring();
+        test_ratelimit();
+
+        dup2(out, STDOUT_FILENO);
+        dup2(err, STDERR_FILENO);
+
+        return 0;
+}
@@ -0,0 +1,331 @@
+/*
+ * Tests for the manager, on a simulated sysfs tree, fed uevents through a socket
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "firmwared.h"
+#include "manager.h"
+#include "transfer.h"
+
+#define CHUNK_SIZE (4096)
+#define N_CHUNKS (3)
+
+char **firmware_dirs = NULL;
+size_t firmware_dirs_size;
+
+static void msleep(unsigned int msec) {
+        struct timespec ts = { .tv_sec = msec / 1000, .tv_nsec = (msec % 1000) * 1000000L };
+
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                ;
+}
+
+static void write_file(int dirfd, const char *name, const char *content) {
+        int fd;
+
+        fd = openat(dirfd, name, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        assert(write(fd, content, strlen(content)) == (ssize_t)strlen(content));
+        close(fd);
+}
+
+typedef struct TestConfig {
+        unsigned int n_threads;
+        const char *priority_rules;
+} TestConfig;
+
+/* the daemon, until SIGTERM */
+static void run_manager(const char *root, const TestConfig *test) {
+        char firmware[256], sys[256], socket_path[256], rules[256];
+        char *dirs[] = { firmware };
+        ManagerConfig config = {
+                .tentative = true,
+                .cache_size = 1024 * 1024,
+                .engine = MANAGER_ENGINE_THREADS,
+                .n_threads = test->n_threads,
+                .transfer = TRANSFER_AUTO,
+                .chunk_size = TRANSFER_CHUNK_SIZE_DEFAULT,
+                .sysfs_path = sys,
+                .uevent_socket = socket_path,
+        };
+        Manager *manager = NULL;
+        int r;
+
+        /* not left behind by a failed test */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+        snprintf(firmware, sizeof(firmware), "%s/firmware", root);
+        snprintf(sys, sizeof(sys), "%s/sys", root);
+        snprintf(socket_path, sizeof(socket_path), "%s/uevent", root);
+        if (test->priority_rules) {
+                snprintf(rules, sizeof(rules), "%s/%s", root, test->priority_rules);
+                config.priority_rules_path = rules;
+        }
+
+        firmware_dirs = dirs;
+        firmware_dirs_size = 1;
+
+        r = manager_new(&manager, &config);
+        if (r >= 0)
+                r = manager_run(manager);
+        if (manager)
+                manager_free(manager);
+
+        _exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static pid_t start_manager(const char *root, const TestConfig *test) {
+        pid_t pid;
+
+        pid = fork();
+        assert(pid >= 0);
+        if (pid == 0)
+                run_manager(root, test);
+
+        return pid;
+}
+
+static void stop_manager(pid_t pid) {
+        int status;
+
+        assert(kill(pid, SIGTERM) >= 0);
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+/* the firmware dir and a sysfs tree without devices */
+static void make_tree(int rootfd) {
+        assert(mkdirat(rootfd, "firmware", 0755) >= 0);
+        assert(mkdirat(rootfd, "sys", 0755) >= 0);
+        assert(mkdirat(rootfd, "sys/class", 0755) >= 0);
+        assert(mkdirat(rootfd, "sys/class/firmware", 0755) >= 0);
+        write_file(rootfd, "sys/class/firmware/timeout", "60\n");
+        assert(mkdirat(rootfd, "sys/devices", 0755) >= 0);
+        assert(mkdirat(rootfd, "sys/devices/virtual", 0755) >= 0);
+        assert(mkdirat(rootfd, "sys/devices/virtual/firmware", 0755) >= 0);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+        remove(path);
+        return 0;
+}
+
+static void remove_tree(const char *root) {
+        nftw(root, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+}
+
+/*
+ * Adds a device asking for firmware. Its "loading" is a FIFO; until it is
+ * opened for reading, by open_loading(), an upload to the device blocks.
+ */
+static void add_device(int rootfd, const char *device) {
+        char path[256];
+
+        snprintf(path, sizeof(path), "sys/devices/virtual/firmware/%s", device);
+        assert(mkdirat(rootfd, path, 0755) >= 0);
+        snprintf(path, sizeof(path), "sys/devices/virtual/firmware/%s/loading", device);
+        assert(mkfifoat(rootfd, path, 0644) >= 0);
+        snprintf(path, sizeof(path), "sys/devices/virtual/firmware/%s/data", device);
+        write_file(rootfd, path, "");
+}
+
+static int open_loading(int rootfd, const char *device) {
+        char path[256];
+        int fd;
+
+        snprintf(path, sizeof(path), "sys/devices/virtual/firmware/%s/loading", device);
+        fd = openat(rootfd, path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+        assert(fd >= 0);
+
+        return fd;
+}
+
+static void send_uevent(const char *root, const char *device, const char *name) {
+        static unsigned int seqnum;
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        char buf[512];
+        int fd, n;
+
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/uevent", root);
+
+        /* the daemon binds it once it is up */
+        for (unsigned int i = 0; access(addr.sun_path, F_OK) < 0; i++) {
+                assert(i < 500);
+                msleep(10);
+        }
+
+        n = snprintf(buf, sizeof(buf),
+                     "add@/devices/virtual/firmware/%s%cACTION=add%cDEVPATH=/devices/virtual/firmware/%s%c"
+                     "SUBSYSTEM=firmware%cFIRMWARE=%s%cSEQNUM=%u%c",
+                     device, 0, 0, device, 0, 0, name, 0, ++seqnum, 0);
+
+        fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+        assert(fd >= 0);
+        assert(sendto(fd, buf, n, 0, (struct sockaddr *)&addr, sizeof(addr)) == n);
+        close(fd);
+}
+
+/* what the daemon wrote to "loading", once it set it back to 0 */
+static void read_loading(int fd, char *buf, size_t size) {
+        size_t len = strlen(buf);
+
+        for (unsigned int i = 0; !strstr(buf, "0\n"); i++) {
+                struct pollfd p = { .fd = fd, .events = POLLIN };
+                ssize_t n;
+
+                assert(i < 500);
+
+                if (poll(&p, 1, 10) <= 0)
+                        continue;
+
+                n = read(fd, buf + len, size - len - 1);
+                if (n <= 0) {
+                        /* no writer at the moment */
+                        msleep(10);
+                        continue;
+                }
+
+                len += n;
+                buf[len] = '\0';
+        }
+}
+
+/*
+ * A request waiting in tentative mode for its firmware is only served once the
+ * file is complete, not as soon as it is created.
+ */
+static void test_tentative_partial_write(const char *root) {
+        TestConfig test = { .n_threads = 1 };
+        char blob[N_CHUNKS * CHUNK_SIZE], data[sizeof(blob) + 1], loading[64] = "";
+        int rootfd, loadingfd, datafd, fd;
+        pid_t pid;
+
+        rootfd = open(root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(rootfd >= 0);
+
+        make_tree(rootfd);
+        add_device(rootfd, "dev0");
+        loadingfd = open_loading(rootfd, "dev0");
+
+        pid = start_manager(root, &test);
+
+        send_uevent(root, "dev0", "late.bin");
+
+        /* parked, as there is no such firmware */
+        msleep(100);
+
+        for (size_t i = 0; i < sizeof(blob); i++)
+                blob[i] = 'a' + i % 23;
+
+        /* copied in slowly, as by cp from a slow disk */
+        fd = openat(rootfd, "firmware/late.bin", O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        for (unsigned int i = 0; i < N_CHUNKS; i++) {
+                msleep(100);
+                assert(write(fd, blob + i * CHUNK_SIZE, CHUNK_SIZE) == CHUNK_SIZE);
+        }
+        close(fd);
+
+        read_loading(loadingfd, loading, sizeof(loading));
+        assert(!strcmp(loading, "1\n0\n"));
+
+        datafd = openat(rootfd, "sys/devices/virtual/firmware/dev0/data", O_RDONLY|O_CLOEXEC);
+        assert(datafd >= 0);
+        assert(read(datafd, data, sizeof(data)) == sizeof(blob));
+        assert(!memcmp(data, blob, sizeof(blob)));
+        close(datafd);
+
+        stop_manager(pid);
+
+        close(loadingfd);
+        close(rootfd);
+        remove_tree(root);
+}
+
+/*
+ * With every worker stuck on a slow upload, requests wait in the queue; the
+ * first worker to be free takes the one that goes first, not the oldest.
+ */
+static void test_priority_behind_slow(const char *root) {
+        TestConfig test = { .n_threads = 2, .priority_rules = "rules" };
+        char loading[4][64] = {};
+        int rootfd, fds[4];
+        pid_t pid;
+
+        rootfd = open(root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(rootfd >= 0);
+
+        make_tree(rootfd);
+        write_file(rootfd, "rules", "name high.bin -10\n");
+        write_file(rootfd, "firmware/slow.bin", "slow");
+        write_file(rootfd, "firmware/low.bin", "low");
+        write_file(rootfd, "firmware/high.bin", "high");
+        for (unsigned int i = 0; i < 4; i++) {
+                char device[8];
+
+                snprintf(device, sizeof(device), "dev%u", i);
+                add_device(rootfd, device);
+        }
+
+        pid = start_manager(root, &test);
+
+        /* both workers block, opening "loading" */
+        send_uevent(root, "dev0", "slow.bin");
+        send_uevent(root, "dev1", "slow.bin");
+        msleep(100);
+
+        /* queued one after the other, not ranked in one go */
+        send_uevent(root, "dev2", "low.bin");
+        msleep(100);
+        send_uevent(root, "dev3", "high.bin");
+        msleep(100);
+
+        /* one worker is free again, and must not take the low priority request */
+        fds[0] = open_loading(rootfd, "dev0");
+        read_loading(fds[0], loading[0], sizeof(loading[0]));
+        fds[3] = open_loading(rootfd, "dev3");
+        read_loading(fds[3], loading[3], sizeof(loading[3]));
+        assert(!strcmp(loading[3], "1\n0\n"));
+
+        fds[1] = open_loading(rootfd, "dev1");
+        read_loading(fds[1], loading[1], sizeof(loading[1]));
+        fds[2] = open_loading(rootfd, "dev2");
+        read_loading(fds[2], loading[2], sizeof(loading[2]));
+
+        stop_manager(pid);
+
+        for (unsigned int i = 0; i < 4; i++) {
+                assert(!strcmp(loading[i], "1\n0\n"));
+                close(fds[i]);
+        }
+        close(rootfd);
+        remove_tree(root);
+}
+
+int main(int argc, char **argv) {
+        char root[] = "/tmp/test-manager-XXXXXX";
+
+        assert(mkdtemp(root));
+        test_tentative_partial_write(root);
+
+        assert(mkdtemp(strcpy(root, "/tmp/test-manager-XXXXXX")));
+        test_priority_behind_slow(root);
+
+        return 0;
+}
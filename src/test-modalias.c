@@ -0,0 +1,146 @@
+/*
+ * Tests for the modalias map
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "modalias.h"
+
+typedef struct Seen {
+        unsigned int n;
+        char names[256];
+} Seen;
+
+static void seen_cb(const char *firmware, void *userdata) {
+        Seen *seen = userdata;
+
+        strcat(seen->names, firmware);
+        strcat(seen->names, ";");
+        seen->n++;
+}
+
+static void write_map(const char *path, const char *contents) {
+        FILE *f;
+
+        f = fopen(path, "we");
+        assert(f);
+        fputs(contents, f);
+        fclose(f);
+}
+
+static void test_lookup(void) {
+        char path[] = "/tmp/test-modalias-XXXXXX";
+        ModaliasMap *map;
+        Seen seen = {};
+        int fd;
+
+        fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+
+        write_map(path,
+                  "# firmwared modalias map 1\n"
+                  "alias pci:v00008086d00002723sv*sd*bc*sc*i* iwlwifi\n"
+                  "firmware iwlwifi iwlwifi-cc-a0-77.ucode\n"
+                  "firmware iwlwifi iwlwifi-cc-a0-72.ucode\n"
+                  "alias usb:v0BDAp8179d*dc*dsc*dp*ic*isc*ip*in* r8188eu\n"
+                  "firmware r8188eu rtlwifi/rtl8188eufw.bin\n"
+                  "firmware snd-hda-intel intel/hda.bin\n"
+                  "alias pci:v*d*sv*sd*bc01sc*i* no_firmware\n"
+                  "# a comment\n"
+                  "\n"
+                  "garbage\n"
+                  "alias incomplete\n"
+                  "module foo bar\n");
+
+        assert(modalias_map_new(&map, path) >= 0);
+        assert(modalias_map_get_n_modules(map) == 3);
+
+        assert(modalias_map_lookup(map, "pci:v00008086d00002723sv00008086sd00000084bc02sc80i00",
+                                   seen_cb, &seen) == 1);
+        assert(seen.n == 2);
+        assert(!strcmp(seen.names, "iwlwifi-cc-a0-77.ucode;iwlwifi-cc-a0-72.ucode;"));
+
+        /* modules that declare nothing are of no interest */
+        seen = (Seen) {};
+        assert(modalias_map_lookup(map, "pci:v00001234d00005678sv0sd0bc01sc06i01", seen_cb, &seen) == 0);
+        assert(seen.n == 0);
+
+        assert(modalias_map_lookup(map, "usb:v0BDAp8179d0000dc00dsc00dp00icFFiscFFipFFin00",
+                                   seen_cb, &seen) == 1);
+        assert(!strcmp(seen.names, "rtlwifi/rtl8188eufw.bin;"));
+
+        /* '-' and '_' are the same in module names */
+        seen = (Seen) {};
+        assert(modalias_map_lookup_module(map, "snd_hda_intel", seen_cb, &seen) == 1);
+        assert(modalias_map_lookup_module(map, "snd-hda-intel", seen_cb, &seen) == 1);
+        assert(seen.n == 2);
+        assert(modalias_map_lookup_module(map, "unknown", seen_cb, &seen) == 0);
+        assert(modalias_map_lookup_module(map, "", seen_cb, &seen) == 0);
+
+        modalias_map_free(map);
+
+        write_map(path, "alias pci:* foo\n");
+        assert(modalias_map_new(&map, path) == -EBADMSG);
+
+        unlink(path);
+        assert(modalias_map_new(&map, path) == -ENOENT);
+}
+
+/* patterns are tried by bus, but still in the order of the file */
+static void test_buses(void) {
+        char path[] = "/tmp/test-modalias-XXXXXX";
+        ModaliasMap *map;
+        Seen seen = {};
+        int fd;
+
+        fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+
+        write_map(path,
+                  "# firmwared modalias map 1\n"
+                  "alias pci:v00001111* first\n"
+                  "alias *v00001111* any\n"
+                  "alias p?i:v00001111* wild\n"
+                  "alias usb:v00001111* usb\n"
+                  "alias pci:v0000111* last\n"
+                  "alias nobus last\n"
+                  "firmware first first.bin\n"
+                  "firmware any any.bin\n"
+                  "firmware wild wild.bin\n"
+                  "firmware usb usb.bin\n"
+                  "firmware last last.bin\n");
+
+        assert(modalias_map_new(&map, path) >= 0);
+
+        assert(modalias_map_lookup(map, "pci:v00001111d00002222", seen_cb, &seen) == 4);
+        assert(!strcmp(seen.names, "first.bin;any.bin;wild.bin;last.bin;"));
+
+        seen = (Seen) {};
+        assert(modalias_map_lookup(map, "usb:v00001111p2222", seen_cb, &seen) == 2);
+        assert(!strcmp(seen.names, "any.bin;usb.bin;"));
+
+        /* no bus of its own, or an unknown one */
+        seen = (Seen) {};
+        assert(modalias_map_lookup(map, "nobus", seen_cb, &seen) == 1);
+        assert(!strcmp(seen.names, "last.bin;"));
+        seen = (Seen) {};
+        assert(modalias_map_lookup(map, "of:v00001111", seen_cb, &seen) == 1);
+        assert(!strcmp(seen.names, "any.bin;"));
+
+        modalias_map_free(map);
+        unlink(path);
+}
+
+int main(int argc, char **argv) {
+        test_lookup();
+        test_buses();
+
+        return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Tests for firmware packs
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pack.h"
+
+static void write_file(int dirfd, const char *name, const char *content) {
+        int fd;
+
+        fd = openat(dirfd, name, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        assert(write(fd, content, strlen(content)) == (ssize_t)strlen(content));
+        close(fd);
+}
+
+static void test_pack(int dirfd) {
+        const void *data;
+        char path[256];
+        int dirfds[2];
+        size_t size;
+        Pack *pack;
+
+        assert(mkdirat(dirfd, "a", 0755) >= 0);
+        assert(mkdirat(dirfd, "a/sub", 0755) >= 0);
+        assert(mkdirat(dirfd, "b", 0755) >= 0);
+        write_file(dirfd, "a/one.bin", "one");
+        write_file(dirfd, "a/sub/two.bin", "two");
+        write_file(dirfd, "b/one.bin", "shadowed");
+        write_file(dirfd, "b/three.bin", "three");
+
+        dirfds[0] = openat(dirfd, "a", O_PATH|O_DIRECTORY|O_CLOEXEC);
+        dirfds[1] = openat(dirfd, "b", O_PATH|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfds[0] >= 0 && dirfds[1] >= 0);
+
+        snprintf(path, sizeof(path), "/proc/self/fd/%d/firmware.pack", dirfd);
+        assert(pack_write(path, dirfds, 2) >= 0);
+        assert(pack_open(&pack, dirfd, "firmware.pack") >= 0);
+
+        assert(pack_find(pack, "one.bin", &data, &size) >= 0);
+        assert(size == 3 && !memcmp(data, "one", 3));
+        assert((uintptr_t)data % PACK_ALIGNMENT == 0);
+        assert(pack_find(pack, "sub/two.bin", &data, &size) >= 0);
+        assert(size == 3 && !memcmp(data, "two", 3));
+        assert(pack_find(pack, "three.bin", &data, &size) >= 0);
+        assert(size == 5 && !memcmp(data, "three", 5));
+        assert(pack_find(pack, "four.bin", &data, &size) == -ENOENT);
+
+        pack_free(pack);
+
+        /* anything but a pack is rejected */
+        assert(pack_open(&pack, dirfd, "b/three.bin") == -EBADMSG);
+
+        close(dirfds[0]);
+        close(dirfds[1]);
+        unlinkat(dirfd, "firmware.pack", 0);
+        unlinkat(dirfd, "a/one.bin", 0);
+        unlinkat(dirfd, "a/sub/two.bin", 0);
+        unlinkat(dirfd, "b/one.bin", 0);
+        unlinkat(dirfd, "b/three.bin", 0);
+        unlinkat(dirfd, "a/sub", AT_REMOVEDIR);
+        unlinkat(dirfd, "a", AT_REMOVEDIR);
+        unlinkat(dirfd, "b", AT_REMOVEDIR);
+}
+
+int main(int argc, char **argv) {
+        char dir[] = "/tmp/test-pack-XXXXXX";
+        int dirfd;
+
+        assert(mkdtemp(dir));
+        dirfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(dirfd >= 0);
+
+        test_pack(dirfd);
+
+        close(dirfd);
+        rmdir(dir);
+
+        return 0;
+}
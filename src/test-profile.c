@@ -0,0 +1,108 @@
+/*
+ * Tests for the boot profile
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "profile.h"
+
+static void test_record(void) {
+        Profile *p;
+        char name[32];
+
+        assert(profile_new(&p) >= 0);
+
+        assert(profile_record(p, "a.bin", 10) == 1);
+        assert(profile_record(p, "b/c.bin", 20) == 1);
+        assert(profile_record(p, "a.bin", 30) == 0);
+        assert(profile_record(p, "", 40) == -EINVAL);
+        assert(profile_record(p, "d\n.bin", 40) == -EINVAL);
+
+        assert(profile_get_size(p) == 2);
+        assert(!strcmp(profile_get_name(p, 0), "a.bin"));
+        assert(profile_get_usec(p, 0) == 10);
+        assert(!strcmp(profile_get_name(p, 1), "b/c.bin"));
+        assert(profile_get_usec(p, 1) == 20);
+
+        /* a full profile drops the rest */
+        for (unsigned int i = 0; profile_get_size(p) < PROFILE_ENTRIES_MAX; i++) {
+                snprintf(name, sizeof(name), "fw-%u.bin", i);
+                assert(profile_record(p, name, i) == 1);
+        }
+        assert(profile_record(p, "late.bin", 1) == 0);
+
+        profile_free(p);
+}
+
+static void test_save_load(void) {
+        char path[] = "/tmp/test-profile-XXXXXX";
+        Profile *p;
+        FILE *f;
+        int fd;
+
+        fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+
+        assert(profile_new(&p) >= 0);
+        assert(profile_record(p, "first.bin", 100) == 1);
+        assert(profile_record(p, "with space.bin", 200) == 1);
+        assert(profile_save(p, path) >= 0);
+        profile_free(p);
+
+        assert(profile_new(&p) >= 0);
+        assert(profile_load(p, path) >= 0);
+        assert(profile_get_size(p) == 2);
+        assert(!strcmp(profile_get_name(p, 0), "first.bin"));
+        assert(profile_get_usec(p, 0) == 100);
+        assert(!strcmp(profile_get_name(p, 1), "with space.bin"));
+        assert(profile_get_usec(p, 1) == 200);
+        profile_free(p);
+
+        /* damaged lines are skipped */
+        f = fopen(path, "we");
+        assert(f);
+        fputs("# firmwared boot profile 1\n"
+              "garbage\n"
+              "5\n"
+              "7 good.bin\n"
+              "-\n"
+              "9 also-good.bin", f);
+        fclose(f);
+
+        assert(profile_new(&p) >= 0);
+        assert(profile_load(p, path) >= 0);
+        assert(profile_get_size(p) == 2);
+        assert(!strcmp(profile_get_name(p, 0), "good.bin"));
+        assert(!strcmp(profile_get_name(p, 1), "also-good.bin"));
+        profile_free(p);
+
+        /* another format is not guessed at */
+        f = fopen(path, "we");
+        assert(f);
+        fputs("# firmwared boot profile 2\n1 a.bin\n", f);
+        fclose(f);
+
+        assert(profile_new(&p) >= 0);
+        assert(profile_load(p, path) == -EBADMSG);
+        assert(profile_get_size(p) == 0);
+        profile_free(p);
+
+        unlink(path);
+
+        assert(profile_new(&p) >= 0);
+        assert(profile_load(p, path) == -ENOENT);
+        profile_free(p);
+}
+
+int main(int argc, char **argv) {
+        test_record();
+        test_save_load();
+
+        return 0;
+}
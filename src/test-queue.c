@@ -0,0 +1,198 @@
+/*
+ * Tests for the request queue and the priority rules
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "priority.h"
+#include "queue.h"
+
+static void push_deadline(RequestQueue *q, const char *name, int priority, uint64_t size, uint64_t deadline,
+                          uint64_t now) {
+        Request *request;
+
+        assert(request_new(&request, "/devices/foo", name) >= 0);
+        request->priority = priority;
+        request->size = size;
+        request->deadline = deadline;
+        assert(request_queue_push(q, request, now) >= 0);
+}
+
+static void push(RequestQueue *q, const char *name, int priority, uint64_t size, uint64_t now) {
+        push_deadline(q, name, priority, size, UINT64_MAX, now);
+}
+
+static void check_pop(RequestQueue *q, uint64_t now, const char *name, bool starved) {
+        Request *request;
+        bool s;
+
+        request = request_queue_pop(q, now, &s);
+        assert(request);
+        assert(!strcmp(request->name, name));
+        assert(s == starved);
+        request_free(request);
+}
+
+static void test_order(void) {
+        RequestQueue *q;
+
+        assert(request_queue_new(&q, 1000) >= 0);
+        assert(!request_queue_pop(q, 0, NULL));
+
+        push(q, "gpu", 0, 30000000, 0);
+        push(q, "wifi", 0, 2000000, 0);
+        push(q, "nic", -10, 500000, 0);
+        push(q, "missing", 0, 0, 0);
+        push(q, "wifi-2", 0, 2000000, 0);
+        push(q, "audio", 10, 100, 0);
+        assert(request_queue_size(q) == 6);
+
+        /* by priority, then smallest first, then in order */
+        check_pop(q, 10, "nic", false);
+        check_pop(q, 10, "missing", false);
+        check_pop(q, 10, "wifi", false);
+        check_pop(q, 10, "wifi-2", false);
+        check_pop(q, 10, "gpu", false);
+        check_pop(q, 10, "audio", false);
+        assert(request_queue_size(q) == 0);
+
+        request_queue_free(q);
+}
+
+static void test_deadline(void) {
+        RequestQueue *q;
+
+        assert(request_queue_new(&q, UINT64_MAX) >= 0);
+
+        push_deadline(q, "late", 0, 10, 60000, 0);
+        push_deadline(q, "big-soon", 0, 30000000, 50000, 0);
+        push_deadline(q, "small-soon", 0, 100, 50000, 0);
+        push_deadline(q, "never", 0, 1, UINT64_MAX, 0);
+        push_deadline(q, "urgent-but-unimportant", 1, 1, 1000, 0);
+
+        /* earliest deadline first within a priority, the smaller one on a tie */
+        check_pop(q, 0, "small-soon", false);
+        check_pop(q, 0, "big-soon", false);
+        check_pop(q, 0, "late", false);
+        check_pop(q, 0, "never", false);
+        check_pop(q, 0, "urgent-but-unimportant", false);
+
+        request_queue_free(q);
+}
+
+static void test_starvation(void) {
+        RequestQueue *q;
+        char name[32];
+
+        assert(request_queue_new(&q, 1000) >= 0);
+
+        push(q, "big", 0, 1000000, 0);
+        push(q, "huge", 0, 2000000, 100);
+
+        /* a stream of small ones keeps the big one waiting, for a while */
+        for (unsigned int i = 0; i < 5; i++) {
+                snprintf(name, sizeof(name), "small-%u", i);
+                push(q, name, 0, 10, 200 + i);
+        }
+
+        check_pop(q, 500, "small-0", false);
+        check_pop(q, 999, "small-1", false);
+        check_pop(q, 1000, "big", true);
+        check_pop(q, 1050, "small-2", false);
+        check_pop(q, 1100, "huge", true);
+        check_pop(q, 1100, "small-3", false);
+        check_pop(q, 5000, "small-4", false);
+
+        /* queued requests are freed along */
+        push(q, "left", 0, 0, 0);
+        request_queue_free(q);
+}
+
+static void test_heap(void) {
+        RequestQueue *q;
+        uint64_t last = 0;
+
+        assert(request_queue_new(&q, UINT64_MAX) >= 0);
+
+        for (unsigned int i = 0; i < 1000; i++) {
+                char name[32];
+
+                snprintf(name, sizeof(name), "%u", i);
+                push(q, name, 0, (uint64_t)rand() % 10000, 0);
+        }
+
+        for (unsigned int i = 0; i < 1000; i++) {
+                Request *request = request_queue_pop(q, 0, NULL);
+
+                assert(request);
+                assert(request->size >= last);
+                last = request->size;
+                request_free(request);
+        }
+
+        request_queue_free(q);
+}
+
+static void test_rules(void) {
+        char path[] = "/tmp/test-queue-XXXXXX";
+        PriorityRules *rules;
+        FILE *f;
+        int fd;
+
+        fd = mkstemp(path);
+        assert(fd >= 0);
+        f = fdopen(fd, "we");
+        assert(f);
+        fputs("# storage first\n"
+              "subsystem nvme -20\n"
+              "name rtl_nic/* -10\n"
+              "\n"
+              "  # indented comment\n"
+              "name amdgpu/* 20\n"
+              "name * 5\n"
+              "bogus line\n"
+              "name missing-priority\n"
+              "name x 1 trailing\n", f);
+        fclose(f);
+
+        assert(priority_rules_new(&rules, path) >= 0);
+        assert(priority_rules_need_subsystem(rules));
+
+        assert(priority_rules_lookup(rules, "rtl_nic/rtl8168h-2.fw", "pci") == -10);
+        assert(priority_rules_lookup(rules, "whatever.bin", "nvme") == -20);
+        assert(priority_rules_lookup(rules, "amdgpu/navi10_sos.bin", NULL) == 20);
+        assert(priority_rules_lookup(rules, "iwlwifi-cc-a0-77.ucode", NULL) == 5);
+        assert(priority_rules_lookup(rules, "x", NULL) == 5);
+
+        priority_rules_free(rules);
+
+        f = fopen(path, "we");
+        assert(f);
+        fputs("name foo.bin -1\n", f);
+        fclose(f);
+
+        assert(priority_rules_new(&rules, path) >= 0);
+        assert(!priority_rules_need_subsystem(rules));
+        assert(priority_rules_lookup(rules, "foo.bin", NULL) == -1);
+        assert(priority_rules_lookup(rules, "bar.bin", NULL) == 0);
+        priority_rules_free(rules);
+
+        unlink(path);
+        assert(priority_rules_new(&rules, path) == -ENOENT);
+}
+
+int main(int argc, char **argv) {
+        test_order();
+        test_deadline();
+        test_starvation();
+        test_heap();
+        test_rules();
+
+        return 0;
+}
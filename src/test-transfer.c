@@ -0,0 +1,221 @@
+/*
+ * Tests for the transfer strategies and their tuner
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "transfer.h"
+
+#define BLOB_SIZE (300 * 1024 + 17)
+
+static int blob_new(char *path, char **blobp) {
+        char *blob;
+        int fd;
+
+        blob = malloc(BLOB_SIZE);
+        assert(blob);
+        for (size_t i = 0; i < BLOB_SIZE; i++)
+                blob[i] = (char)rand();
+
+        fd = mkostemp(path, O_CLOEXEC);
+        assert(fd >= 0);
+        assert(write(fd, blob, BLOB_SIZE) == BLOB_SIZE);
+
+        *blobp = blob;
+        return fd;
+}
+
+static void check_copy(const char *blob, int fd, size_t size) {
+        char *buf;
+
+        buf = malloc(size + 1);
+        assert(buf);
+        assert(pread(fd, buf, size + 1, 0) == (ssize_t)size);
+        assert(!memcmp(buf, blob, size));
+        free(buf);
+}
+
+static void test_copy(void) {
+        char source[] = "/tmp/test-transfer-XXXXXX";
+        char *blob;
+        int firmwarefd;
+
+        firmwarefd = blob_new(source, &blob);
+
+        for (TransferStrategy s = 0; s < _TRANSFER_MAX; s++) {
+                char target[] = "/tmp/test-transfer-XXXXXX";
+                size_t done;
+                int datafd;
+
+                datafd = mkostemp(target, O_CLOEXEC);
+                assert(datafd >= 0);
+
+                /* the source's own offset does not matter */
+                assert(lseek(firmwarefd, 1234, SEEK_SET) == 1234);
+
+                assert(transfer_copy(s, datafd, firmwarefd, BLOB_SIZE, 4096, &done) >= 0);
+                assert(done == BLOB_SIZE);
+                check_copy(blob, datafd, BLOB_SIZE);
+
+                /* a file that is shorter than claimed */
+                assert(ftruncate(datafd, 0) >= 0);
+                assert(lseek(datafd, 0, SEEK_SET) == 0);
+                assert(transfer_copy(s, datafd, firmwarefd, BLOB_SIZE + 1, 4096, &done) < 0);
+
+                close(datafd);
+                unlink(target);
+        }
+
+        close(firmwarefd);
+        unlink(source);
+        free(blob);
+}
+
+static void test_strategy_names(void) {
+        for (TransferStrategy s = 0; s < _TRANSFER_MAX; s++)
+                assert(transfer_strategy_from_string(transfer_strategy_to_string(s)) == s);
+
+        assert(transfer_strategy_from_string("auto") == TRANSFER_AUTO);
+        assert(transfer_strategy_from_string("carrier-pigeon") == _TRANSFER_MAX);
+}
+
+static void test_tuner(void) {
+        TransferStats stats;
+        Transfer *t;
+        unsigned int picked[_TRANSFER_MAX] = {};
+
+        assert(transfer_new(&t, TRANSFER_AUTO, 4096) >= 0);
+
+        /* every strategy is measured twice first */
+        for (unsigned int i = 0; i < 2 * _TRANSFER_MAX; i++) {
+                TransferStrategy s = transfer_choose(t, 1, 1000);
+
+                assert(s == (TransferStrategy)(i / 2));
+                transfer_record(t, s, 1, 1000, s == TRANSFER_MMAP ? 10 : 100);
+        }
+
+        /* then the fastest wins, except for an occasional second look */
+        for (unsigned int i = 0; i < 256; i++)
+                picked[transfer_choose(t, 1, 1000)]++;
+        assert(picked[TRANSFER_MMAP] >= 250);
+
+        /* other sizes and filesystems are measured on their own */
+        assert(transfer_choose(t, 1, 10 * 1024 * 1024) == TRANSFER_SENDFILE);
+        assert(transfer_choose(t, 2, 1000) == TRANSFER_SENDFILE);
+
+        transfer_get_stats(t, TRANSFER_MMAP, &stats);
+        assert(stats.transfers == 2);
+        assert(stats.bytes == 2000);
+        assert(stats.usec == 20);
+
+        transfer_free(t);
+
+        /* a fixed strategy is never second-guessed */
+        assert(transfer_new(&t, TRANSFER_SPLICE, 4096) >= 0);
+        for (unsigned int i = 0; i < 100; i++)
+                assert(transfer_choose(t, 1, 1000) == TRANSFER_SPLICE);
+        transfer_free(t);
+
+        assert(transfer_new(&t, TRANSFER_AUTO, 0) == -EINVAL);
+}
+
+static void test_run(void) {
+        char source[] = "/tmp/test-transfer-XXXXXX";
+        char target[] = "/tmp/test-transfer-XXXXXX";
+        uint64_t transfers = 0;
+        Transfer *t;
+        char *blob;
+        int firmwarefd, datafd;
+
+        firmwarefd = blob_new(source, &blob);
+        datafd = mkostemp(target, O_CLOEXEC);
+        assert(datafd >= 0);
+
+        assert(transfer_new(&t, TRANSFER_AUTO, TRANSFER_CHUNK_SIZE_DEFAULT) >= 0);
+
+        for (unsigned int i = 0; i < 3 * _TRANSFER_MAX; i++) {
+                assert(ftruncate(datafd, 0) >= 0);
+                assert(lseek(datafd, 0, SEEK_SET) == 0);
+                assert(transfer_run(t, datafd, firmwarefd, BLOB_SIZE, 0) >= 0);
+                check_copy(blob, datafd, BLOB_SIZE);
+        }
+
+        for (TransferStrategy s = 0; s < _TRANSFER_MAX; s++) {
+                TransferStats stats;
+
+                transfer_get_stats(t, s, &stats);
+                assert(stats.bytes == stats.transfers * BLOB_SIZE);
+                transfers += stats.transfers;
+        }
+        assert(transfers == 3 * _TRANSFER_MAX);
+
+        transfer_free(t);
+        close(datafd);
+        unlink(target);
+        close(firmwarefd);
+        unlink(source);
+        free(blob);
+}
+
+/* a strategy refused by some files is still tried for others */
+static void test_unsupported(void) {
+        char source[] = "/tmp/test-transfer-XXXXXX";
+        char target[] = "/tmp/test-transfer-XXXXXX";
+        TransferStats stats;
+        Transfer *t;
+        char *blob;
+        int firmwarefd, datafd, appendfd;
+
+        firmwarefd = blob_new(source, &blob);
+        datafd = mkostemp(target, O_CLOEXEC);
+        assert(datafd >= 0);
+        appendfd = open(target, O_WRONLY|O_APPEND|O_CLOEXEC);
+        assert(appendfd >= 0);
+
+        assert(transfer_new(&t, TRANSFER_AUTO, TRANSFER_CHUNK_SIZE_DEFAULT) >= 0);
+
+        /* sendfile() and splice() refuse to append, read-write takes over */
+        for (unsigned int i = 0; i < 2; i++) {
+                assert(ftruncate(datafd, 0) >= 0);
+                assert(transfer_run(t, appendfd, firmwarefd, BLOB_SIZE, 1) >= 0);
+                check_copy(blob, datafd, BLOB_SIZE);
+        }
+        transfer_get_stats(t, TRANSFER_SENDFILE, &stats);
+        assert(stats.transfers == 0);
+        transfer_get_stats(t, TRANSFER_READ_WRITE, &stats);
+        assert(stats.transfers == 2);
+
+        /* the same strategy is fine for another filesystem */
+        assert(ftruncate(datafd, 0) >= 0);
+        assert(transfer_run(t, datafd, firmwarefd, BLOB_SIZE, 2) >= 0);
+        check_copy(blob, datafd, BLOB_SIZE);
+        transfer_get_stats(t, TRANSFER_SENDFILE, &stats);
+        assert(stats.transfers == 1);
+
+        /* and not tried again for the one that refused it */
+        assert(transfer_choose(t, 1, BLOB_SIZE) != TRANSFER_SENDFILE);
+
+        transfer_free(t);
+        close(appendfd);
+        close(datafd);
+        unlink(target);
+        close(firmwarefd);
+        unlink(source);
+        free(blob);
+}
+
+int main(int argc, char **argv) {
+        test_strategy_names();
+        test_copy();
+        test_tuner();
+        test_run();
+        test_unsupported();
+
+        return 0;
+}
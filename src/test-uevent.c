@@ -0,0 +1,279 @@
+/*
+ * Tests for the uevent parser and the sysfs enumeration
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "uevent.h"
+
+static void test_parse(void) {
+        char buf[] = "add@/devices/virtual/firmware/foo\0"
+                     "ACTION=add\0"
+                     "DEVPATH=/devices/virtual/firmware/foo\0"
+                     "SUBSYSTEM=firmware\0"
+                     "FIRMWARE=foo/bar.bin\0"
+                     "MODALIAS=pci:v00008086d00002723sv*\0"
+                     "TIMEOUT=60\0"
+                     "SEQNUM=4711\0"
+                     "UNTERMINATED=x";
+        char udev[] = "libudev\0\xfe\xed\xca\xfe";
+        char junk[] = "ACTION=add\0DEVPATH=/devices/foo\0";
+        Uevent event;
+
+        assert(uevent_parse(&event, buf, sizeof(buf) - 1) >= 0);
+        assert(!strcmp(event.action, "add"));
+        assert(!strcmp(event.devpath, "/devices/virtual/firmware/foo"));
+        assert(!strcmp(event.subsystem, "firmware"));
+        assert(!strcmp(event.firmware, "foo/bar.bin"));
+        assert(!strcmp(event.modalias, "pci:v00008086d00002723sv*"));
+        assert(!strcmp(event.timeout, "60"));
+        assert(event.seqnum == 4711);
+
+        /* the header alone is not enough */
+        assert(uevent_parse(&event, buf, strlen(buf) + 1) == -EBADMSG);
+
+        assert(uevent_parse(&event, udev, sizeof(udev) - 1) == -EPROTO);
+        assert(uevent_parse(&event, junk, sizeof(junk) - 1) == -EBADMSG);
+}
+
+static void test_parse_file(void) {
+        char buf[] = "FIRMWARE=foo.bin\nTIMEOUT=60\nASYNC=0\n";
+        Uevent event;
+
+        assert(uevent_parse_file(&event, buf, strlen(buf)) >= 0);
+        assert(!strcmp(event.firmware, "foo.bin"));
+        assert(!strcmp(event.timeout, "60"));
+        assert(!event.action);
+        assert(!event.devpath);
+}
+
+static bool filter_passes(int fds[2], const char *buf, size_t len) {
+        char rbuf[4096];
+        ssize_t n;
+
+        assert(send(fds[0], buf, len, 0) == (ssize_t)len);
+        n = recv(fds[1], rbuf, sizeof(rbuf), MSG_DONTWAIT);
+        if (n < 0) {
+                assert(errno == EAGAIN);
+                return false;
+        }
+
+        assert((size_t)n == len);
+        return true;
+}
+
+#define FILTER_PASSES(fds, s) filter_passes(fds, s, sizeof(s) - 1)
+
+static void test_filter(void) {
+        char longpath[2048] = "add@/devices/";
+        int fds[2];
+        size_t len;
+
+        assert(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0, fds) >= 0);
+        assert(uevent_attach_filter(fds[1], "firmware") >= 0);
+
+        assert(FILTER_PASSES(fds, "add@/devices/foo\0ACTION=add\0DEVPATH=/devices/foo\0"
+                                  "SUBSYSTEM=firmware\0FIRMWARE=a.bin\0SEQNUM=1\0"));
+        assert(!FILTER_PASSES(fds, "add@/devices/foo\0ACTION=add\0DEVPATH=/devices/foo\0"
+                                   "SUBSYSTEM=usb\0SEQNUM=2\0"));
+        assert(!FILTER_PASSES(fds, "add@/devices/foo\0ACTION=add\0DEVPATH=/devices/foo\0"
+                                   "SUBSYSTEM=firmware2\0SEQNUM=3\0"));
+        assert(!FILTER_PASSES(fds, "add@/devices/foo\0ACTION=add\0DEVPATH=/devices/foo\0"
+                                   "SUBSYSTEM=firmwar\0SEQNUM=4\0"));
+        assert(!FILTER_PASSES(fds, "remove@/devices/foo\0ACTION=remove\0SEQNUM=5\0"));
+
+        /* not sure, so let through */
+        assert(FILTER_PASSES(fds, "add@/devices/SUBSTANCE\0ACTION=add\0DEVPATH=/devices/SUBSTANCE\0"
+                                  "SUBSYSTEM=usb\0SEQNUM=6\0"));
+
+        /* the key is beyond what the filter looks at */
+        memset(longpath + strlen(longpath), 'x', 1500);
+        len = strlen(longpath) + 1;
+        memcpy(longpath + len, "SUBSYSTEM=usb", 14);
+        assert(filter_passes(fds, longpath, len + 14));
+
+        close(fds[0]);
+        close(fds[1]);
+}
+
+static void test_action_filter(void) {
+        int fds[2];
+
+        assert(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0, fds) >= 0);
+        assert(uevent_attach_action_filter(fds[1], "add") >= 0);
+
+        assert(FILTER_PASSES(fds, "add@/devices/foo\0ACTION=add\0MODALIAS=usb:v1\0"));
+        assert(FILTER_PASSES(fds, "add@/module/foo\0ACTION=add\0SUBSYSTEM=module\0"));
+        assert(!FILTER_PASSES(fds, "remove@/devices/foo\0ACTION=remove\0"));
+        assert(!FILTER_PASSES(fds, "addx@/devices/foo\0"));
+        assert(!FILTER_PASSES(fds, "bind@/devices/foo\0ACTION=bind\0"));
+        assert(!FILTER_PASSES(fds, "ad"));
+
+        close(fds[0]);
+        close(fds[1]);
+
+        assert(uevent_attach_action_filter(fds[1], "") == -EINVAL);
+}
+
+typedef struct Seen {
+        unsigned int n;
+        char devpath[64];
+        char firmware[64];
+} Seen;
+
+static void enumerate_cb(const Uevent *event, void *userdata) {
+        Seen *seen = userdata;
+
+        assert(!strcmp(event->action, "add"));
+        assert(!strcmp(event->subsystem, "firmware"));
+        snprintf(seen->devpath, sizeof(seen->devpath), "%s", event->devpath);
+        snprintf(seen->firmware, sizeof(seen->firmware), "%s", event->firmware);
+        seen->n++;
+}
+
+static void test_enumerate(void) {
+        char dir[] = "/tmp/test-uevent-XXXXXX";
+        Seen seen = {};
+        int sysfd, fd;
+
+        assert(mkdtemp(dir));
+        sysfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        assert(sysfd >= 0);
+
+        /* nothing to enumerate without the class */
+        assert(uevent_enumerate(sysfd, "firmware", enumerate_cb, &seen) == 0);
+        assert(seen.n == 0);
+
+        assert(mkdirat(sysfd, "devices", 0755) >= 0);
+        assert(mkdirat(sysfd, "devices/foo", 0755) >= 0);
+        assert(mkdirat(sysfd, "class", 0755) >= 0);
+        assert(mkdirat(sysfd, "class/firmware", 0755) >= 0);
+        assert(symlinkat("../../devices/foo", sysfd, "class/firmware/foo") >= 0);
+
+        fd = openat(sysfd, "devices/foo/uevent", O_CREAT|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        assert(write(fd, "FIRMWARE=foo.bin\n", 17) == 17);
+        close(fd);
+
+        /* class attributes are not devices */
+        fd = openat(sysfd, "class/firmware/timeout", O_CREAT|O_WRONLY|O_CLOEXEC, 0644);
+        assert(fd >= 0);
+        close(fd);
+
+        assert(uevent_enumerate(sysfd, "firmware", enumerate_cb, &seen) == 1);
+        assert(seen.n == 1);
+        assert(!strcmp(seen.devpath, "/devices/foo"));
+        assert(!strcmp(seen.firmware, "foo.bin"));
+
+        /* a backlog larger than one read of the directory */
+        for (unsigned int i = 0; i < 3000; i++) {
+                char name[64];
+
+                snprintf(name, sizeof(name), "class/firmware/foo-with-a-longer-name-%u", i);
+                assert(symlinkat("../../devices/foo", sysfd, name) >= 0);
+        }
+
+        seen.n = 0;
+        assert(uevent_enumerate(sysfd, "firmware", enumerate_cb, &seen) == 3001);
+        assert(seen.n == 3001);
+
+        for (unsigned int i = 0; i < 3000; i++) {
+                char name[64];
+
+                snprintf(name, sizeof(name), "class/firmware/foo-with-a-longer-name-%u", i);
+                unlinkat(sysfd, name, 0);
+        }
+
+        unlinkat(sysfd, "class/firmware/timeout", 0);
+        unlinkat(sysfd, "class/firmware/foo", 0);
+        unlinkat(sysfd, "class/firmware", AT_REMOVEDIR);
+        unlinkat(sysfd, "class", AT_REMOVEDIR);
+        unlinkat(sysfd, "devices/foo/uevent", 0);
+        unlinkat(sysfd, "devices/foo", AT_REMOVEDIR);
+        unlinkat(sysfd, "devices", AT_REMOVEDIR);
+        close(sysfd);
+        rmdir(dir);
+}
+
+static void test_socket(void) {
+        char dir[] = "/tmp/test-uevent-XXXXXX";
+        char buf[] = "add@/devices/virtual/firmware/foo\0"
+                     "ACTION=add\0"
+                     "DEVPATH=/devices/virtual/firmware/foo\0"
+                     "SUBSYSTEM=firmware\0"
+                     "FIRMWARE=foo.bin\0"
+                     "SEQNUM=1\0";
+        char other[] = "add@/devices/virtual/misc/bar\0"
+                       "ACTION=add\0"
+                       "DEVPATH=/devices/virtual/misc/bar\0"
+                       "SUBSYSTEM=misc\0"
+                       "SEQNUM=2\0";
+        char later[] = "add@/devices/virtual/firmware/baz\0"
+                       "ACTION=add\0"
+                       "DEVPATH=/devices/virtual/firmware/baz\0"
+                       "SUBSYSTEM=firmware\0"
+                       "FIRMWARE=baz.bin\0"
+                       "SEQNUM=5\0";
+        UeventStats stats;
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        UeventMonitor *m;
+        Seen seen = {};
+        int fd;
+
+        assert(mkdtemp(dir));
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/uevent", dir);
+
+        assert(uevent_monitor_new_socket(&m, addr.sun_path) >= 0);
+        assert(uevent_monitor_filter_subsystem(m, "firmware") >= 0);
+
+        fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+        assert(fd >= 0);
+        assert(sendto(fd, other, sizeof(other) - 1, 0, (struct sockaddr *)&addr, sizeof(addr)) > 0);
+        assert(sendto(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&addr, sizeof(addr)) > 0);
+        close(fd);
+
+        /* events of our own user are taken like the kernel's */
+        assert(uevent_monitor_receive(m, enumerate_cb, &seen) == 0);
+        assert(seen.n == 1);
+        assert(!strcmp(seen.devpath, "/devices/virtual/firmware/foo"));
+        assert(!strcmp(seen.firmware, "foo.bin"));
+
+        /* the kernel numbers what the filter keeps from us too */
+        fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+        assert(fd >= 0);
+        assert(sendto(fd, later, sizeof(later) - 1, 0, (struct sockaddr *)&addr, sizeof(addr)) > 0);
+        close(fd);
+
+        assert(uevent_monitor_receive(m, enumerate_cb, &seen) == 0);
+        assert(seen.n == 2);
+        uevent_monitor_get_stats(m, &stats);
+        assert(stats.emitted == 5);
+        assert(stats.received == 2);
+        assert(stats.relevant == 2);
+
+        /* the socket goes with the monitor */
+        uevent_monitor_free(m);
+        assert(access(addr.sun_path, F_OK) < 0 && errno == ENOENT);
+        rmdir(dir);
+}
+
+int main(int argc, char **argv) {
+        test_parse();
+        test_parse_file();
+        test_filter();
+        test_action_filter();
+        test_enumerate();
+        test_socket();
+
+        return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * Tests for the worker pool
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+#define N_REQUESTS (2000)
+
+typedef struct Seen {
+        unsigned int handled;
+        /* the slow request holds up its worker until this is set */
+        int release;
+        int slow_started;
+} Seen;
+
+static void handle(Request *request, void *userdata) {
+        Seen *seen = userdata;
+
+        if (!strcmp(request->name, "slow")) {
+                __atomic_store_n(&seen->slow_started, 1, __ATOMIC_SEQ_CST);
+                while (!__atomic_load_n(&seen->release, __ATOMIC_SEQ_CST))
+                        usleep(1000);
+        }
+
+        __atomic_add_fetch(&seen->handled, 1, __ATOMIC_SEQ_CST);
+}
+
+static void submit(WorkerPool *pool, const char *devpath, const char *name) {
+        Request *request;
+
+        assert(request_new(&request, devpath, name) >= 0);
+        assert(worker_pool_submit(pool, request) >= 0);
+}
+
+static void test_worker(unsigned int n_workers) {
+        WorkerPool *pool;
+        Seen seen = {};
+
+        assert(worker_pool_new(&pool, n_workers, handle, &seen) >= 0);
+
+        for (unsigned int i = 0; i < N_REQUESTS; i++) {
+                char devpath[32], name[32];
+
+                snprintf(devpath, sizeof(devpath), "/devices/%u", i % 10);
+                snprintf(name, sizeof(name), "%u", i);
+                submit(pool, devpath, name);
+        }
+
+        /* freeing waits for everything submitted */
+        worker_pool_free(pool);
+        assert(seen.handled == N_REQUESTS);
+}
+
+/* a slow upload only holds up its own worker, whatever the device */
+static void test_slow(void) {
+        WorkerPool *pool;
+        Seen seen = {};
+
+        assert(worker_pool_new(&pool, 2, handle, &seen) >= 0);
+
+        submit(pool, "/devices/0", "slow");
+        while (!__atomic_load_n(&seen.slow_started, __ATOMIC_SEQ_CST))
+                usleep(1000);
+
+        for (unsigned int i = 0; i < 100; i++) {
+                char devpath[32];
+
+                snprintf(devpath, sizeof(devpath), "/devices/%u", i);
+                submit(pool, devpath, "fast");
+        }
+
+        for (unsigned int i = 0; __atomic_load_n(&seen.handled, __ATOMIC_SEQ_CST) < 100; i++) {
+                assert(i < 5000);
+                usleep(1000);
+        }
+
+        __atomic_store_n(&seen.release, 1, __ATOMIC_SEQ_CST);
+        worker_pool_free(pool);
+        assert(seen.handled == 101);
+}
+
+int main(int argc, char **argv) {
+        Request *request;
+
+        assert(request_new(&request, "/devices/0", NULL) == -EINVAL);
+        assert(worker_pool_new(NULL, 0, handle, NULL) == -EINVAL);
+
+        test_worker(1);
+        test_worker(3);
+        test_slow();
+
+        return 0;
+}
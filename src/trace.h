@@ -0,0 +1,25 @@
+#pragma once
+
+/*
+ * Static tracepoints of the "firmwared" provider, for bpftrace, perf and
+ * the like; README lists them with their arguments. With <sys/sdt.h> each
+ * is a single nop and a note in the binary until a tracer attaches to it,
+ * without it they are compiled out. Arguments are only evaluated into
+ * registers, so they should be at hand anyway.
+ */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define TRACE(name) DTRACE_PROBE(firmwared, name)
+#define TRACE1(name, a) DTRACE_PROBE1(firmwared, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(firmwared, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(firmwared, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(firmwared, name, a, b, c, d)
+#else
+#define TRACE(name) do { } while (0)
+#define TRACE1(name, a) do { } while (0)
+#define TRACE2(name, a, b) do { } while (0)
+#define TRACE3(name, a, b, c) do { } while (0)
+#define TRACE4(name, a, b, c, d) do { } while (0)
+#endif
@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "transfer.h"
+
+/*
+ * The tuner keeps a moving average of the throughput of every strategy, per
+ * source filesystem and size class. Each strategy is tried a few times
+ * first; after that the fastest one is used, and now and then one of the
+ * others is measured again, in case things changed.
+ */
+
+/* size classes: below 64K, 1M, 16M, and anything larger */
+#define TRANSFER_SIZE_CLASSES (4)
+
+/* distinct source filesystems told apart, the last slot takes the rest */
+#define TRANSFER_FS_MAX (8)
+
+/* samples of each strategy before the tuner trusts the averages */
+#define TRANSFER_PROBES (2)
+
+/* one in this many choices re-measures another strategy */
+#define TRANSFER_EXPLORE (64)
+
+static const char * const transfer_strategy_names[_TRANSFER_MAX] = {
+        [TRANSFER_SENDFILE] = "sendfile",
+        [TRANSFER_SPLICE] = "splice",
+        [TRANSFER_MMAP] = "mmap",
+        [TRANSFER_READ_WRITE] = "read-write",
+};
+
+typedef struct TransferSample {
+        unsigned int n;
+        /* bytes per microsecond */
+        double rate;
+} TransferSample;
+
+typedef struct TransferCell {
+        TransferSample samples[_TRANSFER_MAX];
+        /* refused by such files, e.g. splice() from a filesystem without it */
+        bool unsupported[_TRANSFER_MAX];
+        unsigned int choices;
+} TransferCell;
+
+typedef struct TransferFs {
+        long type;
+        bool used;
+        TransferCell cells[TRANSFER_SIZE_CLASSES];
+} TransferFs;
+
+struct Transfer {
+        pthread_mutex_t lock;
+        TransferStrategy strategy;
+        size_t chunk_size;
+        TransferFs fs[TRANSFER_FS_MAX];
+        TransferStats stats[_TRANSFER_MAX];
+};
+
+const char *transfer_strategy_to_string(TransferStrategy s) {
+        if (s == TRANSFER_AUTO)
+                return "auto";
+
+        return transfer_strategy_names[s];
+}
+
+/* returns _TRANSFER_MAX for unknown names */
+TransferStrategy transfer_strategy_from_string(const char *s) {
+        if (!strcmp(s, "auto"))
+                return TRANSFER_AUTO;
+
+        for (TransferStrategy i = 0; i < _TRANSFER_MAX; i++)
+                if (!strcmp(s, transfer_strategy_names[i]))
+                        return i;
+
+        return _TRANSFER_MAX;
+}
+
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* writes all of @size, however little the file takes at once, counting in @donep */
+static int transfer_write(int fd, const char *p, size_t size, size_t *donep) {
+        while (size) {
+                ssize_t n;
+
+                n = write(fd, p, size);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                } else if (n == 0)
+                        return -EIO;
+
+                p += n;
+                size -= n;
+                *donep += n;
+        }
+
+        return 0;
+}
+
+static int transfer_sendfile(int datafd, int firmwarefd, size_t size, size_t *donep) {
+        off_t offset = 0;
+
+        while ((size_t)offset < size) {
+                ssize_t n;
+
+                n = sendfile(datafd, firmwarefd, &offset, size - offset);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                } else if (n == 0)
+                        return -EIO;
+
+                *donep = offset;
+        }
+
+        return 0;
+}
+
+static int transfer_splice(int datafd, int firmwarefd, size_t size, size_t chunk_size, size_t *donep) {
+        _cleanup_close_ int pipe_in = -1;
+        _cleanup_close_ int pipe_out = -1;
+        int fds[2];
+        loff_t offset = 0;
+
+        if (pipe2(fds, O_CLOEXEC) < 0)
+                return -errno;
+
+        pipe_out = fds[0];
+        pipe_in = fds[1];
+
+        /* the pipe is as large as a chunk, if we may; else chunks are smaller */
+        fcntl(pipe_in, F_SETPIPE_SZ, (int)chunk_size);
+
+        while ((size_t)offset < size) {
+                ssize_t n;
+
+                n = splice(firmwarefd, &offset, pipe_in, NULL, MIN(chunk_size, size - offset), SPLICE_F_MOVE);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                } else if (n == 0)
+                        return -EIO;
+
+                /* drain the pipe, in as many pieces as the device wants */
+                while (n > 0) {
+                        ssize_t m;
+
+                        m = splice(pipe_out, NULL, datafd, NULL, n, SPLICE_F_MOVE);
+                        if (m < 0) {
+                                if (errno == EINTR)
+                                        continue;
+
+                                return -errno;
+                        } else if (m == 0)
+                                return -EIO;
+
+                        n -= m;
+                        *donep += m;
+                }
+        }
+
+        return 0;
+}
+
+static int transfer_mmap(int datafd, int firmwarefd, size_t size, size_t *donep) {
+        struct stat st;
+        void *map;
+        int r;
+
+        /* reading beyond the end of the file would fault */
+        if (fstat(firmwarefd, &st) < 0)
+                return -errno;
+        if ((size_t)st.st_size < size)
+                return -EIO;
+
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, firmwarefd, 0);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        madvise(map, size, MADV_SEQUENTIAL);
+
+        /* one large write, continued wherever the device stops */
+        r = transfer_write(datafd, map, size, donep);
+
+        munmap(map, size);
+        return r;
+}
+
+static int transfer_read_write(int datafd, int firmwarefd, size_t size, size_t chunk_size, size_t *donep) {
+        _cleanup_free_ char *buf = NULL;
+        size_t offset = 0;
+
+        buf = malloc(chunk_size);
+        if (!buf)
+                return -ENOMEM;
+
+        while (offset < size) {
+                ssize_t n;
+                int r;
+
+                n = pread(firmwarefd, buf, MIN(chunk_size, size - offset), offset);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                } else if (n == 0)
+                        return -EIO;
+
+                r = transfer_write(datafd, buf, n, donep);
+                if (r < 0)
+                        return r;
+
+                offset += n;
+        }
+
+        return 0;
+}
+
+/*
+ * Copies the first @size bytes of @firmwarefd to the current position of
+ * @datafd. The file offset of @firmwarefd is not used, so descriptors shared
+ * between threads are fine. @donep says how far the copy got, also on
+ * failure.
+ */
+int transfer_copy(TransferStrategy s, int datafd, int firmwarefd, size_t size, size_t chunk_size,
+                  size_t *donep) {
+        *donep = 0;
+
+        switch (s) {
+        case TRANSFER_SENDFILE:
+                return transfer_sendfile(datafd, firmwarefd, size, donep);
+        case TRANSFER_SPLICE:
+                return transfer_splice(datafd, firmwarefd, size, chunk_size, donep);
+        case TRANSFER_MMAP:
+                return transfer_mmap(datafd, firmwarefd, size, donep);
+        case TRANSFER_READ_WRITE:
+                return transfer_read_write(datafd, firmwarefd, size, chunk_size, donep);
+        default:
+                return -EINVAL;
+        }
+}
+
+/*
+ * With TRANSFER_AUTO, the strategy is picked by the tuner, otherwise
+ * @strategy is always used. @chunk_size is the size of the buffer for
+ * read-write, and of the pipe for splice.
+ */
+int transfer_new(Transfer **transferp, TransferStrategy strategy, size_t chunk_size) {
+        Transfer *t;
+
+        if (strategy >= _TRANSFER_MAX || chunk_size == 0)
+                return -EINVAL;
+
+        t = calloc(1, sizeof(*t));
+        if (!t)
+                return -ENOMEM;
+
+        pthread_mutex_init(&t->lock, NULL);
+        t->strategy = strategy;
+        t->chunk_size = chunk_size;
+
+        *transferp = t;
+        return 0;
+}
+
+void transfer_free(Transfer *t) {
+        pthread_mutex_destroy(&t->lock);
+        free(t);
+}
+
+static unsigned int transfer_size_class(size_t size) {
+        if (size < 64 * 1024)
+                return 0;
+        if (size < 1024 * 1024)
+                return 1;
+        if (size < 16 * 1024 * 1024)
+                return 2;
+
+        return 3;
+}
+
+static TransferCell *transfer_get_cell(Transfer *t, long fs_type, size_t size) {
+        TransferFs *fs = &t->fs[TRANSFER_FS_MAX - 1];
+
+        for (unsigned int i = 0; i < TRANSFER_FS_MAX; i++) {
+                if (!t->fs[i].used) {
+                        t->fs[i].used = true;
+                        t->fs[i].type = fs_type;
+                }
+
+                if (t->fs[i].type == fs_type) {
+                        fs = &t->fs[i];
+                        break;
+                }
+        }
+
+        return &fs->cells[transfer_size_class(size)];
+}
+
+/* picks the strategy for @size bytes from a filesystem with the magic @fs_type */
+TransferStrategy transfer_choose(Transfer *t, long fs_type, size_t size) {
+        TransferStrategy best = TRANSFER_SENDFILE, probe = _TRANSFER_MAX;
+        TransferCell *cell;
+        double rate = -1;
+
+        if (t->strategy != TRANSFER_AUTO)
+                return t->strategy;
+
+        pthread_mutex_lock(&t->lock);
+
+        cell = transfer_get_cell(t, fs_type, size);
+        cell->choices++;
+
+        for (TransferStrategy s = 0; s < _TRANSFER_MAX; s++) {
+                if (cell->unsupported[s])
+                        continue;
+
+                if (cell->samples[s].n < TRANSFER_PROBES) {
+                        probe = s;
+                        break;
+                }
+
+                if (cell->samples[s].rate > rate) {
+                        rate = cell->samples[s].rate;
+                        best = s;
+                }
+        }
+
+        /* take turns re-measuring the others */
+        if (probe == _TRANSFER_MAX && cell->choices % TRANSFER_EXPLORE == 0) {
+                probe = (cell->choices / TRANSFER_EXPLORE) % _TRANSFER_MAX;
+                if (cell->unsupported[probe])
+                        probe = _TRANSFER_MAX;
+        }
+
+        pthread_mutex_unlock(&t->lock);
+
+        return probe != _TRANSFER_MAX ? probe : best;
+}
+
+/* accounts a transfer of @size bytes that took @usec */
+void transfer_record(Transfer *t, TransferStrategy s, long fs_type, size_t size, uint64_t usec) {
+        TransferSample *sample;
+        double rate;
+
+        rate = (double)size / (usec ? usec : 1);
+
+        pthread_mutex_lock(&t->lock);
+
+        t->stats[s].transfers++;
+        t->stats[s].bytes += size;
+        t->stats[s].usec += usec;
+
+        sample = &transfer_get_cell(t, fs_type, size)->samples[s];
+        if (sample->n == 0)
+                sample->rate = rate;
+        else
+                sample->rate += (rate - sample->rate) / 4;
+        sample->n++;
+
+        pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * Copies @size bytes of @firmwarefd to @datafd the way that was the fastest
+ * so far, and measures it. A strategy that the files do not support at all
+ * is not tried again for files of that filesystem and size; the copy falls
+ * back to read-write then. The copy is
+ * accounted to the filesystem with the magic @fs_type, or to the one of
+ * @firmwarefd if that is 0.
+ */
+int transfer_run(Transfer *t, int datafd, int firmwarefd, size_t size, long fs_type) {
+        TransferStrategy s;
+        uint64_t start;
+        size_t done;
+        int r;
+
+        if (fs_type == 0) {
+                struct statfs sfs;
+
+                if (fstatfs(firmwarefd, &sfs) >= 0)
+                        fs_type = sfs.f_type;
+        }
+
+        s = transfer_choose(t, fs_type, size);
+
+        start = now_usec();
+        r = transfer_copy(s, datafd, firmwarefd, size, t->chunk_size, &done);
+        if (r < 0 && done == 0 && s != TRANSFER_READ_WRITE &&
+            (r == -EINVAL || r == -ENOSYS || r == -EOPNOTSUPP || r == -ENODEV)) {
+                pthread_mutex_lock(&t->lock);
+                transfer_get_cell(t, fs_type, size)->unsupported[s] = true;
+                pthread_mutex_unlock(&t->lock);
+
+                s = TRANSFER_READ_WRITE;
+                start = now_usec();
+                r = transfer_copy(s, datafd, firmwarefd, size, t->chunk_size, &done);
+        }
+        if (r < 0)
+                return r;
+
+        transfer_record(t, s, fs_type, size, now_usec() - start);
+        return 0;
+}
+
+void transfer_get_stats(Transfer *t, TransferStrategy s, TransferStats *stats) {
+        pthread_mutex_lock(&t->lock);
+        *stats = t->stats[s];
+        pthread_mutex_unlock(&t->lock);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ways of copying a firmware file into a device's data file. Which one is
+ * the fastest depends on where the file lives and how big it is, so by
+ * default every combination of source filesystem and size is measured, and
+ * the best strategy picked from that.
+ *
+ * The source filesystem is the one the firmware was found on. A blob served
+ * from the cache is copied out of a memfd, but is still accounted to the
+ * filesystem it was read from; so for files within the cache budget, the
+ * tuner learns how fast cached copies of ext4 or 9p files go, say, while
+ * larger ones are measured straight from their filesystem.
+ */
+
+typedef enum TransferStrategy {
+        TRANSFER_SENDFILE,
+        TRANSFER_SPLICE,
+        TRANSFER_MMAP,
+        TRANSFER_READ_WRITE,
+        _TRANSFER_MAX,
+        TRANSFER_AUTO = -1,
+} TransferStrategy;
+
+#define TRANSFER_CHUNK_SIZE_DEFAULT (128 * 1024)
+
+typedef struct TransferStats {
+        uint64_t transfers;
+        uint64_t bytes;
+        uint64_t usec;
+} TransferStats;
+
+typedef struct Transfer Transfer;
+
+const char *transfer_strategy_to_string(TransferStrategy strategy);
+TransferStrategy transfer_strategy_from_string(const char *s);
+
+int transfer_copy(TransferStrategy strategy, int datafd, int firmwarefd, size_t size, size_t chunk_size,
+                  size_t *donep);
+
+int transfer_new(Transfer **transferp, TransferStrategy strategy, size_t chunk_size);
+void transfer_free(Transfer *transfer);
+
+TransferStrategy transfer_choose(Transfer *transfer, long fs_type, size_t size);
+void transfer_record(Transfer *transfer, TransferStrategy strategy, long fs_type, size_t size, uint64_t usec);
+int transfer_run(Transfer *transfer, int datafd, int firmwarefd, size_t size, long fs_type);
+
+void transfer_get_stats(Transfer *transfer, TransferStrategy strategy, TransferStats *stats);
+
+static inline void transfer_freep(Transfer **transferp) {
+        if (*transferp)
+                transfer_free(*transferp);
+}
@@ -0,0 +1,676 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log-util.h"
+#include "macro.h"
+#include "uevent.h"
+
+/* datagrams read per recvmmsg() */
+#define UEVENT_BATCH (32)
+
+/* the kernel limits the environment of an event to 2k */
+#define UEVENT_BUFFER_SIZE (8192)
+
+#define UEVENT_GROUP_KERNEL (1)
+
+/* directory entries read per getdents64() */
+#define UEVENT_DIRENT_BUFFER_SIZE (64 * 1024)
+
+/* room for a storm of events while we are busy, as much as udevd asks for */
+#define UEVENT_RCVBUF_SIZE (128 * 1024 * 1024)
+
+/*
+ * Bytes of each datagram searched for the subsystem by the socket filter, at
+ * most and at least. The kernel charges filters to the socket's option
+ * memory (net.core.optmem_max), so we settle for less if we have to.
+ */
+#define UEVENT_FILTER_SCAN_MAX (960)
+#define UEVENT_FILTER_SCAN_MIN (120)
+#define UEVENT_FILTER_SUBSYSTEM_MAX (64)
+
+struct UeventMonitor {
+        int fd;
+        /* bound to instead of the kernel's netlink group, see uevent_monitor_new_socket() */
+        char *path;
+        char *subsystem;
+        char *action;
+        UeventStats stats;
+        uint64_t seqnum;
+        /* the span of sequence numbers seen, for what the kernel emitted */
+        uint64_t first_seqnum;
+        uint64_t last_seqnum;
+        struct mmsghdr msgs[UEVENT_BATCH];
+        struct iovec iovs[UEVENT_BATCH];
+        union {
+                struct sockaddr_nl nl;
+                struct sockaddr_un un;
+        } addrs[UEVENT_BATCH];
+        union {
+                struct cmsghdr cmsg;
+                char buf[CMSG_SPACE(sizeof(struct ucred))];
+        } controls[UEVENT_BATCH];
+        char buffers[UEVENT_BATCH][UEVENT_BUFFER_SIZE];
+};
+
+static const char *uevent_match(const char *s, size_t len, const char *key, size_t keylen) {
+        if (len < keylen || memcmp(s, key, keylen))
+                return NULL;
+
+        return s + keylen;
+}
+
+#define UEVENT_MATCH(s, len, key) uevent_match(s, len, key "=", sizeof(key))
+
+/* picks the few keys we care about out of NUL-separated KEY=value pairs */
+static void uevent_parse_env(Uevent *event, const char *p, const char *end) {
+        while (p < end) {
+                const char *value;
+                size_t len;
+
+                len = strnlen(p, end - p);
+                if (len == (size_t)(end - p))
+                        break;
+
+                if ((value = UEVENT_MATCH(p, len, "ACTION")))
+                        event->action = value;
+                else if ((value = UEVENT_MATCH(p, len, "DEVPATH")))
+                        event->devpath = value;
+                else if ((value = UEVENT_MATCH(p, len, "SUBSYSTEM")))
+                        event->subsystem = value;
+                else if ((value = UEVENT_MATCH(p, len, "FIRMWARE")))
+                        event->firmware = value;
+                else if ((value = UEVENT_MATCH(p, len, "MODALIAS")))
+                        event->modalias = value;
+                else if ((value = UEVENT_MATCH(p, len, "TIMEOUT")))
+                        event->timeout = value;
+                else if ((value = UEVENT_MATCH(p, len, "SEQNUM")))
+                        event->seqnum = strtoull(value, NULL, 10);
+
+                p += len + 1;
+        }
+}
+
+/*
+ * Parses a datagram as sent by the kernel: an "action@devpath" header,
+ * followed by the environment.
+ */
+int uevent_parse(Uevent *event, char *buf, size_t len) {
+        const char *header_end;
+
+        *event = (Uevent) {};
+
+        /* udev's own messages start with a binary header, they are not for us */
+        if (len >= 8 && !memcmp(buf, "libudev", 8))
+                return -EPROTO;
+
+        header_end = memchr(buf, '\0', len);
+        if (!header_end || !memchr(buf, '@', header_end - buf))
+                return -EBADMSG;
+
+        uevent_parse_env(event, header_end + 1, buf + len);
+
+        if (!event->action || !event->devpath)
+                return -EBADMSG;
+
+        return 0;
+}
+
+/*
+ * Parses the contents of a sysfs "uevent" attribute, which has only the
+ * environment, one pair per line. @buf is modified.
+ */
+int uevent_parse_file(Uevent *event, char *buf, size_t len) {
+        *event = (Uevent) {};
+
+        for (size_t i = 0; i < len; i++)
+                if (buf[i] == '\n')
+                        buf[i] = '\0';
+
+        uevent_parse_env(event, buf, buf + len);
+
+        return 0;
+}
+
+static int uevent_monitor_alloc(UeventMonitor **monitorp, int family, int type, int protocol) {
+        _cleanup_(uevent_monitor_freep) UeventMonitor *m = NULL;
+        int on = 1;
+
+        m = calloc(1, sizeof(*m));
+        if (!m)
+                return -ENOMEM;
+
+        m->fd = socket(family, type|SOCK_CLOEXEC|SOCK_NONBLOCK, protocol);
+        if (m->fd < 0)
+                return -errno;
+
+        if (setsockopt(m->fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
+                return -errno;
+
+        for (unsigned int i = 0; i < UEVENT_BATCH; i++) {
+                m->iovs[i].iov_base = m->buffers[i];
+                m->msgs[i].msg_hdr.msg_iov = &m->iovs[i];
+                m->msgs[i].msg_hdr.msg_iovlen = 1;
+                m->msgs[i].msg_hdr.msg_name = &m->addrs[i];
+                m->msgs[i].msg_hdr.msg_control = &m->controls[i];
+        }
+
+        *monitorp = m;
+        m = NULL;
+
+        return 0;
+}
+
+int uevent_monitor_new(UeventMonitor **monitorp) {
+        _cleanup_(uevent_monitor_freep) UeventMonitor *m = NULL;
+        struct sockaddr_nl addr = {
+                .nl_family = AF_NETLINK,
+                .nl_groups = UEVENT_GROUP_KERNEL,
+        };
+        int size = UEVENT_RCVBUF_SIZE;
+        int r;
+
+        r = uevent_monitor_alloc(&m, AF_NETLINK, SOCK_RAW, NETLINK_KOBJECT_UEVENT);
+        if (r < 0)
+                return r;
+
+        /* beyond net.core.rmem_max only with CAP_NET_ADMIN, else get what we can */
+        if (setsockopt(m->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+            setsockopt(m->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+                log_warn("cannot enlarge the uevent receive buffer: %m");
+
+        if (bind(m->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+                return -errno;
+
+        *monitorp = m;
+        m = NULL;
+
+        return 0;
+}
+
+/*
+ * Takes events from a datagram socket bound at @path rather than from the
+ * kernel, each in the format of the netlink messages, and sent by a process
+ * of our own user; for simulations. A full socket makes senders wait, so
+ * no event is lost.
+ */
+int uevent_monitor_new_socket(UeventMonitor **monitorp, const char *path) {
+        _cleanup_(uevent_monitor_freep) UeventMonitor *m = NULL;
+        struct sockaddr_un addr = {
+                .sun_family = AF_UNIX,
+        };
+        int r;
+
+        if (strlen(path) >= sizeof(addr.sun_path))
+                return -ENAMETOOLONG;
+
+        strcpy(addr.sun_path, path);
+
+        r = uevent_monitor_alloc(&m, AF_UNIX, SOCK_DGRAM, 0);
+        if (r < 0)
+                return r;
+
+        unlink(path);
+        if (bind(m->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+                return -errno;
+
+        m->path = strdup(path);
+        if (!m->path)
+                return -ENOMEM;
+
+        *monitorp = m;
+        m = NULL;
+
+        return 0;
+}
+
+void uevent_monitor_free(UeventMonitor *m) {
+        if (m->fd >= 0)
+                close(m->fd);
+        if (m->path) {
+                unlink(m->path);
+                free(m->path);
+        }
+        free(m->subsystem);
+        free(m->action);
+        free(m);
+}
+
+typedef struct UeventFilter {
+        struct sock_filter insns[BPF_MAXINSNS];
+        unsigned int n;
+        /* jumps to be pointed at the final accept or drop */
+        unsigned int accepts[UEVENT_FILTER_SUBSYSTEM_MAX];
+        unsigned int n_accepts;
+        unsigned int drops[UEVENT_FILTER_SUBSYSTEM_MAX];
+        unsigned int n_drops;
+} UeventFilter;
+
+static void uevent_filter_emit(UeventFilter *f, uint16_t code, uint8_t jt, uint8_t jf, uint32_t k) {
+        f->insns[f->n++] = (struct sock_filter) BPF_JUMP(code, k, jt, jf);
+}
+
+/* packet loads are big-endian */
+static uint32_t uevent_filter_word(const char *s, size_t n) {
+        uint32_t v = 0;
+
+        for (size_t i = 0; i < n; i++)
+                v = v << 8 | (uint8_t)s[i];
+
+        return v;
+}
+
+/* loads @n bytes at X + @offset, and continues only if they match @s */
+static void uevent_filter_match(UeventFilter *f, uint32_t offset, const char *s, size_t n, bool certain) {
+        uint16_t size = n == 4 ? BPF_W : (n == 2 ? BPF_H : BPF_B);
+
+        uevent_filter_emit(f, BPF_LD|size|BPF_IND, 0, 0, offset);
+        if (certain)
+                f->drops[f->n_drops++] = f->n;
+        else
+                f->accepts[f->n_accepts++] = f->n;
+        uevent_filter_emit(f, BPF_JMP|BPF_JEQ|BPF_K, 0, 0, uevent_filter_word(s, n));
+}
+
+/*
+ * Builds a classic BPF program that only lets through datagrams with
+ * "SUBSYSTEM=@subsystem". Without loops, the search for the key is unrolled
+ * over the first @scan bytes; whenever the program cannot be
+ * sure, the datagram is let through and left to the parser. Loads beyond the
+ * end of a datagram drop it.
+ */
+static int uevent_filter_build(UeventFilter *f, const char *subsystem, uint32_t scan) {
+        size_t len = strlen(subsystem);
+        uint32_t verify, offset;
+        unsigned int accept, drop;
+
+        if (len == 0 || len > UEVENT_FILTER_SUBSYSTEM_MAX / 2)
+                return -EINVAL;
+
+        *f = (UeventFilter) {};
+        verify = 4 * (scan - 1) + 1;
+
+        /* X points at the NUL in front of the key */
+        for (uint32_t i = 1; i < scan; i++) {
+                uevent_filter_emit(f, BPF_LD|BPF_W|BPF_ABS, 0, 0, i);
+                uevent_filter_emit(f, BPF_JMP|BPF_JEQ|BPF_K, 0, 2, uevent_filter_word("SUBS", 4));
+                uevent_filter_emit(f, BPF_LDX|BPF_W|BPF_IMM, 0, 0, i - 1);
+                uevent_filter_emit(f, BPF_JMP|BPF_JA, 0, 0, verify - f->n - 1);
+        }
+
+        /* the key is further out than we looked */
+        uevent_filter_emit(f, BPF_RET|BPF_K, 0, 0, UINT32_MAX);
+
+        /* the first "SUBS" may just be part of another string */
+        uevent_filter_match(f, 0, "", 1, false);
+        uevent_filter_match(f, 5, "YSTE", 4, false);
+        uevent_filter_match(f, 9, "M=", 2, false);
+
+        offset = 11;
+        while (len > 0) {
+                size_t n = len >= 4 ? 4 : (len >= 2 ? 2 : 1);
+
+                uevent_filter_match(f, offset, subsystem, n, true);
+                subsystem += n;
+                offset += n;
+                len -= n;
+        }
+        uevent_filter_match(f, offset, "", 1, true);
+
+        accept = f->n;
+        uevent_filter_emit(f, BPF_RET|BPF_K, 0, 0, UINT32_MAX);
+        drop = f->n;
+        uevent_filter_emit(f, BPF_RET|BPF_K, 0, 0, 0);
+
+        for (unsigned int i = 0; i < f->n_accepts; i++)
+                f->insns[f->accepts[i]].jf = accept - f->accepts[i] - 1;
+        for (unsigned int i = 0; i < f->n_drops; i++)
+                f->insns[f->drops[i]].jf = drop - f->drops[i] - 1;
+
+        return 0;
+}
+
+/* drops whatever does not start with "@action@", which is short and always first */
+static int uevent_filter_build_action(UeventFilter *f, const char *action) {
+        size_t len = strlen(action);
+        uint32_t offset = 0;
+        unsigned int drop;
+
+        if (len == 0 || len >= UEVENT_FILTER_SUBSYSTEM_MAX / 2)
+                return -EINVAL;
+
+        *f = (UeventFilter) {};
+
+        while (len > 0) {
+                size_t n = len >= 4 ? 4 : (len >= 2 ? 2 : 1);
+
+                uevent_filter_match(f, offset, action, n, true);
+                action += n;
+                offset += n;
+                len -= n;
+        }
+        uevent_filter_match(f, offset, "@", 1, true);
+
+        uevent_filter_emit(f, BPF_RET|BPF_K, 0, 0, UINT32_MAX);
+        drop = f->n;
+        uevent_filter_emit(f, BPF_RET|BPF_K, 0, 0, 0);
+
+        for (unsigned int i = 0; i < f->n_drops; i++)
+                f->insns[f->drops[i]].jf = drop - f->drops[i] - 1;
+
+        return 0;
+}
+
+/* attaches the filter for @subsystem to the socket @fd */
+int uevent_attach_filter(int fd, const char *subsystem) {
+        _cleanup_free_ UeventFilter *f = NULL;
+        struct sock_fprog prog;
+        int r;
+
+        f = malloc(sizeof(*f));
+        if (!f)
+                return -ENOMEM;
+
+        for (uint32_t scan = UEVENT_FILTER_SCAN_MAX; scan >= UEVENT_FILTER_SCAN_MIN; scan /= 2) {
+                r = uevent_filter_build(f, subsystem, scan);
+                if (r < 0)
+                        return r;
+
+                prog = (struct sock_fprog) {
+                        .len = f->n,
+                        .filter = f->insns,
+                };
+
+                if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) >= 0)
+                        return 0;
+
+                r = -errno;
+                if (r != -ENOMEM)
+                        break;
+        }
+
+        return r;
+}
+
+/*
+ * Only passes on events of @subsystem. The kernel is asked to drop everything
+ * else before it is queued; if that fails, the events are still filtered
+ * here, but the error is returned.
+ */
+int uevent_monitor_filter_subsystem(UeventMonitor *m, const char *subsystem) {
+        int r;
+
+        free(m->subsystem);
+        m->subsystem = strdup(subsystem);
+        if (!m->subsystem)
+                return -ENOMEM;
+
+        r = uevent_attach_filter(m->fd, subsystem);
+        if (r < 0)
+                return r;
+
+        m->stats.filtered = true;
+        return 0;
+}
+
+/* attaches a filter that only lets through events of @action to the socket @fd */
+int uevent_attach_action_filter(int fd, const char *action) {
+        _cleanup_free_ UeventFilter *f = NULL;
+        struct sock_fprog prog;
+        int r;
+
+        f = malloc(sizeof(*f));
+        if (!f)
+                return -ENOMEM;
+
+        r = uevent_filter_build_action(f, action);
+        if (r < 0)
+                return r;
+
+        prog = (struct sock_fprog) {
+                .len = f->n,
+                .filter = f->insns,
+        };
+
+        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/* like uevent_monitor_filter_subsystem(), for the events of @action */
+int uevent_monitor_filter_action(UeventMonitor *m, const char *action) {
+        int r;
+
+        free(m->action);
+        m->action = strdup(action);
+        if (!m->action)
+                return -ENOMEM;
+
+        r = uevent_attach_action_filter(m->fd, action);
+        if (r < 0)
+                return r;
+
+        m->stats.filtered = true;
+        return 0;
+}
+
+void uevent_monitor_get_stats(UeventMonitor *m, UeventStats *stats) {
+        *stats = m->stats;
+        stats->emitted = m->last_seqnum > 0 ? m->last_seqnum - m->first_seqnum + 1 : 0;
+}
+
+int uevent_monitor_get_fd(UeventMonitor *m) {
+        return m->fd;
+}
+
+/* only the kernel itself may send events, or our own user to a simulated socket */
+static bool uevent_monitor_check_sender(UeventMonitor *m, struct msghdr *hdr) {
+        const struct sockaddr_nl *addr = hdr->msg_name;
+        struct cmsghdr *cmsg;
+        struct ucred cred;
+
+        if (!m->path && (hdr->msg_namelen != sizeof(*addr) || addr->nl_pid != 0))
+                return false;
+
+        cmsg = CMSG_FIRSTHDR(hdr);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(cred)))
+                return false;
+
+        memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+        return cred.uid == 0 || (m->path && cred.uid == geteuid());
+}
+
+/*
+ * The kernel numbers all of its events, so a jump in SEQNUM means that some
+ * were lost. That only holds while we see all of them: with the socket
+ * filter, most events never reach us, and only an overflow tells.
+ */
+static bool uevent_monitor_check_seqnum(UeventMonitor *m, uint64_t seqnum) {
+        bool gap;
+
+        if (seqnum == 0)
+                return false;
+
+        if (m->first_seqnum == 0 || seqnum < m->first_seqnum)
+                m->first_seqnum = seqnum;
+        if (seqnum > m->last_seqnum)
+                m->last_seqnum = seqnum;
+
+        if (m->stats.filtered)
+                return false;
+
+        gap = m->seqnum > 0 && seqnum > m->seqnum + 1;
+        if (gap)
+                m->stats.gaps++;
+
+        if (seqnum > m->seqnum)
+                m->seqnum = seqnum;
+
+        return gap;
+}
+
+/*
+ * Reads every pending event, a batch of datagrams at a time, and calls @func
+ * for each of them. Returns 1 if events were lost on the way, because the
+ * socket overflowed or the sequence numbers skipped some; the caller has to
+ * find out what it missed then.
+ */
+int uevent_monitor_receive(UeventMonitor *m, uevent_func_t func, void *userdata) {
+        bool lost = false;
+
+        for (;;) {
+                int n;
+
+                for (unsigned int i = 0; i < UEVENT_BATCH; i++) {
+                        m->iovs[i].iov_len = UEVENT_BUFFER_SIZE;
+                        m->msgs[i].msg_hdr.msg_namelen = sizeof(m->addrs[i]);
+                        m->msgs[i].msg_hdr.msg_controllen = sizeof(m->controls[i]);
+                        m->msgs[i].msg_hdr.msg_flags = 0;
+                }
+
+                n = recvmmsg(m->fd, m->msgs, UEVENT_BATCH, MSG_DONTWAIT, NULL);
+                if (n < 0) {
+                        if (errno == EAGAIN)
+                                return lost;
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == ENOBUFS) {
+                                log_warn("uevent socket overflowed, events were lost");
+                                m->stats.overflows++;
+                                lost = true;
+                                continue;
+                        }
+
+                        return -errno;
+                }
+
+                m->stats.received += n;
+
+                for (int i = 0; i < n; i++) {
+                        struct msghdr *hdr = &m->msgs[i].msg_hdr;
+                        Uevent event;
+
+                        if (hdr->msg_flags & (MSG_TRUNC|MSG_CTRUNC) || !uevent_monitor_check_sender(m, hdr))
+                                continue;
+
+                        if (uevent_parse(&event, m->buffers[i], m->msgs[i].msg_len) < 0)
+                                continue;
+
+                        if (uevent_monitor_check_seqnum(m, event.seqnum))
+                                lost = true;
+
+                        if (m->subsystem && (!event.subsystem || strcmp(event.subsystem, m->subsystem)))
+                                continue;
+                        if (m->action && strcmp(event.action, m->action))
+                                continue;
+
+                        m->stats.relevant++;
+                        func(&event, userdata);
+                }
+
+                if (n < UEVENT_BATCH)
+                        return lost;
+        }
+}
+
+static int uevent_read_device(int classfd, const char *name, Uevent *event, char *link, size_t linksize,
+                              char *buf, size_t bufsize) {
+        char path[NAME_MAX + sizeof("/uevent")];
+        _cleanup_close_ int fd = -1;
+        const char *devpath;
+        ssize_t n;
+
+        /* "../../devices/...", relative to the class directory */
+        n = readlinkat(classfd, name, link, linksize - 1);
+        if (n < 0)
+                return -errno;
+        link[n] = '\0';
+
+        devpath = strstr(link, "/devices/");
+        if (!devpath)
+                return -EINVAL;
+
+        snprintf(path, sizeof(path), "%s/uevent", name);
+
+        fd = openat(classfd, path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        n = read(fd, buf, bufsize);
+        if (n < 0)
+                return -errno;
+
+        uevent_parse_file(event, buf, n);
+        event->devpath = devpath;
+
+        return 0;
+}
+
+/*
+ * Calls @func for every device of @subsystem that exists already, as if it
+ * was just added. The class directory is read with getdents64() straight
+ * into one large buffer, so a long backlog costs few system calls and no
+ * allocation per device. Returns the number of devices.
+ */
+int uevent_enumerate(int sysfd, const char *subsystem, uevent_func_t func, void *userdata) {
+        _cleanup_free_ char *dents = NULL;
+        _cleanup_close_ int classfd = -1;
+        char path[PATH_MAX];
+        int n_devices = 0;
+
+        snprintf(path, sizeof(path), "class/%s", subsystem);
+
+        classfd = openat(sysfd, path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (classfd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        dents = malloc(UEVENT_DIRENT_BUFFER_SIZE);
+        if (!dents)
+                return -ENOMEM;
+
+        for (;;) {
+                ssize_t n;
+
+                n = getdents64(classfd, dents, UEVENT_DIRENT_BUFFER_SIZE);
+                if (n < 0)
+                        return -errno;
+                if (n == 0)
+                        break;
+
+                for (ssize_t offset = 0; offset < n; ) {
+                        struct dirent64 *de = (struct dirent64 *)(dents + offset);
+                        char link[PATH_MAX], buf[UEVENT_BUFFER_SIZE];
+                        Uevent event;
+
+                        offset += de->d_reclen;
+
+                        /* devices are symlinks, anything else is a class attribute */
+                        if (de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+                                continue;
+
+                        if (uevent_read_device(classfd, de->d_name, &event, link, sizeof(link),
+                                               buf, sizeof(buf)) < 0)
+                                continue;
+
+                        event.action = "add";
+                        event.subsystem = subsystem;
+                        func(&event, userdata);
+                        n_devices++;
+                }
+        }
+
+        return n_devices;
+}
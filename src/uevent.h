@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Kernel uevents, read straight from the netlink socket.
+ *
+ * A parsed event only points into the buffer it was parsed from, and is valid
+ * for as long as that buffer; nothing is allocated per event.
+ */
+
+typedef struct Uevent {
+        const char *action;
+        const char *devpath;
+        const char *subsystem;
+        const char *firmware;
+        const char *modalias;
+        const char *timeout;
+        uint64_t seqnum;
+} Uevent;
+
+int uevent_parse(Uevent *event, char *buf, size_t len);
+int uevent_parse_file(Uevent *event, char *buf, size_t len);
+
+typedef void (*uevent_func_t)(const Uevent *event, void *userdata);
+
+typedef struct UeventStats {
+        /* by the kernel, as told by the span of SEQNUMs seen, filtered out or not */
+        uint64_t emitted;
+        uint64_t received;
+        uint64_t relevant;
+        uint64_t overflows;
+        uint64_t gaps;
+        bool filtered;
+} UeventStats;
+
+typedef struct UeventMonitor UeventMonitor;
+
+int uevent_monitor_new(UeventMonitor **monitorp);
+int uevent_monitor_new_socket(UeventMonitor **monitorp, const char *path);
+void uevent_monitor_free(UeventMonitor *monitor);
+
+int uevent_monitor_get_fd(UeventMonitor *monitor);
+int uevent_monitor_filter_subsystem(UeventMonitor *monitor, const char *subsystem);
+int uevent_monitor_filter_action(UeventMonitor *monitor, const char *action);
+void uevent_monitor_get_stats(UeventMonitor *monitor, UeventStats *stats);
+int uevent_monitor_receive(UeventMonitor *monitor, uevent_func_t func, void *userdata);
+
+int uevent_attach_filter(int fd, const char *subsystem);
+int uevent_attach_action_filter(int fd, const char *action);
+
+int uevent_enumerate(int sysfd, const char *subsystem, uevent_func_t func, void *userdata);
+
+static inline void uevent_monitor_freep(UeventMonitor **monitorp) {
+        if (*monitorp)
+                uevent_monitor_free(*monitorp);
+}
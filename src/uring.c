@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "uring.h"
+
+struct Uring {
+        int fd;
+        void *sq_map;
+        size_t sq_map_size;
+        void *cq_map;
+        size_t cq_map_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned int sq_entries;
+        unsigned int *sq_head;
+        unsigned int *sq_tail;
+        unsigned int *sq_mask;
+        unsigned int *sq_array;
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int *cq_mask;
+        struct io_uring_cqe *cqes;
+        /* entries handed out, but not yet published to the kernel */
+        unsigned int sqe_tail;
+};
+
+int uring_new(Uring **ringp, unsigned int entries) {
+        _cleanup_(uring_freep) Uring *ring = NULL;
+        struct io_uring_params p = {
+                .flags = IORING_SETUP_SUBMIT_ALL,
+        };
+
+        ring = calloc(1, sizeof(*ring));
+        if (!ring)
+                return -ENOMEM;
+
+        ring->sq_map = MAP_FAILED;
+        ring->cq_map = MAP_FAILED;
+        ring->sqes = MAP_FAILED;
+
+        ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (ring->fd < 0)
+                return -errno;
+
+        ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+        ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_map_size > ring->sq_map_size)
+                        ring->sq_map_size = ring->cq_map_size;
+                ring->cq_map_size = ring->sq_map_size;
+        }
+
+        ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                            ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_map == MAP_FAILED)
+                return -errno;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                ring->cq_map = ring->sq_map;
+        else {
+                ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                                    ring->fd, IORING_OFF_CQ_RING);
+                if (ring->cq_map == MAP_FAILED)
+                        return -errno;
+        }
+
+        ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED)
+                return -errno;
+
+        ring->sq_entries = p.sq_entries;
+        ring->sq_head = (unsigned int *)((char *)ring->sq_map + p.sq_off.head);
+        ring->sq_tail = (unsigned int *)((char *)ring->sq_map + p.sq_off.tail);
+        ring->sq_mask = (unsigned int *)((char *)ring->sq_map + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned int *)((char *)ring->sq_map + p.sq_off.array);
+        ring->cq_head = (unsigned int *)((char *)ring->cq_map + p.cq_off.head);
+        ring->cq_tail = (unsigned int *)((char *)ring->cq_map + p.cq_off.tail);
+        ring->cq_mask = (unsigned int *)((char *)ring->cq_map + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + p.cq_off.cqes);
+        ring->sqe_tail = *ring->sq_tail;
+
+        *ringp = ring;
+        ring = NULL;
+
+        return 0;
+}
+
+void uring_free(Uring *ring) {
+        if (ring->sqes != MAP_FAILED)
+                munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+                munmap(ring->cq_map, ring->cq_map_size);
+        if (ring->sq_map != MAP_FAILED)
+                munmap(ring->sq_map, ring->sq_map_size);
+        if (ring->fd >= 0)
+                close(ring->fd);
+        free(ring);
+}
+
+/* becomes readable when completions are pending */
+int uring_get_fd(Uring *ring) {
+        return ring->fd;
+}
+
+/*
+ * Registers a table of @n_files empty slots, to be filled by openat() with a
+ * file index, and used by later requests without an fd lookup.
+ */
+int uring_register_files(Uring *ring, unsigned int n_files) {
+        struct io_uring_rsrc_register reg = {
+                .nr = n_files,
+                .flags = IORING_RSRC_REGISTER_SPARSE,
+        };
+
+        if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) < 0)
+                return -errno;
+
+        return 0;
+}
+
+unsigned int uring_get_sq_space(Uring *ring) {
+        return ring->sq_entries - (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/* returns a cleared entry, or NULL if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+        struct io_uring_sqe *sqe;
+        unsigned int index;
+
+        if (uring_get_sq_space(ring) == 0)
+                return NULL;
+
+        index = ring->sqe_tail & *ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        ring->sq_array[index] = index;
+        ring->sqe_tail++;
+
+        return sqe;
+}
+
+/*
+ * Submits everything queued so far, and waits for @wait_nr completions.
+ */
+int uring_submit(Uring *ring, unsigned int wait_nr) {
+        unsigned int n;
+
+        __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+        n = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (n == 0 && wait_nr == 0)
+                return 0;
+
+        for (;;) {
+                if (syscall(__NR_io_uring_enter, ring->fd, n, wait_nr,
+                            wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0) >= 0)
+                        return 0;
+
+                if (errno != EINTR)
+                        return -errno;
+        }
+}
+
+/* copies out the next completion, if any */
+bool uring_get_cqe(Uring *ring, struct io_uring_cqe *cqe) {
+        unsigned int head = *ring->cq_head;
+
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+                return false;
+
+        *cqe = ring->cqes[head & *ring->cq_mask];
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, talking to the kernel directly: submission entries are
+ * queued with uring_get_sqe() and handed over in one go by uring_submit().
+ */
+
+typedef struct Uring Uring;
+
+int uring_new(Uring **ringp, unsigned int entries);
+void uring_free(Uring *ring);
+
+int uring_get_fd(Uring *ring);
+int uring_register_files(Uring *ring, unsigned int n_files);
+
+unsigned int uring_get_sq_space(Uring *ring);
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+int uring_submit(Uring *ring, unsigned int wait_nr);
+bool uring_get_cqe(Uring *ring, struct io_uring_cqe *cqe);
+
+static inline void uring_freep(Uring **ringp) {
+        if (*ringp)
+                uring_free(*ringp);
+}
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "macro.h"
+#include "worker.h"
+
+/*
+ * A fixed pool of threads handling firmware requests.
+ *
+ * All workers take requests from one bounded queue, so whichever worker is
+ * idle picks up the next request, and one slow upload only ever holds up its
+ * own worker. The manager never hands over two requests for the same device
+ * at once, so nothing needs to be kept in order here.
+ *
+ * Workers wait on a condition variable for work; the event loop only waits,
+ * on another one, when it finds the queue full.
+ */
+
+#define WORKER_QUEUE_SIZE (256)
+
+typedef struct Worker {
+        WorkerPool *pool;
+        pthread_t thread;
+        bool started;
+} Worker;
+
+struct WorkerPool {
+        Worker *workers;
+        unsigned int n_workers;
+        worker_handler_t handler;
+        void *userdata;
+        pthread_mutex_t lock;
+        pthread_cond_t work;
+        pthread_cond_t space;
+        size_t head;
+        size_t tail;
+        bool stopping;
+        Request *queue[WORKER_QUEUE_SIZE];
+};
+
+static void *worker_thread(void *userdata) {
+        Worker *w = userdata;
+        WorkerPool *pool = w->pool;
+
+        pthread_mutex_lock(&pool->lock);
+
+        for (;;) {
+                Request *req;
+
+                if (pool->head == pool->tail) {
+                        /* only leave once everything queued has been handled */
+                        if (pool->stopping)
+                                break;
+
+                        pthread_cond_wait(&pool->work, &pool->lock);
+                        continue;
+                }
+
+                req = pool->queue[pool->head++ % WORKER_QUEUE_SIZE];
+                pthread_cond_signal(&pool->space);
+                pthread_mutex_unlock(&pool->lock);
+
+                pool->handler(req, pool->userdata);
+                request_free(req);
+
+                pthread_mutex_lock(&pool->lock);
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+}
+
+int worker_pool_new(WorkerPool **poolp, unsigned int n_workers, worker_handler_t handler, void *userdata) {
+        _cleanup_(worker_pool_freep) WorkerPool *pool = NULL;
+
+        if (n_workers == 0)
+                return -EINVAL;
+
+        pool = calloc(1, sizeof(*pool));
+        if (!pool)
+                return -ENOMEM;
+
+        pool->handler = handler;
+        pool->userdata = userdata;
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->space, NULL);
+
+        pool->workers = calloc(n_workers, sizeof(Worker));
+        if (!pool->workers)
+                return -ENOMEM;
+
+        for (unsigned int i = 0; i < n_workers; i++) {
+                Worker *w = &pool->workers[i];
+                int r;
+
+                w->pool = pool;
+                pool->n_workers++;
+
+                r = pthread_create(&w->thread, NULL, worker_thread, w);
+                if (r)
+                        return -r;
+
+                w->started = true;
+        }
+
+        *poolp = pool;
+        pool = NULL;
+
+        return 0;
+}
+
+/*
+ * Lets the workers finish every request that was submitted, then stops them.
+ */
+void worker_pool_free(WorkerPool *pool) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (unsigned int i = 0; i < pool->n_workers; i++)
+                if (pool->workers[i].started)
+                        pthread_join(pool->workers[i].thread, NULL);
+
+        /* only left over if no worker could be started */
+        while (pool->head != pool->tail)
+                request_free(pool->queue[pool->head++ % WORKER_QUEUE_SIZE]);
+
+        pthread_cond_destroy(&pool->space);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->workers);
+        free(pool);
+}
+
+/*
+ * Queues @request, taking ownership of it, for the next worker that is
+ * idle. Blocks while the queue is full.
+ */
+int worker_pool_submit(WorkerPool *pool, Request *request) {
+        pthread_mutex_lock(&pool->lock);
+
+        while (pool->tail - pool->head >= WORKER_QUEUE_SIZE)
+                pthread_cond_wait(&pool->space, &pool->lock);
+
+        pool->queue[pool->tail++ % WORKER_QUEUE_SIZE] = request;
+        pthread_cond_signal(&pool->work);
+
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+}
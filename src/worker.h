@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "request.h"
+
+typedef struct WorkerPool WorkerPool;
+
+/* called on a worker thread; the request is freed afterwards */
+typedef void (*worker_handler_t)(Request *request, void *userdata);
+
+int worker_pool_new(WorkerPool **poolp, unsigned int n_workers, worker_handler_t handler, void *userdata);
+void worker_pool_free(WorkerPool *pool);
+
+int worker_pool_submit(WorkerPool *pool, Request *request);
+
+static inline void worker_pool_freep(WorkerPool **poolp) {
+        if (*poolp)
+                worker_pool_free(*poolp);
+}
@@ -0,0 +1,655 @@
+/*
+ * Request storm benchmark
+ *
+ * Runs firmwared against a simulated sysfs: every request gets a fake
+ * firmware device, with a FIFO for "loading" and a plain file for "data",
+ * and its uevent is sent to the socket the daemon was told to take them
+ * from. Up to a number of requests are outstanding at once; each is done
+ * once "loading" is set to 0, or to -1 for firmware that does not exist.
+ * Reports the throughput, and percentiles of the latency from the uevent
+ * being sent to the request being done.
+ *
+ *   firmware-bench [options] [-- firmwared options]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "macro.h"
+
+/* a request that made no progress for this long is not coming back */
+#define BENCH_STALL_MSEC (10 * 1000)
+
+/* how long the daemon gets to start up */
+#define BENCH_START_MSEC (5 * 1000)
+
+#define BENCH_DEVICES "sys/devices/virtual/firmware"
+
+typedef struct Device {
+        unsigned int id;
+        int loadingfd;
+        bool hit;
+        uint64_t start;
+        /* what was written to "loading" so far */
+        char state[32];
+        size_t n_state;
+} Device;
+
+typedef struct Bench {
+        const char *daemon;
+        char **daemon_args;
+        unsigned int n_requests;
+        unsigned int concurrency;
+        size_t size;
+        unsigned int n_files;
+        unsigned int miss_percent;
+        bool verbose;
+        int rootfd;
+        char root[PATH_MAX];
+        char socket_path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+        pid_t pid;
+        int sockfd;
+        int epollfd;
+        Device *devices;
+        unsigned int *free_slots;
+        unsigned int n_free;
+        unsigned int started;
+        unsigned int done;
+        unsigned int loaded;
+        unsigned int cancelled;
+        unsigned int failed;
+        Histogram latency;
+} Bench;
+
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int parse_size(const char *s, size_t *sizep) {
+        unsigned long long size;
+        char *end;
+
+        errno = 0;
+        size = strtoull(s, &end, 10);
+        if (errno || end == s)
+                return -EINVAL;
+
+        switch (*end) {
+        case 'G':
+                size *= 1024;
+                /* fall through */
+        case 'M':
+                size *= 1024;
+                /* fall through */
+        case 'K':
+                size *= 1024;
+                end++;
+                break;
+        }
+
+        if (*end || size == 0)
+                return -EINVAL;
+
+        *sizep = size;
+        return 0;
+}
+
+static int parse_unsigned(const char *s, unsigned int *np) {
+        unsigned long n;
+        char *end;
+
+        errno = 0;
+        n = strtoul(s, &end, 10);
+        if (errno || end == s || *end || n > UINT_MAX)
+                return -EINVAL;
+
+        *np = n;
+        return 0;
+}
+
+static int write_file(int dirfd, const char *path, const void *data, size_t size) {
+        _cleanup_close_ int fd = -1;
+        const char *p = data;
+
+        fd = openat(dirfd, path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+        if (fd < 0)
+                return -errno;
+
+        while (size > 0) {
+                ssize_t n;
+
+                n = write(fd, p, size);
+                if (n < 0)
+                        return -errno;
+
+                p += n;
+                size -= n;
+        }
+
+        return 0;
+}
+
+/* the firmware files, and the bits of sysfs the daemon looks at besides the devices */
+static int bench_setup(Bench *b) {
+        _cleanup_free_ char *blob = NULL;
+        int r;
+
+        blob = malloc(b->size);
+        if (!blob)
+                return -ENOMEM;
+
+        for (size_t i = 0; i < b->size; i++)
+                blob[i] = i * 31;
+
+        if (mkdirat(b->rootfd, "firmware", 0755) < 0 ||
+            mkdirat(b->rootfd, "firmware/bench", 0755) < 0 ||
+            mkdirat(b->rootfd, "sys", 0755) < 0 ||
+            mkdirat(b->rootfd, "sys/class", 0755) < 0 ||
+            mkdirat(b->rootfd, "sys/class/firmware", 0755) < 0 ||
+            mkdirat(b->rootfd, "sys/devices", 0755) < 0 ||
+            mkdirat(b->rootfd, "sys/devices/virtual", 0755) < 0 ||
+            mkdirat(b->rootfd, BENCH_DEVICES, 0755) < 0)
+                return -errno;
+
+        r = write_file(b->rootfd, "sys/class/firmware/timeout", "60\n", 3);
+        if (r < 0)
+                return r;
+
+        for (unsigned int i = 0; i < b->n_files; i++) {
+                char path[64];
+
+                snprintf(path, sizeof(path), "firmware/bench/blob-%u", i);
+                r = write_file(b->rootfd, path, blob, b->size);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static void bench_cleanup(Bench *b) {
+        for (unsigned int i = 0; i < b->n_files; i++) {
+                char path[64];
+
+                snprintf(path, sizeof(path), "firmware/bench/blob-%u", i);
+                unlinkat(b->rootfd, path, 0);
+        }
+
+        unlinkat(b->rootfd, "sys/class/firmware/timeout", 0);
+
+        unlinkat(b->rootfd, BENCH_DEVICES, AT_REMOVEDIR);
+        unlinkat(b->rootfd, "sys/devices/virtual", AT_REMOVEDIR);
+        unlinkat(b->rootfd, "sys/devices", AT_REMOVEDIR);
+        unlinkat(b->rootfd, "sys/class/firmware", AT_REMOVEDIR);
+        unlinkat(b->rootfd, "sys/class", AT_REMOVEDIR);
+        unlinkat(b->rootfd, "sys", AT_REMOVEDIR);
+        unlinkat(b->rootfd, "firmware/bench", AT_REMOVEDIR);
+        unlinkat(b->rootfd, "firmware", AT_REMOVEDIR);
+        unlinkat(b->rootfd, "uevent", 0);
+        rmdir(b->root);
+}
+
+static int bench_start_daemon(Bench *b) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        char firmware[PATH_MAX + sizeof("/firmware")], sys[PATH_MAX + sizeof("/sys")];
+        uint64_t deadline;
+        size_t n = 0;
+        char **argv;
+
+        snprintf(firmware, sizeof(firmware), "%s/firmware", b->root);
+        snprintf(sys, sizeof(sys), "%s/sys", b->root);
+
+        for (char **a = b->daemon_args; a && *a; a++)
+                n++;
+
+        argv = calloc(n + 10, sizeof(char *));
+        if (!argv)
+                return -ENOMEM;
+
+        argv[0] = (char *)b->daemon;
+        argv[1] = "--dirs";
+        argv[2] = firmware;
+        argv[3] = "--sysfs";
+        argv[4] = sys;
+        argv[5] = "--uevent-socket";
+        argv[6] = b->socket_path;
+        argv[7] = "--control";
+        argv[8] = "";
+        for (size_t i = 0; i < n; i++)
+                argv[9 + i] = b->daemon_args[i];
+
+        b->pid = fork();
+        if (b->pid < 0) {
+                free(argv);
+                return -errno;
+        }
+
+        if (b->pid == 0) {
+                if (!b->verbose) {
+                        int fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+
+                        if (fd >= 0) {
+                                dup2(fd, STDOUT_FILENO);
+                                dup2(fd, STDERR_FILENO);
+                        }
+                }
+
+                execv(b->daemon, argv);
+                fprintf(stderr, "firmware-bench %s: %m\n", b->daemon);
+                _exit(EXIT_FAILURE);
+        }
+
+        free(argv);
+
+        b->sockfd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+        if (b->sockfd < 0)
+                return -errno;
+
+        strcpy(addr.sun_path, b->socket_path);
+
+        /* the socket is bound once the daemon listens */
+        deadline = now_usec() + BENCH_START_MSEC * 1000;
+        while (connect(b->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                if (now_usec() > deadline || waitpid(b->pid, NULL, WNOHANG) != 0)
+                        return -ECONNREFUSED;
+
+                usleep(10 * 1000);
+        }
+
+        return 0;
+}
+
+static void bench_stop_daemon(Bench *b) {
+        if (b->sockfd >= 0)
+                close(b->sockfd);
+
+        if (b->pid > 0) {
+                kill(b->pid, SIGTERM);
+                waitpid(b->pid, NULL, 0);
+        }
+}
+
+static int bench_send_uevent(Bench *b, const char *devpath, const char *name, unsigned int seqnum) {
+        char buf[1024];
+        int n;
+
+        n = snprintf(buf, sizeof(buf),
+                     "add@%s%c"
+                     "ACTION=add%c"
+                     "DEVPATH=%s%c"
+                     "SUBSYSTEM=firmware%c"
+                     "FIRMWARE=%s%c"
+                     "TIMEOUT=60%c"
+                     "SEQNUM=%u%c",
+                     devpath, 0, 0, devpath, 0, 0, name, 0, 0, seqnum, 0);
+
+        if (send(b->sockfd, buf, n, 0) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/* adds the device for request @id, asks for its firmware, and waits for it to be loaded */
+static int bench_start_request(Bench *b) {
+        char dir[64], path[96], devpath[96], name[64];
+        unsigned int slot = b->free_slots[--b->n_free];
+        Device *d = &b->devices[slot];
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = slot };
+        int fd, r;
+
+        *d = (Device) {
+                .id = b->started++,
+                .loadingfd = -1,
+        };
+        /* spread evenly, so that any hundred requests in a row have the ratio */
+        d->hit = (d->id * 37) % 100 >= b->miss_percent;
+
+        snprintf(dir, sizeof(dir), BENCH_DEVICES "/bench-%u", d->id);
+        snprintf(devpath, sizeof(devpath), "/devices/virtual/firmware/bench-%u", d->id);
+        if (d->hit)
+                snprintf(name, sizeof(name), "bench/blob-%u", d->id % b->n_files);
+        else
+                snprintf(name, sizeof(name), "bench/missing-%u", d->id);
+
+        if (mkdirat(b->rootfd, dir, 0755) < 0)
+                return -errno;
+
+        snprintf(path, sizeof(path), "%s/loading", dir);
+        if (mkfifoat(b->rootfd, path, 0644) < 0)
+                return -errno;
+
+        /* without a writer yet, this neither blocks nor reports a hangup */
+        d->loadingfd = openat(b->rootfd, path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+        if (d->loadingfd < 0)
+                return -errno;
+
+        snprintf(path, sizeof(path), "%s/data", dir);
+        fd = openat(b->rootfd, path, O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+        if (fd < 0)
+                return -errno;
+        close(fd);
+
+        if (epoll_ctl(b->epollfd, EPOLL_CTL_ADD, d->loadingfd, &ev) < 0)
+                return -errno;
+
+        d->start = now_usec();
+
+        r = bench_send_uevent(b, devpath, name, d->id + 1);
+        if (r < 0)
+                return r;
+
+        return 0;
+}
+
+static void bench_finish_request(Bench *b, unsigned int slot, bool finished, bool cancelled) {
+        Device *d = &b->devices[slot];
+        char dir[64], path[96];
+        struct stat st;
+
+        histogram_add(&b->latency, now_usec() - d->start);
+
+        snprintf(dir, sizeof(dir), BENCH_DEVICES "/bench-%u", d->id);
+        snprintf(path, sizeof(path), "%s/data", dir);
+
+        if (finished && d->hit && fstatat(b->rootfd, path, &st, 0) >= 0 && (size_t)st.st_size == b->size)
+                b->loaded++;
+        else if (cancelled && !d->hit)
+                b->cancelled++;
+        else {
+                if (b->verbose)
+                        fprintf(stderr, "request %u for %s firmware went wrong: '%.*s'\n",
+                                d->id, d->hit ? "existing" : "missing", (int)d->n_state, d->state);
+                b->failed++;
+        }
+
+        epoll_ctl(b->epollfd, EPOLL_CTL_DEL, d->loadingfd, NULL);
+        close(d->loadingfd);
+        d->loadingfd = -1;
+
+        unlinkat(b->rootfd, path, 0);
+        snprintf(path, sizeof(path), "%s/loading", dir);
+        unlinkat(b->rootfd, path, 0);
+        unlinkat(b->rootfd, dir, AT_REMOVEDIR);
+
+        b->free_slots[b->n_free++] = slot;
+        b->done++;
+}
+
+/* reads what was written to "loading" of the device in @slot, and finishes it once it is over */
+static void bench_process(Bench *b, unsigned int slot) {
+        Device *d = &b->devices[slot];
+        bool finished = false, cancelled = false, eof = false;
+        ssize_t n;
+
+        for (;;) {
+                if (d->n_state == sizeof(d->state))
+                        break;
+
+                n = read(d->loadingfd, d->state + d->n_state, sizeof(d->state) - d->n_state);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        eof = n == 0;
+                        break;
+                }
+
+                d->n_state += n;
+        }
+
+        /* the last complete line is what the device was left with */
+        for (const char *p = d->state, *end = d->state + d->n_state; p < end; ) {
+                const char *nl = memchr(p, '\n', end - p);
+
+                if (!nl)
+                        break;
+
+                finished = nl - p == 1 && p[0] == '0';
+                cancelled = nl - p == 2 && p[0] == '-' && p[1] == '1';
+                p = nl + 1;
+        }
+
+        if (finished || cancelled || eof || d->n_state == sizeof(d->state))
+                bench_finish_request(b, slot, finished, cancelled);
+}
+
+static int bench_run(Bench *b) {
+        struct epoll_event events[64];
+        uint64_t start, usec;
+        int r;
+
+        start = now_usec();
+
+        while (b->done < b->n_requests) {
+                int n;
+
+                while (b->n_free > 0 && b->started < b->n_requests) {
+                        r = bench_start_request(b);
+                        if (r < 0)
+                                return r;
+                }
+
+                n = epoll_wait(b->epollfd, events, ELEMENTSOF(events), BENCH_STALL_MSEC);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0)
+                        return -errno;
+                if (n == 0) {
+                        fprintf(stderr, "firmware-bench: no progress for %u s, %u requests outstanding\n",
+                                BENCH_STALL_MSEC / 1000, b->started - b->done);
+                        return -ETIMEDOUT;
+                }
+
+                for (int i = 0; i < n; i++)
+                        bench_process(b, events[i].data.u32);
+        }
+
+        usec = now_usec() - start;
+
+        printf("requests: %u, %u loaded, %u cancelled, %u failed\n",
+               b->n_requests, b->loaded, b->cancelled, b->failed);
+        printf("time:     %.3f s, %.1f requests/s, %.1f MiB/s\n",
+               (double)usec / 1000000, (double)b->n_requests * 1000000 / usec,
+               (double)b->loaded * b->size * 1000000 / usec / (1024 * 1024));
+        printf("latency:  p50 %llu us, p90 %llu us, p99 %llu us, max %llu us\n",
+               (unsigned long long)histogram_percentile(&b->latency, 50),
+               (unsigned long long)histogram_percentile(&b->latency, 90),
+               (unsigned long long)histogram_percentile(&b->latency, 99),
+               (unsigned long long)histogram_max(&b->latency));
+
+        return b->failed > 0 ? -EIO : 0;
+}
+
+static void usage(void) {
+        printf("firmware-bench - Request storm benchmark for firmwared\n"
+               "Usage:\n"
+               "\tfirmware-bench [options] [-- firmwared options]\n"
+               "Options:\n"
+               "\t-d, --daemon PATH      The daemon to run (default: ./firmwared)\n"
+               "\t-n, --requests N       Requests in total (default: 1000)\n"
+               "\t-c, --concurrency N    Requests outstanding at once (default: 256)\n"
+               "\t-s, --size SIZE        Bytes per firmware file (K, M, G; default: 64K)\n"
+               "\t-f, --files N          Distinct firmware files (default: 16)\n"
+               "\t-m, --miss PERCENT     Requests for missing firmware (default: 0)\n"
+               "\t-t, --tmpdir DIR       Where the simulated tree goes (default: $TMPDIR\n"
+               "\t                       or /tmp; a tmpfs keeps the disk out of it)\n"
+               "\t-v, --verbose          Show the daemon's log and failed requests\n"
+               "\t-h, --help             Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "daemon",      required_argument, NULL, 'd' },
+	{ "requests",    required_argument, NULL, 'n' },
+	{ "concurrency", required_argument, NULL, 'c' },
+	{ "size",        required_argument, NULL, 's' },
+	{ "files",       required_argument, NULL, 'f' },
+	{ "miss",        required_argument, NULL, 'm' },
+	{ "tmpdir",      required_argument, NULL, 't' },
+	{ "verbose",     no_argument,       NULL, 'v' },
+	{ "help",        no_argument,       NULL, 'h' },
+	{ }
+};
+
+int main(int argc, char **argv) {
+        Bench b = {
+                .daemon = "./firmwared",
+                .n_requests = 1000,
+                .concurrency = 256,
+                .size = 64 * 1024,
+                .n_files = 16,
+                .rootfd = -1,
+                .sockfd = -1,
+                .epollfd = -1,
+        };
+        const char *tmpdir = getenv("TMPDIR");
+        int r;
+
+        if (!tmpdir)
+                tmpdir = "/tmp";
+
+        for (;;) {
+                int opt;
+
+                opt = getopt_long(argc, argv, "d:n:c:s:f:m:t:vh", main_options, NULL);
+                if (opt < 0)
+                        break;
+
+                switch (opt) {
+                case 'd':
+                        b.daemon = optarg;
+                        break;
+                case 'n':
+                        r = parse_unsigned(optarg, &b.n_requests);
+                        if (r < 0 || b.n_requests == 0) {
+                                fprintf(stderr, "invalid number of requests '%s'\n", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'c':
+                        r = parse_unsigned(optarg, &b.concurrency);
+                        if (r < 0 || b.concurrency == 0) {
+                                fprintf(stderr, "invalid concurrency '%s'\n", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 's':
+                        r = parse_size(optarg, &b.size);
+                        if (r < 0) {
+                                fprintf(stderr, "invalid size '%s'\n", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'f':
+                        r = parse_unsigned(optarg, &b.n_files);
+                        if (r < 0 || b.n_files == 0) {
+                                fprintf(stderr, "invalid number of files '%s'\n", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'm':
+                        r = parse_unsigned(optarg, &b.miss_percent);
+                        if (r < 0 || b.miss_percent > 100) {
+                                fprintf(stderr, "invalid miss percentage '%s'\n", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 't':
+                        tmpdir = optarg;
+                        break;
+                case 'v':
+                        b.verbose = true;
+                        break;
+                case 'h':
+                        usage();
+                        return EXIT_SUCCESS;
+                default:
+                        return EXIT_FAILURE;
+                }
+        }
+
+        b.daemon_args = argv + optind;
+
+        /* the FIFOs hold a descriptor each, on top of the daemon's own */
+        if (b.concurrency > b.n_requests)
+                b.concurrency = b.n_requests;
+
+        b.devices = calloc(b.concurrency, sizeof(Device));
+        b.free_slots = calloc(b.concurrency, sizeof(unsigned int));
+        if (!b.devices || !b.free_slots) {
+                fprintf(stderr, "firmware-bench: %s\n", strerror(ENOMEM));
+                return EXIT_FAILURE;
+        }
+
+        for (unsigned int i = 0; i < b.concurrency; i++) {
+                b.devices[i].loadingfd = -1;
+                b.free_slots[b.n_free++] = b.concurrency - 1 - i;
+        }
+
+        snprintf(b.root, sizeof(b.root), "%s/firmware-bench-XXXXXX", tmpdir);
+        if (!mkdtemp(b.root)) {
+                fprintf(stderr, "firmware-bench %s: %m\n", b.root);
+                return EXIT_FAILURE;
+        }
+
+        if (snprintf(b.socket_path, sizeof(b.socket_path), "%s/uevent", b.root) >=
+            (int)sizeof(b.socket_path)) {
+                fprintf(stderr, "firmware-bench %s: %s\n", b.root, strerror(ENAMETOOLONG));
+                rmdir(b.root);
+                return EXIT_FAILURE;
+        }
+
+        b.rootfd = open(b.root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        b.epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (b.rootfd < 0 || b.epollfd < 0) {
+                fprintf(stderr, "firmware-bench: %m\n");
+                rmdir(b.root);
+                return EXIT_FAILURE;
+        }
+
+        r = bench_setup(&b);
+        if (r < 0)
+                fprintf(stderr, "firmware-bench %s: %s\n", b.root, strerror(-r));
+
+        if (r >= 0) {
+                r = bench_start_daemon(&b);
+                if (r < 0)
+                        fprintf(stderr, "firmware-bench %s: %s\n", b.daemon, strerror(-r));
+        }
+
+        if (r >= 0) {
+                r = bench_run(&b);
+                if (r < 0 && r != -EIO && r != -ETIMEDOUT)
+                        fprintf(stderr, "firmware-bench: %s\n", strerror(-r));
+        }
+
+        bench_stop_daemon(&b);
+
+        for (unsigned int i = 0; i < b.concurrency; i++)
+                if (b.devices[i].loadingfd >= 0)
+                        bench_finish_request(&b, i, false, false);
+
+        bench_cleanup(&b);
+        close(b.epollfd);
+        close(b.rootfd);
+        free(b.devices);
+        free(b.free_slots);
+
+        return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -537,6 +537,21 @@ static void test_tentative_load(const void *test_data) {
                         test_tentative_trigger_cb, (gpointer)user);
 }
 
+static void test_tentative_firmware_appears(void *user_data) {
+        struct user_data *user = user_data;
+
+        tester_debug("install firmware while the daemon waits for it");
+        setup_firmware_files(user->cfg);
+}
+
+static void test_tentative_late_load(const void *test_data) {
+        struct user_data *user = tester_get_data();
+
+        tester_wait(2, test_tentative_firmware_appears, user);
+        trigger_load_async(user->fd, user->cfg->filename, NULL,
+                        test_tentative_trigger_cb, (gpointer)user);
+}
+
 static void setup_tentative_load(const void *test_data) {
         struct user_data *user = tester_get_data();
 
@@ -613,6 +628,9 @@ int main(int argc, char *argv[]) {
         test_load("Load via daemon tentative mode",
                 setup_tentative_load, test_tentative_load,
                 teardown_daemon_load, &cfg_tentative);
+        test_load("Load via daemon tentative mode, late firmware",
+                setup_tentative_load, test_tentative_late_load,
+                teardown_daemon_load, &cfg_tentative);
         test_load("Load via kernel",
                 setup_kernel_sync_load, test_firmware_load,
                 teardown_kernel_load, &cfg_kernel);
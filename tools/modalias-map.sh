@@ -0,0 +1,30 @@
+#!/bin/bash
+#
+# Modalias Map
+# Writes the map for `firmwared --modalias-map`: the firmware each kernel
+# module declares, and the modalias patterns of those modules. Run it when
+# the image is built, as it asks modinfo about every module.
+#
+# usage: modalias-map.sh [KERNEL-VERSION] > modalias.map
+#
+
+set -e
+
+kver=${1:-$(uname -r)}
+moddir=/lib/modules/$kver
+declared=$(mktemp)
+trap 'rm -f "$declared"' EXIT
+
+while IFS=: read -r path _ ; do
+        module=${path##*/}
+        module=${module%%.ko*}
+        module=${module//-/_}
+
+        modinfo -F firmware "$moddir/$path" 2>/dev/null | while read -r firmware ; do
+                echo "firmware $module $firmware"
+        done
+done < "$moddir/modules.dep" > "$declared"
+
+echo "# firmwared modalias map 1"
+awk 'NR == FNR { declares[$2] = 1; print; next }
+     $1 == "alias" && ($3 in declares)' "$declared" "$moddir/modules.alias"